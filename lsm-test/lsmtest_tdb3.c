@@ -772,6 +772,9 @@ int test_lsm_config_str(
     { "max_freelist",     0, LSM_CONFIG_MAX_FREELIST },
     { "multi_proc",       0, LSM_CONFIG_MULTIPLE_PROCESSES },
     { "worker_automerge", 1, LSM_CONFIG_AUTOMERGE },
+    { "merge_policy",     0, LSM_CONFIG_MERGE_POLICY },
+    { "size_ratio",       0, LSM_CONFIG_SIZE_RATIO },
+    { "window_age",       0, LSM_CONFIG_WINDOW_AGE },
     { "test_no_recovery", 0, TEST_NO_RECOVERY },
     { "bg_min_ckpt",      0, TEST_NO_RECOVERY },
 
@@ -44,6 +44,7 @@
 # FIXME:  Required options for now.
 #
 #OPTS += -DLSM_MUTEX_NONE
+OPTS += -DLSM_MUTEX_PTHREADS
 #OPTS += -DSQLITE4_DEBUG=1 -DLSM_DEBUG=1
 OPTS += -DHAVE_GMTIME_R
 OPTS += -DHAVE_LOCALTIME_R
@@ -72,7 +73,7 @@ LIBOBJ+= vdbe.o parse.o \
          callback.o complete.o ctime.o date.o delete.o env.o expr.o \
          fault.o fkey.o fts5.o fts5func.o \
          func.o global.o hash.o \
-         icu.o insert.o kv.o kvlsm.o kvmem.o legacy.o \
+         icu.o insert.o kv.o kvephm.o kvlsm.o kvmem.o kvsort.o legacy.o \
          lsm_ckpt.o lsm_file.o lsm_log.o lsm_main.o lsm_mem.o lsm_mutex.o \
          lsm_shared.o lsm_str.o lsm_sorted.o lsm_tree.o \
          lsm_unix.o lsm_varint.o \
@@ -81,13 +82,14 @@ LIBOBJ+= vdbe.o parse.o \
          opcodes.o os.o \
          pragma.o prepare.o printf.o \
          random.o resolve.o rowset.o rtree.o select.o status.o \
-         tokenize.o trigger.o \
+         threads.o tokenize.o trigger.o \
          update.o util.o varint.o \
          vdbeapi.o vdbeaux.o vdbecodec.o vdbecursor.o \
          vdbemem.o vdbetrace.o \
          walker.o where.o utf.o
 
 LIBOBJ += bt_unix.o bt_pager.o bt_main.o bt_varint.o kvbt.o bt_lock.o bt_log.o
+LIBOBJ += kvhybrid.o
 
 # All of the source code files.
 #
@@ -125,8 +127,11 @@ SRC = \
   $(TOP)/src/kv.c \
   $(TOP)/src/kv.h \
   $(TOP)/src/kvbt.c \
+  $(TOP)/src/kvhybrid.c \
   $(TOP)/src/kvlsm.c \
+  $(TOP)/src/kvephm.c \
   $(TOP)/src/kvmem.c \
+  $(TOP)/src/kvsort.c \
   $(TOP)/src/legacy.c \
   $(TOP)/src/lsm.h \
   $(TOP)/src/lsmInt.h \
@@ -171,6 +176,7 @@ SRC = \
   $(TOP)/src/sqliteLimit.h \
   $(TOP)/src/status.c \
   $(TOP)/src/tclsqlite.c \
+  $(TOP)/src/threads.c \
   $(TOP)/src/tokenize.c \
   $(TOP)/src/trigger.c \
   $(TOP)/src/utf.c \
@@ -259,6 +265,9 @@ TESTSRC2 = \
   $(TOP)/src/fts5func.c \
   $(TOP)/src/func.c \
   $(TOP)/src/insert.c \
+  $(TOP)/src/kv.c \
+  $(TOP)/src/kvephm.c \
+  $(TOP)/src/kvsort.c \
   $(TOP)/src/mem5.c \
   $(TOP)/src/os.c \
   $(TOP)/src/pragma.c \
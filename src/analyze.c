@@ -163,7 +163,7 @@ static void openStatTable(
   for(i=0; i<ArraySize(aTable); i++){
     sqlite4VdbeAddOp3(v, OP_OpenWrite, iStatCur+i, aRoot[i], iDb);
     sqlite4VdbeChangeP4(v, -1, (char *)3, P4_INT32);
-    sqlite4VdbeChangeP5(v, aCreateTbl[i]);
+    if( aCreateTbl[i] ) sqlite4VdbeChangeP5(v, OPFLAG_P2ISREG);
   }
 }
 
@@ -510,6 +510,7 @@ static void analyzeOneTable(
     assert( iDb==sqlite4SchemaToIndex(db, pIdx->pSchema) );
     sqlite4VdbeAddOp4(v, OP_OpenRead, iIdxCur, pIdx->tnum, iDb,
         (char *)pKey, P4_KEYINFO_HANDOFF);
+    sqlite4VdbeChangeP5(v, OPFLAG_SCAN);
     VdbeComment((v, "%s", pIdx->zName));
 
     /* Populate the register containing the index name. */
@@ -121,6 +121,16 @@ int sqlite4BtDelete(bt_cursor*);
 int sqlite4BtSetCookie(bt_db*, unsigned int iVal);
 int sqlite4BtGetCookie(bt_db*, unsigned int *piVal);
 
+/*
+** Estimate the number of keys greater than or equal to pLo/nLo and smaller
+** than pHi/nHi (or with no upper bound if pHi is NULL). The estimate is
+** derived from the fan-out of the b-tree nodes visited by a seek to each
+** bound.
+*/
+int sqlite4BtEstimateRange(bt_db*, const void *pLo, int nLo,
+    const void *pHi, int nHi, sqlite4_int64 *pnRow
+);
+
 
 /*
 ** kvstore xControl() method.
@@ -2398,6 +2398,86 @@ int sqlite4BtCsrData(
   return rc;
 }
 
+/*
+** Seek a cursor on the main b-tree to key pK/nK and use the path from the
+** root to the leaf to estimate the position of the key in the tree. Set
+** *pfPos to the estimated fraction of the entries in the tree that are
+** smaller than pK/nK, and *pfRow to the estimated number of entries in 
+** the tree (the product of the fan-out of each node on the path).
+*/
+static int btEstimatePos(
+  bt_db *db,                      /* Database handle */
+  const void *pK, int nK,         /* Key to estimate the position of */
+  double *pfPos,                  /* OUT: Fraction of keys smaller than pK */
+  double *pfRow                   /* OUT: Estimated entries in tree */
+){
+  const int pgsz = sqlite4BtPagerPagesize(db->pPager);
+  BtCursor csr;
+  double fPos = 0.0;
+  double fRow = 1.0;
+  int rc;
+
+  btCsrSetup(db, sqlite4BtPagerDbhdr(db->pPager)->iRoot, &csr);
+  rc = btCsrSeek(&csr, 0, pK, nK, BT_SEEK_GE, BT_CSRSEEK_UPDATE);
+  if( rc==SQLITE4_NOTFOUND || rc==SQLITE4_INEXACT ) rc = SQLITE4_OK;
+  if( rc==SQLITE4_OK ){
+    double fWidth = 1.0;          /* Fraction of tree under current node */
+    int i;
+    for(i=0; i<csr.nPg; i++){
+      u8 *aData = btPageData(csr.apPage[i]);
+      int nChild = btCellCount(aData, pgsz);
+      if( btFlags(aData) & BT_PGFLAGS_INTERNAL ) nChild++;
+      if( nChild==0 ){
+        fRow = 0.0;
+        break;
+      }
+      fWidth = fWidth / nChild;
+      fPos += fWidth * csr.aiCell[i];
+      fRow = fRow * nChild;
+    }
+  }
+  btCsrReset(&csr, 1);
+
+  *pfPos = fPos;
+  *pfRow = fRow;
+  return rc;
+}
+
+/*
+** Estimate the number of entries in the database with keys greater than
+** or equal to pLo/nLo and smaller than pHi/nHi, and write the result to
+** *pnRow. If pHi is NULL, there is no upper bound. 
+**
+** The estimate is based on the position of each key within the interior 
+** nodes of the main b-tree, so it costs no more than two seeks. Entries
+** stored in the fast-insert tree are not considered.
+**
+** A read transaction must be open on the database.
+*/
+int sqlite4BtEstimateRange(
+  bt_db *db,                      /* Database handle */
+  const void *pLo, int nLo,       /* Lower bound (inclusive) */
+  const void *pHi, int nHi,       /* Upper bound (exclusive), or NULL */
+  sqlite4_int64 *pnRow            /* OUT: Estimated number of entries */
+){
+  double fLo, fHi = 1.0;          /* Positions of pLo and pHi */
+  double nLoRow, nHiRow;          /* Tree size estimates */
+  int rc;
+
+  assert( sqlite4BtPagerTransactionLevel(db->pPager)>0 );
+  *pnRow = 0;
+
+  rc = btEstimatePos(db, pLo ? pLo : (const void*)"", nLo, &fLo, &nLoRow);
+  nHiRow = nLoRow;
+  if( rc==SQLITE4_OK && pHi ){
+    rc = btEstimatePos(db, pHi, nHi, &fHi, &nHiRow);
+  }
+  if( rc==SQLITE4_OK && fHi>fLo ){
+    *pnRow = (sqlite4_int64)((fHi - fLo) * (nLoRow + nHiRow) / 2.0 + 0.5);
+  }
+  return rc;
+}
+
 /*
 ** The argument points to a buffer containing an overflow array. Return
 ** the size of the overflow array in bytes. 
@@ -1572,7 +1572,7 @@ void sqlite4EndTable(
 
       assert(pParse->nTab==1);
       sqlite4VdbeAddOp3(v, OP_OpenWrite, 1, iPkRoot, iDb);
-      sqlite4VdbeChangeP5(v, 1);
+      sqlite4VdbeChangeP5(v, OPFLAG_P2ISREG);
       pParse->nTab = 2;
       sqlite4SelectDestInit(&dest, SRT_Table, 1);
       sqlite4Select(pParse, pSelect, &dest);
@@ -2254,7 +2254,10 @@ void sqlite4EncodeIndexValue(
 
   reg = sqlite4GetTempRange(pParse, pIdx->nCover);
   for(i=0; i<pIdx->nCover; i++){
-    sqlite4ExprCodeGetColumnOfTable(v, pTab, iPkCsr, pIdx->aiCover[i], reg+i);
+    /* The value is consumed by OP_MakeRecord before the cursor moves */
+    sqlite4ExprCodeGetColumnOfTable(
+        v, pTab, iPkCsr, pIdx->aiCover[i], reg+i, OPFLAG_EPHEM
+    );
   }
   sqlite4VdbeAddOp3(v, OP_MakeRecord, reg, pIdx->nCover, regOut);
   sqlite4ReleaseTempRange(pParse, reg, pIdx->nCover);
@@ -2298,7 +2301,7 @@ static void sqlite4RefillIndex(Parse *pParse, Index *pIdx, int bCreate){
     sqlite4VdbeAddOp2(v, OP_Clear, pIdx->tnum, iDb);
   }
   sqlite4OpenIndex(pParse, iIdx, iDb, pIdx, OP_OpenWrite);
-  if( bCreate ) sqlite4VdbeChangeP5(v, 1);
+  if( bCreate ) sqlite4VdbeChangeP5(v, OPFLAG_P2ISREG);
 
   /* Loop through the contents of the PK index. At each row, insert the
   ** corresponding entry into the auxiliary index.  */
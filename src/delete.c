@@ -466,7 +466,9 @@ void sqlite4GenerateRowDelete(
     pParse->nMem += (pTab->nCol+1);
     for(iCol=0; iCol<pTab->nCol; iCol++){
       if( mask==0xffffffff || mask&(1<<iCol) ){
-        sqlite4ExprCodeGetColumnOfTable(v, pTab, iPkCsr, iCol, regOld+iCol+1);
+        sqlite4ExprCodeGetColumnOfTable(
+            v, pTab, iPkCsr, iCol, regOld+iCol+1, 0
+        );
       }
     }
     assert( (pPk==0)==IsView(pTab) );
@@ -539,10 +541,13 @@ void sqlite4EncodeIndexKey(
   nTmpReg = pIdx->nColumn + nPkCol;
   regTmp = sqlite4GetTempRange(pParse, nTmpReg);
 
-  /* Assemble the values for the key in the array of temp registers */
+  /* Assemble the values for the key in the array of temp registers. The
+  ** values are consumed by OP_MakeKey before the cursor moves, so they 
+  ** need not be copied out of the cursor (OPFLAG_EPHEM).  */
   for(i=0; i<pIdx->nColumn; i++){
     int regVal = regTmp + i;
     sqlite4VdbeAddOp3(v, OP_Column, iPkCsr, pIdx->aiColumn[i], regVal);
+    sqlite4VdbeChangeP5(v, OPFLAG_EPHEM);
   }
   for(i=0; i<nPkCol; i++){
     int iCol = pPk->aiColumn[i];
@@ -551,6 +556,7 @@ void sqlite4EncodeIndexKey(
       sqlite4VdbeAddOp2(v, OP_Rowid, iPkCsr, regVal);
     }else{
       sqlite4VdbeAddOp3(v, OP_Column, iPkCsr, pPk->aiColumn[i], regVal);
+      sqlite4VdbeChangeP5(v, OPFLAG_EPHEM);
     }
   }
 
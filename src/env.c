@@ -18,14 +18,32 @@
 /*
 ** Default factory objects
 */
-static KVFactory memFactory = {
+static KVFactory sorterFactory = {
    0,
+   "sorter",
+   sqlite4KVStoreOpenSorter,
+   1
+};
+static KVFactory ephemeralFactory = {
+   &sorterFactory,
+   "ephemeral",
+   sqlite4KVStoreOpenEphemeral,
+   1
+};
+static KVFactory memFactory = {
+   &ephemeralFactory,
    "temp",
    sqlite4KVStoreOpenMem,
    1
 };
-static KVFactory btFactory = {
+static KVFactory hybridFactory = {
    &memFactory,
+   "hybrid",
+   sqlite4KVStoreOpenHybrid,
+   1
+};
+static KVFactory btFactory = {
+   &hybridFactory,
    "bt",
    sqlite4KVStoreOpenBtree,
    1
@@ -2169,23 +2169,31 @@ static void sqlite4ExprCachePinRegister(Parse *pParse, int iReg){
 
 /*
 ** Generate code to extract the value of the iCol-th column of a table.
+**
+** If an OP_Column opcode is used, its P5 is set to p5. This is a mask of
+** OPFLAG_EPHEM and OPFLAG_PIN. The caller is responsible for using the
+** value only as permitted by those flags (see OP_Column).
 */
 void sqlite4ExprCodeGetColumnOfTable(
   Vdbe *v,        /* The VDBE under construction */
   Table *pTab,    /* The table containing the value */
   int iTabCur,    /* The cursor for this table */
   int iCol,       /* Index of the column to extract */
-  int regOut      /* Extract the valud into this register */
+  int regOut,     /* Extract the valud into this register */
+  u8 p5           /* P5 value for OP_Column */
 ){
+  assert( (p5 & ~(OPFLAG_EPHEM|OPFLAG_PIN))==0 );
   if( iCol<0 ){
     sqlite4VdbeAddOp2(v, OP_Rowid, iTabCur, regOut);
   }else if( IsKvstore(pTab) ){
     int aOp[2] = { OP_RowKey, OP_RowData };
     assert( iCol==0 || iCol==1 );
     sqlite4VdbeAddOp2(v, aOp[iCol], iTabCur, regOut);
+  }else if( IsVirtual(pTab) ){
+    sqlite4VdbeAddOp3(v, OP_VColumn, iTabCur, iCol, regOut);
   }else{
-    int op = IsVirtual(pTab) ? OP_VColumn : OP_Column;
-    sqlite4VdbeAddOp3(v, op, iTabCur, iCol, regOut);
+    sqlite4VdbeAddOp3(v, OP_Column, iTabCur, iCol, regOut);
+    sqlite4VdbeChangeP5(v, p5);
   }
   if( iCol>=0 ){
     sqlite4ColumnDefault(v, pTab, iCol, regOut);
@@ -2200,13 +2208,16 @@ void sqlite4ExprCodeGetColumnOfTable(
 **
 ** There must be an open cursor to pTab in iTable when this routine
 ** is called.  If iColumn<0 then code is generated that extracts the rowid.
+** If the value is not already cached in a register, p5 is passed through
+** to sqlite4ExprCodeGetColumnOfTable().
 */
 int sqlite4ExprCodeGetColumn(
   Parse *pParse,   /* Parsing and code generating context */
   Table *pTab,     /* Description of the table we are reading from */
   int iColumn,     /* Index of the table column */
   int iTable,      /* The cursor pointing to the table */
-  int iReg         /* Store results here */
+  int iReg,        /* Store results here */
+  u8 p5            /* P5 value for OP_Column */
 ){
   Vdbe *v = pParse->pVdbe;
   int i;
@@ -2220,7 +2231,7 @@ int sqlite4ExprCodeGetColumn(
     }
   }  
   assert( v!=0 );
-  sqlite4ExprCodeGetColumnOfTable(v, pTab, iTable, iColumn, iReg);
+  sqlite4ExprCodeGetColumnOfTable(v, pTab, iTable, iColumn, iReg, p5);
   sqlite4ExprCacheStore(pParse, iTable, iColumn, iReg);
   return iReg;
 }
@@ -2349,7 +2360,7 @@ int sqlite4ExprCodeTarget(Parse *pParse, Expr *pExpr, int target){
         inReg = pExpr->iColumn + pParse->ckBase;
       }else{
         inReg = sqlite4ExprCodeGetColumn(pParse, pExpr->pTab,
-                                 pExpr->iColumn, pExpr->iTable, target);
+                                 pExpr->iColumn, pExpr->iTable, target, 0);
       }
       break;
     }
@@ -2626,7 +2637,7 @@ int sqlite4ExprCodeTarget(Parse *pParse, Expr *pExpr, int target){
       if( pFarg ){
         r1 = sqlite4GetTempRange(pParse, nFarg);
         sqlite4ExprCachePush(pParse);     /* Ticket 2ea2425d34be */
-        sqlite4ExprCodeExprList(pParse, pFarg, r1, 1);
+        sqlite4ExprCodeExprList(pParse, pFarg, r1, SQLITE4_ECEL_DUP);
         sqlite4ExprCachePop(pParse, 1);   /* Ticket 2ea2425d34be */
       }else{
         r1 = 0;
@@ -3381,13 +3392,25 @@ void sqlite4ExprCodeConstants(Parse *pParse, Expr *pExpr){
 ** Generate code that pushes the value of every element of the given
 ** expression list into a sequence of registers beginning at target.
 **
+** The flags argument is a mask of the following:
+**
+**   SQLITE4_ECEL_DUP    Make a hard copy of every element, instead of a
+**                       shallow copy, if it is not coded directly into
+**                       its target register.
+**
+**   SQLITE4_ECEL_PIN    The registers are used only by an OP_ResultRow 
+**                       that follows. Columns read directly into their
+**                       target registers are pinned in the KV cursor 
+**                       until then, instead of being copied out of it
+**                       (see OPFLAG_PIN).
+**
 ** Return the number of elements evaluated.
 */
 int sqlite4ExprCodeExprList(
   Parse *pParse,     /* Parsing context */
   ExprList *pList,   /* The expression list to be coded */
   int target,        /* Where to write results */
-  int doHardCopy     /* Make a hard copy of every element */
+  u8 flags           /* SQLITE4_ECEL_* flags */
 ){
   ExprListItem *pItem;
   int i, n;
@@ -3397,10 +3420,19 @@ int sqlite4ExprCodeExprList(
   n = pList->nExpr;
   for(pItem=pList->a, i=0; i<n; i++, pItem++){
     Expr *pExpr = pItem->pExpr;
-    int inReg = sqlite4ExprCodeTarget(pParse, pExpr, target+i);
+    int inReg;
+    if( (flags & SQLITE4_ECEL_PIN) && pExpr->op==TK_COLUMN 
+     && pExpr->iTable>=0 
+    ){
+      inReg = sqlite4ExprCodeGetColumn(pParse, pExpr->pTab, pExpr->iColumn,
+          pExpr->iTable, target+i, OPFLAG_EPHEM|OPFLAG_PIN
+      );
+    }else{
+      inReg = sqlite4ExprCodeTarget(pParse, pExpr, target+i);
+    }
     if( inReg!=target+i ){
-      sqlite4VdbeAddOp2(pParse->pVdbe, doHardCopy ? OP_Copy : OP_SCopy,
-                        inReg, target+i);
+      int op = (flags & SQLITE4_ECEL_DUP) ? OP_Copy : OP_SCopy;
+      sqlite4VdbeAddOp2(pParse->pVdbe, op, inReg, target+i);
     }
   }
   return n;
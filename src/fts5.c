@@ -2836,7 +2836,7 @@ int sqlite4_mi_column_value(
 
           rc = sqlite4VdbeDecoderCreate(db,0, pCsr->pCsr, pInfo->nCol, &pCodec);
           for(i=0; rc==SQLITE4_OK && i<pInfo->nCol; i++){
-            rc = sqlite4VdbeDecoderGetColumn(pCodec, i, 0, &pCsr->aMem[i]);
+            rc = sqlite4VdbeDecoderGetColumn(pCodec, i, 0, 0, &pCsr->aMem[i]);
           }
           sqlite4VdbeDecoderDestroy(pCodec);
         }
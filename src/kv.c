@@ -17,6 +17,81 @@
 */
 #include "sqliteInt.h"
 
+/*
+** The maximum number of closed cursors that are kept in the pool of a
+** single KVStore for reuse by subsequent sqlite4KVStoreOpenCursor() calls.
+*/
+#ifndef SQLITE4_KV_MAX_CSRPOOL
+# define SQLITE4_KV_MAX_CSRPOOL 8
+#endif
+
+/*
+** A pool of closed cursors belonging to a single KVStore. This object is
+** allocated the first time a cursor is added to the pool of a store, and
+** freed by sqlite4KVStoreClose().
+*/
+struct sqlite4_kvcsrpool {
+  int nCsr;                                 /* Number of entries in apCsr[] */
+  KVCursor *apCsr[SQLITE4_KV_MAX_CSRPOOL];  /* Reset cursors ready for reuse */
+};
+
+/*
+** Scan cursors enabled by sqlite4KVCursorEnableBatch() start reading 
+** entries using xNextBatch after KVBATCH_THRESHOLD consecutive calls to 
+** sqlite4KVCursorNext().  Each batch contains up to KVBATCH_NSLICE 
+** entries.
+*/
+#define KVBATCH_THRESHOLD 4
+#define KVBATCH_NSLICE    32
+
+/*
+** Batch state for a single cursor.
+**
+** While nSlice>0, the cursor is logically positioned on entry aSlice[iSlice]
+** and the underlying storage engine cursor is positioned somewhere after
+** it (on entry aSlice[nSlice-1] or at EOF). Before any method other than
+** xNext, xKey or xData is invoked, the storage engine cursor is moved back
+** to the logical position using xSeek (see kvBatchSync()).
+**
+** The batch is discarded if the content of the store is modified while it 
+** is in use. This is detected by comparing KVStore.iWriteGen with the 
+** value it had when the batch was read. Batching is disabled for the 
+** cursor from that point on, as it is likely to be modified again.
+**
+** The data of the last entry in a batch may not have been copied by
+** xNextBatch (see KVBATCH_MAXDATA). In this case its pData field is NULL
+** and the data is read directly from the storage engine cursor, which is
+** positioned on that entry.
+**
+** Alternatively, if nMultiGet>0, aSlice[] holds the sorted results of the
+** most recent sqlite4KVCursorMultiGet() call. In this case nSlice is 
+** either 0, if the storage engine cursor is positioned by the most recent
+** xSeek, or nMultiGet, if the cursor is logically positioned on entry
+** aSlice[iSlice] by an EQ seek that was served from the multi-get results.
+*/
+struct sqlite4_kvbatch {
+  int bEnable;                    /* True if batching is enabled */
+  int bScan;                      /* True to read ahead using xNextBatch */
+  int nNext;                      /* Consecutive xNext calls */
+  int nMultiGet;                  /* Number of multi-get results in aSlice[] */
+  int nSlice;                     /* Number of entries in aSlice[] */
+  int iSlice;                     /* Current entry in aSlice[] */
+  int rc;                         /* Return code from xNextBatch */
+  unsigned iWriteGen;             /* KVStore.iWriteGen when batch was read */
+  sqlite4_buffer key;             /* Used by kvBatchSync() */
+  KVSlice aSlice[KVBATCH_NSLICE]; /* Entries returned by xNextBatch */
+};
+
+/*
+** The following variables are incremented each time xMultiGet is invoked
+** and each time an EQ seek is served from the results of xMultiGet. They
+** are used by the test scripts only.
+*/
+#ifdef SQLITE4_TEST
+int sqlite4_kv_multigets = 0;
+int sqlite4_kv_multiget_hits = 0;
+#endif
+
 /*
 ** Names of error codes used for tracing.
 */
@@ -75,6 +150,65 @@ static void kvTrace(KVStore *p, const char *zFormat, ...){
   }
 }
 
+/*
+** Initialize the fields of a new KVStore object that are managed by the
+** KV layer instead of by the storage engine.
+*/
+static void kvStoreInit(KVStore *p, const char *zName, int fTrace){
+  sqlite4_randomness(p->pEnv, sizeof(p->kvId), &p->kvId);
+  sqlite4_snprintf(p->zKVName, sizeof(p->zKVName), "%s", zName);
+  p->fTrace = fTrace;
+  p->pCsrPool = 0;
+  p->pPin = 0;
+  p->iWriteGen = 0;
+}
+
+/*
+** Invoke the xUnpin callback of each pin on cursor pCsr of store p, or of
+** each pin on the store if pCsr is NULL.  This is called before any
+** operation that might change or free the pinned content.
+*/
+static void kvUnpin(KVStore *p, KVCursor *pCsr){
+  KVPin *pPin = p->pPin;
+  while( pPin ){
+    if( pCsr==0 || pPin->pCsr==pCsr ){
+      pPin->xUnpin(pPin);
+      sqlite4KVCursorUnpin(pPin);
+
+      /* The callback may have released other pins too. Start again. */
+      pPin = p->pPin;
+    }else{
+      pPin = pPin->pNext;
+    }
+  }
+}
+
+/*
+** Pin the current entry of cursor p (see the comments above struct
+** sqlite4_kvpin in kv.h).  The xUnpin and pCtx fields of pPin must be
+** set by the caller.
+*/
+void sqlite4KVCursorPin(KVCursor *p, KVPin *pPin){
+  assert( pPin->pCsr==0 && pPin->xUnpin!=0 );
+  pPin->pCsr = p;
+  pPin->pNext = p->pStore->pPin;
+  p->pStore->pPin = pPin;
+}
+
+/*
+** Release a pin taken by sqlite4KVCursorPin().  This is a no-op if the
+** pin has already been released.
+*/
+void sqlite4KVCursorUnpin(KVPin *pPin){
+  if( pPin->pCsr ){
+    KVPin **pp;
+    for(pp=&pPin->pCsr->pStore->pPin; *pp!=pPin; pp=&(*pp)->pNext);
+    *pp = pPin->pNext;
+    pPin->pCsr = 0;
+    pPin->pNext = 0;
+  }
+}
+
 /*
 ** Open a storage engine via URI
 */
@@ -92,7 +226,13 @@ int sqlite4KVStoreOpen(
   KVFactory *pMkr;
   sqlite4_kvfactory xFactory;
 
-  if( (flags & SQLITE4_KVOPEN_TEMPORARY)!=0 || zUri==0 || zUri[0]==0 ){
+  if( (flags & SQLITE4_KVOPEN_SORTER)!=0 ){
+    zStorageName = "sorter";
+  }else if( (flags & SQLITE4_KVOPEN_TEMPORARY)!=0
+         && (flags & SQLITE4_KVOPEN_NO_TRANSACTIONS)!=0
+  ){
+    zStorageName = "ephemeral";
+  }else if( (flags & SQLITE4_KVOPEN_TEMPORARY)!=0 || zUri==0 || zUri[0]==0 ){
     zStorageName = "temp";
   }else{
     zStorageName = sqlite4_uri_parameter(zUri, "kv");
@@ -116,10 +256,7 @@ int sqlite4KVStoreOpen(
   rc = xFactory(pEnv, &pNew, zUri, flags);
   *ppKVStore = pNew;
   if( pNew ){
-    sqlite4_randomness(pEnv, sizeof(pNew->kvId), &pNew->kvId);
-    sqlite4_snprintf(pNew->zKVName, sizeof(pNew->zKVName),
-                     "%s", zName);
-    pNew->fTrace = (db->flags & SQLITE4_KvTrace)!=0;
+    kvStoreInit(pNew, zName, (db->flags & SQLITE4_KvTrace)!=0);
     kvTrace(pNew, "open(%s,%d,0x%04x)", zUri, pNew->kvId, flags);
   }
   return rc;
@@ -152,13 +289,23 @@ int sqlite4KVStoreReplace(
     kvTrace(p, "xReplace(%d,%s,%d,%s,%d)",
            p->kvId, zKey, (int)nKey, zData, (int)nData);
   }
+  if( p->pPin ) kvUnpin(p, 0);
+  p->iWriteGen++;
   return p->pStoreVfunc->xReplace(p,pKey,nKey,pData,nData);
 }
 int sqlite4KVStoreOpenCursor(KVStore *p, KVCursor **ppKVCursor){
   KVCursor *pCur;
   int rc;
 
-  rc = p->pStoreVfunc->xOpenCursor(p, &pCur);
+  if( p->pCsrPool && p->pCsrPool->nCsr>0 ){
+    /* Recycle a cursor that was reset by an earlier call to
+    ** sqlite4KVCursorClose(). */
+    pCur = p->pCsrPool->apCsr[--p->pCsrPool->nCsr];
+    rc = SQLITE4_OK;
+  }else{
+    rc = p->pStoreVfunc->xOpenCursor(p, &pCur);
+    if( pCur ) pCur->pBatch = 0;
+  }
   *ppKVCursor = pCur;
   if( pCur ){
     sqlite4_randomness(pCur->pEnv, sizeof(pCur->curId), &pCur->curId);
@@ -169,6 +316,302 @@ int sqlite4KVStoreOpenCursor(KVStore *p, KVCursor **ppKVCursor){
           p->kvId, pCur?pCur->curId:-1, kvErrName(rc));
   return rc;
 }
+
+/*
+** Free the batch object associated with cursor p, if any.
+*/
+static void kvBatchFree(KVCursor *p){
+  if( p->pBatch ){
+    sqlite4_buffer_clear(&p->pBatch->key);
+    sqlite4_free(p->pEnv, p->pBatch);
+    p->pBatch = 0;
+  }
+}
+
+/*
+** Discard the contents of the batch belonging to cursor p, if any.
+*/
+static void kvBatchClear(KVCursor *p){
+  if( p->pBatch ){
+    p->pBatch->nSlice = 0;
+    p->pBatch->nNext = 0;
+    p->pBatch->nMultiGet = 0;
+  }
+}
+
+/*
+** Cursor p is logically positioned on an entry of its current batch. Seek
+** the storage engine cursor to the same entry (using the seek direction 
+** passed as the second argument) and discard the batch. The return value
+** is that returned by xSeek.
+*/
+static int kvBatchSync(KVCursor *p, int dir){
+  struct sqlite4_kvbatch *pBatch = p->pBatch;
+  KVSlice *pSlice = &pBatch->aSlice[pBatch->iSlice];
+  int rc;
+
+  /* The key must be copied, as xSeek may overwrite the memory that
+  ** pSlice->pKey points to.  */
+  rc = sqlite4_buffer_set(&pBatch->key, pSlice->pKey, pSlice->nKey);
+  kvBatchClear(p);
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4KVCursorSeek(p, pBatch->key.p, pBatch->key.n, dir);
+  }
+  return rc;
+}
+
+/*
+** Advance cursor p, which has batching enabled, to the next entry.
+*/
+static int kvBatchNext(KVCursor *p){
+  struct sqlite4_kvbatch *pBatch = p->pBatch;
+  int rc;
+
+  if( pBatch->nMultiGet ){
+    /* The cursor is positioned by an EQ seek. Either the storage engine 
+    ** cursor was moved by xSeek, or the seek was served from the results
+    ** of xMultiGet, in which case the storage engine cursor is moved to
+    ** the same entry before advancing it.  */
+    if( pBatch->nSlice==0 ){
+      kvBatchClear(p);
+      return p->pStoreVfunc->xNext(p);
+    }
+    rc = kvBatchSync(p, +1);
+    if( rc==SQLITE4_OK ){
+      rc = p->pStoreVfunc->xNext(p);
+    }else if( rc==SQLITE4_INEXACT ){
+      rc = SQLITE4_OK;
+    }
+    return rc;
+  }
+  if( pBatch->nSlice ){
+    if( pBatch->iWriteGen!=p->pStore->iWriteGen ){
+      /* The store has been written since this batch was read. Move the
+      ** underlying cursor back to the current entry and advance it as
+      ** normal. If the current entry has been deleted, the seek leaves
+      ** the cursor on the entry that follows it.  */
+      pBatch->bEnable = 0;
+      rc = kvBatchSync(p, +1);
+      if( rc==SQLITE4_OK ){
+        rc = p->pStoreVfunc->xNext(p);
+      }else if( rc==SQLITE4_INEXACT ){
+        rc = SQLITE4_OK;
+      }
+      return rc;
+    }
+    if( (pBatch->iSlice+1)<pBatch->nSlice ){
+      pBatch->iSlice++;
+      return SQLITE4_OK;
+    }
+    pBatch->nSlice = 0;
+    if( pBatch->rc!=SQLITE4_OK ) return pBatch->rc;
+  }else if( pBatch->bScan==0 || pBatch->nNext<KVBATCH_THRESHOLD ){
+    pBatch->nNext++;
+    return p->pStoreVfunc->xNext(p);
+  }
+
+  rc = p->pStoreVfunc->xNextBatch(
+      p, pBatch->aSlice, KVBATCH_NSLICE, &pBatch->nSlice
+  );
+  kvTrace(p->pStore, "xNextBatch(%d,%d) -> %s", 
+          p->curId, pBatch->nSlice, kvErrName(rc));
+  if( pBatch->nSlice>0 ){
+    pBatch->iSlice = 0;
+    pBatch->rc = rc;
+    pBatch->iWriteGen = p->pStore->iWriteGen;
+    rc = SQLITE4_OK;
+  }
+  return rc;
+}
+
+/*
+** Allow read-only cursor p to resolve EQ seeks in batches using xMultiGet
+** and, if bScan is true, to read entries ahead of its position in batches
+** using xNextBatch, if the storage engine supports it. This is called by
+** the VDBE for cursors opened by OP_OpenRead. Batching remains enabled 
+** until the cursor is reset or closed.
+*/
+void sqlite4KVCursorEnableBatch(KVCursor *p, int bScan){
+  if( p->pStoreVfunc->iVersion>=3 && p->pStoreVfunc->xNextBatch ){
+    if( p->pBatch==0 ){
+      p->pBatch = (struct sqlite4_kvbatch*)sqlite4_malloc(
+          p->pEnv, sizeof(struct sqlite4_kvbatch)
+      );
+      if( p->pBatch==0 ) return;
+      memset(p->pBatch, 0, sizeof(struct sqlite4_kvbatch));
+    }
+    p->pBatch->bEnable = 1;
+    p->pBatch->bScan = bScan;
+  }
+}
+
+/*
+** If cursor p is reading entries in batches, set *ppKey and *pnKey to the
+** key of the entry iAhead entries after the current entry and return 
+** SQLITE4_OK. Return SQLITE4_NOTFOUND if that entry is not part of the
+** current batch.  The key remains valid until the cursor is next moved.
+*/
+int sqlite4KVCursorPeek(
+  KVCursor *p, 
+  int iAhead, 
+  const KVByteArray **ppKey, 
+  KVSize *pnKey
+){
+  struct sqlite4_kvbatch *pBatch = p->pBatch;
+  int i;
+  if( pBatch==0 || pBatch->nMultiGet || pBatch->nSlice==0 
+   || pBatch->iWriteGen!=p->pStore->iWriteGen
+  ){
+    return SQLITE4_NOTFOUND;
+  }
+  i = pBatch->iSlice + iAhead;
+  if( i>=pBatch->nSlice ) return SQLITE4_NOTFOUND;
+  *ppKey = pBatch->aSlice[i].pKey;
+  *pnKey = pBatch->aSlice[i].nKey;
+  return SQLITE4_OK;
+}
+
+/*
+** Compare key pKey/nKey with the key of slice pSlice in the same way as
+** memcmp().
+*/
+static int kvSliceCompare(
+  const KVSlice *pSlice, 
+  const KVByteArray *pKey, 
+  KVSize nKey
+){
+  KVSize n = pSlice->nKey<nKey ? pSlice->nKey : nKey;
+  int c = memcmp(pSlice->pKey, pKey, n);
+  if( c==0 ) c = (int)(pSlice->nKey - nKey);
+  return c;
+}
+
+/*
+** Search the results of the most recent xMultiGet call on cursor p for
+** key pKey/nKey. Return the index of the matching slice, or -1 if there
+** is no such slice or the results are no longer valid.
+*/
+static int kvMultiGetFind(KVCursor *p, const KVByteArray *pKey, KVSize nKey){
+  struct sqlite4_kvbatch *pBatch = p->pBatch;
+  int iLo, iHi;
+
+  if( pBatch==0 || pBatch->nMultiGet==0 ) return -1;
+  if( pBatch->iWriteGen!=p->pStore->iWriteGen ){
+    kvBatchClear(p);
+    return -1;
+  }
+  iLo = 0;
+  iHi = pBatch->nMultiGet-1;
+  while( iLo<=iHi ){
+    int iMid = (iLo+iHi)/2;
+    int c = kvSliceCompare(&pBatch->aSlice[iMid], pKey, nKey);
+    if( c==0 ) return iMid;
+    if( c<0 ){
+      iLo = iMid+1;
+    }else{
+      iHi = iMid-1;
+    }
+  }
+  return -1;
+}
+
+/*
+** Return true if it is worth calling sqlite4KVCursorMultiGet() on cursor
+** p ahead of an EQ seek for key pKey/nKey. That is, if the store supports
+** xMultiGet, p is a read-only cursor (one for which batching has been 
+** enabled) and the key is not already available from the results of an 
+** earlier call.
+*/
+int sqlite4KVCursorWantMultiGet(
+  KVCursor *p, 
+  const KVByteArray *pKey, 
+  KVSize nKey
+){
+  return p->pBatch && p->pBatch->bEnable
+      && p->pStoreVfunc->iVersion>=6 && p->pStoreVfunc->xMultiGet
+      && kvMultiGetFind(p, pKey, nKey)<0;
+}
+
+/*
+** Look up the nKey keys in array aKey[], which must be sorted in ascending
+** order and contain no duplicates, using a single call to xMultiGet. The
+** results are used to serve subsequent EQ seeks on the same cursor until
+** the cursor is moved by any other method or the store is written. If
+** the store does not support xMultiGet, or p is not a read-only cursor,
+** SQLITE4_NOTFOUND is returned. At most KVBATCH_NSLICE keys are looked
+** up - any keys beyond that are ignored.
+*/
+int sqlite4KVCursorMultiGet(KVCursor *p, const KVSlice *aKey, int nKey){
+  struct sqlite4_kvbatch *pBatch = p->pBatch;
+  int rc;
+
+  if( pBatch==0 || pBatch->bEnable==0 
+   || p->pStoreVfunc->iVersion<6 || p->pStoreVfunc->xMultiGet==0
+  ){
+    return SQLITE4_NOTFOUND;
+  }
+  assert( nKey>0 );
+  if( nKey>KVBATCH_NSLICE ) nKey = KVBATCH_NSLICE;
+  if( p->pStore->pPin ) kvUnpin(p->pStore, p);
+  kvBatchClear(p);
+  memcpy(pBatch->aSlice, aKey, nKey*sizeof(KVSlice));
+  rc = p->pStoreVfunc->xMultiGet(p, pBatch->aSlice, nKey);
+  kvTrace(p->pStore, "xMultiGet(%d,%d) -> %s", p->curId, nKey, kvErrName(rc));
+#ifdef SQLITE4_TEST
+  sqlite4_kv_multigets++;
+#endif
+  if( rc==SQLITE4_OK ){
+    pBatch->nMultiGet = nKey;
+    pBatch->iWriteGen = p->pStore->iWriteGen;
+  }
+  return rc;
+}
+
+/*
+** Append a copy of an entry to buffer pBuf. The sizes of the key and 
+** data are recorded in *pSlice. The pointers in *pSlice are set later, 
+** by sqlite4KVBatchFinish(), as pBuf may be reallocated by each call to 
+** this function. If aData is NULL, only the key is copied.
+*/
+int sqlite4KVBatchAppend(
+  sqlite4_buffer *pBuf,
+  KVSlice *pSlice,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  int rc;
+  rc = sqlite4_buffer_append(pBuf, aKey, nKey);
+  if( rc==SQLITE4_OK && aData && nData>0 ){
+    rc = sqlite4_buffer_append(pBuf, aData, nData);
+  }
+  pSlice->nKey = nKey;
+  pSlice->pData = aData;
+  pSlice->nData = nData;
+  return rc;
+}
+
+/*
+** Set the key and data pointers of the nSlice entries in aSlice[], each
+** of which was added to buffer pBuf by sqlite4KVBatchAppend().  The data
+** pointer of an entry appended with a negative data size (a key that was
+** not found by xMultiGet) or with a NULL data pointer (data that was not
+** copied) is set to NULL.
+*/
+void sqlite4KVBatchFinish(sqlite4_buffer *pBuf, KVSlice *aSlice, int nSlice){
+  const KVByteArray *a = (const KVByteArray*)pBuf->p;
+  int i;
+  for(i=0; i<nSlice; i++){
+    aSlice[i].pKey = a;
+    a += aSlice[i].nKey;
+    if( aSlice[i].nData<0 || (aSlice[i].pData==0 && aSlice[i].nData>0) ){
+      aSlice[i].pData = 0;
+    }else{
+      aSlice[i].pData = a;
+      a += aSlice[i].nData;
+    }
+  }
+}
+
 int sqlite4KVCursorSeek(
   KVCursor *p,
   const KVByteArray *pKey, KVSize nKey,
@@ -176,7 +619,27 @@ int sqlite4KVCursorSeek(
 ){
   int rc;
   assert( dir==0 || dir==(+1) || dir==(-1) || dir==(-2) );  
-  rc = p->pStoreVfunc->xSeek(p,pKey,nKey,dir);
+  if( p->pStore->pPin ) kvUnpin(p->pStore, p);
+  if( dir==0 && p->pBatch && p->pBatch->nMultiGet ){
+    /* Serve EQ seeks from the results of an earlier xMultiGet call. If
+    ** the key is not one of those looked up, seek the storage engine 
+    ** cursor but keep the results for the seeks that follow.  */
+    int i = kvMultiGetFind(p, pKey, nKey);
+    if( i>=0 ){
+      p->pBatch->nSlice = p->pBatch->nMultiGet;
+      p->pBatch->iSlice = i;
+      rc = p->pBatch->aSlice[i].nData<0 ? SQLITE4_NOTFOUND : SQLITE4_OK;
+#ifdef SQLITE4_TEST
+      sqlite4_kv_multiget_hits++;
+#endif
+    }else{
+      p->pBatch->nSlice = 0;
+      rc = p->pStoreVfunc->xSeek(p,pKey,nKey,dir);
+    }
+  }else{
+    kvBatchClear(p);
+    rc = p->pStoreVfunc->xSeek(p,pKey,nKey,dir);
+  }
   if( p->fTrace ){
     char zKey[52];
     binToHex(zKey, sizeof(zKey), pKey, nKey);
@@ -185,33 +648,88 @@ int sqlite4KVCursorSeek(
   }
   return rc;
 }
+int sqlite4KVCursorSetPrefix(
+  KVCursor *p,
+  const KVByteArray *pPrefix, KVSize nPrefix
+){
+  int rc = SQLITE4_OK;
+  if( p->pStore->pPin ) kvUnpin(p->pStore, p);
+  kvBatchClear(p);
+  if( p->pStoreVfunc->iVersion>=2 && p->pStoreVfunc->xSetPrefix ){
+    rc = p->pStoreVfunc->xSetPrefix(p, pPrefix, nPrefix);
+    if( p->fTrace ){
+      char zPrefix[52];
+      binToHex(zPrefix, sizeof(zPrefix), pPrefix, nPrefix);
+      kvTrace(p->pStore, "xSetPrefix(%d,%s,%d) -> %s",
+              p->curId, zPrefix, (int)nPrefix, kvErrName(rc));
+    }
+  }
+  return rc;
+}
 int sqlite4KVCursorNext(KVCursor *p){
   int rc;
-  rc = p->pStoreVfunc->xNext(p);
-  kvTrace(p->pStore, "xNext(%d) -> %s", p->curId, kvErrName(rc));
+  if( p->pStore->pPin ) kvUnpin(p->pStore, p);
+  if( p->pBatch && p->pBatch->bEnable ){
+    rc = kvBatchNext(p);
+  }else{
+    rc = p->pStoreVfunc->xNext(p);
+  }
+  if( p->fTrace ){
+    kvTrace(p->pStore, "xNext(%d) -> %s", p->curId, kvErrName(rc));
+  }
   return rc;
 }
 int sqlite4KVCursorPrev(KVCursor *p){
   int rc;
-  rc = p->pStoreVfunc->xPrev(p);
+  if( p->pStore->pPin ) kvUnpin(p->pStore, p);
+  if( p->pBatch && p->pBatch->nSlice ){
+    rc = kvBatchSync(p, -1);
+    if( rc==SQLITE4_OK ){
+      rc = p->pStoreVfunc->xPrev(p);
+    }else if( rc==SQLITE4_INEXACT ){
+      rc = SQLITE4_OK;
+    }
+  }else{
+    kvBatchClear(p);
+    rc = p->pStoreVfunc->xPrev(p);
+  }
   kvTrace(p->pStore, "xPrev(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorDelete(KVCursor *p){
-  int rc;
-  rc = p->pStoreVfunc->xDelete(p);
+  int rc = SQLITE4_OK;
+  if( p->pStore->pPin ) kvUnpin(p->pStore, 0);
+  if( p->pBatch && p->pBatch->nSlice ){
+    rc = kvBatchSync(p, 0);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = p->pStoreVfunc->xDelete(p);
+    p->pStore->iWriteGen++;
+  }
   kvTrace(p->pStore, "xDelete(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorReset(KVCursor *p){
   int rc;
+  if( p->pStore->pPin ) kvUnpin(p->pStore, p);
+  if( p->pBatch ){
+    p->pBatch->bEnable = 0;
+    kvBatchClear(p);
+  }
   rc = p->pStoreVfunc->xReset(p);
   kvTrace(p->pStore, "xReset(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorKey(KVCursor *p, const KVByteArray **ppKey, KVSize *pnKey){
   int rc;
-  rc = p->pStoreVfunc->xKey(p, ppKey, pnKey);
+  if( p->pBatch && p->pBatch->nSlice ){
+    KVSlice *pSlice = &p->pBatch->aSlice[p->pBatch->iSlice];
+    *ppKey = pSlice->pKey;
+    *pnKey = pSlice->nKey;
+    rc = SQLITE4_OK;
+  }else{
+    rc = p->pStoreVfunc->xKey(p, ppKey, pnKey);
+  }
   if( p->fTrace ){
     if( rc==SQLITE4_OK ){
       char zKey[52];
@@ -231,7 +749,23 @@ int sqlite4KVCursorData(
   KVSize *pnData
 ){
   int rc;
-  rc = p->pStoreVfunc->xData(p, ofst, n, ppData, pnData);
+  KVSlice *pSlice = 0;
+  if( p->pBatch && p->pBatch->nSlice ){
+    pSlice = &p->pBatch->aSlice[p->pBatch->iSlice];
+  }
+  if( pSlice && (pSlice->pData || pSlice->nData<=0) ){
+    KVSize nAvail = pSlice->nData - ofst;
+    if( nAvail<0 ) nAvail = 0;
+    *ppData = &pSlice->pData[ofst];
+    *pnData = (n<0 || n>nAvail) ? nAvail : n;
+    rc = SQLITE4_OK;
+  }else{
+    /* Either there is no batch, or the data of the current entry was not
+    ** copied into it. In the latter case the current entry is the last
+    ** in the batch and the storage engine cursor is positioned on it. */
+    assert( pSlice==0 || p->pBatch->iSlice==p->pBatch->nSlice-1 );
+    rc = p->pStoreVfunc->xData(p, ofst, n, ppData, pnData);
+  }
   if( p->fTrace ){
     if( rc==SQLITE4_OK ){
       char zData[52];
@@ -245,13 +779,43 @@ int sqlite4KVCursorData(
   }
   return rc;
 }
+
+/*
+** Return true if cursor p, which is about to be closed, may be reset and
+** added to the cursor pool of its store. This is only possible if the 
+** store supports cursor recycling (iVersion 7 or greater) and its pool 
+** is not already full.
+*/
+static int kvCursorPoolable(KVCursor *p){
+  KVStore *pStore = p->pStore;
+  if( pStore->pStoreVfunc->iVersion<7 ) return 0;
+  if( pStore->pCsrPool==0 ){
+    pStore->pCsrPool = (struct sqlite4_kvcsrpool*)sqlite4MallocZero(
+        pStore->pEnv, sizeof(struct sqlite4_kvcsrpool)
+    );
+    if( pStore->pCsrPool==0 ) return 0;
+  }
+  return pStore->pCsrPool->nCsr<SQLITE4_KV_MAX_CSRPOOL;
+}
+
+/*
+** Close cursor p.  If the store supports cursor recycling, the cursor 
+** is reset and added to the pool instead of being destroyed.
+*/
 int sqlite4KVCursorClose(KVCursor *p){
   int rc = SQLITE4_OK;
   if( p ){
     KVStore *pStore = p->pStore;
     int curId = p->curId;
-    rc = p->pStoreVfunc->xCloseCursor(p);
-    kvTrace(pStore, "xCloseCursor(%d) -> %s", curId, kvErrName(rc));
+    if( pStore->pPin ) kvUnpin(pStore, p);
+    if( kvCursorPoolable(p) && sqlite4KVCursorReset(p)==SQLITE4_OK ){
+      struct sqlite4_kvcsrpool *pPool = pStore->pCsrPool;
+      pPool->apCsr[pPool->nCsr++] = p;
+    }else{
+      kvBatchFree(p);
+      rc = p->pStoreVfunc->xCloseCursor(p);
+      kvTrace(pStore, "xCloseCursor(%d) -> %s", curId, kvErrName(rc));
+    }
   }
   return rc;
 }
@@ -296,6 +860,8 @@ int sqlite4KVStoreRollback(KVStore *p, int iLevel){
   int rc;
   assert( iLevel>=0 );
   assert( iLevel<=p->iTransLevel );
+  if( p->pPin ) kvUnpin(p, 0);
+  p->iWriteGen++;
   rc = p->pStoreVfunc->xRollback(p, iLevel);
   kvTrace(p, "xRollback(%d,%d) -> %s", p->kvId, iLevel, kvErrName(rc));
   assert( p->iTransLevel==iLevel || rc!=SQLITE4_OK );
@@ -306,6 +872,8 @@ int sqlite4KVStoreRevert(KVStore *p, int iLevel){
   assert( iLevel>0 );
   assert( iLevel<=p->iTransLevel );
   if( p->pStoreVfunc->xRevert ){
+    if( p->pPin ) kvUnpin(p, 0);
+    p->iWriteGen++;
     rc = p->pStoreVfunc->xRevert(p, iLevel);
     kvTrace(p, "xRevert(%d,%d) -> %s", p->kvId, iLevel, kvErrName(rc));
   }else{
@@ -318,14 +886,343 @@ int sqlite4KVStoreRevert(KVStore *p, int iLevel){
   return rc;
 }
 int sqlite4KVStoreClose(KVStore *p){
-  int rc;
+  int rc = SQLITE4_OK;
   if( p ){
+    assert( p->pPin==0 );
+    /* Destroy any pooled cursors before closing the store itself */
+    if( p->pCsrPool ){
+      struct sqlite4_kvcsrpool *pPool = p->pCsrPool;
+      while( pPool->nCsr>0 ){
+        KVCursor *pCur = pPool->apCsr[--pPool->nCsr];
+        kvBatchFree(pCur);
+        p->pStoreVfunc->xCloseCursor(pCur);
+      }
+      sqlite4_free(p->pEnv, pPool);
+      p->pCsrPool = 0;
+    }
     kvTrace(p, "xClose(%d)", p->kvId);
     rc = p->pStoreVfunc->xClose(p);
   }
   return rc;
 }
 
+/*
+** Estimate the number of entries in store p with keys greater than or
+** equal to aLo/nLo and smaller than aHi/nHi (or with no upper bound if
+** aHi is NULL).  Return SQLITE4_NOTFOUND if the store does not provide 
+** estimates.
+*/
+int sqlite4KVStoreEstimateRange(
+  KVStore *p,
+  const KVByteArray *aLo, KVSize nLo,
+  const KVByteArray *aHi, KVSize nHi,
+  sqlite4_int64 *pnRow
+){
+  int rc = SQLITE4_NOTFOUND;
+  *pnRow = 0;
+  if( p->pStoreVfunc->iVersion>=5 && p->pStoreVfunc->xEstimateRange ){
+    rc = p->pStoreVfunc->xEstimateRange(p, aLo, nLo, aHi, nHi, pnRow);
+    kvTrace(p, "xEstimateRange(%d) -> %s %lld",
+            p->kvId, kvErrName(rc), *pnRow);
+  }
+  return rc;
+}
+
+/*
+** The maximum number of threads, including the calling thread, used by
+** sqlite4KVStoreParallelScan().  Parallel scans are disabled if this is
+** less than 2.  In test builds the limit may be changed at runtime using
+** the sqlite4_scan_threads variable, and sqlite4_parallel_scans is 
+** incremented each time a parallel scan is run.
+*/
+#ifndef SQLITE4_SCAN_THREADS
+# define SQLITE4_SCAN_THREADS 4
+#endif
+#ifdef SQLITE4_TEST
+int sqlite4_scan_threads = SQLITE4_SCAN_THREADS;
+int sqlite4_parallel_scans = 0;
+# define KVSCAN_NTHREAD sqlite4_scan_threads
+#else
+# define KVSCAN_NTHREAD SQLITE4_SCAN_THREADS
+#endif
+
+/*
+** Each part of a parallel scan other than the first is read using a new
+** connection to the database, which is relatively expensive to open. So
+** the number of parts is limited so that each is estimated to contain at
+** least SQLITE4_SCAN_MINROW entries. In test builds the limit may be 
+** changed at runtime using the sqlite4_scan_minrow variable.
+*/
+#ifndef SQLITE4_SCAN_MINROW
+# define SQLITE4_SCAN_MINROW 2000
+#endif
+#ifdef SQLITE4_TEST
+int sqlite4_scan_minrow = SQLITE4_SCAN_MINROW;
+# define KVSCAN_MINROW sqlite4_scan_minrow
+#else
+# define KVSCAN_MINROW SQLITE4_SCAN_MINROW
+#endif
+
+/*
+** The keys returned by xSplit are accumulated in an instance of this
+** object. The keys are stored one after another in buf, and the offset of
+** the end of each key is stored in aEnd[].
+*/
+typedef struct KVSplit KVSplit;
+struct KVSplit {
+  sqlite4_buffer buf;             /* Keys returned by xSplit */
+  int nKey;                       /* Number of keys in buf */
+  int nMaxKey;                    /* Number of keys requested */
+  int aEnd[KVSCAN_MAXPART];       /* Offset of the end of each key */
+};
+
+/*
+** One part of a parallel scan. The part consists of the entries with keys
+** that are greater than or equal to aFirst/nFirst and less than aLast/nLast.
+** For the last part, aLast is NULL and the part consists of all entries 
+** that begin with the prefix.
+*/
+typedef struct KVScanPart KVScanPart;
+struct KVScanPart {
+  int iPart;                      /* Index of this part */
+  KVStore *pStore;                /* Store to read (may be a clone) */
+  KVCursor *pCsr;                 /* Cursor open on pStore */
+  const KVByteArray *aPrefix;     /* Prefix shared by all keys in scan */
+  KVSize nPrefix;                 /* Size of aPrefix[] in bytes */
+  const KVByteArray *aFirst;      /* First key in part */
+  KVSize nFirst;                  /* Size of aFirst[] in bytes */
+  const KVByteArray *aLast;       /* Upper bound of part, or NULL */
+  KVSize nLast;                   /* Size of aLast[] in bytes */
+  int (*xEntry)(void*, int, KVCursor*);
+  void *pCtx;                     /* First argument passed to xEntry */
+  int rc;                         /* Result of scan */
+};
+
+/*
+** xSplit callback used by sqlite4KVStoreParallelScan().
+*/
+static int kvSplitKey(void *pCtx, const KVByteArray *aKey, KVSize nKey){
+  KVSplit *p = (KVSplit*)pCtx;
+  int rc = SQLITE4_OK;
+  if( p->nKey<p->nMaxKey ){
+    rc = sqlite4_buffer_append(&p->buf, aKey, nKey);
+    if( rc==SQLITE4_OK ){
+      p->aEnd[p->nKey++] = p->buf.n;
+    }
+  }
+  return rc;
+}
+
+/*
+** Return an estimate of the number of entries in store p with keys that
+** begin with prefix aPrefix/nPrefix, or -1 if no estimate is available.
+*/
+static i64 kvScanEstimate(
+  KVStore *p,
+  const KVByteArray *aPrefix, KVSize nPrefix
+){
+  KVByteArray aHi[16];            /* Smallest key larger than the prefix */
+  KVSize nHi = nPrefix;
+  sqlite4_int64 nRow = 0;
+
+  /* Keys that begin with the prefix are smaller than aHi/nHi. If the 
+  ** prefix is empty or made up of 0xFF bytes only, there is no upper 
+  ** bound. */
+  while( nHi>0 && aPrefix[nHi-1]==0xFF ) nHi--;
+  if( nHi>(KVSize)sizeof(aHi) ) return -1;
+  memcpy(aHi, aPrefix, nHi);
+  if( nHi>0 ) aHi[nHi-1]++;
+
+  if( sqlite4KVStoreEstimateRange(
+        p, aPrefix, nPrefix, (nHi>0 ? aHi : 0), nHi, &nRow)!=SQLITE4_OK 
+  ){
+    return -1;
+  }
+  return nRow;
+}
+
+/*
+** Invoke the xEntry callback for each entry in a single part of a
+** parallel scan.
+*/
+static int kvScanPart(KVScanPart *p){
+  KVCursor *pCsr = p->pCsr;
+  int rc;
+
+  rc = sqlite4KVCursorSeek(pCsr, p->aFirst, p->nFirst, +1);
+  if( rc==SQLITE4_INEXACT ) rc = SQLITE4_OK;
+  while( rc==SQLITE4_OK ){
+    const KVByteArray *aKey;
+    KVSize nKey;
+
+    rc = sqlite4KVCursorKey(pCsr, &aKey, &nKey);
+    if( rc!=SQLITE4_OK ) break;
+    if( p->aLast ){
+      int n = (nKey<p->nLast ? nKey : p->nLast);
+      int res = memcmp(aKey, p->aLast, n);
+      if( res>0 || (res==0 && nKey>=p->nLast) ) break;
+    }else{
+      if( nKey<p->nPrefix || memcmp(aKey, p->aPrefix, p->nPrefix) ) break;
+    }
+    rc = p->xEntry(p->pCtx, p->iPart, pCsr);
+    if( rc==SQLITE4_OK ) rc = sqlite4KVCursorNext(pCsr);
+  }
+  if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  return rc;
+}
+
+/*
+** Main routine for the worker threads of a parallel scan.
+*/
+static void *kvScanThread(void *pArg){
+  KVScanPart *p = (KVScanPart*)pArg;
+  p->rc = kvScanPart(p);
+  return 0;
+}
+
+/*
+** Invoke xEntry once for each entry in store p with a key that begins 
+** with aPrefix/nPrefix. The entries are divided into up to 
+** SQLITE4_SCAN_THREADS contiguous parts, using the xSplit method of the 
+** store, and each part is read by a separate thread using a cursor open 
+** on a clone of the store obtained from xCloneReader. The first part is
+** read by the calling thread using store p itself.
+**
+** The second argument passed to xEntry is the index of the part that the
+** entry belongs to, and the third is a cursor pointing to the entry. Calls
+** for entries that belong to the same part are made by a single thread,
+** in key order. Calls for different parts are made concurrently, so the 
+** callback should keep separate state for each part. If xEntry returns
+** other than SQLITE4_OK, the scan of that part stops and the error code
+** is returned.
+**
+** If the scan is run, *pnPart is set to the number of parts. If it is not
+** (because the store does not support the required methods, threads are 
+** not available, there are too few entries to make it worthwhile, the 
+** keys cannot be split or the read transaction cannot be cloned) *pnPart
+** is set to zero and SQLITE4_OK returned. In this case
+** the caller should scan the entries itself.
+*/
+int sqlite4KVStoreParallelScan(
+  KVStore *p,
+  const KVByteArray *aPrefix, KVSize nPrefix,
+  int (*xEntry)(void*, int, KVCursor*),
+  void *pCtx,
+  int *pnPart
+){
+  const KVStoreMethods *pMeth = p->pStoreVfunc;
+  KVScanPart aPart[KVSCAN_MAXPART];
+  SQLiteThread *apThread[KVSCAN_MAXPART];
+  KVSplit split;
+  int nPart;
+  int nThread = KVSCAN_NTHREAD;
+  i64 nRow;
+  int rc = SQLITE4_OK;
+  int i;
+
+  *pnPart = 0;
+#ifndef SQLITE4_THREADS_IMPLEMENTED
+  nThread = 1;
+#endif
+  if( nThread>KVSCAN_MAXPART ) nThread = KVSCAN_MAXPART;
+  if( nThread<2 || p->fTrace || pMeth->iVersion<4 
+   || pMeth->xSplit==0 || pMeth->xCloneReader==0
+   || p->pEnv->bCoreMutex==0
+  ){
+    return SQLITE4_OK;
+  }
+
+  /* If the store can estimate the number of entries in the range, use
+  ** fewer parts (or none at all) for small ranges. */
+  nRow = kvScanEstimate(p, aPrefix, nPrefix);
+  if( nRow>=0 && KVSCAN_MINROW>0 && nRow/KVSCAN_MINROW<nThread ){
+    nThread = (int)(nRow/KVSCAN_MINROW);
+    if( nThread<2 ) return SQLITE4_OK;
+  }
+
+  memset(&split, 0, sizeof(split));
+  sqlite4_buffer_init(&split.buf, p->pEnv->pMM);
+  split.nMaxKey = nThread-1;
+  rc = pMeth->xSplit(p, aPrefix, nPrefix, nThread, kvSplitKey, &split);
+  nPart = split.nKey+1;
+  if( rc!=SQLITE4_OK || nPart<2 ){
+    sqlite4_buffer_clear(&split.buf);
+    return rc;
+  }
+
+  /* Set up each part. Part 0 uses store p. The others use clones. */
+  memset(aPart, 0, sizeof(aPart));
+  for(i=0; i<nPart; i++){
+    KVScanPart *pPart = &aPart[i];
+    const KVByteArray *aKey = (const KVByteArray*)split.buf.p;
+    pPart->iPart = i;
+    pPart->aPrefix = aPrefix;
+    pPart->nPrefix = nPrefix;
+    if( i==0 ){
+      pPart->aFirst = aPrefix;
+      pPart->nFirst = nPrefix;
+    }else{
+      int iStart = (i==1 ? 0 : split.aEnd[i-2]);
+      pPart->aFirst = &aKey[iStart];
+      pPart->nFirst = split.aEnd[i-1] - iStart;
+    }
+    if( i<nPart-1 ){
+      int iStart = (i==0 ? 0 : split.aEnd[i-1]);
+      pPart->aLast = &aKey[iStart];
+      pPart->nLast = split.aEnd[i] - iStart;
+    }
+    pPart->xEntry = xEntry;
+    pPart->pCtx = pCtx;
+    if( rc!=SQLITE4_OK ) continue;
+    if( i==0 ){
+      pPart->pStore = p;
+    }else{
+      rc = pMeth->xCloneReader(p, &pPart->pStore);
+      if( pPart->pStore ) kvStoreInit(pPart->pStore, p->zKVName, 0);
+    }
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4KVStoreOpenCursor(pPart->pStore, &pPart->pCsr);
+    }
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4KVCursorSetPrefix(pPart->pCsr, aPrefix, nPrefix);
+      sqlite4KVCursorEnableBatch(pPart->pCsr, 1);
+    }
+  }
+
+  if( rc==SQLITE4_OK ){
+#ifdef SQLITE4_TEST
+    sqlite4_parallel_scans++;
+#endif
+    memset(apThread, 0, sizeof(apThread));
+    for(i=1; i<nPart && rc==SQLITE4_OK; i++){
+      rc = sqlite4ThreadCreate(p->pEnv, &apThread[i], kvScanThread, &aPart[i]);
+    }
+    if( rc==SQLITE4_OK ){
+      aPart[0].rc = kvScanPart(&aPart[0]);
+    }
+    for(i=1; i<nPart; i++){
+      if( apThread[i] ){
+        void *pDummy;
+        sqlite4ThreadJoin(p->pEnv, apThread[i], &pDummy);
+      }
+    }
+    for(i=0; i<nPart && rc==SQLITE4_OK; i++){
+      rc = aPart[i].rc;
+    }
+    if( rc==SQLITE4_OK ) *pnPart = nPart;
+  }else if( rc==SQLITE4_BUSY ){
+    /* A clone could not be opened on the same snapshot. */
+    rc = SQLITE4_OK;
+  }
+
+  for(i=0; i<nPart; i++){
+    sqlite4KVCursorClose(aPart[i].pCsr);
+    if( i>0 ) sqlite4KVStoreClose(aPart[i].pStore);
+  }
+  sqlite4_buffer_clear(&split.buf);
+  return rc;
+}
+
 /*
 ** Key for the meta-data
 */
@@ -379,6 +1276,8 @@ int sqlite4KVStoreGetMeta(KVStore *p, int iStart, int nMeta, unsigned int *a){
 */
 int sqlite4KVStorePutSchema(KVStore *p, unsigned int iVal){
   kvTrace(p, "xPutMeta(%d,%d)", p->kvId, (int)iVal);
+  if( p->pPin ) kvUnpin(p, 0);
+  p->iWriteGen++;
   return p->pStoreVfunc->xPutMeta(p, iVal);
 }
 
@@ -111,6 +111,11 @@
 ** every call must be stable until the cursor moves, or is reset or closed.
 ** The cursor owns the values returned by xKey and xData and will take
 ** responsiblity for freeing memory used to hold those values when appropriate.
+** The VDBE relies on this to use text and blob values in place, without
+** copying them, when they are consumed before the cursor moves (see the 
+** OPFLAG_EPHEM flag of OP_Column). Values that must remain valid for
+** longer, such as the columns of a result row, are pinned using 
+** sqlite4KVCursorPin().
 ** 
 ** The xDelete method deletes the entry that the cursor is currently
 ** pointing at.  However, subsequent xNext or xPrev calls behave as if the
@@ -122,6 +127,90 @@
 ** functioning normally, including responding correctly to subsequent
 ** xNext and xPrev calls.
 ** 
+** The xReset method returns a cursor to the state it was in immediately
+** after xOpenCursor.  Any position, prefix restriction or snapshot held
+** by the cursor is released, so that a reset cursor holds no resources
+** that would prevent the transaction level from being reduced to zero.
+** If the store has an iVersion of 7 or greater, the KV layer uses xReset
+** to recycle cursors: instead of calling xCloseCursor, a closed cursor is
+** reset and kept in a small per-store pool, and a later xOpenCursor on the
+** same store may be satisfied from that pool.  A recycled cursor may be
+** used in a different transaction from the one in which it was opened.
+** If xReset returns anything other than SQLITE4_OK, the cursor is closed
+** using xCloseCursor instead.  All pooled cursors are closed before xClose
+** is invoked on the store.  Stores that already recycle cursors internally,
+** or whose xReset cannot release everything a cursor holds, should report
+** an iVersion of 6 or less.
+** 
+** The xNextBatch method is available if the store has an iVersion of 3
+** or greater.  It advances the cursor up to nSlice times, exactly as if
+** by repeated calls to xNext, and stores the key and data of each entry
+** visited in aSlice[].  The number of entries stored is written to
+** *pnSlice.  The entries returned are only guaranteed to remain stable 
+** until the next method call on the same cursor.  Fewer than nSlice 
+** entries may be returned, for example to bound the memory used.  If the
+** end of the database is reached, SQLITE4_NOTFOUND is returned (along
+** with any entries visited before the end was reached).  Following a call
+** to xNextBatch the cursor is positioned on the last entry returned. If
+** SQLITE4_NOTFOUND was returned, the cursor is at EOF.  Other return 
+** codes are error codes, for example SQLITE4_NOMEM or SQLITE4_IOERR.
+** Rather than copying a large value, xNextBatch may end the batch with 
+** that entry and set its pData field to NULL (nData is still set to the
+** size of the data). The KV layer then reads the data using xData, as 
+** the cursor is positioned on that entry.
+** 
+** The KV layer uses xNextBatch for cursors that the VDBE marks as 
+** read-only scans (see sqlite4KVCursorEnableBatch()).  Calls to xNext, 
+** xKey and xData on such a cursor are then served from the most recent 
+** batch without calling into the storage engine.
+** 
+** The xSplit and xCloneReader methods are available if the store has an
+** iVersion of 4 or greater.  Either may be NULL.  xSplit invokes callback 
+** xKey on up to (nPart-1) keys, in ascending order, that divide the 
+** entries with keys that begin with prefix pPrefix/nPrefix into nPart 
+** roughly equal parts.  The keys passed to xKey need not be the keys of
+** existing entries.  xSplit may only be called while the store has a
+** transaction open.  If xKey returns other than SQLITE4_OK, xSplit returns
+** that value immediately.
+** 
+** xCloneReader opens a second connection to the same database and opens 
+** a read transaction on it that sees exactly the same data as the read 
+** transaction currently open on the store.  If this is not possible, for 
+** example because the store has a write transaction open, SQLITE4_BUSY 
+** is returned.  The clone should use the same configuration as the store
+** it was cloned from.  It may be used by a different thread than that 
+** store, and is closed using xClose before it.
+** 
+** The KV layer uses these two methods to read large ranges of keys using
+** several threads in parallel (see sqlite4KVStoreParallelScan()).
+** 
+** The xEstimateRange method is available if the store has an iVersion of
+** 5 or greater.  It may be NULL.  It sets *pnRow to an estimate of the 
+** number of entries with keys greater than or equal to aLo/nLo and smaller
+** than aHi/nHi.  If aHi is NULL there is no upper bound.  The estimate 
+** should be cheap to compute, typically from the interior nodes of the
+** store's data structures, and may be approximate.  If no estimate can be
+** made, SQLITE4_NOTFOUND is returned.  xEstimateRange may be called with
+** or without a transaction open.  The query planner uses it to estimate
+** the number of rows visited by range scans of tables and indexes.
+** 
+** The xMultiGet method is available if the store has an iVersion of 6
+** or greater.  It may be NULL.  Before it is called, the pKey and nKey
+** fields of each of the nSlice entries in aSlice[] are set to the keys to
+** look up, in ascending order and with no duplicates.  For each key that
+** is present in the store, xMultiGet sets the pKey, nKey, pData and nData
+** fields of the slice to copies of the key and data of the entry, owned 
+** by the cursor.  For each key that is not present, pData is set to NULL
+** and nData to -1.  The results remain valid until the next call to 
+** xMultiGet, xNextBatch, xReset or xCloseCursor on the same cursor. 
+** Following a call to xMultiGet the position of the cursor is undefined,
+** so the next call must not be to xNext, xPrev, xKey, xData or xDelete.
+** Because the keys are sorted, an implementation may share the work of 
+** locating neighbouring keys.
+** 
+** The KV layer uses xMultiGet to resolve the primary key lookups made by
+** a scan of a secondary index in batches (see sqlite4KVCursorMultiGet()).
+** 
 ** The xGetMethod method allows a key-value store to implement custom PRAGMA 
 ** commands, or override existing built-in PRAGMAs. Each time the user prepares
 ** a PRAGMA statement, the xGetMethod method of the corresponding key-value
@@ -155,12 +244,43 @@
 typedef struct sqlite4_kvstore KVStore;
 typedef struct sqlite4_kv_methods KVStoreMethods;
 typedef struct sqlite4_kvcursor KVCursor;
+typedef struct sqlite4_kvslice KVSlice;
+typedef struct sqlite4_kvpin KVPin;
 typedef unsigned char KVByteArray;
 typedef sqlite4_kvsize KVSize;
 
+/*
+** A pin on the current entry of a KV cursor. While a cursor is pinned,
+** the key and data most recently returned by sqlite4KVCursorKey() and
+** sqlite4KVCursorData() for it may be used in place.
+**
+** Pinned content is not copied. Instead, the KV layer invokes the xUnpin
+** callback of a pin immediately before any operation that might change 
+** or free the pinned content: moving, resetting or closing the pinned
+** cursor, or writing to or rolling back the store through any cursor. 
+** This is required even of storage engines that keep xKey and xData 
+** results stable across writes made through other cursors, as the b-tree 
+** store modifies pages in place. The pinned content is still valid when 
+** xUnpin is called, so that the callback may copy whatever it still needs.
+** The pin is released when xUnpin returns, if the callback has not already
+** done so by calling sqlite4KVCursorUnpin().
+**
+** The caller sets the xUnpin and pCtx fields before passing the KVPin to
+** sqlite4KVCursorPin(). The remaining fields are managed by the KV layer.
+*/
+struct sqlite4_kvpin {
+  KVCursor *pCsr;                 /* Pinned cursor, or NULL if not pinned */
+  void (*xUnpin)(KVPin*);         /* Invoked before pinned content changes */
+  void *pCtx;                     /* For use by xUnpin */
+  KVPin *pNext;                   /* Next pin on the same store */
+};
+
 int sqlite4KVStoreOpenBtree(sqlite4_env*, KVStore**, const char *, unsigned);
 int sqlite4KVStoreOpenMem(sqlite4_env*, KVStore**, const char *, unsigned);
 int sqlite4KVStoreOpenLsm(sqlite4_env*, KVStore**, const char *, unsigned);
+int sqlite4KVStoreOpenHybrid(sqlite4_env*, KVStore**, const char*, unsigned);
+int sqlite4KVStoreOpenEphemeral(sqlite4_env*, KVStore**, const char*, unsigned);
+int sqlite4KVStoreOpenSorter(sqlite4_env*, KVStore**, const char *, unsigned);
 int sqlite4KVStoreOpen(
   sqlite4*,
   const char *zLabel, 
@@ -179,6 +299,10 @@ int sqlite4KVCursorSeek(
   const KVByteArray *pKey, KVSize nKey,
   int dir
 );
+int sqlite4KVCursorSetPrefix(
+  KVCursor *p,
+  const KVByteArray *pPrefix, KVSize nPrefix
+);
 int sqlite4KVCursorNext(KVCursor *p);
 int sqlite4KVCursorPrev(KVCursor *p);
 int sqlite4KVCursorDelete(KVCursor *p);
@@ -192,6 +316,12 @@ int sqlite4KVCursorData(
   KVSize *pnData
 );
 int sqlite4KVCursorClose(KVCursor *p);
+void sqlite4KVCursorEnableBatch(KVCursor *p, int bScan);
+int sqlite4KVCursorPeek(KVCursor*, int, const KVByteArray**, KVSize*);
+int sqlite4KVCursorWantMultiGet(KVCursor*, const KVByteArray*, KVSize);
+int sqlite4KVCursorMultiGet(KVCursor *p, const KVSlice *aKey, int nKey);
+void sqlite4KVCursorPin(KVCursor *p, KVPin *pPin);
+void sqlite4KVCursorUnpin(KVPin *pPin);
 int sqlite4KVStoreBegin(KVStore *p, int iLevel);
 int sqlite4KVStoreCommitPhaseOne(KVStore *p, int iLevel);
 int sqlite4KVStoreCommitPhaseTwo(KVStore *p, int iLevel);
@@ -205,6 +335,42 @@ int sqlite4KVStorePutMeta(sqlite4*, KVStore *p, int, int, unsigned int*);
 
 int sqlite4KVStorePutSchema(KVStore *p, unsigned int iVal);
 int sqlite4KVStoreGetSchema(KVStore *p, unsigned int *piVal);
+int sqlite4KVStoreEstimateRange(KVStore *p,
+    const KVByteArray *aLo, KVSize nLo,
+    const KVByteArray *aHi, KVSize nHi,
+    sqlite4_int64 *pnRow
+);
+
+/*
+** Visit every entry with a key that begins with aPrefix/nPrefix using up 
+** to KVSCAN_MAXPART threads.  See kv.c for details.
+*/
+#define KVSCAN_MAXPART 16
+int sqlite4KVStoreParallelScan(
+  KVStore *p,
+  const KVByteArray *aPrefix, KVSize nPrefix,
+  int (*xEntry)(void *pCtx, int iPart, KVCursor *pCsr),
+  void *pCtx,
+  int *pnPart
+);
+
+/*
+** Utilities for storage engines that implement xNextBatch by copying
+** entries into a buffer owned by the cursor.  An implementation stops
+** adding entries to a batch once the buffer holds KVBATCH_MAXBYTES bytes.
+** The data of an entry larger than KVBATCH_MAXDATA bytes is not copied.
+** Instead, the entry is appended with a NULL data pointer and ends the
+** batch.
+*/
+#define KVBATCH_MAXBYTES (32*1024)
+#define KVBATCH_MAXDATA  1024
+int sqlite4KVBatchAppend(
+  sqlite4_buffer *pBuf,
+  KVSlice *pSlice,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+);
+void sqlite4KVBatchFinish(sqlite4_buffer *pBuf, KVSlice *aSlice, int nSlice);
 
 #ifdef SQLITE4_DEBUG
   void sqlite4KVStoreDump(KVStore *p);
@@ -38,7 +38,8 @@ struct KVBt {
 */
 struct KVBtCsr {
   KVCursor base;                  /* Base class. Must be first */
-  bt_cursor *pCsr;                /* LSM cursor handle */
+  bt_cursor *pCsr;                /* bt cursor handle */
+  sqlite4_buffer batch;           /* Entries returned by xNextBatch */
 };
   
 /*
@@ -147,10 +148,12 @@ static int btReset(KVCursor *pKVCursor){
 }
 
 /*
-** Destroy a cursor object
+** Destroy a cursor object. The batch buffer is freed first, as the 
+** KVBtCsr structure is part of the bt cursor allocation.
 */
 static int btCloseCursor(KVCursor *pKVCursor){
   KVBtCsr *pBtcsr = (KVBtCsr *)pKVCursor;
+  sqlite4_buffer_clear(&pBtcsr->batch);
   sqlite4BtCsrClose(pBtcsr->pCsr);
   return SQLITE4_OK;
 }
@@ -171,6 +174,116 @@ static int btPrevEntry(KVCursor *pKVCursor){
   return sqlite4BtCsrPrev(pBtcsr->pCsr);
 }
 
+/*
+** Advance a cursor up to nSlice times, copying the key and data of each
+** entry visited into the cursor's batch buffer. Page memory cannot be
+** returned directly, as page references are released as the cursor moves.
+** The batch ends early at an entry with more than KVBATCH_MAXDATA bytes
+** of data, which is not copied. The KV layer reads it using btData().
+*/
+static int btNextBatch(
+  KVCursor *pKVCursor,
+  KVSlice *aSlice,
+  int nSlice,
+  int *pnSlice
+){
+  KVBtCsr *pBtcsr = (KVBtCsr *)pKVCursor;
+  int rc = SQLITE4_OK;
+  int n = 0;
+
+  pBtcsr->batch.n = 0;
+  while( rc==SQLITE4_OK && n<nSlice && pBtcsr->batch.n<KVBATCH_MAXBYTES ){
+    const void *pKey; int nKey;
+    const void *pVal; int nVal;
+
+    rc = sqlite4BtCsrNext(pBtcsr->pCsr);
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4BtCsrKey(pBtcsr->pCsr, &pKey, &nKey);
+    }
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4BtCsrData(pBtcsr->pCsr, 0, -1, &pVal, &nVal);
+    }
+    if( rc==SQLITE4_OK ){
+      int bLarge = (nVal>KVBATCH_MAXDATA);
+      rc = sqlite4KVBatchAppend(&pBtcsr->batch, &aSlice[n], pKey, nKey,
+                                bLarge ? 0 : pVal, nVal);
+      if( rc==SQLITE4_OK ) n++;
+      if( bLarge ) break;
+    }
+  }
+
+  sqlite4KVBatchFinish(&pBtcsr->batch, aSlice, n);
+  *pnSlice = n;
+  return rc;
+}
+
+/*
+** The maximum number of entries btMultiGet() steps over using xNext when
+** moving the cursor from one key to the next before it gives up and 
+** seeks from the root of the b-tree instead.
+*/
+#define BT_MULTIGET_NSTEP 4
+
+/*
+** Look up each of the nSlice sorted keys in aSlice[], copying the entries
+** found into the cursor's batch buffer. If a key is close to the previous
+** one, the cursor is stepped forward to it instead of seeking, so that
+** neighbouring keys share a single descent of the b-tree.
+*/
+static int btMultiGet(KVCursor *pKVCursor, KVSlice *aSlice, int nSlice){
+  KVBtCsr *pBtcsr = (KVBtCsr *)pKVCursor;
+  int rc = SQLITE4_OK;
+  int bValid = 0;                 /* True if cursor points to an entry */
+  int i;
+
+  pBtcsr->batch.n = 0;
+  for(i=0; rc==SQLITE4_OK && i<nSlice; i++){
+    const KVByteArray *aKey = aSlice[i].pKey;
+    int nKey = aSlice[i].nKey;
+    const void *pVal = 0;
+    int nVal = -1;
+    int c = -1;                   /* Cursor key compared to aKey/nKey */
+    int nStep;
+
+    /* Step forward from the entry found for the previous key. */
+    for(nStep=0; bValid && rc==SQLITE4_OK; nStep++){
+      const void *pCsrKey; int nCsrKey;
+      rc = sqlite4BtCsrKey(pBtcsr->pCsr, &pCsrKey, &nCsrKey);
+      if( rc==SQLITE4_OK ){
+        c = memcmp(pCsrKey, aKey, nCsrKey<nKey ? nCsrKey : nKey);
+        if( c==0 ) c = nCsrKey - nKey;
+        if( c>=0 || nStep==BT_MULTIGET_NSTEP ) break;
+        rc = sqlite4BtCsrNext(pBtcsr->pCsr);
+      }
+    }
+    if( rc==SQLITE4_NOTFOUND ){
+      rc = SQLITE4_OK;
+      bValid = 0;
+      c = -1;
+    }
+
+    if( rc==SQLITE4_OK && c<0 ){
+      rc = sqlite4BtCsrSeek(pBtcsr->pCsr, (void *)aKey, nKey, BT_SEEK_GE);
+      bValid = (rc==SQLITE4_OK || rc==SQLITE4_INEXACT);
+      c = (rc==SQLITE4_OK ? 0 : 1);
+      if( rc==SQLITE4_INEXACT || rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+    }
+
+    if( rc==SQLITE4_OK && c==0 ){
+      rc = sqlite4BtCsrData(pBtcsr->pCsr, 0, -1, &pVal, &nVal);
+    }
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4KVBatchAppend(&pBtcsr->batch, &aSlice[i], aKey, nKey,
+                                pVal, nVal);
+    }
+  }
+
+  if( rc==SQLITE4_OK ){
+    sqlite4KVBatchFinish(&pBtcsr->batch, aSlice, nSlice);
+  }
+  return rc;
+}
+
 /*
 ** Seek a cursor.
 */
@@ -340,6 +453,30 @@ static int btGetMethod(
   return SQLITE4_NOTFOUND;
 }
 
+/*
+** Estimate the number of keys between aLo/nLo and aHi/nHi. If no read
+** transaction is open, open one for the duration of the call.
+*/
+static int btEstimateRange(
+  KVStore *pKVStore,
+  const KVByteArray *aLo, KVSize nLo,
+  const KVByteArray *aHi, KVSize nHi,
+  sqlite4_int64 *pnRow
+){
+  KVBt *p = (KVBt *)pKVStore;
+  int bOpen = (sqlite4BtTransactionLevel(p->pDb)==0);
+  int rc = SQLITE4_OK;
+
+  if( bOpen ) rc = sqlite4BtBegin(p->pDb, 1);
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4BtEstimateRange(p->pDb, 
+        (const void *)aLo, (int)nLo, (const void *)aHi, (int)nHi, pnRow
+    );
+    if( bOpen ) sqlite4BtCommit(p->pDb, 0);
+  }
+  return rc;
+}
+
 int sqlite4KVStoreOpenBtree(
   sqlite4_env *pEnv,              /* The environment to use */
   sqlite4_kvstore **ppKVStore,    /* OUT: New KV store returned here */
@@ -347,7 +484,7 @@ int sqlite4KVStoreOpenBtree(
   unsigned flags                  /* Bit flags */
 ){
   static const sqlite4_kv_methods bt_methods = {
-    1,                            /* iVersion */
+    6,                            /* iVersion */
     sizeof(sqlite4_kv_methods),   /* szSelf */
     btReplace,                    /* xReplace */
     btOpenCursor,                 /* xOpenCursor */
@@ -368,7 +505,13 @@ int sqlite4KVStoreOpenBtree(
     btControl,                    /* xControl */
     btGetMeta,                    /* xGetMeta */
     btPutMeta,                    /* xPutMeta */
-    btGetMethod                   /* xGetMethod */
+    btGetMethod,                  /* xGetMethod */
+    0,                            /* xSetPrefix */
+    btNextBatch,                  /* xNextBatch */
+    0,                            /* xSplit */
+    0,                            /* xCloneReader */
+    btEstimateRange,              /* xEstimateRange */
+    btMultiGet                    /* xMultiGet */
   };
 
   KVBt *pNew = 0;
@@ -0,0 +1,1034 @@
+/*
+** 2013 March 25
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** An in-memory key/value storage subsystem used for the ephemeral tables
+** opened by OP_OpenEphemeral. It presents the interface defined by kv.h.
+**
+** Unlike the general purpose store in kvmem.c, this store does not support
+** rollback, and so is only used when the store is opened with both the
+** SQLITE4_KVOPEN_TEMPORARY and SQLITE4_KVOPEN_NO_TRANSACTIONS flags.
+**
+** Content is stored in a B+tree. Leaves hold pointers to records, and are
+** linked together in key order. Each record holds its key and value in a
+** single contiguous allocation. All records and tree nodes are allocated
+** from an arena that is freed in one shot when the store is closed.
+** Nothing is freed before then: when a record is overwritten or deleted,
+** the old record stays in the arena. This is fine for an ephemeral table,
+** which is discarded at the end of the statement that uses it.
+**
+** Because records are never freed, pointers returned by xKey and xData
+** remain valid for as long as the store is open. A cursor remembers the
+** record it points to. If the tree has been modified since the cursor was
+** positioned, xNext and xPrev relocate the cursor by searching for that
+** record's key before moving.
+**
+** If the arena grows larger than KVEphm.nMaxMem bytes, the contents of
+** the tree are copied into a temporary LSM database (opened with 
+** safety=off and no log file) and all subsequent operations are passed
+** through to it. Open cursors are moved to the LSM database at the same
+** time. The arena is not freed until the store is closed, so that
+** pointers already returned by xKey and xData remain valid. If the LSM
+** database cannot be created, the error is returned to the caller. The
+** limit defaults to SQLITE4_EPHEMERAL_MAXMEM, and may be changed using
+** the SQLITE4_KVCTRL_MAXMEM file-control (see "PRAGMA ephemeral_maxmem").
+**
+** Writes to the LSM database are made within a single write transaction,
+** which is left open until the store is closed. It is only committed, and
+** a new one opened, each time roughly LSM_CONFIG_AUTOFLUSH bytes have been
+** written, so that the LSM in-memory tree can be flushed to disk (see
+** kvephmLsmCommit()).
+*/
+#include "sqliteInt.h"
+#include "lsm.h"
+
+/* Forward declarations of object names */
+typedef struct KVEphm KVEphm;
+typedef struct KVEphmChunk KVEphmChunk;
+typedef struct KVEphmCursor KVEphmCursor;
+typedef struct KVEphmNode KVEphmNode;
+typedef struct KVEphmRecord KVEphmRecord;
+
+#define KVEPHM_NCELL       32          /* Maximum cells in a tree node */
+#define KVEPHM_MAX_DEPTH   24          /* Maximum depth of tree */
+#define KVEPHM_CHUNK_MIN   1024        /* Size of first arena chunk */
+#define KVEPHM_CHUNK_MAX   (64*1024)   /* Maximum size of arena chunks */
+
+/*
+** A key/value pair. The key and value follow this header in memory.
+*/
+struct KVEphmRecord {
+  KVSize nKey;                    /* Size of key in bytes */
+  KVSize nData;                   /* Size of value in bytes */
+};
+#define kvephmRecKey(pRec)  ((KVByteArray*)&(pRec)[1])
+#define kvephmRecData(pRec) (kvephmRecKey(pRec) + (pRec)->nKey)
+
+/*
+** A node of the B+tree.
+**
+** In a leaf node, apRec[] holds the nCell records stored in the leaf in
+** key order. Leaves are linked together using pPrev and pNext.
+**
+** An interior node has nCell separator keys in apRec[] and nCell+1 child
+** pointers in apChild[]. All keys in the sub-tree headed by apChild[i]
+** are smaller than the key of apRec[i], and all keys in the sub-tree
+** headed by apChild[i+1] are greater than or equal to it. A separator
+** may refer to a record that has since been deleted or overwritten.
+**
+** Each array has room for one extra entry, so that an entry may be added
+** to a full node before it is split. Leaf nodes are allocated without
+** space for apChild[].
+*/
+struct KVEphmNode {
+  int nCell;                      /* Number of entries in apRec[] */
+  int bLeaf;                      /* True for a leaf node */
+  KVEphmNode *pPrev;              /* Previous leaf (leaves only) */
+  KVEphmNode *pNext;              /* Next leaf (leaves only) */
+  KVEphmRecord *apRec[KVEPHM_NCELL+1];   /* Records or separator keys */
+  KVEphmNode *apChild[KVEPHM_NCELL+2];   /* Child nodes (interior only) */
+};
+#define KVEPHM_LEAF_SIZE offsetof(KVEphmNode, apChild)
+
+/*
+** Memory for records and nodes is allocated from a linked list of
+** arena chunks. The first chunk in the list is the one currently being
+** allocated from.
+*/
+struct KVEphmChunk {
+  KVEphmChunk *pNext;             /* Next (older) chunk */
+  int nAlloc;                     /* Bytes of space following this header */
+  int nUsed;                      /* Bytes of space used so far */
+};
+
+/*
+** The ephemeral storage object.
+*/
+struct KVEphm {
+  KVStore base;                   /* Base class, must be first */
+  KVEphmNode *pRoot;              /* Root of the tree, or NULL */
+  KVEphmChunk *pChunk;            /* Arena chunks */
+  i64 nMem;                       /* Total size of arena chunks in bytes */
+  i64 nMaxMem;                    /* Spill to disk once nMem exceeds this */
+  u32 iGen;                       /* Incremented when the tree is modified */
+  KVEphmCursor *pCsr;             /* List of open cursors */
+  unsigned int iMeta;             /* Schema cookie value */
+  int bNoSpill;                   /* True if an attempt to spill failed */
+  lsm_db *pLsm;                   /* Temporary database, once spilled */
+  char *zSpill;                   /* Name of temporary database file */
+  int nFlush;                     /* Commit pLsm after this many bytes */
+  int nTrans;                     /* Bytes written by open pLsm transaction */
+};
+
+/*
+** A cursor. If pRec is not NULL, the cursor points to the record at
+** pLeaf->apRec[iCell]. If iGen no longer matches KVEphm.iGen, pLeaf and
+** iCell are out of date and the cursor must be relocated using the key
+** of pRec before they are used.
+**
+** Once the store has spilled to disk, pLsmCsr is used instead. If the
+** cursor pointed to a deleted entry when it was moved to the LSM database,
+** it is left pointing at the following entry and bSkipNext is set, so
+** that the next call to xNext does not move it. The same is done when the
+** LSM cursor is closed and reopened by kvephmLsmCommit(), which uses 
+** eSave and saved to remember its position.
+*/
+struct KVEphmCursor {
+  KVCursor base;                  /* Base class, must be first */
+  KVEphm *pOwner;                 /* The tree that owns this cursor */
+  KVEphmCursor *pCsrNext;         /* Next cursor opened on pOwner */
+  KVEphmRecord *pRec;             /* Current record, or NULL */
+  KVEphmNode *pLeaf;              /* Leaf containing pRec */
+  int iCell;                      /* Index of pRec in pLeaf->apRec[] */
+  u32 iGen;                       /* Value of KVEphm.iGen when positioned */
+  lsm_cursor *pLsmCsr;            /* Cursor on KVEphm.pLsm, if spilled */
+  int bSkipNext;                  /* Next xNext is a no-op */
+  int eSave;                      /* KVEPHM_SAVE_* value */
+  sqlite4_buffer saved;           /* Saved key, if eSave==KVEPHM_SAVE_KEY */
+};
+
+/*
+** Values for KVEphmCursor.eSave.
+*/
+#define KVEPHM_SAVE_NONE   0      /* LSM cursor was not closed */
+#define KVEPHM_SAVE_EOF    1      /* LSM cursor closed at EOF */
+#define KVEPHM_SAVE_KEY    2      /* LSM cursor closed, key in "saved" */
+
+/*
+** Allocate nByte bytes from the arena. Return NULL if a malloc fails.
+** Chunk sizes start small, so that ephemeral tables holding a handful of
+** rows stay cheap, and double up to KVEPHM_CHUNK_MAX.
+*/
+static void *kvephmAlloc(KVEphm *p, int nByte){
+  KVEphmChunk *pChunk = p->pChunk;
+  int nHdr = ROUND8(sizeof(KVEphmChunk));
+  void *pRet;
+
+  nByte = ROUND8(nByte);
+  if( pChunk==0 || pChunk->nAlloc-pChunk->nUsed<nByte ){
+    int nAlloc = KVEPHM_CHUNK_MIN;
+    if( pChunk ) nAlloc = MIN(KVEPHM_CHUNK_MAX, (pChunk->nAlloc+nHdr)*2);
+    nAlloc = MAX(nByte, nAlloc - nHdr);
+    pChunk = sqlite4_malloc(p->base.pEnv, nHdr + nAlloc);
+    if( pChunk==0 ) return 0;
+    pChunk->pNext = p->pChunk;
+    pChunk->nAlloc = nAlloc;
+    pChunk->nUsed = 0;
+    p->pChunk = pChunk;
+    p->nMem += nHdr + nAlloc;
+  }
+  pRet = &((u8*)pChunk)[nHdr + pChunk->nUsed];
+  pChunk->nUsed += nByte;
+  return pRet;
+}
+
+/*
+** Allocate a new, empty tree node.
+*/
+static KVEphmNode *kvephmNewNode(KVEphm *p, int bLeaf){
+  int nByte = bLeaf ? KVEPHM_LEAF_SIZE : sizeof(KVEphmNode);
+  KVEphmNode *pNode = (KVEphmNode*)kvephmAlloc(p, nByte);
+  if( pNode ){
+    memset(pNode, 0, nByte);
+    pNode->bLeaf = bLeaf;
+  }
+  return pNode;
+}
+
+/*
+** Compare key aKey/nKey with the key of record pRec. Return negative,
+** zero or positive if aKey is less than, equal to or greater than the
+** record key.
+*/
+static int kvephmCompare(
+  const KVByteArray *aKey, KVSize nKey,
+  KVEphmRecord *pRec
+){
+  KVSize n = MIN(nKey, pRec->nKey);
+  int c = memcmp(aKey, kvephmRecKey(pRec), n);
+  if( c==0 ) c = (nKey<pRec->nKey ? -1 : (nKey>pRec->nKey));
+  return c;
+}
+
+/*
+** Return the index of the first entry in pNode->apRec[] with a key
+** greater than (if bUpper is true) or greater than or equal to (if
+** bUpper is false) aKey/nKey. Set *pbExact if an entry equal to the
+** key is found.
+*/
+static int kvephmSearchNode(
+  KVEphmNode *pNode,
+  const KVByteArray *aKey, KVSize nKey,
+  int bUpper,
+  int *pbExact
+){
+  int iLo = 0;
+  int iHi = pNode->nCell;
+  while( iLo<iHi ){
+    int iMid = (iLo+iHi)/2;
+    int c = kvephmCompare(aKey, nKey, pNode->apRec[iMid]);
+    if( c==0 ) *pbExact = 1;
+    if( c>0 || (c==0 && bUpper) ){
+      iLo = iMid+1;
+    }else{
+      iHi = iMid;
+    }
+  }
+  return iLo;
+}
+
+/*
+** Descend the tree to the leaf that should contain key aKey/nKey. If
+** aPath is not NULL, record the interior nodes visited and the child
+** index taken in each in aPath[] and aIdx[], and the number of interior
+** nodes in *pnPath.
+**
+** Set *ppLeaf to the leaf and *piCell to the index of the first cell in
+** it with a key greater than or equal to aKey/nKey (which may be equal
+** to the number of cells in the leaf). Return true if the cell key is an
+** exact match.
+*/
+static int kvephmSeekLeaf(
+  KVEphm *p,
+  const KVByteArray *aKey, KVSize nKey,
+  KVEphmNode **aPath, int *aIdx, int *pnPath,
+  KVEphmNode **ppLeaf, int *piCell
+){
+  KVEphmNode *pNode = p->pRoot;
+  int nPath = 0;
+  int bExact = 0;
+
+  while( pNode->bLeaf==0 ){
+    int bDummy = 0;
+    int i = kvephmSearchNode(pNode, aKey, nKey, 1, &bDummy);
+    if( aPath ){
+      assert( nPath<KVEPHM_MAX_DEPTH );
+      aPath[nPath] = pNode;
+      aIdx[nPath] = i;
+    }
+    nPath++;
+    pNode = pNode->apChild[i];
+  }
+  if( pnPath ) *pnPath = nPath;
+  *ppLeaf = pNode;
+  *piCell = kvephmSearchNode(pNode, aKey, nKey, 0, &bExact);
+  return bExact;
+}
+
+/*
+** Split node pNode, which has overflowed, into two. Return the new right
+** sibling and set *ppSep to the separator key for the parent.
+*/
+static KVEphmNode *kvephmSplit(
+  KVEphm *p,
+  KVEphmNode *pNode,
+  KVEphmRecord **ppSep
+){
+  KVEphmNode *pRight = kvephmNewNode(p, pNode->bLeaf);
+  int nLeft = pNode->nCell / 2;
+  if( pRight==0 ) return 0;
+
+  if( pNode->bLeaf ){
+    pRight->nCell = pNode->nCell - nLeft;
+    memcpy(pRight->apRec, &pNode->apRec[nLeft],
+           pRight->nCell*sizeof(KVEphmRecord*));
+    pRight->pPrev = pNode;
+    pRight->pNext = pNode->pNext;
+    if( pNode->pNext ) pNode->pNext->pPrev = pRight;
+    pNode->pNext = pRight;
+    *ppSep = pRight->apRec[0];
+  }else{
+    /* The separator at apRec[nLeft] moves up to the parent */
+    pRight->nCell = pNode->nCell - nLeft - 1;
+    memcpy(pRight->apRec, &pNode->apRec[nLeft+1],
+           pRight->nCell*sizeof(KVEphmRecord*));
+    memcpy(pRight->apChild, &pNode->apChild[nLeft+1],
+           (pRight->nCell+1)*sizeof(KVEphmNode*));
+    *ppSep = pNode->apRec[nLeft];
+  }
+  pNode->nCell = nLeft;
+  return pRight;
+}
+
+/*
+** Insert record pRec into the tree, replacing any existing record with
+** the same key.
+*/
+static int kvephmInsert(KVEphm *p, KVEphmRecord *pRec){
+  KVEphmNode *aPath[KVEPHM_MAX_DEPTH];
+  int aIdx[KVEPHM_MAX_DEPTH];
+  int nPath;
+  KVEphmNode *pNode;
+  KVEphmNode *pChild;
+  KVEphmRecord *pSep;
+  int iCell;
+
+  if( p->pRoot==0 ){
+    p->pRoot = kvephmNewNode(p, 1);
+    if( p->pRoot==0 ) return SQLITE4_NOMEM;
+  }
+
+  if( kvephmSeekLeaf(p, kvephmRecKey(pRec), pRec->nKey,
+                     aPath, aIdx, &nPath, &pNode, &iCell) ){
+    /* Overwrite an existing entry. The shape of the tree is unchanged,
+    ** but KVEphm.iGen is still incremented so that any cursor pointing
+    ** at the old record picks up the new one (see kvephmCsrRestore()). */
+    p->iGen++;
+    pNode->apRec[iCell] = pRec;
+    return SQLITE4_OK;
+  }
+
+  p->iGen++;
+  memmove(&pNode->apRec[iCell+1], &pNode->apRec[iCell],
+          (pNode->nCell-iCell)*sizeof(KVEphmRecord*));
+  pNode->apRec[iCell] = pRec;
+  pNode->nCell++;
+
+  /* Split overflowing nodes, working up towards the root */
+  while( pNode->nCell>KVEPHM_NCELL ){
+    KVEphmNode *pParent;
+    int i;
+
+    pChild = kvephmSplit(p, pNode, &pSep);
+    if( pChild==0 ) return SQLITE4_NOMEM;
+    if( nPath==0 ){
+      pParent = kvephmNewNode(p, 0);
+      if( pParent==0 ) return SQLITE4_NOMEM;
+      pParent->apChild[0] = pNode;
+      p->pRoot = pParent;
+      i = 0;
+    }else{
+      nPath--;
+      pParent = aPath[nPath];
+      i = aIdx[nPath];
+    }
+    memmove(&pParent->apRec[i+1], &pParent->apRec[i],
+            (pParent->nCell-i)*sizeof(KVEphmRecord*));
+    memmove(&pParent->apChild[i+2], &pParent->apChild[i+1],
+            (pParent->nCell-i)*sizeof(KVEphmNode*));
+    pParent->apRec[i] = pSep;
+    pParent->apChild[i+1] = pChild;
+    pParent->nCell++;
+    pNode = pParent;
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Point cursor pCur at cell iCell of leaf pLeaf. If iCell is past the
+** end of the leaf (or, if bNext is false, before its start), move to the
+** first (or last) cell of the nearest non-empty leaf in that direction.
+** Return SQLITE4_NOTFOUND and leave the cursor pointing at nothing if
+** there is no such cell.
+*/
+static int kvephmCsrSet(
+  KVEphmCursor *pCur,
+  KVEphmNode *pLeaf,
+  int iCell,
+  int bNext
+){
+  if( bNext ){
+    while( pLeaf && iCell>=pLeaf->nCell ){
+      pLeaf = pLeaf->pNext;
+      iCell = 0;
+    }
+  }else{
+    while( pLeaf && iCell<0 ){
+      pLeaf = pLeaf->pPrev;
+      iCell = (pLeaf ? pLeaf->nCell-1 : 0);
+    }
+  }
+  if( pLeaf==0 ){
+    pCur->pRec = 0;
+    pCur->pLeaf = 0;
+    return SQLITE4_NOTFOUND;
+  }
+  pCur->pLeaf = pLeaf;
+  pCur->iCell = iCell;
+  pCur->pRec = pLeaf->apRec[iCell];
+  pCur->iGen = pCur->pOwner->iGen;
+  return SQLITE4_OK;
+}
+
+/*
+** If the tree has been modified since cursor pCur was positioned, search
+** for the key of the current record to bring pLeaf and iCell up to date.
+** Return true if the key is still in the tree, in which case pRec is set
+** to the record now stored under it, which differs from the old one if
+** the entry has been overwritten. If it is not, iCell is left at the
+** position where it would be.
+*/
+static int kvephmCsrRestore(KVEphmCursor *pCur){
+  KVEphm *p = pCur->pOwner;
+  KVEphmRecord *pRec = pCur->pRec;
+  if( pCur->iGen==p->iGen ) return 1;
+  pCur->iGen = p->iGen;
+  if( kvephmSeekLeaf(p, kvephmRecKey(pRec), pRec->nKey,
+                     0, 0, 0, &pCur->pLeaf, &pCur->iCell) ){
+    pCur->pRec = pCur->pLeaf->apRec[pCur->iCell];
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** Close the temporary LSM database, if it is open, and delete the files
+** that make it up.
+*/
+static void kvephmCloseLsm(KVEphm *p){
+  sqlite4_env *pEnv = p->base.pEnv;
+  lsm_env *pVfs = lsm_default_env();
+  if( p->pLsm ){
+    lsm_rollback(p->pLsm, 0);
+    lsm_close(p->pLsm);
+    p->pLsm = 0;
+  }
+  if( p->zSpill ){
+    static const char *azSuffix[] = { "", "-log", "-shm" };
+    int i;
+    for(i=0; i<ArraySize(azSuffix); i++){
+      char *zFile = sqlite4_mprintf(pEnv, "%s%s", p->zSpill, azSuffix[i]);
+      if( zFile ) pVfs->xUnlink(pVfs, zFile);
+      sqlite4_free(pEnv, zFile);
+    }
+    sqlite4_free(pEnv, p->zSpill);
+    p->zSpill = 0;
+  }
+}
+
+/*
+** Create the temporary LSM database used once an ephemeral store has
+** grown too large to hold in memory. As for the sorter's temporary file,
+** the name is obtained from sqlite4OsTempName() and the database files
+** are accessed, and later deleted, using the default LSM environment.
+** A write transaction is opened on the new database.
+*/
+static int kvephmOpenLsm(KVEphm *p){
+  sqlite4_env *pEnv = p->base.pEnv;
+  int rc;
+
+  p->zSpill = sqlite4OsTempName(pEnv, "sqlite4_ephm");
+  if( p->zSpill==0 ) return SQLITE4_NOMEM;
+
+  rc = lsm_new(lsm_default_env(), &p->pLsm);
+  if( rc==LSM_OK ){
+    int iVal = 0;
+    lsm_config(p->pLsm, LSM_CONFIG_MULTIPLE_PROCESSES, &iVal);
+    iVal = 0;
+    lsm_config(p->pLsm, LSM_CONFIG_USE_LOG, &iVal);
+    iVal = LSM_SAFETY_OFF;
+    lsm_config(p->pLsm, LSM_CONFIG_SAFETY, &iVal);
+    iVal = -1;
+    lsm_config(p->pLsm, LSM_CONFIG_AUTOFLUSH, &iVal);
+    p->nFlush = iVal*1024;
+    p->nTrans = 0;
+    rc = lsm_open(p->pLsm, p->zSpill);
+  }
+  if( rc==LSM_OK ) rc = lsm_begin(p->pLsm, 1);
+  if( rc!=LSM_OK ) kvephmCloseLsm(p);
+  return rc;
+}
+
+/*
+** Commit the write transaction open on the temporary LSM database, so
+** that its in-memory tree may be flushed to disk, and open a new one.
+**
+** A new write transaction cannot be opened while an LSM cursor is still
+** reading from the version of the database that existed before the 
+** flush. So each open LSM cursor is closed before the commit, and then
+** reopened and moved back to the same key afterwards. If that key has
+** been deleted, the cursor is left at the following entry and bSkipNext
+** is set, as it is when a cursor is first moved to the LSM database.
+*/
+static int kvephmLsmCommit(KVEphm *p){
+  KVEphmCursor *pCur;
+  int rc = LSM_OK;
+
+  for(pCur=p->pCsr; pCur; pCur=pCur->pCsrNext){
+    pCur->eSave = KVEPHM_SAVE_NONE;
+    if( pCur->pLsmCsr==0 ) continue;
+    if( rc==LSM_OK && lsm_csr_valid(pCur->pLsmCsr) ){
+      const void *pKey;
+      int nKey;
+      rc = lsm_csr_key(pCur->pLsmCsr, &pKey, &nKey);
+      if( rc==LSM_OK ) rc = sqlite4_buffer_set(&pCur->saved, pKey, nKey);
+      pCur->eSave = KVEPHM_SAVE_KEY;
+    }else{
+      pCur->eSave = KVEPHM_SAVE_EOF;
+    }
+    lsm_csr_close(pCur->pLsmCsr);
+    pCur->pLsmCsr = 0;
+  }
+
+  if( rc==LSM_OK ) rc = lsm_commit(p->pLsm, 0);
+  if( rc==LSM_OK ) rc = lsm_begin(p->pLsm, 1);
+  p->nTrans = 0;
+
+  for(pCur=p->pCsr; rc==LSM_OK && pCur; pCur=pCur->pCsrNext){
+    if( pCur->eSave==KVEPHM_SAVE_NONE ) continue;
+    rc = lsm_csr_open(p->pLsm, &pCur->pLsmCsr);
+    if( rc==LSM_OK && pCur->eSave==KVEPHM_SAVE_KEY ){
+      sqlite4_buffer *pKey = &pCur->saved;
+      rc = lsm_csr_seek(pCur->pLsmCsr, pKey->p, pKey->n, LSM_SEEK_GE);
+      if( rc==LSM_OK ){
+        const void *pDbKey;
+        int nDbKey;
+        if( lsm_csr_valid(pCur->pLsmCsr)==0 ){
+          pCur->bSkipNext = 1;
+        }else{
+          rc = lsm_csr_key(pCur->pLsmCsr, &pDbKey, &nDbKey);
+          if( nDbKey!=pKey->n || memcmp(pDbKey, pKey->p, nDbKey) ){
+            pCur->bSkipNext = 1;
+          }
+        }
+      }
+    }
+  }
+  return rc;
+}
+
+/*
+** Write a key/value pair to the temporary LSM database. Or, if nData is
+** negative, delete key aKey/nKey from it. Once the open write transaction
+** has written KVEphm.nFlush bytes, it is committed and a new one opened.
+*/
+static int kvephmLsmWrite(
+  KVEphm *p,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  int rc;
+  if( nData<0 ){
+    rc = lsm_delete(p->pLsm, aKey, nKey);
+  }else{
+    rc = lsm_insert(p->pLsm, aKey, nKey, aData, nData);
+  }
+  p->nTrans += nKey + MAX(nData, 0);
+  if( rc==LSM_OK && p->nTrans>=p->nFlush ){
+    rc = kvephmLsmCommit(p);
+  }
+  return rc;
+}
+
+/*
+** Move the contents of the tree and all open cursors to a temporary LSM
+** database. If this fails, an error code is returned. The store is left
+** using memory, and no further attempt to spill is made.
+*/
+static int kvephmSpill(KVEphm *p){
+  KVEphmNode *pLeaf;
+  KVEphmCursor *pCur;
+  int rc;
+
+  rc = kvephmOpenLsm(p);
+
+  /* Copy the tree into the database in key order */
+  for(pLeaf=p->pRoot; pLeaf && pLeaf->bLeaf==0; pLeaf=pLeaf->apChild[0]);
+  for(; rc==LSM_OK && pLeaf; pLeaf=pLeaf->pNext){
+    int i;
+    for(i=0; rc==LSM_OK && i<pLeaf->nCell; i++){
+      KVEphmRecord *pRec = pLeaf->apRec[i];
+      rc = kvephmLsmWrite(p, kvephmRecKey(pRec), pRec->nKey,
+                          kvephmRecData(pRec), pRec->nData);
+    }
+  }
+
+  /* Move each open cursor to the same position in the LSM database */
+  for(pCur=p->pCsr; rc==LSM_OK && pCur; pCur=pCur->pCsrNext){
+    rc = lsm_csr_open(p->pLsm, &pCur->pLsmCsr);
+    if( rc==LSM_OK && pCur->pRec ){
+      KVEphmRecord *pRec = pCur->pRec;
+      pCur->bSkipNext = !kvephmCsrRestore(pCur);
+      rc = lsm_csr_seek(pCur->pLsmCsr, kvephmRecKey(pRec), pRec->nKey,
+                        LSM_SEEK_GE);
+    }
+  }
+
+  if( rc!=LSM_OK ){
+    for(pCur=p->pCsr; pCur; pCur=pCur->pCsrNext){
+      lsm_csr_close(pCur->pLsmCsr);
+      pCur->pLsmCsr = 0;
+      pCur->bSkipNext = 0;
+    }
+    kvephmCloseLsm(p);
+    p->bNoSpill = 1;
+  }else{
+    p->pRoot = 0;
+  }
+  return rc;
+}
+
+/*
+** Store a new key/value pair, overwriting any prior entry with the
+** same key.
+*/
+static int kvephmReplace(
+  KVStore *pKVStore,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  KVEphm *p = (KVEphm*)pKVStore;
+  KVEphmRecord *pRec;
+  int rc;
+
+  if( p->pLsm ){
+    return kvephmLsmWrite(p, aKey, nKey, aData, nData);
+  }
+
+  pRec = kvephmAlloc(p, sizeof(KVEphmRecord) + nKey + nData);
+  if( pRec==0 ) return SQLITE4_NOMEM;
+  pRec->nKey = nKey;
+  pRec->nData = nData;
+  memcpy(kvephmRecKey(pRec), aKey, nKey);
+  memcpy(kvephmRecData(pRec), aData, nData);
+  rc = kvephmInsert(p, pRec);
+
+  if( rc==SQLITE4_OK && p->nMem>p->nMaxMem && p->bNoSpill==0 ){
+    rc = kvephmSpill(p);
+  }
+  return rc;
+}
+
+/*
+** Create a new cursor object.
+*/
+static int kvephmOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
+  KVEphm *p = (KVEphm*)pKVStore;
+  KVEphmCursor *pCur;
+  pCur = sqlite4_malloc(p->base.pEnv, sizeof(*pCur) );
+  if( pCur==0 ){
+    *ppKVCursor = 0;
+    return SQLITE4_NOMEM;
+  }
+  memset(pCur, 0, sizeof(*pCur));
+  if( p->pLsm ){
+    int rc = lsm_csr_open(p->pLsm, &pCur->pLsmCsr);
+    if( rc!=LSM_OK ){
+      sqlite4_free(p->base.pEnv, pCur);
+      *ppKVCursor = 0;
+      return rc;
+    }
+  }
+  pCur->pOwner = p;
+  pCur->pCsrNext = p->pCsr;
+  p->pCsr = pCur;
+  pCur->base.pStore = pKVStore;
+  pCur->base.pStoreVfunc = pKVStore->pStoreVfunc;
+  *ppKVCursor = (KVCursor*)pCur;
+  return SQLITE4_OK;
+}
+
+/*
+** Reset a cursor
+*/
+static int kvephmReset(KVCursor *pKVCursor){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  int rc = SQLITE4_OK;
+  pCur->pRec = 0;
+  pCur->pLeaf = 0;
+  pCur->bSkipNext = 0;
+  if( pCur->pLsmCsr ){
+    /* Replace the LSM cursor with a new, unpositioned one */
+    lsm_csr_close(pCur->pLsmCsr);
+    pCur->pLsmCsr = 0;
+    rc = lsm_csr_open(pCur->pOwner->pLsm, &pCur->pLsmCsr);
+  }
+  return rc;
+}
+
+/*
+** Destroy a cursor object
+*/
+static int kvephmCloseCursor(KVCursor *pKVCursor){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  if( pCur ){
+    KVEphmCursor **pp;
+    for(pp=&pCur->pOwner->pCsr; *pp!=pCur; pp=&(*pp)->pCsrNext);
+    *pp = pCur->pCsrNext;
+    lsm_csr_close(pCur->pLsmCsr);
+    sqlite4_buffer_clear(&pCur->saved);
+    sqlite4_free(pCur->base.pEnv, pCur);
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Return SQLITE4_OK if LSM cursor pCsr points to a valid entry, or
+** SQLITE4_NOTFOUND otherwise.
+*/
+static int kvephmLsmValid(lsm_cursor *pCsr){
+  return lsm_csr_valid(pCsr) ? SQLITE4_OK : SQLITE4_NOTFOUND;
+}
+
+/*
+** Move a cursor to the next entry.
+*/
+static int kvephmNextEntry(KVCursor *pKVCursor){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  int iCell;
+  if( pCur->pLsmCsr ){
+    int rc = SQLITE4_OK;
+    if( lsm_csr_valid(pCur->pLsmCsr)==0 ) return SQLITE4_NOTFOUND;
+    if( pCur->bSkipNext ){
+      pCur->bSkipNext = 0;
+    }else{
+      rc = lsm_csr_next(pCur->pLsmCsr);
+    }
+    return (rc==LSM_OK ? kvephmLsmValid(pCur->pLsmCsr) : rc);
+  }
+  if( pCur->pRec==0 ) return SQLITE4_NOTFOUND;
+  if( kvephmCsrRestore(pCur) ){
+    iCell = pCur->iCell + 1;
+  }else{
+    iCell = pCur->iCell;
+  }
+  return kvephmCsrSet(pCur, pCur->pLeaf, iCell, 1);
+}
+
+/*
+** Move a cursor to the previous entry.
+*/
+static int kvephmPrevEntry(KVCursor *pKVCursor){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  if( pCur->pLsmCsr ){
+    int rc;
+    if( pCur->bSkipNext && lsm_csr_valid(pCur->pLsmCsr)==0 ){
+      /* The deleted entry the cursor points to was the last */
+      rc = lsm_csr_last(pCur->pLsmCsr);
+    }else{
+      if( lsm_csr_valid(pCur->pLsmCsr)==0 ) return SQLITE4_NOTFOUND;
+      rc = lsm_csr_prev(pCur->pLsmCsr);
+    }
+    pCur->bSkipNext = 0;
+    return (rc==LSM_OK ? kvephmLsmValid(pCur->pLsmCsr) : rc);
+  }
+  if( pCur->pRec==0 ) return SQLITE4_NOTFOUND;
+  kvephmCsrRestore(pCur);
+  return kvephmCsrSet(pCur, pCur->pLeaf, pCur->iCell-1, 0);
+}
+
+/*
+** Seek a cursor.
+*/
+static int kvephmSeek(
+  KVCursor *pKVCursor,
+  const KVByteArray *aKey,
+  KVSize nKey,
+  int direction
+){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  KVEphm *p = pCur->pOwner;
+  KVEphmNode *pLeaf;
+  int iCell;
+  int rc;
+
+  pCur->pRec = 0;
+  pCur->pLeaf = 0;
+  pCur->bSkipNext = 0;
+  if( p->pLsm ){
+    /* Reposition the existing LSM cursor, as kvlsmSeek() does. It is only
+    ** reopened if an earlier xReset() failed to open a replacement. */
+    int eSeek = LSM_SEEK_EQ;
+    if( direction>0 ) eSeek = LSM_SEEK_GE;
+    if( direction<0 ) eSeek = LSM_SEEK_LE;
+    if( pCur->pLsmCsr==0 ){
+      rc = lsm_csr_open(p->pLsm, &pCur->pLsmCsr);
+      if( rc!=LSM_OK ) return rc;
+    }
+    rc = lsm_csr_seek(pCur->pLsmCsr, aKey, nKey, eSeek);
+    if( rc==LSM_OK ) rc = kvephmLsmValid(pCur->pLsmCsr);
+    if( rc==SQLITE4_OK ){
+      const void *pDbKey;
+      int nDbKey;
+      rc = lsm_csr_key(pCur->pLsmCsr, &pDbKey, &nDbKey);
+      if( rc==LSM_OK && (nDbKey!=nKey || memcmp(pDbKey, aKey, nKey)) ){
+        rc = SQLITE4_INEXACT;
+      }
+    }
+    return rc;
+  }
+  if( p->pRoot==0 ) return SQLITE4_NOTFOUND;
+
+  if( kvephmSeekLeaf(p, aKey, nKey, 0, 0, 0, &pLeaf, &iCell) ){
+    return kvephmCsrSet(pCur, pLeaf, iCell, 1);
+  }
+  if( direction==0 ) return SQLITE4_NOTFOUND;
+  if( direction>0 ){
+    rc = kvephmCsrSet(pCur, pLeaf, iCell, 1);
+  }else{
+    rc = kvephmCsrSet(pCur, pLeaf, iCell-1, 0);
+  }
+  return (rc==SQLITE4_OK ? SQLITE4_INEXACT : rc);
+}
+
+/*
+** Delete the entry that the cursor is pointing to.
+**
+** The cursor continues to point at the deleted entry. Subsequent xNext
+** or xPrev calls move to the entries either side of it.
+*/
+static int kvephmDelete(KVCursor *pKVCursor){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  KVEphmNode *pLeaf;
+  int iCell;
+
+  assert( pCur->pOwner->base.iTransLevel>=2 );
+  if( pCur->pLsmCsr ){
+    const void *pKey;
+    int nKey;
+    int rc = SQLITE4_OK;
+    if( lsm_csr_valid(pCur->pLsmCsr) ){
+      rc = lsm_csr_key(pCur->pLsmCsr, &pKey, &nKey);
+      if( rc==LSM_OK ) rc = kvephmLsmWrite(pCur->pOwner, pKey, nKey, 0, -1);
+    }
+    return rc;
+  }
+  if( pCur->pRec==0 || kvephmCsrRestore(pCur)==0 ) return SQLITE4_OK;
+  pLeaf = pCur->pLeaf;
+  iCell = pCur->iCell;
+  memmove(&pLeaf->apRec[iCell], &pLeaf->apRec[iCell+1],
+          (pLeaf->nCell-iCell-1)*sizeof(KVEphmRecord*));
+  pLeaf->nCell--;
+  pCur->pOwner->iGen++;
+  return SQLITE4_OK;
+}
+
+/*
+** Return the key of the entry the cursor is pointing to.
+*/
+static int kvephmKey(
+  KVCursor *pKVCursor,         /* The cursor whose key is desired */
+  const KVByteArray **paKey,   /* Make this point to the key */
+  KVSize *pN                   /* Make this point to the size of the key */
+){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  if( pCur->pLsmCsr && lsm_csr_valid(pCur->pLsmCsr) ){
+    return lsm_csr_key(pCur->pLsmCsr, (const void**)paKey, (int*)pN);
+  }
+  if( pCur->pLsmCsr || pCur->pRec==0 ){
+    *paKey = 0;
+    *pN = 0;
+    return SQLITE4_DONE;
+  }
+  *paKey = kvephmRecKey(pCur->pRec);
+  *pN = pCur->pRec->nKey;
+  return SQLITE4_OK;
+}
+
+/*
+** Return the data of the entry the cursor is pointing to.
+*/
+static int kvephmData(
+  KVCursor *pKVCursor,         /* The cursor from which to take the data */
+  KVSize ofst,                 /* Offset into the data to begin reading */
+  KVSize n,                    /* Number of bytes requested */
+  const KVByteArray **paData,  /* Pointer to the data written here */
+  KVSize *pNData               /* Number of bytes delivered */
+){
+  KVEphmCursor *pCur = (KVEphmCursor*)pKVCursor;
+  if( pCur->pLsmCsr && lsm_csr_valid(pCur->pLsmCsr) ){
+    const void *pData;
+    int nData;
+    int rc = lsm_csr_value(pCur->pLsmCsr, &pData, &nData);
+    if( rc==LSM_OK ){
+      *paData = (const KVByteArray*)pData + ofst;
+      *pNData = nData - ofst;
+    }
+    return rc;
+  }
+  if( pCur->pLsmCsr || pCur->pRec==0 ){
+    *paData = 0;
+    *pNData = 0;
+    return SQLITE4_DONE;
+  }
+  kvephmCsrRestore(pCur);
+  *paData = kvephmRecData(pCur->pRec) + ofst;
+  *pNData = pCur->pRec->nData - ofst;
+  return SQLITE4_OK;
+}
+
+/*
+** An ephemeral store does not support rollback. The transaction methods
+** just record the current transaction level.
+*/
+static int kvephmBegin(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvephmCommitPhaseOne(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+static int kvephmCommitPhaseTwo(KVStore *pKVStore, int iLevel){
+  if( pKVStore->iTransLevel>iLevel ) pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvephmRollback(KVStore *pKVStore, int iLevel){
+  if( pKVStore->iTransLevel>iLevel ) pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvephmRevert(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+
+/*
+** Destructor for the entire ephemeral store.
+*/
+static int kvephmClose(KVStore *pKVStore){
+  KVEphm *p = (KVEphm*)pKVStore;
+  KVEphmChunk *pChunk;
+  KVEphmChunk *pNext;
+  sqlite4_env *pEnv;
+  if( p==0 ) return SQLITE4_OK;
+  assert( p->pCsr==0 );
+  pEnv = p->base.pEnv;
+  kvephmCloseLsm(p);
+  for(pChunk=p->pChunk; pChunk; pChunk=pNext){
+    pNext = pChunk->pNext;
+    sqlite4_free(pEnv, pChunk);
+  }
+  memset(p, 0, sizeof(*p));
+  sqlite4_free(pEnv, p);
+  return SQLITE4_OK;
+}
+
+static int kvephmControl(KVStore *pKVStore, int op, void *pArg){
+  KVEphm *p = (KVEphm*)pKVStore;
+  if( op==SQLITE4_KVCTRL_MAXMEM ){
+    int *pnMax = (int *)pArg;
+    if( *pnMax>0 ) p->nMaxMem = *pnMax;
+    *pnMax = (int)p->nMaxMem;
+    return SQLITE4_OK;
+  }
+  return SQLITE4_NOTFOUND;
+}
+
+static int kvephmGetMeta(KVStore *pKVStore, unsigned int *piVal){
+  KVEphm *p = (KVEphm*)pKVStore;
+  *piVal = p->iMeta;
+  return SQLITE4_OK;
+}
+
+static int kvephmPutMeta(KVStore *pKVStore, unsigned int iVal){
+  KVEphm *p = (KVEphm*)pKVStore;
+  p->iMeta = iVal;
+  return SQLITE4_OK;
+}
+
+/* Virtual methods for the ephemeral storage engine */
+static const KVStoreMethods kvephmMethods = {
+  7,                        /* iVersion */
+  sizeof(KVStoreMethods),   /* szSelf */
+  kvephmReplace,            /* xReplace */
+  kvephmOpenCursor,         /* xOpenCursor */
+  kvephmSeek,               /* xSeek */
+  kvephmNextEntry,          /* xNext */
+  kvephmPrevEntry,          /* xPrev */
+  kvephmDelete,             /* xDelete */
+  kvephmKey,                /* xKey */
+  kvephmData,               /* xData */
+  kvephmReset,              /* xReset */
+  kvephmCloseCursor,        /* xCloseCursor */
+  kvephmBegin,              /* xBegin */
+  kvephmCommitPhaseOne,     /* xCommitPhaseOne */
+  kvephmCommitPhaseTwo,     /* xCommitPhaseTwo */
+  kvephmRollback,           /* xRollback */
+  kvephmRevert,             /* xRevert */
+  kvephmClose,              /* xClose */
+  kvephmControl,            /* xControl */
+  kvephmGetMeta,            /* xGetMeta */
+  kvephmPutMeta,            /* xPutMeta */
+  0,                        /* xGetMethod */
+  0,                        /* xSetPrefix */
+  0,                        /* xNextBatch */
+  0,                        /* xSplit */
+  0,                        /* xCloneReader */
+  0,                        /* xEstimateRange */
+  0                         /* xMultiGet */
+};
+
+/*
+** Create a new ephemeral storage engine and return a pointer to it.
+*/
+int sqlite4KVStoreOpenEphemeral(
+  sqlite4_env *pEnv,              /* Runtime environment */
+  KVStore **ppKVStore,            /* OUT: Write the new KVStore here */
+  const char *zName,              /* Name of storage unit (ignored) */
+  unsigned openFlags              /* Flags */
+){
+  KVEphm *pNew = sqlite4_malloc(pEnv, sizeof(*pNew) );
+  if( pNew==0 ) return SQLITE4_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->base.pStoreVfunc = &kvephmMethods;
+  pNew->base.pEnv = pEnv;
+  pNew->nMaxMem = SQLITE4_EPHEMERAL_MAXMEM;
+  *ppKVStore = (KVStore*)pNew;
+  return SQLITE4_OK;
+}
@@ -0,0 +1,1008 @@
+/*
+** 2013 April 16
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** This file implements a composite storage engine that presents the
+** interface defined by kv.h. It is selected using the "kv=hybrid" URI
+** parameter.
+**
+** A hybrid store consists of an LSM store in the named database file and
+** a b-tree store in a second file with the same name and "-bt" appended.
+** All writes are made to the LSM store, which is optimized for them.
+** Entries whose keys have not been written recently are then migrated
+** from the LSM store to the b-tree store, which is faster to search.
+** Reads use a cursor that merges the contents of the two stores.
+**
+** Each value written to the LSM store is prefixed with a single byte
+** header. HYBRID_LIVE indicates a regular entry. HYBRID_DELETE indicates
+** that the key has been deleted, and that any entry with the same key in
+** the b-tree store should be ignored. Entries in the b-tree store have no
+** header. If both stores contain the same key, the LSM entry is used.
+**
+** Migration moves a batch of entries from the LSM store to the b-tree
+** store. Once HYBRID_MIGRATE_INTERVAL write transactions have been
+** committed by the connection, a migration is due. It is run the next time
+** the connection opens a write transaction while no other transaction is
+** open, before the write transaction itself is opened. Any error is 
+** returned to the caller as if it had occurred while opening the write
+** transaction. Committing a transaction never runs a migration. The 
+** "hybrid_migrate" pragma may also be used to run a migration at any time
+** outside of a write transaction.
+**
+** The b-tree write transaction is committed before the migrated entries
+** are deleted from the LSM store. And the snapshot of the LSM store is 
+** always opened before that of the b-tree store. So a reader never misses
+** an entry that is being migrated, and an entry that is present in both
+** stores after a crash is shadowed by the LSM copy.
+**
+** To decide which entries are stable enough to migrate, keys are divided
+** into ranges by their first byte (for SQLite tables and indexes, this
+** is usually the root number). For each range, the connection records the
+** smallest key written during the current and previous windows of
+** HYBRID_WINDOW_COMMITS write transactions. Keys greater than or equal
+** to either of these are hot and remain in the LSM store. So a range that
+** is only appended to migrates all but its tail, and a range that is
+** updated at random stays in the LSM store until the updates stop.
+**
+** WRITERS: Any number of connections may write to a hybrid database, 
+** but only one at a time. The b-tree store is only ever written by
+** migration, and a migration holds the LSM write lock from before it opens
+** its b-tree write transaction until after it has committed both. So the
+** LSM write lock serializes all writes to both stores, and a connection
+** that attempts to migrate while another connection is writing fails with
+** SQLITE4_BUSY. Each connection only tracks its own writes when deciding
+** which keys are hot, so one connection may migrate keys that another is
+** still updating. This costs performance, not correctness.
+*/
+#include "sqliteInt.h"
+
+/* Forward declarations of objects */
+typedef struct KVHybrid KVHybrid;
+typedef struct KVHybridCsr KVHybridCsr;
+typedef struct HybridRange HybridRange;
+
+/*
+** Header byte values for entries in the LSM store.
+*/
+#define HYBRID_LIVE   0x00
+#define HYBRID_DELETE 0x01
+
+/*
+** Tuning parameters. See the comment at the top of this file.
+*/
+#define HYBRID_WINDOW_COMMITS   16   /* Write transactions per window */
+#define HYBRID_MIGRATE_INTERVAL 8    /* Write transactions per migration */
+#define HYBRID_MIGRATE_BATCH    1024 /* Maximum entries moved by a migration */
+
+/*
+** The keys written to a single key range during the current and previous
+** windows. Element iWindow of each array is the current window.
+*/
+struct HybridRange {
+  sqlite4_buffer aMin[2];         /* Smallest key written in each window */
+  u8 abSet[2];                    /* True if aMin[i] is valid */
+};
+
+/*
+** An instance of an open connection to a hybrid store.  A subclass of
+** KVStore.
+*/
+struct KVHybrid {
+  KVStore base;                   /* Base class, must be first */
+  KVStore *pLsm;                  /* Write-optimized store */
+  KVStore *pBt;                   /* Read-optimized store */
+  sqlite4_buffer value;           /* Buffer used to add value headers */
+  sqlite4_buffer migrate;         /* Key at which to resume migration */
+  int nCommit;                    /* Write transactions committed */
+  int bMigrate;                   /* True if a migration is due */
+  int iWindow;                    /* Index of current window (0 or 1) */
+  HybridRange aRange[256];        /* Recent writes to each key range */
+};
+
+/*
+** Values for KVHybridCsr.eCur. The cursor points to the entry of the LSM
+** store, the b-tree store, or both if the two stores have the same key.
+*/
+#define HYBRID_CSR_LSM  0x01
+#define HYBRID_CSR_BT   0x02
+#define HYBRID_CSR_BOTH 0x03
+
+/*
+** An instance of an open cursor pointing into a hybrid store.  A subclass
+** of KVCursor.
+*/
+struct KVHybridCsr {
+  KVCursor base;                  /* Base class. Must be first */
+  KVCursor *pLsmCsr;              /* Cursor on the LSM store */
+  KVCursor *pBtCsr;               /* Cursor on the b-tree store */
+  int bLsm;                       /* True if pLsmCsr points to an entry */
+  int bBt;                        /* True if pBtCsr points to an entry */
+  int eCur;                       /* HYBRID_CSR_* value, or 0 at EOF */
+  int bShadow;                    /* True if b-tree may hold current key */
+};
+
+/*
+** Compare two keys in the same way as the underlying stores.
+*/
+static int hybridKeyCompare(
+  const KVByteArray *aLeft, KVSize nLeft,
+  const KVByteArray *aRight, KVSize nRight
+){
+  int res = memcmp(aLeft, aRight, nLeft<nRight ? nLeft : nRight);
+  if( res==0 ) res = (int)(nLeft - nRight);
+  return res;
+}
+
+/*
+** Return a pointer to the HybridRange object for the range of key aKey.
+*/
+static HybridRange *hybridRange(KVHybrid *p, const KVByteArray *aKey, int n){
+  return &p->aRange[n>0 ? aKey[0] : 0];
+}
+
+/*
+** Record that key aKey/nKey is being written by the current transaction.
+*/
+static int hybridNoteWrite(
+  KVHybrid *p,
+  const KVByteArray *aKey,
+  KVSize nKey
+){
+  HybridRange *pRange = hybridRange(p, aKey, nKey);
+  int i = p->iWindow;
+  int rc = SQLITE4_OK;
+
+  if( pRange->abSet[i]==0 || 0>hybridKeyCompare(aKey, nKey,
+        (const KVByteArray *)pRange->aMin[i].p, pRange->aMin[i].n)
+  ){
+    rc = sqlite4_buffer_set(&pRange->aMin[i], aKey, nKey);
+    pRange->abSet[i] = (rc==SQLITE4_OK);
+  }
+  return rc;
+}
+
+/*
+** Return true if key aKey/nKey is in the hot part of its key range.
+*/
+static int hybridIsHot(KVHybrid *p, const KVByteArray *aKey, KVSize nKey){
+  HybridRange *pRange = hybridRange(p, aKey, nKey);
+  int i;
+  for(i=0; i<2; i++){
+    if( pRange->abSet[i] && 0<=hybridKeyCompare(aKey, nKey,
+          (const KVByteArray *)pRange->aMin[i].p, pRange->aMin[i].n)
+    ){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Set *pbDelete to true if the LSM store entry that cursor pLsmCsr points
+** to is a HYBRID_DELETE entry, or to false if it is a regular entry.
+*/
+static int hybridIsDelete(KVCursor *pLsmCsr, int *pbDelete){
+  const KVByteArray *aData;
+  KVSize nData;
+  int rc;
+
+  rc = pLsmCsr->pStoreVfunc->xData(pLsmCsr, 0, -1, &aData, &nData);
+  if( rc==SQLITE4_OK ){
+    if( nData<1 ) return SQLITE4_CORRUPT_BKPT;
+    *pbDelete = (aData[0]==HYBRID_DELETE);
+  }
+  return rc;
+}
+
+static int hybridMigrate(KVHybrid *p, int nMax, int *pnMove);
+
+/*
+** Begin a transaction or subtransaction. The LSM store is opened first
+** so that its snapshot is never newer than that of the b-tree store. The
+** b-tree store is only ever read, so a read transaction is sufficient.
+**
+** If a migration is due and a write transaction is being opened while no
+** other transaction is open, the migration is run first.
+*/
+static int hybridBegin(KVStore *pKVStore, int iLevel){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  int rc = SQLITE4_OK;
+
+  if( p->bMigrate && iLevel>=2 && pKVStore->iTransLevel==0 ){
+    int nMove;
+    rc = hybridMigrate(p, HYBRID_MIGRATE_BATCH, &nMove);
+    if( rc!=SQLITE4_OK ) return rc;
+  }
+
+  rc = p->pLsm->pStoreVfunc->xBegin(p->pLsm, iLevel);
+  if( rc==SQLITE4_OK && p->pBt->iTransLevel==0 ){
+    rc = p->pBt->pStoreVfunc->xBegin(p->pBt, 1);
+    if( rc!=SQLITE4_OK ){
+      p->pLsm->pStoreVfunc->xRollback(p->pLsm, pKVStore->iTransLevel);
+    }
+  }
+  pKVStore->iTransLevel = p->pLsm->iTransLevel;
+  return rc;
+}
+
+/*
+** This is called after each write transaction is committed. Advance the
+** window used to identify hot keys and, if it is time, mark a migration
+** as due. It is run by the next call to hybridBegin() that opens a write
+** transaction.
+*/
+static void hybridCommitDone(KVHybrid *p){
+  p->nCommit++;
+  if( (p->nCommit % HYBRID_WINDOW_COMMITS)==0 ){
+    int i;
+    p->iWindow = !p->iWindow;
+    for(i=0; i<ArraySize(p->aRange); i++){
+      p->aRange[i].abSet[p->iWindow] = 0;
+    }
+  }
+  if( (p->nCommit % HYBRID_MIGRATE_INTERVAL)==0 ){
+    p->bMigrate = 1;
+  }
+}
+
+/*
+** Commit a transaction or subtransaction.
+*/
+static int hybridCommitPhaseOne(KVStore *pKVStore, int iLevel){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  return p->pLsm->pStoreVfunc->xCommitPhaseOne(p->pLsm, iLevel);
+}
+static int hybridCommitPhaseTwo(KVStore *pKVStore, int iLevel){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  int bWrite = (iLevel<2 && pKVStore->iTransLevel>=2);
+  int rc;
+
+  rc = p->pLsm->pStoreVfunc->xCommitPhaseTwo(p->pLsm, iLevel);
+  if( rc==SQLITE4_OK && iLevel==0 && p->pBt->iTransLevel>0 ){
+    rc = p->pBt->pStoreVfunc->xCommitPhaseTwo(p->pBt, 0);
+  }
+  pKVStore->iTransLevel = p->pLsm->iTransLevel;
+  if( rc==SQLITE4_OK && bWrite ) hybridCommitDone(p);
+  return rc;
+}
+
+/*
+** Rollback a transaction or subtransaction.
+*/
+static int hybridRollback(KVStore *pKVStore, int iLevel){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  int rc;
+
+  rc = p->pLsm->pStoreVfunc->xRollback(p->pLsm, iLevel);
+  if( iLevel==0 ){
+    int rc2 = p->pBt->pStoreVfunc->xRollback(p->pBt, 0);
+    if( rc==SQLITE4_OK ) rc = rc2;
+  }
+  pKVStore->iTransLevel = p->pLsm->iTransLevel;
+  return rc;
+}
+
+/*
+** Revert a transaction back to what it was when it started.
+*/
+static int hybridRevert(KVStore *pKVStore, int iLevel){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  return p->pLsm->pStoreVfunc->xRevert(p->pLsm, iLevel);
+}
+
+/*
+** Write entry aKey/nKey to the LSM store. The value is aData/nData with
+** header byte eType prepended.
+*/
+static int hybridWrite(
+  KVHybrid *p,
+  const KVByteArray *aKey, KVSize nKey,
+  int eType,
+  const KVByteArray *aData, KVSize nData
+){
+  u8 aHdr[1];
+  int rc;
+
+  aHdr[0] = (u8)eType;
+  rc = hybridNoteWrite(p, aKey, nKey);
+  if( rc==SQLITE4_OK ) rc = sqlite4_buffer_set(&p->value, aHdr, 1);
+  if( rc==SQLITE4_OK && nData>0 ){
+    rc = sqlite4_buffer_append(&p->value, aData, nData);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = p->pLsm->pStoreVfunc->xReplace(p->pLsm, aKey, nKey,
+        (const KVByteArray *)p->value.p, p->value.n
+    );
+  }
+  return rc;
+}
+
+/*
+** Implementation of the xReplace(X, aKey, nKey, aData, nData) method.
+*/
+static int hybridReplace(
+  KVStore *pKVStore,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  return hybridWrite((KVHybrid *)pKVStore, aKey, nKey,
+      HYBRID_LIVE, aData, nData
+  );
+}
+
+/*
+** Create a new cursor object.
+*/
+static int hybridOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  KVHybridCsr *pCsr;
+  int rc = SQLITE4_OK;
+
+  pCsr = (KVHybridCsr *)sqlite4_malloc(pKVStore->pEnv, sizeof(KVHybridCsr));
+  if( pCsr==0 ){
+    rc = SQLITE4_NOMEM;
+  }else{
+    memset(pCsr, 0, sizeof(KVHybridCsr));
+    rc = p->pLsm->pStoreVfunc->xOpenCursor(p->pLsm, &pCsr->pLsmCsr);
+    if( rc==SQLITE4_OK ){
+      rc = p->pBt->pStoreVfunc->xOpenCursor(p->pBt, &pCsr->pBtCsr);
+    }
+    if( rc==SQLITE4_OK ){
+      pCsr->base.pStore = pKVStore;
+      pCsr->base.pStoreVfunc = pKVStore->pStoreVfunc;
+    }else{
+      if( pCsr->pLsmCsr ){
+        pCsr->pLsmCsr->pStoreVfunc->xCloseCursor(pCsr->pLsmCsr);
+      }
+      sqlite4_free(pKVStore->pEnv, pCsr);
+      pCsr = 0;
+    }
+  }
+
+  *ppKVCursor = (KVCursor*)pCsr;
+  return rc;
+}
+
+/*
+** Reset a cursor.
+*/
+static int hybridReset(KVCursor *pKVCursor){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  int rc;
+  rc = pCsr->pLsmCsr->pStoreVfunc->xReset(pCsr->pLsmCsr);
+  if( rc==SQLITE4_OK ){
+    rc = pCsr->pBtCsr->pStoreVfunc->xReset(pCsr->pBtCsr);
+  }
+  pCsr->bLsm = pCsr->bBt = 0;
+  pCsr->eCur = 0;
+  return rc;
+}
+
+/*
+** Destroy a cursor object.
+*/
+static int hybridCloseCursor(KVCursor *pKVCursor){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  pCsr->pLsmCsr->pStoreVfunc->xCloseCursor(pCsr->pLsmCsr);
+  pCsr->pBtCsr->pStoreVfunc->xCloseCursor(pCsr->pBtCsr);
+  sqlite4_free(pCsr->base.pEnv, pCsr);
+  return SQLITE4_OK;
+}
+
+/*
+** Restrict a cursor to keys that begin with prefix aPrefix/nPrefix. The
+** prefix is passed to each sub-cursor whose store supports xSetPrefix.
+*/
+static int hybridSetPrefix(
+  KVCursor *pKVCursor,
+  const KVByteArray *aPrefix,
+  KVSize nPrefix
+){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  KVCursor *apSub[2];
+  int rc = SQLITE4_OK;
+  int i;
+
+  apSub[0] = pCsr->pLsmCsr;
+  apSub[1] = pCsr->pBtCsr;
+  for(i=0; rc==SQLITE4_OK && i<2; i++){
+    const KVStoreMethods *pMeth = apSub[i]->pStoreVfunc;
+    if( pMeth->iVersion>=2 && pMeth->xSetPrefix ){
+      rc = pMeth->xSetPrefix(apSub[i], aPrefix, nPrefix);
+    }
+  }
+  return rc;
+}
+
+/*
+** Move the sub-cursors identified by mask eStep (a combination of the
+** HYBRID_CSR_* flags) one entry in direction iDir.
+*/
+static int hybridStep(KVHybridCsr *pCsr, int eStep, int iDir){
+  int rc = SQLITE4_OK;
+  if( eStep & HYBRID_CSR_LSM ){
+    KVCursor *pSub = pCsr->pLsmCsr;
+    if( iDir>0 ){
+      rc = pSub->pStoreVfunc->xNext(pSub);
+    }else{
+      rc = pSub->pStoreVfunc->xPrev(pSub);
+    }
+    pCsr->bLsm = (rc==SQLITE4_OK);
+    if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  }
+  if( rc==SQLITE4_OK && (eStep & HYBRID_CSR_BT) ){
+    KVCursor *pSub = pCsr->pBtCsr;
+    if( iDir>0 ){
+      rc = pSub->pStoreVfunc->xNext(pSub);
+    }else{
+      rc = pSub->pStoreVfunc->xPrev(pSub);
+    }
+    pCsr->bBt = (rc==SQLITE4_OK);
+    if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  }
+  return rc;
+}
+
+/*
+** Set pCsr->eCur to identify the sub-cursor or sub-cursors that point to
+** the next entry in direction iDir - the smaller key if iDir is positive,
+** or the larger if it is negative. HYBRID_DELETE entries, and the entries
+** they shadow, are skipped. Return SQLITE4_NOTFOUND if there are no more
+** entries.
+*/
+static int hybridSettle(KVHybridCsr *pCsr, int iDir){
+  int rc = SQLITE4_OK;
+
+  while( rc==SQLITE4_OK ){
+    int bDelete = 0;
+
+    if( pCsr->bLsm && pCsr->bBt ){
+      const KVByteArray *aLsm, *aBt;
+      KVSize nLsm, nBt;
+      int res;
+      rc = pCsr->pLsmCsr->pStoreVfunc->xKey(pCsr->pLsmCsr, &aLsm, &nLsm);
+      if( rc==SQLITE4_OK ){
+        rc = pCsr->pBtCsr->pStoreVfunc->xKey(pCsr->pBtCsr, &aBt, &nBt);
+      }
+      if( rc!=SQLITE4_OK ) break;
+      res = hybridKeyCompare(aLsm, nLsm, aBt, nBt) * iDir;
+      if( res==0 ){
+        pCsr->eCur = HYBRID_CSR_BOTH;
+      }else{
+        pCsr->eCur = (res<0 ? HYBRID_CSR_LSM : HYBRID_CSR_BT);
+      }
+    }else if( pCsr->bLsm ){
+      pCsr->eCur = HYBRID_CSR_LSM;
+    }else if( pCsr->bBt ){
+      pCsr->eCur = HYBRID_CSR_BT;
+    }else{
+      pCsr->eCur = 0;
+      rc = SQLITE4_NOTFOUND;
+      break;
+    }
+    pCsr->bShadow = (pCsr->eCur & HYBRID_CSR_BT) ? 1 : 0;
+
+    if( pCsr->eCur & HYBRID_CSR_LSM ){
+      rc = hybridIsDelete(pCsr->pLsmCsr, &bDelete);
+    }
+    if( rc!=SQLITE4_OK || bDelete==0 ) break;
+    rc = hybridStep(pCsr, pCsr->eCur, iDir);
+  }
+
+  return rc;
+}
+
+/*
+** Return the key of the entry the cursor is pointing to.
+*/
+static int hybridKey(
+  KVCursor *pKVCursor,         /* The cursor whose key is desired */
+  const KVByteArray **paKey,   /* Make this point to the key */
+  KVSize *pN                   /* Make this point to the size of the key */
+){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  KVCursor *pSub;
+  if( pCsr->eCur==0 ) return SQLITE4_DONE;
+  pSub = (pCsr->eCur & HYBRID_CSR_LSM) ? pCsr->pLsmCsr : pCsr->pBtCsr;
+  return pSub->pStoreVfunc->xKey(pSub, paKey, pN);
+}
+
+/*
+** Return the data of the entry the cursor is pointing to. The header
+** byte is removed from values read from the LSM store.
+*/
+static int hybridData(
+  KVCursor *pKVCursor,         /* The cursor from which to take the data */
+  KVSize ofst,                 /* Offset into the data to begin reading */
+  KVSize n,                    /* Number of bytes requested */
+  const KVByteArray **paData,  /* Pointer to the data written here */
+  KVSize *pNData               /* Number of bytes delivered */
+){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  const KVByteArray *aData;
+  KVSize nData;
+  int rc;
+
+  if( pCsr->eCur==0 ) return SQLITE4_DONE;
+  if( (pCsr->eCur & HYBRID_CSR_LSM)==0 ){
+    KVCursor *pSub = pCsr->pBtCsr;
+    return pSub->pStoreVfunc->xData(pSub, ofst, n, paData, pNData);
+  }
+
+  rc = pCsr->pLsmCsr->pStoreVfunc->xData(pCsr->pLsmCsr, 0, -1, &aData, &nData);
+  if( rc==SQLITE4_OK ){
+    if( nData<1 ) return SQLITE4_CORRUPT_BKPT;
+    aData++;
+    nData--;
+    if( n<0 ){
+      *paData = aData;
+      *pNData = nData;
+    }else{
+      KVSize nOut = n;
+      if( (ofst+n)>nData ) nOut = nData - ofst;
+      if( nOut<0 ) nOut = 0;
+      *paData = &aData[ofst];
+      *pNData = nOut;
+    }
+  }
+  return rc;
+}
+
+/*
+** Seek a cursor. Both sub-cursors are positioned, and the entry that
+** comes first in the direction of the seek is selected.
+*/
+static int hybridSeek(
+  KVCursor *pKVCursor,
+  const KVByteArray *aKey,
+  KVSize nKey,
+  int dir
+){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  KVCursor *pLsmCsr = pCsr->pLsmCsr;
+  KVCursor *pBtCsr = pCsr->pBtCsr;
+  int iDir = (dir<0 ? -1 : dir);
+  int rc;
+
+  assert( dir==0 || dir==1 || dir==-1 || dir==-2 );
+  pCsr->bLsm = pCsr->bBt = 0;
+  pCsr->eCur = 0;
+
+  /* An equality seek. Search the LSM store first. If it holds the key,
+  ** the b-tree store need not be searched. */
+  if( iDir==0 ){
+    rc = pLsmCsr->pStoreVfunc->xSeek(pLsmCsr, aKey, nKey, 0);
+    if( rc==SQLITE4_OK ){
+      int bDelete = 0;
+      rc = hybridIsDelete(pLsmCsr, &bDelete);
+      if( rc==SQLITE4_OK ){
+        if( bDelete ) return SQLITE4_NOTFOUND;
+        pCsr->eCur = HYBRID_CSR_LSM;
+        pCsr->bShadow = 1;
+      }
+    }else if( rc==SQLITE4_NOTFOUND ){
+      rc = pBtCsr->pStoreVfunc->xSeek(pBtCsr, aKey, nKey, 0);
+      if( rc==SQLITE4_OK ){
+        pCsr->eCur = HYBRID_CSR_BT;
+        pCsr->bShadow = 1;
+      }
+    }
+    return rc;
+  }
+
+  /* A range seek. Position both sub-cursors, then merge. */
+  rc = pLsmCsr->pStoreVfunc->xSeek(pLsmCsr, aKey, nKey, iDir);
+  pCsr->bLsm = (rc==SQLITE4_OK || rc==SQLITE4_INEXACT);
+  if( pCsr->bLsm || rc==SQLITE4_NOTFOUND ){
+    rc = pBtCsr->pStoreVfunc->xSeek(pBtCsr, aKey, nKey, iDir);
+    pCsr->bBt = (rc==SQLITE4_OK || rc==SQLITE4_INEXACT);
+    if( pCsr->bBt || rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  }
+  if( rc==SQLITE4_OK ){
+    rc = hybridSettle(pCsr, iDir);
+  }
+  if( rc==SQLITE4_OK ){
+    const KVByteArray *aCsr;
+    KVSize nCsr;
+    rc = hybridKey(pKVCursor, &aCsr, &nCsr);
+    if( rc==SQLITE4_OK && hybridKeyCompare(aCsr, nCsr, aKey, nKey) ){
+      rc = SQLITE4_INEXACT;
+    }
+  }
+  return rc;
+}
+
+/*
+** Move a cursor to the next entry.
+*/
+static int hybridNext(KVCursor *pKVCursor){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  int rc;
+  if( pCsr->eCur==0 ) return SQLITE4_NOTFOUND;
+  rc = hybridStep(pCsr, pCsr->eCur, 1);
+  if( rc==SQLITE4_OK ) rc = hybridSettle(pCsr, 1);
+  return rc;
+}
+
+/*
+** Move a cursor to the previous entry.
+*/
+static int hybridPrev(KVCursor *pKVCursor){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  int rc;
+  if( pCsr->eCur==0 ) return SQLITE4_NOTFOUND;
+  rc = hybridStep(pCsr, pCsr->eCur, -1);
+  if( rc==SQLITE4_OK ) rc = hybridSettle(pCsr, -1);
+  return rc;
+}
+
+/*
+** Delete the entry that the cursor is pointing to. If the b-tree store
+** may contain the key, a HYBRID_DELETE entry is written to the LSM store.
+** Otherwise the entry is simply removed from the LSM store.
+**
+** As with the other stores, the sub-cursors are left in place so that
+** subsequent xNext and xPrev calls work.
+*/
+static int hybridDelete(KVCursor *pKVCursor){
+  KVHybridCsr *pCsr = (KVHybridCsr *)pKVCursor;
+  KVHybrid *p = (KVHybrid *)pKVCursor->pStore;
+  const KVByteArray *aKey;
+  KVSize nKey;
+  int rc;
+
+  assert( pCsr->eCur!=0 );
+  if( pCsr->bShadow==0 ){
+    KVCursor *pSub = pCsr->pLsmCsr;
+    rc = pSub->pStoreVfunc->xKey(pSub, &aKey, &nKey);
+    if( rc==SQLITE4_OK ) rc = hybridNoteWrite(p, aKey, nKey);
+    if( rc==SQLITE4_OK ) rc = pSub->pStoreVfunc->xDelete(pSub);
+  }else{
+    rc = hybridKey(pKVCursor, &aKey, &nKey);
+    if( rc==SQLITE4_OK ){
+      rc = hybridWrite(p, aKey, nKey, HYBRID_DELETE, 0, 0);
+    }
+  }
+  return rc;
+}
+
+/*
+** Migrate up to nMax entries from the LSM store to the b-tree store,
+** starting at the key where the previous migration stopped. Hot key
+** ranges are skipped. Set *pnMove to the number of entries migrated.
+**
+** Migration uses its own write transactions on both stores, so it may
+** not be run while a write transaction is open on this connection. The 
+** LSM write transaction is opened first and committed last, so that no
+** other connection may write to either store while a migration is running
+** (see the WRITERS note at the top of this file).
+*/
+static int hybridMigrate(KVHybrid *p, int nMax, int *pnMove){
+  const KVStoreMethods *pLsmMeth = p->pLsm->pStoreVfunc;
+  const KVStoreMethods *pBtMeth = p->pBt->pStoreVfunc;
+  int iLevel = p->base.iTransLevel;
+  KVCursor *pCsr = 0;
+  sqlite4_buffer keys;            /* Migrated keys, each preceded by size */
+  int nMove = 0;
+  int rc;
+
+  *pnMove = 0;
+  if( iLevel>=2 ) return SQLITE4_BUSY;
+  sqlite4_buffer_init(&keys, 0);
+
+  rc = pLsmMeth->xBegin(p->pLsm, 2);
+  if( rc==SQLITE4_OK ) rc = pBtMeth->xBegin(p->pBt, 2);
+  if( rc==SQLITE4_OK ) rc = pLsmMeth->xOpenCursor(p->pLsm, &pCsr);
+  if( rc==SQLITE4_OK ){
+    rc = pLsmMeth->xSeek(pCsr,
+        (const KVByteArray *)p->migrate.p, p->migrate.n, 1
+    );
+    if( rc==SQLITE4_INEXACT ) rc = SQLITE4_OK;
+  }
+
+  /* Copy entries to the b-tree store */
+  while( rc==SQLITE4_OK && nMove<nMax ){
+    const KVByteArray *aKey;
+    KVSize nKey;
+    const KVByteArray *aData;
+    KVSize nData;
+
+    rc = pLsmMeth->xKey(pCsr, &aKey, &nKey);
+    if( rc!=SQLITE4_OK ) break;
+    if( hybridIsHot(p, aKey, nKey) ){
+      /* Skip the rest of this key range */
+      KVByteArray iNext = (nKey>0 ? aKey[0] : 0);
+      if( iNext==0xFF ){
+        rc = SQLITE4_NOTFOUND;
+      }else{
+        iNext++;
+        rc = pLsmMeth->xSeek(pCsr, &iNext, 1, 1);
+        if( rc==SQLITE4_INEXACT ) rc = SQLITE4_OK;
+      }
+      continue;
+    }
+
+    rc = pLsmMeth->xData(pCsr, 0, -1, &aData, &nData);
+    if( rc==SQLITE4_OK && nData<1 ) rc = SQLITE4_CORRUPT_BKPT;
+    if( rc==SQLITE4_OK ){
+      if( aData[0]==HYBRID_DELETE ){
+        rc = pBtMeth->xReplace(p->pBt, aKey, nKey, 0, -1);
+      }else{
+        rc = pBtMeth->xReplace(p->pBt, aKey, nKey, &aData[1], nData-1);
+      }
+    }
+    if( rc==SQLITE4_OK ){
+      int n = (int)nKey;
+      rc = sqlite4_buffer_append(&keys, &n, sizeof(n));
+      if( rc==SQLITE4_OK ) rc = sqlite4_buffer_append(&keys, aKey, nKey);
+    }
+    if( rc==SQLITE4_OK ){
+      nMove++;
+      rc = pLsmMeth->xNext(pCsr);
+    }
+  }
+
+  /* Record where the next migration should start. If the end of the LSM
+  ** store was reached, the next migration starts from the beginning. */
+  if( rc==SQLITE4_NOTFOUND ){
+    p->migrate.n = 0;
+    rc = SQLITE4_OK;
+  }else if( rc==SQLITE4_OK ){
+    const KVByteArray *aKey;
+    KVSize nKey;
+    rc = pLsmMeth->xKey(pCsr, &aKey, &nKey);
+    if( rc==SQLITE4_OK ) rc = sqlite4_buffer_set(&p->migrate, aKey, nKey);
+  }
+
+  /* Commit the b-tree transaction, then delete the migrated entries from
+  ** the LSM store and commit that transaction too. */
+  if( rc==SQLITE4_OK ) rc = pBtMeth->xCommitPhaseOne(p->pBt, iLevel);
+  if( rc==SQLITE4_OK ) rc = pBtMeth->xCommitPhaseTwo(p->pBt, iLevel);
+  if( rc==SQLITE4_OK ){
+    u8 *aKeys = (u8 *)keys.p;
+    int i = 0;
+    while( rc==SQLITE4_OK && i<keys.n ){
+      int n;
+      memcpy(&n, &aKeys[i], sizeof(n));
+      i += sizeof(n);
+      rc = pLsmMeth->xSeek(pCsr, &aKeys[i], n, 0);
+      if( rc==SQLITE4_OK ) rc = pLsmMeth->xDelete(pCsr);
+      i += n;
+    }
+  }
+  if( pCsr ) pLsmMeth->xCloseCursor(pCsr);
+  if( rc==SQLITE4_OK ) rc = pLsmMeth->xCommitPhaseOne(p->pLsm, iLevel);
+  if( rc==SQLITE4_OK ) rc = pLsmMeth->xCommitPhaseTwo(p->pLsm, iLevel);
+
+  if( rc==SQLITE4_OK ){
+    p->bMigrate = 0;
+  }else{
+    pBtMeth->xRollback(p->pBt, iLevel);
+    pLsmMeth->xRollback(p->pLsm, iLevel);
+    nMove = 0;
+  }
+  sqlite4_buffer_clear(&keys);
+  *pnMove = nMove;
+  return rc;
+}
+
+/*
+** Destructor for the hybrid store.
+*/
+static int hybridClose(KVStore *pKVStore){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  int i;
+
+  if( p==0 ) return SQLITE4_OK;
+  if( p->pLsm && p->pBt ) hybridRollback(pKVStore, 0);
+  if( p->pLsm ) p->pLsm->pStoreVfunc->xClose(p->pLsm);
+  if( p->pBt ) p->pBt->pStoreVfunc->xClose(p->pBt);
+  for(i=0; i<ArraySize(p->aRange); i++){
+    sqlite4_buffer_clear(&p->aRange[i].aMin[0]);
+    sqlite4_buffer_clear(&p->aRange[i].aMin[1]);
+  }
+  sqlite4_buffer_clear(&p->value);
+  sqlite4_buffer_clear(&p->migrate);
+  sqlite4_free(p->base.pEnv, p);
+  return SQLITE4_OK;
+}
+
+/*
+** File-controls are passed through to the LSM store. The
+** SQLITE4_KVCTRL_LSM_* operations therefore work on hybrid stores too.
+*/
+static int hybridControl(KVStore *pKVStore, int op, void *pArg){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  return p->pLsm->pStoreVfunc->xControl(p->pLsm, op, pArg);
+}
+
+/*
+** The user cookie is stored in the LSM store.
+*/
+static int hybridGetMeta(KVStore *pKVStore, unsigned int *piVal){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  return p->pLsm->pStoreVfunc->xGetMeta(p->pLsm, piVal);
+}
+static int hybridPutMeta(KVStore *pKVStore, unsigned int iVal){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  return p->pLsm->pStoreVfunc->xPutMeta(p->pLsm, iVal);
+}
+
+/*
+** Estimate the number of keys between aLo/nLo and aHi/nHi. This is the
+** sum of the estimates made by the two stores. Entries in both stores and
+** HYBRID_DELETE entries are counted, so the result may be too large.
+*/
+static int hybridEstimateRange(
+  KVStore *pKVStore,
+  const KVByteArray *aLo, KVSize nLo,
+  const KVByteArray *aHi, KVSize nHi,
+  sqlite4_int64 *pnRow
+){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  KVStore *apSub[2];
+  int rc = SQLITE4_NOTFOUND;
+  int i;
+
+  *pnRow = 0;
+  apSub[0] = p->pLsm;
+  apSub[1] = p->pBt;
+  for(i=0; i<2; i++){
+    const KVStoreMethods *pMeth = apSub[i]->pStoreVfunc;
+    sqlite4_int64 nRow = 0;
+    int rc2;
+    if( pMeth->iVersion<5 || pMeth->xEstimateRange==0 ) continue;
+    rc2 = pMeth->xEstimateRange(apSub[i], aLo, nLo, aHi, nHi, &nRow);
+    if( rc2==SQLITE4_OK ){
+      *pnRow += nRow;
+      if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+    }else if( rc2!=SQLITE4_NOTFOUND ){
+      rc = rc2;
+      break;
+    }
+  }
+  return rc;
+}
+
+static void hybridPragmaDestroy(void *p){
+  sqlite4_free(0, p);
+}
+
+/*
+** Implementation of "PRAGMA hybrid_migrate(N)". Migrate up to N entries
+** (default HYBRID_MIGRATE_BATCH) and return the number migrated.
+*/
+static void hybridPragma(sqlite4_context *ctx, int nArg, sqlite4_value **apArg){
+  KVHybrid *p = *(KVHybrid **)sqlite4_context_appdata(ctx);
+  int nMax = HYBRID_MIGRATE_BATCH;
+  int nMove = 0;
+  int rc;
+
+  if( nArg>1 ){
+    sqlite4_result_error(ctx, "wrong number of arguments", -1);
+    return;
+  }
+  if( nArg==1 ) nMax = sqlite4_value_int(apArg[0]);
+  rc = hybridMigrate(p, nMax, &nMove);
+  if( rc!=SQLITE4_OK ){
+    sqlite4_result_error_code(ctx, rc);
+  }else{
+    sqlite4_result_int(ctx, nMove);
+  }
+}
+
+/*
+** Pragmas other than "hybrid_migrate" are passed through to the LSM store.
+*/
+static int hybridGetMethod(
+  sqlite4_kvstore *pKVStore,
+  const char *zMethod,
+  void **ppArg,
+  void (**pxFunc)(sqlite4_context *, int, sqlite4_value **),
+  void (**pxDestroy)(void *)
+){
+  KVHybrid *p = (KVHybrid *)pKVStore;
+  KVHybrid **pp;
+
+  if( sqlite4_stricmp(zMethod, "hybrid_migrate") ){
+    return p->pLsm->pStoreVfunc->xGetMethod(
+        p->pLsm, zMethod, ppArg, pxFunc, pxDestroy
+    );
+  }
+
+  pp = (KVHybrid **)sqlite4_malloc(0, sizeof(KVHybrid *));
+  if( pp==0 ) return SQLITE4_NOMEM;
+  *pp = p;
+  *ppArg = (void *)pp;
+  *pxFunc = hybridPragma;
+  *pxDestroy = hybridPragmaDestroy;
+  return SQLITE4_OK;
+}
+
+/*
+** Create a new hybrid storage engine and return a pointer to it.
+*/
+int sqlite4KVStoreOpenHybrid(
+  sqlite4_env *pEnv,          /* Run-time environment */
+  KVStore **ppKVStore,        /* OUT: write the new KVStore here */
+  const char *zName,          /* Name of the file to open */
+  unsigned openFlags          /* Flags */
+){
+
+  /* Virtual methods for a hybrid data store */
+  static const KVStoreMethods kvhybridMethods = {
+    5,                            /* iVersion */
+    sizeof(KVStoreMethods),       /* szSelf */
+    hybridReplace,                /* xReplace */
+    hybridOpenCursor,             /* xOpenCursor */
+    hybridSeek,                   /* xSeek */
+    hybridNext,                   /* xNext */
+    hybridPrev,                   /* xPrev */
+    hybridDelete,                 /* xDelete */
+    hybridKey,                    /* xKey */
+    hybridData,                   /* xData */
+    hybridReset,                  /* xReset */
+    hybridCloseCursor,            /* xCloseCursor */
+    hybridBegin,                  /* xBegin */
+    hybridCommitPhaseOne,         /* xCommitPhaseOne */
+    hybridCommitPhaseTwo,         /* xCommitPhaseTwo */
+    hybridRollback,               /* xRollback */
+    hybridRevert,                 /* xRevert */
+    hybridClose,                  /* xClose */
+    hybridControl,                /* xControl */
+    hybridGetMeta,                /* xGetMeta */
+    hybridPutMeta,                /* xPutMeta */
+    hybridGetMethod,              /* xGetMethod */
+    hybridSetPrefix,              /* xSetPrefix */
+    0,                            /* xNextBatch */
+    0,                            /* xSplit */
+    0,                            /* xCloneReader */
+    hybridEstimateRange           /* xEstimateRange */
+  };
+
+  KVHybrid *pNew;
+  int rc = SQLITE4_OK;
+
+  pNew = (KVHybrid *)sqlite4_malloc(pEnv, sizeof(KVHybrid));
+  if( pNew==0 ){
+    rc = SQLITE4_NOMEM;
+  }else{
+    int nName = sqlite4Strlen30(zName);
+    char *zBt;
+
+    memset(pNew, 0, sizeof(KVHybrid));
+    pNew->base.pStoreVfunc = &kvhybridMethods;
+    pNew->base.pEnv = pEnv;
+    rc = sqlite4KVStoreOpenLsm(pEnv, &pNew->pLsm, zName, openFlags);
+
+    /* The name of the b-tree file is zName with "-bt" appended. It is
+    ** followed by an empty list of URI parameters. */
+    if( rc==SQLITE4_OK ){
+      zBt = (char *)sqlite4_malloc(pEnv, nName+5);
+      if( zBt==0 ){
+        rc = SQLITE4_NOMEM;
+      }else{
+        memcpy(zBt, zName, nName);
+        memcpy(&zBt[nName], "-bt\0", 5);
+        rc = sqlite4KVStoreOpenBtree(pEnv, &pNew->pBt, zBt, openFlags);
+        sqlite4_free(pEnv, zBt);
+      }
+    }
+
+    if( rc!=SQLITE4_OK ){
+      hybridClose((KVStore *)pNew);
+      pNew = 0;
+    }
+  }
+
+  *ppKVStore = (KVStore*)pNew;
+  return rc;
+}
@@ -27,6 +27,7 @@ struct KVLsm {
   KVStore base;                   /* Base class, must be first */
   lsm_db *pDb;                    /* LSM database handle */
   lsm_cursor *pCsr;               /* LSM cursor holding read-trans open */
+  char *zName;                    /* Copy of URI passed to xFactory */
 };
 
 /*
@@ -35,7 +36,10 @@ struct KVLsm {
 */
 struct KVLsmCsr {
   KVCursor base;                  /* Base class. Must be first */
-  lsm_cursor *pCsr;               /* LSM cursor handle */
+  lsm_cursor *pCsr;               /* LSM cursor handle (or NULL if reset) */
+  sqlite4_buffer batch;           /* Entries returned by xNextBatch */
+  const void *pLazy;              /* Value of current entry, if not copied */
+  int nLazy;                      /* Size of pLazy in bytes */
 };
   
 /*
@@ -197,22 +201,58 @@ static int kvlsmOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
 }
 
 /*
-** Reset a cursor
+** Reset a cursor. The LSM cursor is closed so that it no longer holds
+** a read-transaction open. It is reopened (usually from the LSM cursor
+** cache) by the next xSeek or xSetPrefix call.
 */
 static int kvlsmReset(KVCursor *pKVCursor){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  lsm_csr_close(pCsr->pCsr);
+  pCsr->pCsr = 0;
+  pCsr->pLazy = 0;
   return SQLITE4_OK;
 }
 
+/*
+** Make sure the LSM cursor belonging to pCsr is open. It may have been
+** closed by an earlier call to kvlsmReset().
+*/
+static int kvlsmCsrOpen(KVLsmCsr *pCsr){
+  int rc = SQLITE4_OK;
+  if( pCsr->pCsr==0 ){
+    KVLsm *p = (KVLsm *)pCsr->base.pStore;
+    rc = lsm_csr_open(p->pDb, &pCsr->pCsr);
+  }
+  return rc;
+}
+
 /*
 ** Destroy a cursor object
 */
 static int kvlsmCloseCursor(KVCursor *pKVCursor){
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
   lsm_csr_close(pCsr->pCsr);
+  sqlite4_buffer_clear(&pCsr->batch);
   sqlite4_free(pCsr->base.pEnv, pCsr);
   return SQLITE4_OK;
 }
 
+/*
+** Restrict a cursor to keys that begin with prefix aPrefix/nPrefix.
+*/
+static int kvlsmSetPrefix(
+  KVCursor *pKVCursor, 
+  const KVByteArray *aPrefix, 
+  KVSize nPrefix
+){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  int rc = kvlsmCsrOpen(pCsr);
+  if( rc==SQLITE4_OK ){
+    rc = lsm_csr_prefix(pCsr->pCsr, (const void *)aPrefix, (int)nPrefix);
+  }
+  return rc;
+}
+
 /*
 ** Move a cursor to the next non-deleted node.
 */
@@ -220,7 +260,8 @@ static int kvlsmNextEntry(KVCursor *pKVCursor){
   int rc;
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
 
-  if( lsm_csr_valid(pCsr->pCsr)==0 ) return SQLITE4_NOTFOUND;
+  pCsr->pLazy = 0;
+  if( pCsr->pCsr==0 || lsm_csr_valid(pCsr->pCsr)==0 ) return SQLITE4_NOTFOUND;
   rc = lsm_csr_next(pCsr->pCsr);
   if( rc==LSM_OK && lsm_csr_valid(pCsr->pCsr)==0 ){
     rc = SQLITE4_NOTFOUND;
@@ -235,7 +276,8 @@ static int kvlsmPrevEntry(KVCursor *pKVCursor){
   int rc;
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
 
-  if( lsm_csr_valid(pCsr->pCsr)==0 ) return SQLITE4_NOTFOUND;
+  pCsr->pLazy = 0;
+  if( pCsr->pCsr==0 || lsm_csr_valid(pCsr->pCsr)==0 ) return SQLITE4_NOTFOUND;
   rc = lsm_csr_prev(pCsr->pCsr);
   if( rc==LSM_OK && lsm_csr_valid(pCsr->pCsr)==0 ){
     rc = SQLITE4_NOTFOUND;
@@ -243,6 +285,93 @@ static int kvlsmPrevEntry(KVCursor *pKVCursor){
   return rc;
 }
 
+/*
+** Advance a cursor up to nSlice times, copying the key and data of each
+** entry visited into the cursor's batch buffer. The batch ends early at 
+** an entry with more than KVBATCH_MAXDATA bytes of data. That value is not
+** copied - kvlsmData() returns the buffer it was loaded into by LSM 
+** instead, which remains valid until the cursor is moved.
+*/
+static int kvlsmNextBatch(
+  KVCursor *pKVCursor,
+  KVSlice *aSlice,
+  int nSlice,
+  int *pnSlice
+){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  int rc = SQLITE4_OK;
+  int n = 0;
+
+  pCsr->batch.n = 0;
+  pCsr->pLazy = 0;
+  if( pCsr->pCsr==0 || lsm_csr_valid(pCsr->pCsr)==0 ){
+    rc = SQLITE4_NOTFOUND;
+  }
+  while( rc==SQLITE4_OK && n<nSlice && pCsr->batch.n<KVBATCH_MAXBYTES ){
+    const void *pKey; int nKey;
+    const void *pVal; int nVal;
+
+    rc = lsm_csr_next(pCsr->pCsr);
+    if( rc!=LSM_OK ) break;
+    if( lsm_csr_valid(pCsr->pCsr)==0 ){
+      rc = SQLITE4_NOTFOUND;
+      break;
+    }
+    rc = lsm_csr_key(pCsr->pCsr, &pKey, &nKey);
+    if( rc==LSM_OK ) rc = lsm_csr_value(pCsr->pCsr, &pVal, &nVal);
+    if( rc==LSM_OK ){
+      if( nVal>KVBATCH_MAXDATA ){
+        pCsr->pLazy = pVal;
+        pCsr->nLazy = nVal;
+      }
+      rc = sqlite4KVBatchAppend(&pCsr->batch, &aSlice[n], pKey, nKey, 
+                                pCsr->pLazy ? 0 : pVal, nVal);
+      if( rc==SQLITE4_OK ) n++;
+      if( pCsr->pLazy ) break;
+    }
+  }
+
+  sqlite4KVBatchFinish(&pCsr->batch, aSlice, n);
+  *pnSlice = n;
+  return rc;
+}
+
+/*
+** Look up each of the nSlice sorted keys in aSlice[], copying the entries
+** found into the cursor's batch buffer. The keys are looked up using EQ 
+** seeks on a single LSM cursor, so that the segment pages loaded for one
+** key are reused for the next if it is on the same page (see 
+** seekInSegment() in lsm_sorted.c), and segments that the key ranges of
+** their levels exclude are not visited at all.
+*/
+static int kvlsmMultiGet(KVCursor *pKVCursor, KVSlice *aSlice, int nSlice){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  int rc;
+  int i;
+
+  pCsr->batch.n = 0;
+  pCsr->pLazy = 0;
+  rc = kvlsmCsrOpen(pCsr);
+  for(i=0; rc==SQLITE4_OK && i<nSlice; i++){
+    const void *pVal = 0; 
+    int nVal = -1;
+
+    rc = lsm_csr_seek(pCsr->pCsr, aSlice[i].pKey, aSlice[i].nKey, LSM_SEEK_EQ);
+    if( rc==LSM_OK && lsm_csr_valid(pCsr->pCsr) ){
+      rc = lsm_csr_value(pCsr->pCsr, &pVal, &nVal);
+    }
+    if( rc==LSM_OK ){
+      rc = sqlite4KVBatchAppend(&pCsr->batch, &aSlice[i], 
+          aSlice[i].pKey, aSlice[i].nKey, pVal, nVal
+      );
+    }
+  }
+  if( rc==SQLITE4_OK ){
+    sqlite4KVBatchFinish(&pCsr->batch, aSlice, nSlice);
+  }
+  return rc;
+}
+
 /*
 ** Seek a cursor.
 */
@@ -259,7 +388,11 @@ static int kvlsmSeek(
   assert( LSM_SEEK_EQ==0 && LSM_SEEK_GE==1 && LSM_SEEK_LE==-1 );
   assert( LSM_SEEK_LEFAST==-2 );
 
-  rc = lsm_csr_seek(pCsr->pCsr, (void *)aKey, nKey, dir);
+  pCsr->pLazy = 0;
+  rc = kvlsmCsrOpen(pCsr);
+  if( rc==SQLITE4_OK ){
+    rc = lsm_csr_seek(pCsr->pCsr, (void *)aKey, nKey, dir);
+  }
   if( rc==SQLITE4_OK ){
     if( lsm_csr_valid(pCsr->pCsr)==0 ){
       rc = SQLITE4_NOTFOUND;
@@ -291,7 +424,7 @@ static int kvlsmDelete(KVCursor *pKVCursor){
   int nKey;
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
 
-  assert( lsm_csr_valid(pCsr->pCsr) );
+  assert( pCsr->pCsr && lsm_csr_valid(pCsr->pCsr) );
   rc = lsm_csr_key(pCsr->pCsr, &pKey, &nKey);
   if( rc==SQLITE4_OK ){
     rc = lsm_delete(((KVLsm *)(pKVCursor->pStore))->pDb, pKey, nKey);
@@ -309,7 +442,7 @@ static int kvlsmKey(
   KVSize *pN                   /* Make this point to the size of the key */
 ){
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
-  if( 0==lsm_csr_valid(pCsr->pCsr) ) return SQLITE4_DONE;
+  if( pCsr->pCsr==0 || 0==lsm_csr_valid(pCsr->pCsr) ) return SQLITE4_DONE;
   return lsm_csr_key(pCsr->pCsr, (const void **)paKey, (int *)pN);
 }
 
@@ -328,7 +461,15 @@ static int kvlsmData(
   void *pData;
   int nData;
 
-  rc = lsm_csr_value(pCsr->pCsr, (const void **)&pData, &nData);
+  if( pCsr->pCsr==0 ) return SQLITE4_DONE;
+  if( pCsr->pLazy ){
+    /* The value was loaded by kvlsmNextBatch() but not copied. */
+    pData = (void *)pCsr->pLazy;
+    nData = pCsr->nLazy;
+    rc = SQLITE4_OK;
+  }else{
+    rc = lsm_csr_value(pCsr->pCsr, (const void **)&pData, &nData);
+  }
   if( rc==SQLITE4_OK ){
     if( n<0 ){
       *paData = pData;
@@ -359,10 +500,86 @@ static int kvlsmClose(KVStore *pKVStore){
   assert( p->pCsr==0 );
 
   lsm_close(p->pDb);
+  sqlite4_free(p->base.pEnv, p->zName);
   sqlite4_free(p->base.pEnv, p);
   return SQLITE4_OK;
 }
 
+/*
+** Invoke xKey on up to (nPart-1) keys that divide the keys that begin with
+** the specified prefix into nPart parts.
+*/
+static int kvlsmSplit(
+  KVStore *pKVStore,
+  const KVByteArray *aPrefix,
+  KVSize nPrefix,
+  int nPart,
+  int (*xKey)(void*, const KVByteArray*, KVSize),
+  void *pCtx
+){
+  KVLsm *p = (KVLsm *)pKVStore;
+  return lsm_split(p->pDb, (const void *)aPrefix, (int)nPrefix, nPart,
+      (int (*)(void*, const void*, int))xKey, pCtx
+  );
+}
+
+/*
+** Open a second connection to the database and a read transaction on it
+** that uses the same snapshot as the read transaction open on pKVStore.
+** The new connection uses the same LSM environment and configuration as
+** pKVStore (see lsm_clone()). Return SQLITE4_BUSY if this is not possible.
+*/
+static int kvlsmCloneReader(KVStore *pKVStore, KVStore **ppOut){
+  KVLsm *p = (KVLsm *)pKVStore;
+  sqlite4_env *pEnv = pKVStore->pEnv;
+  KVLsm *pNew;
+  int rc = SQLITE4_OK;
+
+  *ppOut = 0;
+  if( pKVStore->iTransLevel!=1 ) return SQLITE4_BUSY;
+  pNew = (KVLsm *)sqlite4_malloc(pEnv, sizeof(KVLsm));
+  if( pNew==0 ) return SQLITE4_NOMEM;
+
+  memset(pNew, 0, sizeof(KVLsm));
+  pNew->base.pStoreVfunc = pKVStore->pStoreVfunc;
+  pNew->base.pEnv = pEnv;
+  pNew->zName = sqlite4_mprintf(pEnv, "%s", p->zName);
+  if( pNew->zName==0 ) rc = SQLITE4_NOMEM;
+  if( rc==SQLITE4_OK ){
+    rc = lsm_clone(p->pDb, &pNew->pDb);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = kvlsmBegin((KVStore *)pNew, 1);
+  }
+  if( rc!=SQLITE4_OK ){
+    kvlsmClose((KVStore *)pNew);
+    pNew = 0;
+  }
+  *ppOut = (KVStore *)pNew;
+  return rc;
+}
+
+/*
+** Estimate the number of keys between aLo/nLo and aHi/nHi.
+*/
+static int kvlsmEstimateRange(
+  KVStore *pKVStore,
+  const KVByteArray *aLo, KVSize nLo,
+  const KVByteArray *aHi, KVSize nHi,
+  sqlite4_int64 *pnRow
+){
+  KVLsm *p = (KVLsm *)pKVStore;
+  lsm_i64 nRow = 0;
+  int rc;
+
+  rc = lsm_estimate(p->pDb, 
+      (const void *)aLo, (int)nLo, (const void *)aHi, (int)nHi, &nRow
+  );
+  if( rc==LSM_OK && nRow<0 ) rc = SQLITE4_NOTFOUND;
+  *pnRow = (rc==LSM_OK ? nRow : 0);
+  return rc;
+}
+
 static int kvlsmControl(KVStore *pKVStore, int op, void *pArg){
   int rc = SQLITE4_OK;
   KVLsm *p = (KVLsm *)pKVStore;
@@ -518,7 +735,7 @@ int sqlite4KVStoreOpenLsm(
 
   /* Virtual methods for an LSM data store */
   static const KVStoreMethods kvlsmMethods = {
-    1,                            /* iVersion */
+    7,                            /* iVersion */
     sizeof(KVStoreMethods),       /* szSelf */
     kvlsmReplace,                 /* xReplace */
     kvlsmOpenCursor,              /* xOpenCursor */
@@ -539,7 +756,13 @@ int sqlite4KVStoreOpenLsm(
     kvlsmControl,                 /* xControl */
     kvlsmGetMeta,                 /* xGetMeta */
     kvlsmPutMeta,                 /* xPutMeta */
-    kvlsmGetMethod                /* xGetMethod */
+    kvlsmGetMethod,               /* xGetMethod */
+    kvlsmSetPrefix,               /* xSetPrefix */
+    kvlsmNextBatch,               /* xNextBatch */
+    kvlsmSplit,                   /* xSplit */
+    kvlsmCloneReader,             /* xCloneReader */
+    kvlsmEstimateRange,           /* xEstimateRange */
+    kvlsmMultiGet                 /* xMultiGet */
   };
 
   KVLsm *pNew;
@@ -557,13 +780,15 @@ int sqlite4KVStoreOpenLsm(
       { "lsm_page_size", LSM_CONFIG_PAGE_SIZE },
       { "lsm_block_size", LSM_CONFIG_BLOCK_SIZE },
       { "lsm_multiple_processes", LSM_CONFIG_MULTIPLE_PROCESSES },
-      { "lsm_automerge", LSM_CONFIG_AUTOMERGE }
+      { "lsm_automerge", LSM_CONFIG_AUTOMERGE },
+      { "lsm_value_log", LSM_CONFIG_VALUE_LOG }
     };
 
     memset(pNew, 0, sizeof(KVLsm));
     pNew->base.pStoreVfunc = &kvlsmMethods;
     pNew->base.pEnv = pEnv;
-    rc = lsm_new(0, &pNew->pDb);
+    pNew->zName = sqlite4_mprintf(pEnv, "%s", zName);
+    rc = (pNew->zName ? lsm_new(0, &pNew->pDb) : SQLITE4_NOMEM);
     if( rc==SQLITE4_OK ){
       int i;
       for(i=0; i<ArraySize(aConfig); i++){
@@ -579,6 +804,7 @@ int sqlite4KVStoreOpenLsm(
 
     if( rc!=SQLITE4_OK ){
       lsm_close(pNew->pDb);
+      sqlite4_free(pEnv, pNew->zName);
       sqlite4_free(pEnv, pNew);
       pNew = 0;
     }
@@ -83,6 +83,10 @@ struct KVMemCursor {
   KVMemNode *pNode;     /* The entry this cursor points to */
   KVMemData *pData;     /* Data returned by xData */
   int iMagicKVMemCur;   /* Magic number for sanity */
+  int nBatch;           /* Number of entries in apBatch[] */
+  int nBatchAlloc;      /* Allocated size of apBatch[] */
+  KVMemNode **apBatch;  /* Nodes returned by the last xNextBatch */
+  KVMemData **apBatchData;  /* Data returned by the last xNextBatch */
 };
 #define SQLITE4_KVMEMCUR_MAGIC   0xb19bdc1b
 
@@ -683,7 +687,13 @@ static int kvmemOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
 */
 static int kvmemReset(KVCursor *pKVCursor){
   KVMemCursor *pCur = (KVMemCursor*)pKVCursor;
+  int i;
   assert( pCur->iMagicKVMemCur==SQLITE4_KVMEMCUR_MAGIC );
+  for(i=0; i<pCur->nBatch; i++){
+    kvmemDataUnref(pCur->base.pEnv, pCur->apBatchData[i]);
+    kvmemNodeUnref(pCur->base.pEnv, pCur->apBatch[i]);
+  }
+  pCur->nBatch = 0;
   kvmemDataUnref(pCur->base.pEnv, pCur->pData);
   pCur->pData = 0;
   kvmemNodeUnref(pCur->base.pEnv, pCur->pNode);
@@ -701,6 +711,7 @@ static int kvmemCloseCursor(KVCursor *pKVCursor){
     assert( pCur->pOwner->iMagicKVMemBase==SQLITE4_KVMEMBASE_MAGIC );
     pCur->pOwner->nCursor--;
     kvmemReset(pKVCursor);
+    sqlite4_free(pCur->base.pEnv, pCur->apBatch);
     memset(pCur, 0, sizeof(*pCur));
     sqlite4_free(pCur->base.pEnv, pCur);
   }
@@ -728,6 +739,63 @@ static int kvmemNextEntry(KVCursor *pKVCursor){
   return pNode ? SQLITE4_OK : SQLITE4_NOTFOUND;
 }
 
+/*
+** Advance a cursor up to nSlice times. No data is copied. Instead, the
+** cursor holds a reference to each node visited (and to its data) until
+** it is next moved, reset or closed. This keeps the key and data returned
+** in aSlice[] stable even if the tree is modified.
+*/
+static int kvmemNextBatch(
+  KVCursor *pKVCursor,
+  KVSlice *aSlice,
+  int nSlice,
+  int *pnSlice
+){
+  KVMemCursor *pCur = (KVMemCursor*)pKVCursor;
+  KVMemNode *pNode;
+  int n = 0;
+
+  assert( pCur->iMagicKVMemCur==SQLITE4_KVMEMCUR_MAGIC );
+  if( nSlice>pCur->nBatchAlloc ){
+    KVMemNode **apNew = (KVMemNode**)sqlite4_realloc(pCur->base.pEnv,
+        pCur->apBatch, nSlice * (sizeof(KVMemNode*) + sizeof(KVMemData*))
+    );
+    if( apNew==0 ){
+      *pnSlice = 0;
+      return SQLITE4_NOMEM;
+    }
+    pCur->apBatch = apNew;
+    pCur->apBatchData = (KVMemData**)&apNew[nSlice];
+    pCur->nBatchAlloc = nSlice;
+  }
+
+  pNode = pCur->pNode;
+  kvmemReset(pKVCursor);
+  while( pNode && n<nSlice ){
+    do{
+      pNode = kvmemNext(pNode);
+    }while( pNode && pNode->pData==0 );
+    if( pNode ){
+      pCur->apBatch[n] = kvmemNodeRef(pNode);
+      pCur->apBatchData[n] = kvmemDataRef(pNode->pData);
+      aSlice[n].pKey = pNode->aKey;
+      aSlice[n].nKey = pNode->nKey;
+      aSlice[n].pData = pNode->pData->a;
+      aSlice[n].nData = pNode->pData->n;
+      n++;
+      pCur->nBatch = n;
+    }
+  }
+
+  /* Leave the cursor on the last entry returned */
+  if( n>0 ){
+    pCur->pNode = kvmemNodeRef(pCur->apBatch[n-1]);
+    pCur->pData = kvmemDataRef(pCur->apBatchData[n-1]);
+  }
+  *pnSlice = n;
+  return pNode ? SQLITE4_OK : SQLITE4_NOTFOUND;
+}
+
 /*
 ** Move a cursor to the previous non-deleted node.
 */
@@ -946,7 +1014,7 @@ static int kvmemPutMeta(KVStore *pKVStore, unsigned int iVal){
 
 /* Virtual methods for the in-memory storage engine */
 static const KVStoreMethods kvmemMethods = {
-  1,                        /* iVersion */
+  7,                        /* iVersion */
   sizeof(KVStoreMethods),   /* szSelf */
   kvmemReplace,             /* xReplace */
   kvmemOpenCursor,          /* xOpenCursor */
@@ -966,7 +1034,14 @@ static const KVStoreMethods kvmemMethods = {
   kvmemClose,               /* xClose */
   kvmemControl,             /* xControl */
   kvmemGetMeta,             /* xGetMeta */
-  kvmemPutMeta              /* xPutMeta */
+  kvmemPutMeta,             /* xPutMeta */
+  0,                        /* xGetMethod */
+  0,                        /* xSetPrefix */
+  kvmemNextBatch,           /* xNextBatch */
+  0,                        /* xSplit */
+  0,                        /* xCloneReader */
+  0,                        /* xEstimateRange */
+  0                         /* xMultiGet */
 };
 
 /*
@@ -0,0 +1,987 @@
+/*
+** 2013 March 22
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** A key/value storage subsystem used by the VDBE for sorting. It presents
+** the interface defined by kv.h, but only supports the access pattern used
+** by OP_SorterOpen and friends: a sequence of xReplace() calls followed by
+** a forward scan of the contents in key order.
+**
+** Records passed to xReplace() are appended to a list held in large arena
+** chunks. Once the records held in memory exceed a limit, the list is
+** sorted using a merge-sort and written to a temporary file as a single
+** sorted "run". The limit defaults to SQLITE4_SORTER_MAXMEM, and may be
+** changed using the SQLITE4_KVCTRL_MAXMEM file-control (see "PRAGMA
+** sorter_maxmem"). The first time a cursor is positioned, the remaining
+** in-memory records are sorted and a k-way merge of the runs and the
+** in-memory list is started. If there are too many runs to merge in one
+** pass, runs are first merged together into larger runs.
+**
+** The temporary file is named by sqlite4OsTempName() and accessed using
+** the file methods of the default LSM environment. All reads and writes
+** specify an explicit offset, so no seeking is required. Records are
+** accumulated in a buffer and written to the file in large blocks.
+**
+** Keys written to a sorter are assumed to be unique (the VDBE appends a
+** sequence number to each). If duplicate keys are written, all copies are
+** returned by the cursor.
+**
+** Each run in the temporary file is a sequence of records, each formatted
+** as follows:
+**
+**   * The size of the key in bytes, as a varint.
+**   * The size of the value in bytes, as a varint.
+**   * The key.
+**   * The value.
+*/
+#include "sqliteInt.h"
+#include "lsm.h"
+
+/* Forward declarations of object names */
+typedef struct KVSort KVSort;
+typedef struct KVSortChunk KVSortChunk;
+typedef struct KVSortCursor KVSortCursor;
+typedef struct KVSortRecord KVSortRecord;
+typedef struct KVSortRun KVSortRun;
+typedef struct KVSortSource KVSortSource;
+
+#define KVSORT_CHUNK_SIZE (64*1024)   /* Size of each arena chunk */
+#define KVSORT_READ_SIZE  (16*1024)   /* Bytes read from a run at a time */
+#define KVSORT_WRITE_SIZE (64*1024)   /* Size of the write buffer */
+#define KVSORT_MAX_MERGE  16          /* Maximum inputs to a single merge */
+
+/*
+** Each record written to the sorter is stored in memory as an instance of
+** the following object, followed by nKey bytes of key and nData bytes of
+** value.
+*/
+struct KVSortRecord {
+  KVSortRecord *pNext;            /* Next record in list */
+  KVSize nKey;                    /* Size of key in bytes */
+  KVSize nData;                   /* Size of value in bytes */
+};
+#define kvsortRecKey(pRec)  ((KVByteArray*)&(pRec)[1])
+#define kvsortRecData(pRec) (kvsortRecKey(pRec) + (pRec)->nKey)
+
+/*
+** Records are allocated from a linked list of arena chunks. The first
+** chunk in the list is the one currently being allocated from.
+*/
+struct KVSortChunk {
+  KVSortChunk *pNext;             /* Next (older) chunk */
+  int nAlloc;                     /* Bytes of space following this header */
+  int nUsed;                      /* Bytes of space used so far */
+};
+
+/*
+** A sorted run of records stored in the temporary file.
+*/
+struct KVSortRun {
+  i64 iStart;                     /* Offset of first byte of run */
+  i64 iEnd;                       /* Offset of first byte past end of run */
+};
+
+/*
+** An input to a k-way merge. Either a run in the temporary file or a
+** sorted list of in-memory records.
+**
+** For a run, aBuf[] holds nBuf bytes read from the file. Offset iBuf in
+** aBuf[] is the start of the next record, and iNext is the offset within
+** the file corresponding to aBuf[nBuf].
+*/
+struct KVSortSource {
+  KVSortRecord *pRec;             /* Next in-memory record (if pFile==0) */
+  lsm_env *pVfs;                  /* Environment used to read pFile */
+  lsm_file *pFile;                /* Temporary file, or NULL */
+  i64 iNext;                      /* File offset of next byte to read */
+  i64 iEnd;                       /* End of run in file */
+  u8 *aBuf;                       /* Buffer for data read from file */
+  int nAlloc;                     /* Allocated size of aBuf[] */
+  int nBuf;                       /* Valid bytes in aBuf[] */
+  int iBuf;                       /* Offset of next record in aBuf[] */
+  const KVByteArray *aKey;        /* Current key */
+  KVSize nKey;                    /* Size of aKey[] */
+  const KVByteArray *aData;       /* Current value */
+  KVSize nData;                   /* Size of aData[] */
+  int bEof;                       /* True once the source is exhausted */
+};
+
+/*
+** The sorter object.
+*/
+struct KVSort {
+  KVStore base;                   /* Base class, must be first */
+  KVSortRecord *pList;            /* In-memory records */
+  int bSorted;                    /* True if pList is in sorted order */
+  int bReady;                     /* True once prepared by kvsortPrepare() */
+  KVSortChunk *pChunk;            /* Arena chunks holding pList records */
+  i64 nMem;                       /* Bytes of record data in memory */
+  i64 nMaxMem;                    /* Spill to a new run once nMem exceeds */
+  lsm_env *pVfs;                  /* Environment used to access pFile */
+  lsm_file *pFile;                /* Temporary file, or NULL */
+  char *zFile;                    /* Name of temporary file */
+  i64 iEof;                       /* Size of file, including aWrite[] */
+  u8 *aWrite;                     /* Buffered data not yet written to pFile */
+  int nWrite;                     /* Valid bytes in aWrite[] */
+  int nRun;                       /* Number of entries in aRun[] */
+  int nRunAlloc;                  /* Allocated size of aRun[] */
+  KVSortRun *aRun;                /* Runs in temporary file, oldest first */
+  KVSortCursor *pCsr;             /* List of open cursors */
+  unsigned int iMeta;             /* Schema cookie value */
+};
+
+/*
+** A cursor used to read the sorted contents of a sorter. While the cursor
+** is positioned, aHeap[] is a binary min-heap of indexes into aSrc[]. The
+** cursor points to the current record of source aSrc[aHeap[0]].
+*/
+struct KVSortCursor {
+  KVCursor base;                  /* Base class, must be first */
+  KVSort *pOwner;                 /* The sorter that owns this cursor */
+  KVSortCursor *pCsrNext;         /* Next cursor opened on pOwner */
+  int nSrc;                       /* Number of entries in aSrc[] */
+  KVSortSource *aSrc;             /* Merge inputs */
+  int nHeap;                      /* Number of entries in aHeap[] */
+  int *aHeap;                     /* Heap of indexes into aSrc[] */
+};
+
+/*
+** Compare two keys. Return negative, zero or positive if the first key
+** is less than, equal to or greater than the second.
+*/
+static int kvsortKeyCompare(
+  const KVByteArray *aKey1, KVSize nKey1,
+  const KVByteArray *aKey2, KVSize nKey2
+){
+  int c = memcmp(aKey1, aKey2, nKey1<nKey2 ? nKey1 : nKey2);
+  if( c==0 ) c = (nKey1<nKey2 ? -1 : (nKey1>nKey2));
+  return c;
+}
+
+/*
+** Merge two sorted lists of records into one and return the result.
+** Where two keys are equal, the record from p1 comes first.
+*/
+static KVSortRecord *kvsortMergeLists(KVSortRecord *p1, KVSortRecord *p2){
+  KVSortRecord *pRet = 0;
+  KVSortRecord **pp = &pRet;
+  while( p1 && p2 ){
+    int c = kvsortKeyCompare(
+        kvsortRecKey(p1), p1->nKey, kvsortRecKey(p2), p2->nKey
+    );
+    if( c<=0 ){
+      *pp = p1;
+      pp = &p1->pNext;
+      p1 = p1->pNext;
+    }else{
+      *pp = p2;
+      pp = &p2->pNext;
+      p2 = p2->pNext;
+    }
+  }
+  *pp = (p1 ? p1 : p2);
+  return pRet;
+}
+
+/*
+** Sort the list of records pList and return the result. Slot i of aSlot[]
+** holds either NULL or a sorted list of 2^i records.
+*/
+static KVSortRecord *kvsortSortList(KVSortRecord *pList){
+  KVSortRecord *aSlot[64];
+  KVSortRecord *p;
+  int i;
+
+  memset(aSlot, 0, sizeof(aSlot));
+  while( pList ){
+    p = pList;
+    pList = p->pNext;
+    p->pNext = 0;
+    for(i=0; aSlot[i]; i++){
+      p = kvsortMergeLists(aSlot[i], p);
+      aSlot[i] = 0;
+    }
+    aSlot[i] = p;
+  }
+  p = 0;
+  for(i=0; i<ArraySize(aSlot); i++){
+    p = kvsortMergeLists(aSlot[i], p);
+  }
+  return p;
+}
+
+/*
+** Free all arena chunks and forget the in-memory record list.
+*/
+static void kvsortFreeMemory(KVSort *p){
+  KVSortChunk *pChunk;
+  KVSortChunk *pNext;
+  for(pChunk=p->pChunk; pChunk; pChunk=pNext){
+    pNext = pChunk->pNext;
+    sqlite4_free(p->base.pEnv, pChunk);
+  }
+  p->pChunk = 0;
+  p->pList = 0;
+  p->bSorted = 1;
+  p->nMem = 0;
+}
+
+/*
+** Allocate nByte bytes from the arena. Return NULL if a malloc fails.
+*/
+static void *kvsortArenaAlloc(KVSort *p, int nByte){
+  KVSortChunk *pChunk = p->pChunk;
+  void *pRet;
+
+  nByte = ROUND8(nByte);
+  if( pChunk==0 || pChunk->nAlloc-pChunk->nUsed<nByte ){
+    int nAlloc = MAX(nByte, KVSORT_CHUNK_SIZE - ROUND8(sizeof(KVSortChunk)));
+    pChunk = sqlite4_malloc(p->base.pEnv, ROUND8(sizeof(KVSortChunk))+nAlloc);
+    if( pChunk==0 ) return 0;
+    pChunk->pNext = p->pChunk;
+    pChunk->nAlloc = nAlloc;
+    pChunk->nUsed = 0;
+    p->pChunk = pChunk;
+  }
+  pRet = &((u8*)pChunk)[ROUND8(sizeof(KVSortChunk)) + pChunk->nUsed];
+  pChunk->nUsed += nByte;
+  return pRet;
+}
+
+/*
+** Append a run to the KVSort.aRun[] array.
+*/
+static int kvsortAddRun(KVSort *p, i64 iStart, i64 iEnd){
+  if( p->nRun==p->nRunAlloc ){
+    int nNew = p->nRunAlloc ? p->nRunAlloc*2 : 16;
+    KVSortRun *aNew;
+    aNew = sqlite4_realloc(p->base.pEnv, p->aRun, nNew*sizeof(KVSortRun));
+    if( aNew==0 ) return SQLITE4_NOMEM;
+    p->aRun = aNew;
+    p->nRunAlloc = nNew;
+  }
+  p->aRun[p->nRun].iStart = iStart;
+  p->aRun[p->nRun].iEnd = iEnd;
+  p->nRun++;
+  return SQLITE4_OK;
+}
+
+/*
+** Write the contents of the write buffer to the temporary file.
+*/
+static int kvsortFlush(KVSort *p){
+  if( p->nWrite>0 ){
+    i64 iOff = p->iEof - p->nWrite;
+    int rc = p->pVfs->xWrite(p->pFile, iOff, p->aWrite, p->nWrite);
+    if( rc!=LSM_OK ) return SQLITE4_IOERR;
+    p->nWrite = 0;
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Append n bytes of data to the end of the temporary file. The data is
+** buffered in aWrite[] unless it is larger than the buffer.
+*/
+static int kvsortWrite(KVSort *p, const u8 *aData, int n){
+  if( p->nWrite+n>KVSORT_WRITE_SIZE ){
+    int rc = kvsortFlush(p);
+    if( rc!=SQLITE4_OK ) return rc;
+    if( n>KVSORT_WRITE_SIZE ){
+      rc = p->pVfs->xWrite(p->pFile, p->iEof, (void*)aData, n);
+      if( rc!=LSM_OK ) return SQLITE4_IOERR;
+      p->iEof += n;
+      return SQLITE4_OK;
+    }
+  }
+  memcpy(&p->aWrite[p->nWrite], aData, n);
+  p->nWrite += n;
+  p->iEof += n;
+  return SQLITE4_OK;
+}
+
+/*
+** Write a single record to the end of the temporary file.
+*/
+static int kvsortWriteRecord(
+  KVSort *p,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  u8 aHdr[18];
+  int nHdr;
+  int rc;
+  nHdr = sqlite4PutVarint64(aHdr, nKey);
+  nHdr += sqlite4PutVarint64(&aHdr[nHdr], nData);
+  rc = kvsortWrite(p, aHdr, nHdr);
+  if( rc==SQLITE4_OK ) rc = kvsortWrite(p, aKey, nKey);
+  if( rc==SQLITE4_OK ) rc = kvsortWrite(p, aData, nData);
+  return rc;
+}
+
+/*
+** Create the temporary file. Return SQLITE4_OK if successful, or an
+** error code otherwise.
+*/
+static int kvsortOpenFile(KVSort *p){
+  sqlite4_env *pEnv = p->base.pEnv;
+  if( p->aWrite==0 ){
+    p->aWrite = sqlite4_malloc(pEnv, KVSORT_WRITE_SIZE);
+    if( p->aWrite==0 ) return SQLITE4_NOMEM;
+  }
+  p->zFile = sqlite4OsTempName(pEnv, "sqlite4_sort");
+  if( p->zFile==0 ) return SQLITE4_NOMEM;
+  p->pVfs = lsm_default_env();
+  if( p->pVfs->xOpen(p->pVfs, p->zFile, 0, &p->pFile)!=LSM_OK ){
+    p->pFile = 0;
+    sqlite4_free(pEnv, p->zFile);
+    p->zFile = 0;
+    return SQLITE4_CANTOPEN;
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Sort the in-memory records and write them to the temporary file as a
+** new run. If the temporary file cannot be opened, an error is returned
+** and the records are left in memory.
+*/
+static int kvsortSpill(KVSort *p){
+  KVSortRecord *pRec;
+  i64 iStart;
+  int rc = SQLITE4_OK;
+
+  if( p->pFile==0 ){
+    rc = kvsortOpenFile(p);
+    if( rc!=SQLITE4_OK ) return rc;
+  }
+
+  iStart = p->iEof;
+  p->pList = kvsortSortList(p->pList);
+  for(pRec=p->pList; rc==SQLITE4_OK && pRec; pRec=pRec->pNext){
+    rc = kvsortWriteRecord(p, kvsortRecKey(pRec), pRec->nKey,
+                           kvsortRecData(pRec), pRec->nData);
+  }
+  if( rc==SQLITE4_OK ) rc = kvsortFlush(p);
+  if( rc==SQLITE4_OK ) rc = kvsortAddRun(p, iStart, p->iEof);
+  if( rc==SQLITE4_OK ){
+    kvsortFreeMemory(p);
+  }else{
+    p->bSorted = 1;
+    p->iEof = iStart;
+    p->nWrite = 0;
+  }
+  return rc;
+}
+
+/*
+** Make sure that at least n bytes of the next record of run source pSrc
+** are available in the buffer, starting at pSrc->aBuf[pSrc->iBuf]. If
+** bPartial is true, it is not an error if fewer than n bytes remain in
+** the run.
+*/
+static int kvsortSourceFill(
+  sqlite4_env *pEnv,
+  KVSortSource *pSrc,
+  int n,
+  int bPartial
+){
+  int nAvail = pSrc->nBuf - pSrc->iBuf;
+  if( nAvail<n && pSrc->iNext<pSrc->iEnd ){
+    int nRead;
+    if( pSrc->iBuf>0 ){
+      memmove(pSrc->aBuf, &pSrc->aBuf[pSrc->iBuf], nAvail);
+      pSrc->nBuf = nAvail;
+      pSrc->iBuf = 0;
+    }
+    if( pSrc->nAlloc<n ){
+      int nNew = MAX(n, KVSORT_READ_SIZE);
+      u8 *aNew = sqlite4_realloc(pEnv, pSrc->aBuf, nNew);
+      if( aNew==0 ) return SQLITE4_NOMEM;
+      pSrc->aBuf = aNew;
+      pSrc->nAlloc = nNew;
+    }
+    nRead = pSrc->nAlloc - pSrc->nBuf;
+    if( nRead > pSrc->iEnd - pSrc->iNext ){
+      nRead = (int)(pSrc->iEnd - pSrc->iNext);
+    }
+    if( pSrc->pVfs->xRead(
+          pSrc->pFile, pSrc->iNext, &pSrc->aBuf[pSrc->nBuf], nRead)!=LSM_OK
+    ){
+      return SQLITE4_IOERR;
+    }
+    pSrc->nBuf += nRead;
+    pSrc->iNext += nRead;
+    nAvail += nRead;
+  }
+  if( nAvail<n && bPartial==0 ) return SQLITE4_CORRUPT_BKPT;
+  return SQLITE4_OK;
+}
+
+/*
+** Advance source pSrc to its next record. Set pSrc->bEof if there are
+** no more records.
+*/
+static int kvsortSourceNext(sqlite4_env *pEnv, KVSortSource *pSrc){
+  if( pSrc->pFile==0 ){
+    KVSortRecord *pRec = pSrc->pRec;
+    if( pRec==0 ){
+      pSrc->bEof = 1;
+    }else{
+      pSrc->aKey = kvsortRecKey(pRec);
+      pSrc->nKey = pRec->nKey;
+      pSrc->aData = kvsortRecData(pRec);
+      pSrc->nData = pRec->nData;
+      pSrc->pRec = pRec->pNext;
+    }
+  }else{
+    u64 nKey;
+    u64 nData;
+    int nHdr;
+    int rc;
+
+    /* Skip past the current record, if any */
+    pSrc->iBuf += (pSrc->aKey ? (int)(pSrc->nKey + pSrc->nData) : 0);
+    pSrc->aKey = 0;
+    pSrc->aData = 0;
+    if( pSrc->iBuf==pSrc->nBuf && pSrc->iNext==pSrc->iEnd ){
+      pSrc->bEof = 1;
+      return SQLITE4_OK;
+    }
+
+    rc = kvsortSourceFill(pEnv, pSrc, 18, 1);
+    if( rc!=SQLITE4_OK ) return rc;
+    nHdr = sqlite4GetVarint64(
+        &pSrc->aBuf[pSrc->iBuf], pSrc->nBuf-pSrc->iBuf, &nKey
+    );
+    if( nHdr>0 ){
+      int n = sqlite4GetVarint64(
+          &pSrc->aBuf[pSrc->iBuf+nHdr], pSrc->nBuf-pSrc->iBuf-nHdr, &nData
+      );
+      nHdr = (n>0 ? nHdr+n : 0);
+    }
+    if( nHdr==0 ) return SQLITE4_CORRUPT_BKPT;
+    pSrc->iBuf += nHdr;
+
+    rc = kvsortSourceFill(pEnv, pSrc, (int)(nKey+nData), 0);
+    if( rc!=SQLITE4_OK ) return rc;
+    pSrc->aKey = &pSrc->aBuf[pSrc->iBuf];
+    pSrc->nKey = (KVSize)nKey;
+    pSrc->aData = &pSrc->aBuf[pSrc->iBuf + nKey];
+    pSrc->nData = (KVSize)nData;
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Return true if the current record of source aSrc[i1] should be
+** returned before that of aSrc[i2]. Ties are broken in favour of the
+** source with the smaller index (the older run).
+*/
+static int kvsortSourceLess(KVSortSource *aSrc, int i1, int i2){
+  KVSortSource *p1 = &aSrc[i1];
+  KVSortSource *p2 = &aSrc[i2];
+  int c = kvsortKeyCompare(p1->aKey, p1->nKey, p2->aKey, p2->nKey);
+  return (c<0 || (c==0 && i1<i2));
+}
+
+/*
+** Restore the heap property for the sub-tree rooted at aHeap[i].
+*/
+static void kvsortHeapSiftDown(KVSortCursor *pCsr, int i){
+  int *aHeap = pCsr->aHeap;
+  while( 1 ){
+    int iMin = i;
+    int iChild = i*2 + 1;
+    int t;
+    if( iChild<pCsr->nHeap
+     && kvsortSourceLess(pCsr->aSrc, aHeap[iChild], aHeap[iMin])
+    ){
+      iMin = iChild;
+    }
+    iChild++;
+    if( iChild<pCsr->nHeap
+     && kvsortSourceLess(pCsr->aSrc, aHeap[iChild], aHeap[iMin])
+    ){
+      iMin = iChild;
+    }
+    if( iMin==i ) break;
+    t = aHeap[i];
+    aHeap[i] = aHeap[iMin];
+    aHeap[iMin] = t;
+    i = iMin;
+  }
+}
+
+/*
+** Release all merge resources held by cursor pCsr. The cursor is left
+** pointing at nothing.
+*/
+static void kvsortCursorClear(KVSortCursor *pCsr){
+  sqlite4_env *pEnv = pCsr->base.pEnv;
+  int i;
+  for(i=0; i<pCsr->nSrc; i++){
+    sqlite4_free(pEnv, pCsr->aSrc[i].aBuf);
+  }
+  sqlite4_free(pEnv, pCsr->aSrc);
+  sqlite4_free(pEnv, pCsr->aHeap);
+  pCsr->aSrc = 0;
+  pCsr->aHeap = 0;
+  pCsr->nSrc = 0;
+  pCsr->nHeap = 0;
+}
+
+/*
+** Configure cursor pCsr to merge runs iFirst to iFirst+nRun-1 of the
+** owner sorter, along with the in-memory list if bMem is true. Position
+** the cursor on the first record in the merged output.
+*/
+static int kvsortCursorInit(
+  KVSortCursor *pCsr,
+  int iFirst,
+  int nRun,
+  int bMem
+){
+  KVSort *p = pCsr->pOwner;
+  sqlite4_env *pEnv = p->base.pEnv;
+  int nSrc = nRun + (bMem!=0);
+  int rc = SQLITE4_OK;
+  int i;
+
+  kvsortCursorClear(pCsr);
+  pCsr->aSrc = sqlite4_malloc(pEnv, sizeof(KVSortSource)*(nSrc+1));
+  pCsr->aHeap = sqlite4_malloc(pEnv, sizeof(int)*(nSrc+1));
+  if( pCsr->aSrc==0 || pCsr->aHeap==0 ){
+    kvsortCursorClear(pCsr);
+    return SQLITE4_NOMEM;
+  }
+  memset(pCsr->aSrc, 0, sizeof(KVSortSource)*nSrc);
+  pCsr->nSrc = nSrc;
+
+  for(i=0; i<nRun; i++){
+    KVSortSource *pSrc = &pCsr->aSrc[i];
+    pSrc->pVfs = p->pVfs;
+    pSrc->pFile = p->pFile;
+    pSrc->iNext = p->aRun[iFirst+i].iStart;
+    pSrc->iEnd = p->aRun[iFirst+i].iEnd;
+  }
+  if( bMem ) pCsr->aSrc[nRun].pRec = p->pList;
+
+  for(i=0; rc==SQLITE4_OK && i<nSrc; i++){
+    rc = kvsortSourceNext(pEnv, &pCsr->aSrc[i]);
+    if( pCsr->aSrc[i].bEof==0 ) pCsr->aHeap[pCsr->nHeap++] = i;
+  }
+  for(i=pCsr->nHeap/2-1; rc==SQLITE4_OK && i>=0; i--){
+    kvsortHeapSiftDown(pCsr, i);
+  }
+  if( rc!=SQLITE4_OK ) kvsortCursorClear(pCsr);
+  return rc;
+}
+
+/*
+** Advance cursor pCsr to the next record in the merged output.
+*/
+static int kvsortCursorAdvance(KVSortCursor *pCsr){
+  int rc;
+  int iSrc = pCsr->aHeap[0];
+  KVSortSource *pSrc = &pCsr->aSrc[iSrc];
+
+  rc = kvsortSourceNext(pCsr->base.pEnv, pSrc);
+  if( rc==SQLITE4_OK ){
+    if( pSrc->bEof ){
+      pCsr->aHeap[0] = pCsr->aHeap[--pCsr->nHeap];
+    }
+    kvsortHeapSiftDown(pCsr, 0);
+  }
+  return rc;
+}
+
+/*
+** Reduce the number of runs in the temporary file to at most nMax by
+** merging the oldest runs together.
+*/
+static int kvsortReduceRuns(KVSort *p, KVSortCursor *pCsr, int nMax){
+  int rc = SQLITE4_OK;
+  while( rc==SQLITE4_OK && p->nRun>nMax ){
+    int nMerge = MIN(KVSORT_MAX_MERGE, p->nRun - nMax + 1);
+    i64 iStart = p->iEof;
+
+    rc = kvsortCursorInit(pCsr, 0, nMerge, 0);
+    while( rc==SQLITE4_OK && pCsr->nHeap>0 ){
+      KVSortSource *pSrc = &pCsr->aSrc[pCsr->aHeap[0]];
+      rc = kvsortWriteRecord(
+          p, pSrc->aKey, pSrc->nKey, pSrc->aData, pSrc->nData
+      );
+      if( rc==SQLITE4_OK ) rc = kvsortCursorAdvance(pCsr);
+    }
+    if( rc==SQLITE4_OK ) rc = kvsortFlush(p);
+    kvsortCursorClear(pCsr);
+    if( rc==SQLITE4_OK ){
+      p->nRun -= nMerge;
+      memmove(p->aRun, &p->aRun[nMerge], p->nRun*sizeof(KVSortRun));
+      rc = kvsortAddRun(p, iStart, p->iEof);
+    }else{
+      p->iEof = iStart;
+      p->nWrite = 0;
+    }
+  }
+  return rc;
+}
+
+/*
+** Reset any open cursors on sorter p. This is done before the contents of
+** the sorter are modified.
+*/
+static void kvsortResetCursors(KVSort *p){
+  KVSortCursor *pCsr;
+  for(pCsr=p->pCsr; pCsr; pCsr=pCsr->pCsrNext){
+    kvsortCursorClear(pCsr);
+  }
+}
+
+/*
+** Add a new record to the sorter.
+*/
+static int kvsortReplace(
+  KVStore *pKVStore,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  KVSort *p = (KVSort*)pKVStore;
+  KVSortRecord *pRec;
+  int nByte = sizeof(KVSortRecord) + nKey + nData;
+
+  kvsortResetCursors(p);
+  pRec = (KVSortRecord*)kvsortArenaAlloc(p, nByte);
+  if( pRec==0 ) return SQLITE4_NOMEM;
+  pRec->nKey = nKey;
+  pRec->nData = nData;
+  memcpy(kvsortRecKey(pRec), aKey, nKey);
+  memcpy(kvsortRecData(pRec), aData, nData);
+  pRec->pNext = p->pList;
+  p->pList = pRec;
+  p->bSorted = 0;
+  p->bReady = 0;
+  p->nMem += ROUND8(nByte);
+
+  if( p->nMem>p->nMaxMem ){
+    return kvsortSpill(p);
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Create a new cursor object.
+*/
+static int kvsortOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
+  KVSort *p = (KVSort*)pKVStore;
+  KVSortCursor *pCsr;
+  pCsr = sqlite4_malloc(p->base.pEnv, sizeof(*pCsr));
+  if( pCsr==0 ){
+    *ppKVCursor = 0;
+    return SQLITE4_NOMEM;
+  }
+  memset(pCsr, 0, sizeof(*pCsr));
+  pCsr->pOwner = p;
+  pCsr->pCsrNext = p->pCsr;
+  p->pCsr = pCsr;
+  pCsr->base.pStore = pKVStore;
+  pCsr->base.pStoreVfunc = pKVStore->pStoreVfunc;
+  *ppKVCursor = (KVCursor*)pCsr;
+  return SQLITE4_OK;
+}
+
+/*
+** Reset a cursor
+*/
+static int kvsortReset(KVCursor *pKVCursor){
+  kvsortCursorClear((KVSortCursor*)pKVCursor);
+  return SQLITE4_OK;
+}
+
+/*
+** Destroy a cursor object
+*/
+static int kvsortCloseCursor(KVCursor *pKVCursor){
+  KVSortCursor *pCsr = (KVSortCursor*)pKVCursor;
+  if( pCsr ){
+    KVSortCursor **pp;
+    for(pp=&pCsr->pOwner->pCsr; *pp!=pCsr; pp=&(*pp)->pCsrNext);
+    *pp = pCsr->pCsrNext;
+    kvsortCursorClear(pCsr);
+    sqlite4_free(pCsr->base.pEnv, pCsr);
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Move a cursor to the next entry.
+*/
+static int kvsortNextEntry(KVCursor *pKVCursor){
+  KVSortCursor *pCsr = (KVSortCursor*)pKVCursor;
+  int rc;
+  if( pCsr->nHeap==0 ) return SQLITE4_NOTFOUND;
+  rc = kvsortCursorAdvance(pCsr);
+  if( rc==SQLITE4_OK && pCsr->nHeap==0 ) rc = SQLITE4_NOTFOUND;
+  return rc;
+}
+
+/*
+** A sorter may only be scanned in the forward direction.
+*/
+static int kvsortPrevEntry(KVCursor *pKVCursor){
+  return SQLITE4_MISUSE;
+}
+
+/*
+** Prepare sorter p to be read, after records have been added to it. The
+** in-memory records are sorted, and if there are too many runs in the
+** temporary file to merge in a single pass, they are first merged into
+** larger runs. Cursor pCsr is used for those merges.
+**
+** This is done by the first seek after the sorter is written. Subsequent
+** seeks reuse the result until more records are added.
+*/
+static int kvsortPrepare(KVSort *p, KVSortCursor *pCsr){
+  int rc = SQLITE4_OK;
+  if( p->bSorted==0 ){
+    p->pList = kvsortSortList(p->pList);
+    p->bSorted = 1;
+  }
+  if( p->nRun>0 ){
+    rc = kvsortReduceRuns(p, pCsr, KVSORT_MAX_MERGE - (p->pList!=0));
+  }
+  if( rc==SQLITE4_OK ) p->bReady = 1;
+  return rc;
+}
+
+/*
+** Seek a cursor. Only seeks for the smallest key greater than or equal
+** to the probe (direction>0) or for an exact match (direction==0) are
+** supported.
+**
+** If the cursor already points to a key no larger than the probe, it
+** steps forward from its current position. Otherwise it starts a new
+** k-way merge of the runs and the in-memory records, then steps forward
+** past all keys smaller than the probe key. The VDBE only ever seeks to
+** the start of a sorter, so this is cheap in practice.
+*/
+static int kvsortSeek(
+  KVCursor *pKVCursor,
+  const KVByteArray *aKey,
+  KVSize nKey,
+  int direction
+){
+  KVSortCursor *pCsr = (KVSortCursor*)pKVCursor;
+  KVSort *p = pCsr->pOwner;
+  int rc = SQLITE4_OK;
+
+  if( direction<0 ) return SQLITE4_MISUSE;
+
+  if( p->bReady==0 ){
+    rc = kvsortPrepare(p, pCsr);
+  }
+  if( rc==SQLITE4_OK && pCsr->nHeap>0 ){
+    KVSortSource *pSrc = &pCsr->aSrc[pCsr->aHeap[0]];
+    if( kvsortKeyCompare(pSrc->aKey, pSrc->nKey, aKey, nKey)>0 ){
+      kvsortCursorClear(pCsr);
+    }
+  }
+  if( rc==SQLITE4_OK && pCsr->nHeap==0 ){
+    rc = kvsortCursorInit(pCsr, 0, p->nRun, p->pList!=0);
+  }
+  while( rc==SQLITE4_OK && pCsr->nHeap>0 ){
+    KVSortSource *pSrc = &pCsr->aSrc[pCsr->aHeap[0]];
+    int c = kvsortKeyCompare(pSrc->aKey, pSrc->nKey, aKey, nKey);
+    if( c>=0 ){
+      if( c==0 ) return SQLITE4_OK;
+      if( direction==0 ) break;
+      return SQLITE4_INEXACT;
+    }
+    rc = kvsortCursorAdvance(pCsr);
+  }
+  if( rc==SQLITE4_OK ){
+    kvsortCursorClear(pCsr);
+    rc = SQLITE4_NOTFOUND;
+  }
+  return rc;
+}
+
+/*
+** Records may not be deleted from a sorter.
+*/
+static int kvsortDelete(KVCursor *pKVCursor){
+  return SQLITE4_MISUSE;
+}
+
+/*
+** Return the key of the entry the cursor is pointing to.
+*/
+static int kvsortKey(
+  KVCursor *pKVCursor,         /* The cursor whose key is desired */
+  const KVByteArray **paKey,   /* Make this point to the key */
+  KVSize *pN                   /* Make this point to the size of the key */
+){
+  KVSortCursor *pCsr = (KVSortCursor*)pKVCursor;
+  KVSortSource *pSrc;
+  if( pCsr->nHeap==0 ){
+    *paKey = 0;
+    *pN = 0;
+    return SQLITE4_DONE;
+  }
+  pSrc = &pCsr->aSrc[pCsr->aHeap[0]];
+  *paKey = pSrc->aKey;
+  *pN = pSrc->nKey;
+  return SQLITE4_OK;
+}
+
+/*
+** Return the data of the entry the cursor is pointing to.
+*/
+static int kvsortData(
+  KVCursor *pKVCursor,         /* The cursor from which to take the data */
+  KVSize ofst,                 /* Offset into the data to begin reading */
+  KVSize n,                    /* Number of bytes requested */
+  const KVByteArray **paData,  /* Pointer to the data written here */
+  KVSize *pNData               /* Number of bytes delivered */
+){
+  KVSortCursor *pCsr = (KVSortCursor*)pKVCursor;
+  KVSortSource *pSrc;
+  if( pCsr->nHeap==0 ){
+    *paData = 0;
+    *pNData = 0;
+    return SQLITE4_DONE;
+  }
+  pSrc = &pCsr->aSrc[pCsr->aHeap[0]];
+  *paData = pSrc->aData + ofst;
+  *pNData = pSrc->nData - ofst;
+  return SQLITE4_OK;
+}
+
+/*
+** A sorter does not support transactions. The transaction methods just
+** record the current transaction level.
+*/
+static int kvsortBegin(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvsortCommitPhaseOne(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+static int kvsortCommitPhaseTwo(KVStore *pKVStore, int iLevel){
+  if( pKVStore->iTransLevel>iLevel ) pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvsortRollback(KVStore *pKVStore, int iLevel){
+  if( pKVStore->iTransLevel>iLevel ) pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvsortRevert(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+
+/*
+** Destructor for the sorter.
+*/
+static int kvsortClose(KVStore *pKVStore){
+  KVSort *p = (KVSort*)pKVStore;
+  sqlite4_env *pEnv;
+  if( p==0 ) return SQLITE4_OK;
+  assert( p->pCsr==0 );
+  pEnv = p->base.pEnv;
+  kvsortFreeMemory(p);
+  if( p->pFile ){
+    p->pVfs->xClose(p->pFile);
+    p->pVfs->xUnlink(p->pVfs, p->zFile);
+  }
+  sqlite4_free(pEnv, p->zFile);
+  sqlite4_free(pEnv, p->aWrite);
+  sqlite4_free(pEnv, p->aRun);
+  memset(p, 0, sizeof(*p));
+  sqlite4_free(pEnv, p);
+  return SQLITE4_OK;
+}
+
+static int kvsortControl(KVStore *pKVStore, int op, void *pArg){
+  KVSort *p = (KVSort*)pKVStore;
+  if( op==SQLITE4_KVCTRL_MAXMEM ){
+    int *pnMax = (int *)pArg;
+    if( *pnMax>0 ) p->nMaxMem = *pnMax;
+    *pnMax = (int)p->nMaxMem;
+    return SQLITE4_OK;
+  }
+  return SQLITE4_NOTFOUND;
+}
+
+static int kvsortGetMeta(KVStore *pKVStore, unsigned int *piVal){
+  KVSort *p = (KVSort*)pKVStore;
+  *piVal = p->iMeta;
+  return SQLITE4_OK;
+}
+
+static int kvsortPutMeta(KVStore *pKVStore, unsigned int iVal){
+  KVSort *p = (KVSort*)pKVStore;
+  p->iMeta = iVal;
+  return SQLITE4_OK;
+}
+
+/* Virtual methods for the sorter */
+static const KVStoreMethods kvsortMethods = {
+  7,                        /* iVersion */
+  sizeof(KVStoreMethods),   /* szSelf */
+  kvsortReplace,            /* xReplace */
+  kvsortOpenCursor,         /* xOpenCursor */
+  kvsortSeek,               /* xSeek */
+  kvsortNextEntry,          /* xNext */
+  kvsortPrevEntry,          /* xPrev */
+  kvsortDelete,             /* xDelete */
+  kvsortKey,                /* xKey */
+  kvsortData,               /* xData */
+  kvsortReset,              /* xReset */
+  kvsortCloseCursor,        /* xCloseCursor */
+  kvsortBegin,              /* xBegin */
+  kvsortCommitPhaseOne,     /* xCommitPhaseOne */
+  kvsortCommitPhaseTwo,     /* xCommitPhaseTwo */
+  kvsortRollback,           /* xRollback */
+  kvsortRevert,             /* xRevert */
+  kvsortClose,              /* xClose */
+  kvsortControl,            /* xControl */
+  kvsortGetMeta,            /* xGetMeta */
+  kvsortPutMeta,            /* xPutMeta */
+  0,                        /* xGetMethod */
+  0,                        /* xSetPrefix */
+  0,                        /* xNextBatch */
+  0,                        /* xSplit */
+  0,                        /* xCloneReader */
+  0,                        /* xEstimateRange */
+  0                         /* xMultiGet */
+};
+
+/*
+** Create a new sorter and return a pointer to it.
+*/
+int sqlite4KVStoreOpenSorter(
+  sqlite4_env *pEnv,              /* Runtime environment */
+  KVStore **ppKVStore,            /* OUT: Write the new KVStore here */
+  const char *zName,              /* Name of sorter (ignored) */
+  unsigned openFlags              /* Flags */
+){
+  KVSort *pNew = sqlite4_malloc(pEnv, sizeof(*pNew) );
+  if( pNew==0 ) return SQLITE4_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->base.pStoreVfunc = &kvsortMethods;
+  pNew->base.pEnv = pEnv;
+  pNew->bSorted = 1;
+  pNew->nMaxMem = SQLITE4_SORTER_MAXMEM;
+  *ppKVStore = (KVStore*)pNew;
+  return SQLITE4_OK;
+}
@@ -23,6 +23,7 @@ extern "C" {
 /*
 ** Opaque handle types.
 */
+typedef struct lsm_backup lsm_backup;       /* Online backup handle */
 typedef struct lsm_compress lsm_compress;   /* Compression library functions */
 typedef struct lsm_compress_factory lsm_compress_factory;
 typedef struct lsm_cursor lsm_cursor;       /* Database cursor handle */
@@ -206,6 +207,15 @@ int lsm_config(lsm_db *, int, ...);
 **                 database file. Following recovery the database file
 **                 contains all successfully committed transactions.
 **
+**   In full mode, the log file is synced after the WRITER lock is
+**   released, so that a single sync may make the transactions committed
+**   by several concurrent connections durable. A connection that opens a
+**   read transaction while such a sync is outstanding waits for it (or 
+**   performs it) first, so that no connection ever reads data that is
+**   not yet durable. If the sync fails, lsm_commit() returns an error even
+**   though the transaction has already been committed to the in-memory
+**   tree.
+**
 ** LSM_CONFIG_AUTOWORK:
 **   A read/write integer parameter.
 **
@@ -245,6 +255,44 @@ int lsm_config(lsm_db *, int, ...);
 **   A read/write integer parameter. The minimum number of segments to
 **   merge together at a time. Default value 4.
 **
+** LSM_CONFIG_MERGE_POLICY:
+**   A read/write integer parameter. The strategy used to select the levels
+**   to merge together when lsm_work() is called or auto-work is enabled.
+**   Must be set to one of the following:
+**
+**   LSM_MERGE_TIERED: (the default) Runs of LSM_CONFIG_AUTOMERGE or more
+**     levels of similar age are merged together. This minimizes write
+**     amplification at the cost of read and space amplification.
+**
+**   LSM_MERGE_LEVELED: Each level is merged into the level below it until
+**     the lower level is at least LSM_CONFIG_SIZE_RATIO times the size of
+**     the upper. Level sizes then form a geometric series, which minimizes
+**     read and space amplification at the cost of write amplification.
+**
+**   LSM_MERGE_TIMEWINDOW: Levels are merged as for LSM_MERGE_TIERED until
+**     they reach the age configured by LSM_CONFIG_WINDOW_AGE. Each such
+**     level holds the data written during one window of time and is not
+**     merged again unless more than LSM_CONFIG_AUTOMERGE of them exist, in
+**     which case the oldest are merged together. This suits workloads that
+**     write mostly new keys, as each value is rewritten a bounded number 
+**     of times.
+**
+**   The policy used is that of the connection performing the work. Invoking
+**   lsm_work() with an nMerge argument of 1 merges all levels together
+**   regardless of the policy.
+**
+** LSM_CONFIG_SIZE_RATIO:
+**   A read/write integer parameter. The target ratio between the sizes of
+**   adjacent levels used by LSM_MERGE_LEVELED. Values smaller than 2 are
+**   ignored. Default value 10.
+**
+** LSM_CONFIG_WINDOW_AGE:
+**   A read/write integer parameter. The age at which LSM_MERGE_TIMEWINDOW
+**   stops merging a level with younger levels. A level created by a flush
+**   has age 0, and a level created by a merge has an age one greater than
+**   the oldest of its inputs. Values smaller than 1 are ignored. Default 
+**   value 2.
+**
 ** LSM_CONFIG_MAX_FREELIST:
 **   A read/write integer parameter. The maximum number of free-list 
 **   entries that are stored in a database checkpoint (the others are
@@ -281,6 +329,21 @@ int lsm_config(lsm_db *, int, ...);
 ** LSM_CONFIG_READONLY:
 **   A read/write boolean parameter. This parameter may only be set before
 **   lsm_open() is called.
+**
+** LSM_CONFIG_VALUE_LOG:
+**   A read/write integer parameter. If set to a value N greater than zero,
+**   values larger than N bytes are written to a separate value-log file 
+**   (named by appending "-vlog0" or "-vlog1" to the database file name) 
+**   and the database stores only a small pointer to each. This reduces 
+**   the amount of data rewritten by merges when values are large. The
+**   default value is 0 (no value-log).
+**
+** LSM_CONFIG_VALUE_LOG_SIZE:
+**   A read/write integer parameter. Once the value-log file grows larger
+**   than this many KB, a new value-log file is started. Merges then copy
+**   live values out of the old file, which is deleted once no snapshot 
+**   refers to it, reclaiming the space used by overwritten and deleted 
+**   values. The default value is 65536 (64MB).
 */
 #define LSM_CONFIG_AUTOFLUSH                1
 #define LSM_CONFIG_PAGE_SIZE                2
@@ -297,11 +360,20 @@ int lsm_config(lsm_db *, int, ...);
 #define LSM_CONFIG_GET_COMPRESSION         14
 #define LSM_CONFIG_SET_COMPRESSION_FACTORY 15
 #define LSM_CONFIG_READONLY                16
+#define LSM_CONFIG_MERGE_POLICY            17
+#define LSM_CONFIG_SIZE_RATIO              18
+#define LSM_CONFIG_WINDOW_AGE              19
+#define LSM_CONFIG_VALUE_LOG               20
+#define LSM_CONFIG_VALUE_LOG_SIZE          21
 
 #define LSM_SAFETY_OFF    0
 #define LSM_SAFETY_NORMAL 1
 #define LSM_SAFETY_FULL   2
 
+#define LSM_MERGE_TIERED     0
+#define LSM_MERGE_LEVELED    1
+#define LSM_MERGE_TIMEWINDOW 2
+
 /*
 ** CAPI: Compression and/or Encryption Hooks
 */
@@ -460,6 +532,48 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 **   This value should be followed by a single argument of type 
 **   (unsigned int *). If successful, the location pointed to is populated 
 **   with the database compression id before returning.
+**
+** LSM_INFO_AMPLIFICATION:
+**   This value should be followed by three arguments of type (int *) (for
+**   a total of five arguments). Assuming no error occurs, the locations
+**   pointed to are set to estimates of the write, read and space 
+**   amplification of the database, respectively, each multiplied by 100.
+**
+**   Write amplification is the total number of pages written to the 
+**   database file by flushes and merges divided by the number of pages 
+**   written by flushing in-memory trees to disk. It is measured from the
+**   time the database system was last opened (i.e. since the first 
+**   connection to the database was opened).
+**
+**   Read amplification is the number of sorted runs (in-memory trees and
+**   on-disk segments) that may need to be searched to find a single key.
+**
+**   Space amplification is the total size of all segments in the database
+**   file divided by the size of the oldest level. This is an upper bound
+**   on the ratio between the amount of space used and the amount that would
+**   be used if the database were fully merged.
+**
+**   The amount of merging that occurs, and therefore the balance between
+**   these three values, may be controlled using the LSM_CONFIG_MERGE_POLICY
+**   and LSM_CONFIG_AUTOMERGE parameters and the nMerge argument passed to 
+**   lsm_work().
+**
+** LSM_INFO_WRITE_STALLS:
+**   This value should be followed by two arguments of type (int *) (for
+**   a total of four arguments). The first is set to the number of times
+**   an in-memory tree could not be flushed to disk until existing segments
+**   had been merged, because the database already contained too many 
+**   levels. The second is set to the total number of pages written by 
+**   those merges. Both are measured from the time the database system was
+**   last opened.
+**
+**   Each such stall is incurred by whichever connection is writing when 
+**   the in-memory tree fills up. In auto-work mode, connections perform 
+**   extra merging as the number of un-merged levels approaches the limit
+**   in order to make stalls less likely. A steadily increasing stall count
+**   indicates that merging is not keeping up with the write rate - 
+**   consider increasing LSM_CONFIG_AUTOFLUSH or running lsm_work() from a 
+**   background thread or process.
 */
 #define LSM_INFO_NWRITE           1
 #define LSM_INFO_NREAD            2
@@ -474,6 +588,8 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 #define LSM_INFO_TREE_SIZE       11
 #define LSM_INFO_FREELIST_SIZE   12
 #define LSM_INFO_COMPRESSION_ID  13
+#define LSM_INFO_AMPLIFICATION   14
+#define LSM_INFO_WRITE_STALLS    15
 
 
 /* 
@@ -540,6 +656,40 @@ int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite);
 
 int lsm_flush(lsm_db *pDb);
 
+/*
+** CAPI: Bulk Loading a Database
+**
+** Write a stream of key/value pairs directly into a new database segment,
+** bypassing the log file and the in-memory tree. This is much faster than
+** lsm_insert() for large imports, as the data is written to disk once and
+** is not repeatedly merged with other segments.
+**
+** The xNext callback is invoked repeatedly to obtain the entries to write.
+** Each time it is called it should either set *ppKey, *pnKey, *ppVal and
+** *pnVal to point to the next key and value and return LSM_OK, or set 
+** *ppKey to NULL to indicate that there are no more entries. The buffers
+** need only remain valid until the next call to xNext. Keys must be 
+** returned in strictly ascending order (according to the configured 
+** comparison function). If they are not, or if xNext returns any value 
+** other than LSM_OK, the database is not modified and an error code is
+** returned (LSM_MISUSE in the case of an ordering violation).
+**
+** Before the new segment is written, the contents of the in-memory tree
+** are flushed to disk. The ingested entries therefore replace any existing
+** entries with the same keys. Once the new segment has been linked into
+** the database, it is checkpointed. Other connections see either all or
+** none of the ingested entries.
+**
+** Like lsm_flush(), this function may not be called while the connection
+** has an open transaction or cursor. LSM_MISUSE is returned in that case.
+*/
+int lsm_ingest(
+  lsm_db *pDb, 
+  int (*xNext)(void *pCtx, const void **ppKey, int *pnKey, 
+                           const void **ppVal, int *pnVal),
+  void *pCtx
+);
+
 /*
 ** Attempt to checkpoint the current database snapshot. Return an LSM
 ** error code if an error occurs or LSM_OK otherwise.
@@ -561,6 +711,123 @@ int lsm_checkpoint(lsm_db *pDb, int *pnKB);
 int lsm_csr_open(lsm_db *pDb, lsm_cursor **ppCsr);
 int lsm_csr_close(lsm_cursor *pCsr);
 
+/*
+** CAPI: Retained Snapshots
+**
+** lsm_snapshot_retain() retains the database snapshot currently visible
+** to the connection and sets *piId to an identifier for it. Until the
+** snapshot is released by lsm_snapshot_release(), no connection reuses the
+** database blocks it occupies, and lsm_csr_open_snapshot() may be used to
+** open cursors that read the database as it was when it was retained.
+** Each call to lsm_snapshot_retain() must be matched by a call to 
+** lsm_snapshot_release(). Snapshots are released automatically when the
+** connection is closed.
+**
+** A retained snapshot includes only data that had been flushed to the
+** database file when it was retained. To include all committed data, call
+** lsm_flush() first. 
+**
+** At most 8 distinct snapshots may be retained by all connections to a 
+** database at any one time. If this limit has been reached, LSM_BUSY is 
+** returned. Read-only connections may not retain snapshots.
+*/
+int lsm_snapshot_retain(lsm_db *pDb, lsm_i64 *piId);
+int lsm_snapshot_release(lsm_db *pDb, lsm_i64 iId);
+int lsm_csr_open_snapshot(lsm_db *pDb, lsm_i64 iId, lsm_cursor **ppCsr);
+
+/*
+** CAPI: Parallel Reads
+**
+** lsm_split() invokes callback xKey on up to (nSplit-1) keys that divide
+** the database keys that begin with prefix pPrefix/nPrefix into nSplit
+** roughly equal parts, in ascending order. Each key passed to xKey begins
+** with the prefix, but is not necessarily the key of a database entry. The
+** keys are read from the separators b-tree of the largest segment in the
+** database, so the parts are only balanced if most of the keys are stored
+** in that segment. If there are too few keys with the prefix to divide
+** them into nSplit parts, fewer keys are passed to xKey. If xKey returns 
+** other than LSM_OK, lsm_split() returns that value immediately.
+**
+** lsm_clone() opens a second connection to the database that pDb is 
+** connected to, using the same environment and configuration as pDb, 
+** and sets *ppNew to point to it. The new connection has a read 
+** transaction open on exactly the same snapshot, including the same 
+** version of the in-memory tree, as the read transaction open on pDb. It
+** may be used to read part of the database in parallel with pDb. The read
+** transaction remains open until the last cursor opened on the new 
+** connection is closed. The new connection shares the compression hooks 
+** of pDb, and so must be closed using lsm_close() before pDb is. If pDb 
+** does not have a read transaction open, or has a write transaction open,
+** LSM_BUSY is returned.
+*/
+int lsm_split(
+  lsm_db *pDb, 
+  const void *pPrefix, int nPrefix, 
+  int nSplit, 
+  int (*xKey)(void *pCtx, const void *pKey, int nKey), 
+  void *pCtx
+);
+int lsm_clone(lsm_db *pDb, lsm_db **ppNew);
+
+/*
+** CAPI: Range Size Estimates
+**
+** lsm_estimate() sets *pnRow to an estimate of the number of database keys
+** that are greater than or equal to pLo/nLo and smaller than pHi/nHi. If 
+** pHi is NULL, there is no upper bound. The estimate is computed from the
+** size of each segment and the position of the two keys within the 
+** separators b-tree of each segment, so it is cheap to compute but may be
+** far from exact. Entries in the in-memory tree are not counted. If no 
+** estimate can be made (because no segment is large enough to have a 
+** separators b-tree), *pnRow is set to -1.
+*/
+int lsm_estimate(
+  lsm_db *pDb, 
+  const void *pLo, int nLo, 
+  const void *pHi, int nHi, 
+  lsm_i64 *pnRow
+);
+
+/*
+** CAPI: Online Backup
+**
+** These functions copy a snapshot retained using lsm_snapshot_retain() 
+** out of the database while it remains in use by other connections.
+**
+** lsm_backup_open() prepares to copy retained snapshot iId. If iBase is 
+** zero, a full copy is made. Otherwise, iBase must be the id of an older
+** snapshot also retained by the connection, and only those blocks that
+** have been written since snapshot iBase are copied. Free blocks are never
+** copied.
+**
+** Each call to lsm_backup_step() sets *ppData and *pnData to point to a
+** buffer containing data that belongs at offset *piOff of a backup file.
+** *pzSuffix is set to point to a nul-terminated string to append to the
+** backup database file name to obtain the name of the file - "" for the
+** database file itself, or a value-log file suffix (see 
+** LSM_CONFIG_VALUE_LOG). The buffer remains valid until the next call to 
+** lsm_backup_step() or lsm_backup_close(). Once all data has been 
+** returned, *ppData is set to NULL. The last buffer returned contains the
+** database header, so that writing the buffers in order to a copy of the
+** database as it was at snapshot iBase (or to an empty file for a full 
+** backup) produces a database containing snapshot iId. The backup does 
+** not include a log file.
+**
+** A backup holds a reference to snapshot iId until it is closed. All
+** backups must be closed before the database connection is closed.
+*/
+int lsm_backup_open(
+  lsm_db *pDb, lsm_i64 iId, lsm_i64 iBase, lsm_backup **ppBackup
+);
+int lsm_backup_step(
+  lsm_backup *pBackup, 
+  const char **pzSuffix,
+  lsm_i64 *piOff, 
+  const void **ppData, 
+  int *pnData
+);
+int lsm_backup_close(lsm_backup *pBackup);
+
 /* 
 ** CAPI: Positioning Database Cursors
 **
@@ -634,6 +901,27 @@ int lsm_csr_last(lsm_cursor *pCsr);
 int lsm_csr_next(lsm_cursor *pCsr);
 int lsm_csr_prev(lsm_cursor *pCsr);
 
+/*
+** CAPI: Prefix Cursors
+**
+** Restrict the cursor to visiting entries whose keys begin with the
+** nPrefix byte prefix pPrefix. If nPrefix is zero, any existing restriction
+** is removed. The prefix is compared bytewise, so it is only useful with 
+** the default (memcmp() based) key comparison function.
+**
+** Setting a prefix does not move the cursor. Once one has been set, the
+** seek functions and lsm_csr_next() and lsm_csr_prev() operate as usual,
+** except that if the cursor is left pointing to an entry whose key does
+** not begin with the prefix it is considered to be at EOF - lsm_csr_valid()
+** returns zero. Because of this, iteration with lsm_csr_next() or 
+** lsm_csr_prev() halts as soon as the first key beyond the prefix is 
+** encountered, without searching for the next visible entry past it (which
+** may require stepping over arbitrarily many deleted keys).
+**
+** The prefix remains in effect until it is changed or the cursor closed.
+*/
+int lsm_csr_prefix(lsm_cursor *pCsr, const void *pPrefix, int nPrefix);
+
 /*
 ** Values that may be passed as the fourth argument to lsm_csr_seek().
 */
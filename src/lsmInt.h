@@ -53,6 +53,15 @@
 #define LSM_DFLT_MMAP               (LSM_IS_64_BIT ? 1 : 32768)
 #define LSM_DFLT_MULTIPLE_PROCESSES 1
 #define LSM_DFLT_USE_LOG            1
+#define LSM_DFLT_MERGE_POLICY       LSM_MERGE_TIERED
+#define LSM_DFLT_SIZE_RATIO         10
+#define LSM_DFLT_WINDOW_AGE         2
+#define LSM_DFLT_VALUE_LOG_SIZE     (64*1024)
+
+/* Largest value, in KB, that LSM_CONFIG_VALUE_LOG_SIZE may be set to. This
+** leaves room in the 32-bit offsets of value-log pointers for the values
+** appended while the previous value-log file is being collected.  */
+#define LSM_MAX_VALUE_LOG_SIZE      (1024*1024)
 
 /* Initial values for log file checksums. These are only used if the 
 ** database file does not contain a valid checkpoint.  */
@@ -72,6 +81,7 @@ typedef struct DbLog DbLog;
 typedef struct FileSystem FileSystem;
 typedef struct Freelist Freelist;
 typedef struct FreelistEntry FreelistEntry;
+typedef struct KeyRange KeyRange;
 typedef struct Level Level;
 typedef struct LogMark LogMark;
 typedef struct LogRegion LogRegion;
@@ -84,6 +94,7 @@ typedef struct MetaPage MetaPage;
 typedef struct MultiCursor MultiCursor;
 typedef struct Page Page;
 typedef struct Redirect Redirect;
+typedef struct Retained Retained;
 typedef struct Segment Segment;
 typedef struct SegmentMerger SegmentMerger;
 typedef struct ShmChunk ShmChunk;
@@ -130,12 +141,32 @@ int lsmErrorBkpt(int);
 /* The number of bytes reserved at the start of each shm chunk for MM. */
 #define LSM_SHM_CHUNK_HDR  (sizeof(ShmChunk))
 
-/* The number of available read locks. */
-#define LSM_LOCK_NREADER   6
+/* 
+** The number of available read locks. Each read transaction holds a 
+** SHARED lock on a READER slot. The slot records the snapshot and tree 
+** version that must not be recycled while the reader is using it. Readers
+** share a slot if they use the same version, and a reader may also use 
+** a slot that records an older version, provided the shared-memory that
+** version refers to has not been reused (see slotIsUsable()). So this
+** limits the number of versions that may be protected separately, not
+** the number of readers. If every slot holds a version too old to share,
+** lsmReadlock() fails with LSM_BUSY.
+**
+** The READER slots are lock regions, like all other locks. Each region 
+** needs one bit in each of the 64-bit masks lsm_db.mExcl and 
+** lsm_db.mShared, so LSM_LOCK_LAST may not be greater than 64. With 7
+** fixed locks, 32 READER, 16 RWCLIENT and 8 RETAIN slots, 63 regions are 
+** used. More READER slots would require a reader table in shared-memory
+** with its own slot allocator, instead of one lock region per slot.
+*/
+#define LSM_LOCK_NREADER   32
 
 /* The number of available read-write client locks. */
 #define LSM_LOCK_NRWCLIENT   16
 
+/* The number of available retained snapshot locks. */
+#define LSM_LOCK_NRETAIN   8
+
 /* Lock definitions. 
 */
 #define LSM_LOCK_DMS1         1   /* Serialize connect/disconnect ops */
@@ -147,6 +178,13 @@ int lsmErrorBkpt(int);
 #define LSM_LOCK_ROTRANS      7
 #define LSM_LOCK_READER(i)    ((i) + LSM_LOCK_ROTRANS + 1)
 #define LSM_LOCK_RWCLIENT(i)  ((i) + LSM_LOCK_READER(LSM_LOCK_NREADER))
+#define LSM_LOCK_RETAIN(i)    ((i) + LSM_LOCK_RWCLIENT(LSM_LOCK_NRWCLIENT))
+#define LSM_LOCK_LAST         LSM_LOCK_RETAIN(LSM_LOCK_NRETAIN-1)
+
+/* Each lock region uses one bit of the lsm_db.mExcl and mShared masks. */
+#if LSM_LOCK_LAST>64
+# error "LSM lock regions do not fit in the 64-bit lock masks"
+#endif
 
 /*
 ** Hard limit on the number of free-list entries that may be stored in 
@@ -172,6 +210,19 @@ int lsmErrorBkpt(int);
 #define LSM_SYSTEMKEY    0x20     /* True if entry is a system key (FREELIST) */
 
 #define LSM_CONTIGUOUS   0x40     /* Used in lsm_tree.c */
+#define LSM_VALUEPTR     0x80     /* Value is a pointer into the value log */
+
+/*
+** Size in bytes of the value stored in place of a large value when the
+** value-log is in use (LSM_CONFIG_VALUE_LOG). The generation number of
+** the value-log file, the offset of the value within that file and the
+** size of the value in bytes, each a 4-byte big-endian integer. See the
+** comments above lsmFsAppendVlog() for a description of generations.
+*/
+#define LSM_VALUEPTR_SIZE 12
+
+/* Size of the header at the start of each value-log file. */
+#define LSM_VLOG_HDRSIZE 8
 
 /*
 ** A string that can grow by appending.
@@ -267,6 +318,7 @@ struct TreeRoot {
   u32 nHeight;
   u32 nByte;                      /* Total size of this tree in bytes */
   u32 iTransId;
+  u32 iVlogGen;                   /* Oldest value-log generation used (or 0) */
 };
 
 /*
@@ -292,21 +344,21 @@ struct TreeHeader {
 /*
 ** Database handle structure.
 **
-** mLock:
-**   A bitmask representing the locks currently held by the connection.
+** mExcl, mShared:
+**   Bitmasks representing the locks currently held by the connection.
 **   An LSM database supports N distinct locks, where N is some number less
-**   than or equal to 32. Locks are numbered starting from 1 (see the 
+**   than or equal to 64. Locks are numbered starting from 1 (see the 
 **   definitions for LSM_LOCK_WRITER and co.).
 **
-**   The least significant 32-bits in mLock represent EXCLUSIVE locks. The
-**   most significant are SHARED locks. So, if a connection holds a SHARED
-**   lock on lock region iLock, then the following is true:
+**   Bit (iLock-1) of mShared is set if the connection holds a SHARED or
+**   EXCLUSIVE lock on lock region iLock. The same bit of mExcl is set if
+**   the lock is EXCLUSIVE. So, for a SHARED lock, the following is true:
 **
-**       (mLock & ((iLock+32-1) << 1))
+**       (mShared & ((u64)1 << (iLock-1)))
 **
 **   Or for an EXCLUSIVE lock:
 **
-**       (mLock & ((iLock-1) << 1))
+**       (mExcl & ((u64)1 << (iLock-1)))
 ** 
 ** pCsr:
 **   Points to the head of a linked list that contains all currently open
@@ -331,6 +383,9 @@ struct lsm_db {
   int bAutowork;                  /* Configured by LSM_CONFIG_AUTOWORK */
   int nTreeLimit;                 /* Configured by LSM_CONFIG_AUTOFLUSH */
   int nMerge;                     /* Configured by LSM_CONFIG_AUTOMERGE */
+  int eMergePolicy;               /* Configured by LSM_CONFIG_MERGE_POLICY */
+  int nSizeRatio;                 /* Configured by LSM_CONFIG_SIZE_RATIO */
+  int nWindowAge;                 /* Configured by LSM_CONFIG_WINDOW_AGE */
   int bUseLog;                    /* Configured by LSM_CONFIG_USE_LOG */
   int nDfltPgsz;                  /* Configured by LSM_CONFIG_PAGE_SIZE */
   int nDfltBlksz;                 /* Configured by LSM_CONFIG_BLOCK_SIZE */
@@ -339,6 +394,8 @@ struct lsm_db {
   i64 nAutockpt;                  /* Configured by LSM_CONFIG_AUTOCHECKPOINT */
   int bMultiProc;                 /* Configured by L_C_MULTIPLE_PROCESSES */
   int bReadonly;                  /* Configured by LSM_CONFIG_READONLY */
+  int nValueLog;                  /* Configured by LSM_CONFIG_VALUE_LOG */
+  int nVlogSize;                  /* Configured by LSM_CONFIG_VALUE_LOG_SIZE */
   lsm_compress compress;          /* Compression callbacks */
   lsm_compress_factory factory;   /* Compression callback factory */
 
@@ -361,6 +418,8 @@ struct lsm_db {
   int bDiscardOld;                /* True if lsmTreeDiscardOld() was called */
 
   MultiCursor *pCsrCache;         /* List of all closed cursors */
+  Retained *pRetained;            /* Snapshots retained by this connection */
+  int nBackup;                    /* Number of open lsm_backup handles */
 
   /* Worker context */
   Snapshot *pWorker;              /* Worker snapshot (or NULL) */
@@ -378,7 +437,8 @@ struct lsm_db {
   void (*xWork)(lsm_db *, void *);
   void *pWorkCtx;
 
-  u64 mLock;                      /* Mask of current locks. See lsmShmLock(). */
+  u64 mExcl;                      /* Mask of EXCLUSIVE locks. See lsmShmLock() */
+  u64 mShared;                    /* Mask of SHARED and EXCLUSIVE locks */
   lsm_db *pNext;                  /* Next connection to same database */
 
   int nShm;                       /* Size of apShm[] array */
@@ -412,7 +472,9 @@ struct Level {
 
   u16 iAge;                       /* Number of times data has been written */
   u16 flags;                      /* Mask of LEVEL_XXX bits */
+  u32 iVlogGen;                   /* Oldest value-log generation used (or 0) */
   Merge *pMerge;                  /* Merge operation currently underway */
+  KeyRange *pRange;               /* Cached key range of lhs (or NULL) */
   Level *pNext;                   /* Next level in tree */
 };
 
@@ -425,9 +487,15 @@ struct Level {
 ** LEVEL_INCOMPLETE:
 **   This is set while a new toplevel level is being constructed. It is
 **   never set for any level other than a new toplevel.
+**
+** LEVEL_VLOG:
+**   This flag is never set in Level.flags. It is set in the flags field of
+**   a level record within a checkpoint if the level contains pointers 
+**   into the value-log. See ckptExportLevel().
 */
 #define LEVEL_FREELIST_ONLY      0x0001
 #define LEVEL_INCOMPLETE         0x0002
+#define LEVEL_VLOG               0x0004
 
 
 /*
@@ -453,6 +521,7 @@ struct Merge {
   int nSkip;                      /* Number of separators entries to skip */
   int iOutputOff;                 /* Write offset on output page */
   Pgno iCurrentPtr;               /* Current pointer value */
+  u32 iVlogGen;                   /* Oldest vlog generation written to lhs */
 };
 
 /* 
@@ -489,6 +558,21 @@ struct ShmReader {
 ** hdr1, hdr2:
 **   The two copies of the in-memory tree header. Two copies are required
 **   in case a writer fails while updating one of them.
+**
+** iVlogGen, iVlogEnd, iVlogOld:
+**   The generation number of the value-log file currently being appended
+**   to, the offset of its end and the generation of the previous value-log
+**   file, if it has not yet been deleted. These are loaded from the
+**   value-log file headers by the first connection to use them (see
+**   lsmFsAppendVlog()) and may only be modified while holding the WRITER
+**   lock. Except that the checkpointer clears iVlogOld after deleting
+**   the previous value-log file.
+**
+** iVlogFree, iVlogFreeId:
+**   Set by a worker once no in-memory tree, and no level in the snapshot
+**   it is about to save, refers to value-log generation iVlogFree. The
+**   saved snapshot is assigned id (iVlogFreeId+1), so the file may be
+**   deleted once no client is using snapshot iVlogFreeId or older.
 */
 struct ShmHeader {
   u32 aSnap1[LSM_META_PAGE_SIZE / 4];
@@ -498,6 +582,19 @@ struct ShmHeader {
   TreeHeader hdr1;
   TreeHeader hdr2;
   ShmReader aReader[LSM_LOCK_NREADER];
+  i64 aRetain[LSM_LOCK_NRETAIN];  /* Snapshot ids retained by clients */
+  u32 nFlushWrite;                /* Pages written by in-memory tree flushes */
+  u32 nMergeWrite;                /* Pages written by merges */
+  u32 nStall;                     /* Flushes that had to merge first */
+  u32 nStallWrite;                /* Pages written by those merges */
+  u32 iLogCommit;                 /* Number of COMMIT records written to log */
+  u32 iLogSynced;                 /* Value of iLogCommit at last log sync */
+  u32 iLogDurable;                /* Last COMMIT that must be synced */
+  u32 iVlogGen;                   /* Current value-log generation (or 0) */
+  u32 iVlogEnd;                   /* Offset of end of current value-log */
+  u32 iVlogOld;                   /* Previous value-log generation (or 0) */
+  u32 iVlogFree;                  /* iVlogOld value once it may be deleted */
+  i64 iVlogFreeId;                /* Last snapshot that may use iVlogFree */
 };
 
 /*
@@ -573,6 +670,25 @@ struct Snapshot {
 };
 #define LSM_INITIAL_SNAPSHOT_ID 11
 
+/*
+** A snapshot retained using lsm_snapshot_retain(). Each connection has a
+** linked list of these objects, starting at lsm_db.pRetained.
+**
+** While the object exists the connection holds a SHARED lock on lock 
+** LSM_LOCK_RETAIN(iSlot), and ShmHeader.aRetain[iSlot] is set to iId. This
+** prevents worker clients from reusing any block that snapshot iId uses.
+*/
+struct Retained {
+  i64 iId;                        /* Snapshot id */
+  int iSlot;                      /* Index of RETAIN lock held */
+  int nRef;                       /* Number of lsm_snapshot_retain() calls */
+  Snapshot *pSnap;                /* Deserialized snapshot */
+  u32 *aCkpt;                     /* Serialized checkpoint for snapshot */
+  u32 aVlogGen[2];                /* See lsmFsVlogState() */
+  u32 aVlogEnd[2];                /* End offsets for aVlogGen[] */
+  Retained *pNext;                /* Next snapshot retained by connection */
+};
+
 /*
 ** Functions from file "lsm_ckpt.c".
 */
@@ -595,9 +711,11 @@ i64 lsmCheckpointId(u32 *, int);
 u32 lsmCheckpointNWrite(u32 *, int);
 i64 lsmCheckpointLogOffset(u32 *);
 int lsmCheckpointPgsz(u32 *);
+int lsmCheckpointNInt(u32 *);
 int lsmCheckpointBlksz(u32 *);
 void lsmCheckpointLogoffset(u32 *aCkpt, DbLog *pLog);
 void lsmCheckpointZeroLogoffset(lsm_db *);
+void lsmCheckpointBackupMeta(u32 *aCkpt, u8 *aPage);
 
 int lsmCheckpointSaveWorker(lsm_db *pDb, int);
 int lsmDatabaseFull(lsm_db *pDb);
@@ -625,6 +743,7 @@ int lsmTreeLoadHeader(lsm_db *pDb, int *);
 int lsmTreeLoadHeaderOk(lsm_db *, int);
 
 int lsmTreeInsert(lsm_db *pDb, void *pKey, int nKey, void *pVal, int nVal);
+int lsmTreeInsertValuePtr(lsm_db *pDb, void *pKey, int nKey, void *pPtr);
 int lsmTreeDelete(lsm_db *db, void *pKey1, int nKey1, void *pKey2, int nKey2);
 void lsmTreeRollback(lsm_db *pDb, TreeMark *pMark);
 void lsmTreeMark(lsm_db *pDb, TreeMark *pMark);
@@ -732,6 +851,9 @@ int lsmFsDbPageIsLast(Segment *pSeg, Page *pPg);
 int lsmFsIntegrityCheck(lsm_db *);
 #endif
 
+int lsmFsSnapshotBlocks(FileSystem *, Snapshot *, Snapshot *, int **, int *);
+int lsmFsReadBlock(FileSystem *, int, u8 *, i64 *, int *);
+
 Pgno lsmFsRedirectPage(FileSystem *, Redirect *, Pgno);
 
 int lsmFsPageWritable(Page *);
@@ -744,6 +866,18 @@ int lsmFsTruncateLog(FileSystem *pFS, i64 nByte);
 int lsmFsTruncateDb(FileSystem *pFS, i64 nByte);
 int lsmFsCloseAndDeleteLog(FileSystem *pFS);
 
+/* Functions to append to, read, sync and collect the value-log files. */
+int lsmFsAppendVlog(FileSystem *pFS, int bRotate, void *, int, u8 *aPtr);
+int lsmFsReadVlog(FileSystem *pFS, u8 *aPtr, void *pOut);
+int lsmFsSyncVlog(FileSystem *pFS, int bSync);
+int lsmFsRecoverVlog(FileSystem *pFS, u8 *aPtr);
+u32 lsmFsVlogOld(FileSystem *pFS);
+int lsmFsDeleteVlog(FileSystem *pFS, u32 iGen);
+int lsmFsVlogState(FileSystem *pFS, u32 *aGen, u32 *aEnd);
+const char *lsmFsVlogSuffix(u32 iGen);
+int lsmFsVlogHeader(u32 iGen, u32 iEnd, u8 *aHdr);
+int lsmFsReadVlogFile(FileSystem *, u32 iGen, u32 iOff, void *, int nRead);
+
 LsmFile *lsmFsDeferClose(FileSystem *pFS);
 
 /* And to sync the db file */
@@ -804,12 +938,19 @@ void *lsmSortedSplitKey(Level *pLevel, int *pnByte);
 void lsmSortedSaveTreeCursors(lsm_db *);
 
 int lsmMCursorNew(lsm_db *, MultiCursor **);
+int lsmMCursorNewSnapshot(lsm_db *, Snapshot *, MultiCursor **);
+int lsmSortedSplit(lsm_db *, void *, int, int, 
+    int (*)(void *, const void *, int), void *
+);
+int lsmSortedEstimate(lsm_db *, void *, int, void *, int, i64 *);
+int lsmMCursorUsesSnapshot(lsm_db *, Snapshot *);
 void lsmMCursorClose(MultiCursor *, int);
 int lsmMCursorSeek(MultiCursor *, int, void *, int , int);
 int lsmMCursorFirst(MultiCursor *);
 int lsmMCursorPrev(MultiCursor *);
 int lsmMCursorLast(MultiCursor *);
 int lsmMCursorValid(MultiCursor *);
+int lsmMCursorPrefix(MultiCursor *, void *, int);
 int lsmMCursorNext(MultiCursor *);
 int lsmMCursorKey(MultiCursor *, void **, int *);
 int lsmMCursorValue(MultiCursor *, void **, int *);
@@ -845,13 +986,16 @@ int lsmVarintSize(u8 c);
 */
 void lsmLogMessage(lsm_db *, int, const char *, ...);
 int lsmInfoFreelist(lsm_db *pDb, char **pzOut);
+int lsmDefaultCompare(void *, int, void *, int);
 
 /*
 ** Functions from file "lsm_log.c".
 */
 int lsmLogBegin(lsm_db *pDb);
-int lsmLogWrite(lsm_db *, void *, int, void *, int);
-int lsmLogCommit(lsm_db *);
+int lsmLogWrite(lsm_db *, int, void *, int, void *, int);
+int lsmLogCommit(lsm_db *, u32 *);
+int lsmLogSync(lsm_db *, u32);
+int lsmLogSyncDurable(lsm_db *);
 void lsmLogEnd(lsm_db *pDb, int bCommit);
 void lsmLogTell(lsm_db *, LogMark *);
 void lsmLogSeek(lsm_db *, LogMark *);
@@ -869,6 +1013,8 @@ int lsmDbDatabaseConnect(lsm_db*, const char *);
 void lsmDbDatabaseRelease(lsm_db *);
 
 int lsmBeginReadTrans(lsm_db *);
+int lsmBeginReadTransFrom(lsm_db *, lsm_db *);
+const char *lsmDbFilename(lsm_db *);
 int lsmBeginWriteTrans(lsm_db *);
 int lsmBeginFlush(lsm_db *);
 
@@ -932,11 +1078,19 @@ void lsmShmHasLock(lsm_db *db, int iLock, int eOp);
 
 int lsmReadlock(lsm_db *, i64 iLsm, u32 iShmMin, u32 iShmMax);
 
+int lsmRetainSnapshot(lsm_db *, i64 *);
+int lsmReleaseSnapshot(lsm_db *, i64);
+void lsmReleaseAllSnapshots(lsm_db *);
+Retained *lsmRetainedSnapshot(lsm_db *, i64);
+
 int lsmLsmInUse(lsm_db *db, i64 iLsmId, int *pbInUse);
 int lsmTreeInUse(lsm_db *db, u32 iLsmId, int *pbInUse);
 int lsmFreelistAppend(lsm_env *pEnv, Freelist *p, int iBlk, i64 iId);
 
 int lsmDbMultiProc(lsm_db *);
+int lsmDbHoldsWriter(lsm_db *);
+void lsmDbSyncMutexEnter(lsm_db *);
+void lsmDbSyncMutexLeave(lsm_db *);
 void lsmDbDeferredClose(lsm_db *, lsm_file *, LsmFile *);
 LsmFile *lsmDbRecycleFd(lsm_db *);
 
@@ -74,6 +74,9 @@
 **     7. Page containing current split-key (64-bits - 2 integers).
 **     8. Cell within page containing current split-key.
 **     9. Current pointer value (64-bits - 2 integers).
+**    10. If the LEVEL_VLOG flag is set, the oldest value-log generation
+**        referred to by the level. And, if nRight>0, the oldest value-log
+**        generation written to the left-hand segment by the merge.
 **
 **   The block redirect array:
 **
@@ -324,9 +327,11 @@ static void ckptExportLevel(
 ){
   int iOut = *piOut;
   Merge *pMerge;
+  u32 flags = pLevel->flags;
 
   pMerge = pLevel->pMerge;
-  ckptSetValue(p, iOut++, (u32)pLevel->iAge + (u32)(pLevel->flags<<16), pRc);
+  if( pLevel->iVlogGen || (pMerge && pMerge->iVlogGen) ) flags |= LEVEL_VLOG;
+  ckptSetValue(p, iOut++, (u32)pLevel->iAge + (flags<<16), pRc);
   ckptSetValue(p, iOut++, pLevel->nRight, pRc);
   ckptExportSegment(&pLevel->lhs, p, &iOut, pRc);
 
@@ -350,6 +355,11 @@ static void ckptExportLevel(
     ckptAppend64(p, &iOut, pMerge->iCurrentPtr, pRc);
   }
 
+  if( flags & LEVEL_VLOG ){
+    ckptSetValue(p, iOut++, pLevel->iVlogGen, pRc);
+    if( pMerge ) ckptSetValue(p, iOut++, pMerge->iVlogGen, pRc);
+  }
+
   *piOut = iOut;
 }
 
@@ -593,6 +603,13 @@ static int ckptLoadLevels(
         if( pLevel->nRight>0 ){
           rc = ckptSetupMerge(pDb, aIn, &iIn, pLevel);
         }
+
+        /* Load the value-log generations, if any */
+        if( rc==LSM_OK && (pLevel->flags & LEVEL_VLOG) ){
+          pLevel->flags &= ~LEVEL_VLOG;
+          pLevel->iVlogGen = aIn[iIn++];
+          if( pLevel->pMerge ) pLevel->pMerge->iVlogGen = aIn[iIn++];
+        }
       }
     }
   }
@@ -1183,6 +1200,8 @@ i64 lsmCheckpointLogOffset(u32 *aCkpt){
 
 int lsmCheckpointPgsz(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_PGSZ]; }
 
+int lsmCheckpointNInt(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_NCKPT]; }
+
 int lsmCheckpointBlksz(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_BLKSZ]; }
 
 void lsmCheckpointLogoffset(
@@ -1215,6 +1234,24 @@ void lsmCheckpointZeroLogoffset(lsm_db *pDb){
   memcpy(pDb->pShmhdr->aSnap2, pDb->aSnapshot, nCkpt*sizeof(u32));
 }
 
+/*
+** Write a copy of checkpoint aCkpt[] to buffer aPage[] (LSM_META_PAGE_SIZE
+** bytes in size) formatted as a database meta page. The log offset in the
+** copy is set to zero, as backups do not include a log file.
+*/
+void lsmCheckpointBackupMeta(u32 *aCkpt, u8 *aPage){
+  u32 nCkpt = aCkpt[CKPT_HDR_NCKPT];
+  u32 *aCopy = (u32 *)aPage;
+
+  assert( nCkpt>CKPT_HDR_NCKPT && nCkpt<=LSM_META_PAGE_SIZE/sizeof(u32) );
+  memset(aPage, 0, LSM_META_PAGE_SIZE);
+  memcpy(aCopy, aCkpt, nCkpt*sizeof(u32));
+  aCopy[CKPT_HDR_LO_MSW] = 0;
+  aCopy[CKPT_HDR_LO_LSW] = 0;
+  ckptChecksum(aCopy, nCkpt, &aCopy[nCkpt-2], &aCopy[nCkpt-1]);
+  ckptChangeEndianness(aCopy, nCkpt);
+}
+
 /*
 ** Set the output variable to the number of KB of data written into the
 ** database file since the most recent checkpoint.
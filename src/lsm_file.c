@@ -85,6 +85,43 @@
 **     lsmFsTruncateLog
 **     lsmFsCloseAndDeleteLog
 **
+** THE VALUE-LOG FILES
+**
+** If LSM_CONFIG_VALUE_LOG is set, values larger than the configured 
+** threshold are appended to a value-log file. The tree and database 
+** segments then store a small pointer to the value in place of the value
+** itself (see LSM_VALUEPTR in lsmInt.h). 
+**
+** Each value-log file has a generation number. Values are appended to the
+** file with the largest generation number. Once it grows larger than 
+** LSM_CONFIG_VALUE_LOG_SIZE, a file with the next generation number is
+** started and merges relocate the live values that they encounter in the
+** previous generation to the new one. The previous generation file is
+** deleted once no snapshot that may be used by a client or by recovery
+** refers to it (see lsmCheckpointWrite()). A new generation is not started
+** until this has happened, so at most two generations exist at any time.
+** Generation N is stored in the file named by appending "-vlog0" (if N is
+** even) or "-vlog1" (if N is odd) to the database file name.
+**
+** The first 8 bytes of each value-log file contain its generation number
+** and the offset of the end of the data in the file, each as a 4-byte 
+** big-endian integer. Values are stored starting at offset 
+** LSM_VLOG_HDRSIZE. While the database is open, the current generation
+** and end offset are stored in shared-memory (see ShmHeader) and accessed
+** only while holding the WRITER lock, so the header is only written when
+** the file is synced. This file exports:
+**
+**     lsmFsAppendVlog
+**     lsmFsReadVlog
+**     lsmFsSyncVlog
+**     lsmFsRecoverVlog
+**     lsmFsVlogOld
+**     lsmFsDeleteVlog
+**     lsmFsVlogState
+**     lsmFsVlogSuffix
+**     lsmFsVlogHeader
+**     lsmFsReadVlogFile
+**
 ** COMPRESSED DATABASE FILE FORMAT
 **
 ** The compressed database file format is very similar to the normal format.
@@ -213,6 +250,7 @@ struct FileSystem {
   lsm_env *pEnv;                  /* Environment pointer */
   char *zDb;                      /* Database file name */
   char *zLog;                     /* Database file name */
+  char *zVlog;                    /* Value-log file name */
   int nMetasize;                  /* Size of meta pages in bytes */
   int nPagesize;                  /* Database page-size in bytes */
   int nBlocksize;                 /* Database block-size in bytes */
@@ -221,6 +259,12 @@ struct FileSystem {
   LsmFile *pLsmFile;              /* Used after lsm_close() to link into list */
   lsm_file *fdDb;                 /* Database file */
   lsm_file *fdLog;                /* Log file */
+  struct VlogFile {
+    lsm_file *fd;                 /* Value-log file (or NULL) */
+    u32 iGen;                     /* Generation number of fd */
+    int bWrite;                   /* True if fd is open for writing */
+  } aVlog[2];                     /* Value-log files. Indexed by (iGen % 2) */
+  int bVlogDirty;                 /* True if value-log written since sync */
   int szSector;                   /* Database file sector size */
 
   /* If this is a compressed database, a pointer to the compression methods.
@@ -527,6 +571,343 @@ int lsmFsCloseAndDeleteLog(FileSystem *pFS){
   return LSM_OK;
 }
 
+/*
+** Return the suffix appended to the database file name to obtain the 
+** name of the file used to store value-log generation iGen.
+*/
+const char *lsmFsVlogSuffix(u32 iGen){
+  return (iGen & 1) ? "-vlog1" : "-vlog0";
+}
+
+/*
+** Serialize a value-log file header for generation iGen with the end of
+** data at offset iEnd into buffer aHdr. Return the size of the header in
+** bytes.
+*/
+int lsmFsVlogHeader(u32 iGen, u32 iEnd, u8 *aHdr){
+  lsmPutU32(&aHdr[0], iGen);
+  lsmPutU32(&aHdr[4], iEnd);
+  return LSM_VLOG_HDRSIZE;
+}
+
+/*
+** Close the value-log file handle used for generation iGen, if any.
+*/
+static void fsVlogClose(FileSystem *pFS, u32 iGen){
+  struct VlogFile *p = &pFS->aVlog[iGen & 1];
+  if( p->fd ){
+    lsmEnvClose(pFS->pEnv, p->fd);
+    memset(p, 0, sizeof(struct VlogFile));
+  }
+}
+
+/*
+** Open a file-handle on value-log generation iGen, if one is not already
+** open. If bWrite is true, the file is opened for writing. 
+**
+** If bCreate is true, the file is created if it does not already exist 
+** and a new header written to it. Otherwise, if the file does not exist
+** or its header does not identify it as generation iGen, LSM_CORRUPT is
+** returned - a pointer to a value in a value-log file that has been 
+** deleted has been found.
+*/
+static int fsVlogOpen(FileSystem *pFS, u32 iGen, int bWrite, int bCreate){
+  struct VlogFile *p = &pFS->aVlog[iGen & 1];
+  int rc = LSM_OK;
+
+  if( bCreate==0 && p->fd && p->iGen==iGen && (bWrite==0 || p->bWrite) ){
+    return LSM_OK;
+  }
+
+  fsVlogClose(pFS, iGen);
+  strcpy(&pFS->zVlog[strlen(pFS->zDb)], lsmFsVlogSuffix(iGen));
+  rc = lsmEnvOpen(
+      pFS->pEnv, pFS->zVlog, (bWrite ? 0 : LSM_OPEN_READONLY), &p->fd
+  );
+  if( rc==LSM_IOERR_NOENT ) rc = LSM_CORRUPT_BKPT;
+
+  if( rc==LSM_OK ){
+    u8 aHdr[LSM_VLOG_HDRSIZE];
+    if( bCreate ){
+      lsmFsVlogHeader(iGen, LSM_VLOG_HDRSIZE, aHdr);
+      rc = lsmEnvWrite(pFS->pEnv, p->fd, 0, aHdr, LSM_VLOG_HDRSIZE);
+      if( rc==LSM_OK ) rc = lsmEnvSync(pFS->pEnv, p->fd);
+    }else{
+      rc = lsmEnvRead(pFS->pEnv, p->fd, 0, aHdr, LSM_VLOG_HDRSIZE);
+      if( rc==LSM_OK && lsmGetU32(aHdr)!=iGen ) rc = LSM_CORRUPT_BKPT;
+    }
+  }
+
+  if( rc==LSM_OK ){
+    p->iGen = iGen;
+    p->bWrite = bWrite;
+  }else{
+    if( p->fd ) lsmEnvClose(pFS->pEnv, p->fd);
+    memset(p, 0, sizeof(struct VlogFile));
+  }
+  return rc;
+}
+
+/*
+** Read the header of the value-log file that would be used to store a
+** generation with the same parity as iGen. If the file exists and 
+** contains a valid header, set *piGen and *piEnd to the generation and
+** end offset that it contains. Otherwise, set both to zero.
+*/
+static int fsVlogReadHeader(FileSystem *pFS, u32 iGen, u32 *piGen, u32 *piEnd){
+  lsm_file *fd = 0;
+  int rc;
+
+  *piGen = *piEnd = 0;
+  fsVlogClose(pFS, iGen);
+  strcpy(&pFS->zVlog[strlen(pFS->zDb)], lsmFsVlogSuffix(iGen));
+  rc = lsmEnvOpen(pFS->pEnv, pFS->zVlog, LSM_OPEN_READONLY, &fd);
+  if( rc==LSM_IOERR_NOENT ){
+    rc = LSM_OK;
+  }else if( rc==LSM_OK ){
+    u8 aHdr[LSM_VLOG_HDRSIZE];
+    rc = lsmEnvRead(pFS->pEnv, fd, 0, aHdr, LSM_VLOG_HDRSIZE);
+    if( rc==LSM_OK 
+     && lsmGetU32(&aHdr[0])!=0 && (lsmGetU32(&aHdr[0]) & 1)==(iGen & 1)
+     && lsmGetU32(&aHdr[4])>=LSM_VLOG_HDRSIZE
+    ){
+      *piGen = lsmGetU32(&aHdr[0]);
+      *piEnd = lsmGetU32(&aHdr[4]);
+    }
+    lsmEnvClose(pFS->pEnv, fd);
+  }
+  return rc;
+}
+
+/*
+** Write the header of the current value-log generation to disk. Sync the
+** file as well if bSync is true.
+*/
+static int fsVlogWriteHeader(FileSystem *pFS, int bSync){
+  ShmHeader *pShm = pFS->pDb->pShmhdr;
+  int rc;
+
+  rc = fsVlogOpen(pFS, pShm->iVlogGen, 1, 0);
+  if( rc==LSM_OK ){
+    u8 aHdr[LSM_VLOG_HDRSIZE];
+    struct VlogFile *p = &pFS->aVlog[pShm->iVlogGen & 1];
+    lsmFsVlogHeader(pShm->iVlogGen, pShm->iVlogEnd, aHdr);
+    rc = lsmEnvWrite(pFS->pEnv, p->fd, 0, aHdr, LSM_VLOG_HDRSIZE);
+    if( rc==LSM_OK && bSync ) rc = lsmEnvSync(pFS->pEnv, p->fd);
+  }
+  return rc;
+}
+
+/*
+** Start a new value-log generation. The header of the current generation
+** is written and synced, then the file for the new generation is created.
+*/
+static int fsVlogRotate(FileSystem *pFS){
+  ShmHeader *pShm = pFS->pDb->pShmhdr;
+  int rc;
+
+  assert( pShm->iVlogOld==0 );
+  rc = fsVlogWriteHeader(pFS, 1);
+  if( rc==LSM_OK ) rc = fsVlogOpen(pFS, pShm->iVlogGen+1, 1, 1);
+  if( rc==LSM_OK ){
+    pShm->iVlogOld = pShm->iVlogGen;
+    pShm->iVlogGen++;
+    lsmShmBarrier(pFS->pDb);
+    pShm->iVlogEnd = LSM_VLOG_HDRSIZE;
+    pFS->bVlogDirty = 0;
+  }
+  return rc;
+}
+
+/*
+** Append nVal bytes of data from buffer pVal to the current value-log 
+** generation, creating the first value-log file if it does not already
+** exist. If successful, write a pointer to the value (LSM_VALUEPTR_SIZE
+** bytes) to buffer aPtr and return LSM_OK. Otherwise, return an LSM error
+** code.
+**
+** The caller must be holding the WRITER lock. The value-log file is 
+** neither synced nor is its header updated by this function - see
+** lsmFsSyncVlog(). If bRotate is true and the current generation has 
+** grown larger than LSM_CONFIG_VALUE_LOG_SIZE, a new generation is 
+** started before the value is appended. 
+*/
+int lsmFsAppendVlog(
+  FileSystem *pFS,                /* File system object */
+  int bRotate,                    /* True to allow a new generation */
+  void *pVal, int nVal,           /* Value to append */
+  u8 *aPtr                        /* OUT: Pointer to value */
+){
+  ShmHeader *pShm = pFS->pDb->pShmhdr;
+  i64 nMax = (i64)pFS->pDb->nVlogSize * 1024;
+  int rc = LSM_OK;
+
+  assert( lsmShmAssertLock(pFS->pDb, LSM_LOCK_WRITER, LSM_LOCK_EXCL) );
+  if( pShm->iVlogGen==0 ){
+    rc = fsVlogOpen(pFS, 1, 1, 1);
+    if( rc==LSM_OK ){
+      pShm->iVlogGen = 1;
+      pShm->iVlogEnd = LSM_VLOG_HDRSIZE;
+    }
+  }else if( bRotate && pShm->iVlogOld==0 && pShm->iVlogEnd>=nMax ){
+    rc = fsVlogRotate(pFS);
+  }
+
+  if( rc==LSM_OK && (i64)pShm->iVlogEnd + nVal > (i64)0xFFFFFFFF ){
+    rc = LSM_FULL;
+  }
+  if( rc==LSM_OK ) rc = fsVlogOpen(pFS, pShm->iVlogGen, 1, 0);
+  if( rc==LSM_OK ){
+    struct VlogFile *p = &pFS->aVlog[pShm->iVlogGen & 1];
+    rc = lsmEnvWrite(pFS->pEnv, p->fd, pShm->iVlogEnd, pVal, nVal);
+  }
+  if( rc==LSM_OK ){
+    lsmPutU32(&aPtr[0], pShm->iVlogGen);
+    lsmPutU32(&aPtr[4], pShm->iVlogEnd);
+    lsmPutU32(&aPtr[8], (u32)nVal);
+    pShm->iVlogEnd += nVal;
+    pFS->bVlogDirty = 1;
+  }
+  return rc;
+}
+
+/*
+** Read the value that aPtr (a buffer LSM_VALUEPTR_SIZE bytes in size)
+** points to into buffer pOut. Return LSM_OK if successful, or an LSM 
+** error code otherwise.
+*/
+int lsmFsReadVlog(FileSystem *pFS, u8 *aPtr, void *pOut){
+  return lsmFsReadVlogFile(pFS, 
+      lsmGetU32(&aPtr[0]), lsmGetU32(&aPtr[4]), pOut, (int)lsmGetU32(&aPtr[8])
+  );
+}
+
+/*
+** Read nRead bytes from offset iOff of value-log generation iGen into 
+** buffer pOut.
+*/
+int lsmFsReadVlogFile(
+  FileSystem *pFS, 
+  u32 iGen, 
+  u32 iOff, 
+  void *pOut, 
+  int nRead
+){
+  int rc = fsVlogOpen(pFS, iGen, 0, 0);
+  if( rc==LSM_OK ){
+    rc = lsmEnvRead(pFS->pEnv, pFS->aVlog[iGen & 1].fd, iOff, pOut, nRead);
+  }
+  return rc;
+}
+
+/*
+** If this connection has appended to the value-log since it was last 
+** synced, write the header of the current value-log generation to disk.
+** If bSync is true, also sync the file. The caller must be holding the
+** WRITER lock.
+**
+** This is called before a transaction that appended to the value-log is
+** committed, so that the log never refers to values that may be lost in
+** a crash, and before a worker snapshot containing values relocated by 
+** a merge is saved.
+*/
+int lsmFsSyncVlog(FileSystem *pFS, int bSync){
+  int rc = LSM_OK;
+  if( pFS->bVlogDirty ){
+    rc = fsVlogWriteHeader(pFS, bSync);
+    if( rc==LSM_OK ) pFS->bVlogDirty = 0;
+  }
+  return rc;
+}
+
+/*
+** This function is called during recovery. If aPtr is NULL, the state of
+** the value-log stored in shared-memory is initialized based on the
+** headers of any value-log files on disk. Otherwise, aPtr points to a 
+** value-log pointer read from the log file. If it points beyond the end 
+** of the current generation (because the header was not synced before a
+** failure), the end offset stored in shared-memory is extended to match.
+*/
+int lsmFsRecoverVlog(FileSystem *pFS, u8 *aPtr){
+  ShmHeader *pShm = pFS->pDb->pShmhdr;
+  int rc = LSM_OK;
+
+  if( aPtr==0 ){
+    u32 aGen[2];
+    u32 aEnd[2];
+    rc = fsVlogReadHeader(pFS, 0, &aGen[0], &aEnd[0]);
+    if( rc==LSM_OK ) rc = fsVlogReadHeader(pFS, 1, &aGen[1], &aEnd[1]);
+    if( rc==LSM_OK ){
+      int iCur = (aGen[1]>aGen[0]);
+      pShm->iVlogGen = aGen[iCur];
+      pShm->iVlogEnd = aEnd[iCur];
+      pShm->iVlogOld = 0;
+      pShm->iVlogFree = 0;
+      if( aGen[!iCur] && aGen[!iCur]+1==aGen[iCur] ){
+        pShm->iVlogOld = aGen[!iCur];
+      }
+    }
+  }else if( lsmGetU32(&aPtr[0])==pShm->iVlogGen ){
+    u32 iEnd = lsmGetU32(&aPtr[4]) + lsmGetU32(&aPtr[8]);
+    if( iEnd>pShm->iVlogEnd ) pShm->iVlogEnd = iEnd;
+  }
+  return rc;
+}
+
+/*
+** Return the generation number of the previous value-log generation, if
+** there is one and it may still be referred to by the database. Or, if 
+** there is no such generation, zero.
+*/
+u32 lsmFsVlogOld(FileSystem *pFS){
+  ShmHeader *pShm = pFS->pDb->pShmhdr;
+  u32 iOld = pShm->iVlogOld;
+  return (iOld==pShm->iVlogFree ? 0 : iOld);
+}
+
+/*
+** Delete the file used to store value-log generation iGen.
+*/
+int lsmFsDeleteVlog(FileSystem *pFS, u32 iGen){
+  fsVlogClose(pFS, iGen);
+  strcpy(&pFS->zVlog[strlen(pFS->zDb)], lsmFsVlogSuffix(iGen));
+  return lsmEnvUnlink(pFS->pEnv, pFS->zVlog);
+}
+
+/*
+** Set aGen[0] and aEnd[0] to the generation number and end offset of the
+** current value-log generation, and aGen[1] and aEnd[1] to those of the
+** previous generation, if it still exists. Unused entries are set to 
+** zero. This is used when a snapshot is retained for lsm_backup_open().
+**
+** The caller does not hold the WRITER lock, so the shared-memory fields
+** are read twice to guard against a concurrent switch to a new 
+** generation. If one occurs, aEnd[0] may be larger than required, but is
+** never too small.
+*/
+int lsmFsVlogState(FileSystem *pFS, u32 *aGen, u32 *aEnd){
+  ShmHeader *pShm = pFS->pDb->pShmhdr;
+  int rc = LSM_OK;
+  u32 iOld;
+
+  do {
+    aGen[0] = pShm->iVlogGen;
+    lsmShmBarrier(pFS->pDb);
+    aEnd[0] = pShm->iVlogEnd;
+    iOld = pShm->iVlogOld;
+    lsmShmBarrier(pFS->pDb);
+  }while( aGen[0]!=pShm->iVlogGen );
+
+  /* If the previous generation has been deleted since iOld was read, no
+  ** snapshot in use by this connection refers to it.  */
+  aGen[1] = aEnd[1] = 0;
+  if( iOld ){
+    rc = fsVlogReadHeader(pFS, iOld, &aGen[1], &aEnd[1]);
+    if( aGen[1]!=iOld ) aGen[1] = aEnd[1] = 0;
+  }
+  return rc;
+}
+
 /*
 ** Return true if page iReal of the database should be accessed using mmap.
 ** False otherwise.
@@ -627,12 +1008,13 @@ int lsmFsOpen(
   assert( pDb->pFS==0 );
   assert( pDb->pWorker==0 && pDb->pClient==0 );
 
-  nByte = sizeof(FileSystem) + nDb+1 + nDb+4+1;
+  nByte = sizeof(FileSystem) + nDb+1 + nDb+4+1 + nDb+6+1;
   pFS = (FileSystem *)lsmMallocZeroRc(pDb->pEnv, nByte, &rc);
   if( pFS ){
     LsmFile *pLsmFile;
     pFS->zDb = (char *)&pFS[1];
     pFS->zLog = &pFS->zDb[nDb+1];
+    pFS->zVlog = &pFS->zLog[nDb+4+1];
     pFS->nPagesize = LSM_DFLT_PAGE_SIZE;
     pFS->nBlocksize = LSM_DFLT_BLOCK_SIZE;
     pFS->nMetasize = 4 * 1024;
@@ -643,6 +1025,7 @@ int lsmFsOpen(
     memcpy(pFS->zDb, zDb, nDb+1);
     memcpy(pFS->zLog, zDb, nDb);
     memcpy(&pFS->zLog[nDb], "-log", 5);
+    memcpy(pFS->zVlog, zDb, nDb);
 
     /* Allocate the hash-table here. At some point, it should be changed
     ** so that it can grow dynamicly. */
@@ -772,6 +1155,8 @@ void lsmFsClose(FileSystem *pFS){
 
     if( pFS->fdDb ) lsmEnvClose(pFS->pEnv, pFS->fdDb );
     if( pFS->fdLog ) lsmEnvClose(pFS->pEnv, pFS->fdLog );
+    fsVlogClose(pFS, 0);
+    fsVlogClose(pFS, 1);
     lsmFree(pEnv, pFS->pLsmFile);
     lsmFree(pEnv, pFS->apHash);
     lsmFree(pEnv, pFS->aIBuffer);
@@ -3102,6 +3487,144 @@ int lsmInfoArrayPages(lsm_db *pDb, Pgno iFirst, char **pzOut){
   return rc;
 }
 
+/*
+** Return true if segments p1 and p2 are identical, including any block
+** redirections.
+*/
+static int fsSegmentEqual(Segment *p1, Segment *p2){
+  Redirect *pR1 = p1->pRedirect;
+  Redirect *pR2 = p2->pRedirect;
+
+  if( p1->iFirst!=p2->iFirst || p1->iLastPg!=p2->iLastPg 
+   || p1->iRoot!=p2->iRoot || p1->nSize!=p2->nSize 
+  ){
+    return 0;
+  }
+  if( pR1==0 || pR2==0 ) return (pR1==pR2);
+  return (pR1->n==pR2->n 
+       && 0==memcmp(pR1->a, pR2->a, sizeof(struct RedirectEntry)*pR1->n)
+  );
+}
+
+/*
+** Return true if snapshot pSnap contains a segment identical to pSeg.
+*/
+static int fsSnapshotHasSegment(Snapshot *pSnap, Segment *pSeg){
+  Level *pLvl;
+  for(pLvl=pSnap->pLevel; pLvl; pLvl=pLvl->pNext){
+    int i;
+    if( fsSegmentEqual(&pLvl->lhs, pSeg) ) return 1;
+    for(i=0; i<pLvl->nRight; i++){
+      if( fsSegmentEqual(&pLvl->aRhs[i], pSeg) ) return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Set the entry in aUsed[] corresponding to each block used by segment 
+** pSeg to 1. Array aUsed[] is nBlock entries in size.
+*/
+static int fsMarkSegmentBlocks(
+  FileSystem *pFS, 
+  Segment *pSeg, 
+  int nBlock, 
+  u8 *aUsed
+){
+  int rc = LSM_OK;
+  if( pSeg->nSize>0 ){
+    Redirect *pRedir = pSeg->pRedirect;
+    int iBlk = fsRedirectBlock(pRedir, fsPageToBlock(pFS, pSeg->iFirst));
+    int iLastBlk = fsRedirectBlock(pRedir, fsPageToBlock(pFS, pSeg->iLastPg));
+
+    while( rc==LSM_OK ){
+      if( iBlk<1 || iBlk>nBlock ){
+        rc = LSM_CORRUPT_BKPT;
+      }else{
+        aUsed[iBlk-1] = 1;
+        if( iBlk==iLastBlk ) break;
+        rc = fsBlockNext(pFS, pSeg, iBlk, &iBlk);
+      }
+    }
+  }
+  return rc;
+}
+
+/*
+** Set *paBlk to point to an array containing the block numbers of all 
+** blocks used by the segments of snapshot pSnap, in ascending order, and 
+** *pnBlk to the number of entries in the array. Blocks on the free-list 
+** are not included. If pBase is not NULL, then the blocks of segments that
+** also appear, unmodified, in the older snapshot pBase are omitted. The
+** caller is responsible for eventually freeing the array using lsmFree().
+*/
+int lsmFsSnapshotBlocks(
+  FileSystem *pFS,                /* File-system object */
+  Snapshot *pSnap,                /* Snapshot to report on */
+  Snapshot *pBase,                /* Older snapshot to compare with, or NULL */
+  int **paBlk,                    /* OUT: Array of block numbers */
+  int *pnBlk                      /* OUT: Size of *paBlk */
+){
+  const int nBlock = pSnap->nBlock;
+  int rc = LSM_OK;
+  int *aBlk = 0;
+  int nBlk = 0;
+  u8 *aUsed;
+  Level *pLvl;
+
+  aUsed = (u8 *)lsmMallocZeroRc(pFS->pEnv, nBlock+1, &rc);
+  for(pLvl=pSnap->pLevel; rc==LSM_OK && pLvl; pLvl=pLvl->pNext){
+    int i;
+    for(i=-1; rc==LSM_OK && i<pLvl->nRight; i++){
+      Segment *pSeg = (i<0 ? &pLvl->lhs : &pLvl->aRhs[i]);
+      if( pBase==0 || fsSnapshotHasSegment(pBase, pSeg)==0 ){
+        rc = fsMarkSegmentBlocks(pFS, pSeg, nBlock, aUsed);
+      }
+    }
+  }
+
+  if( rc==LSM_OK ){
+    aBlk = (int *)lsmMallocRc(pFS->pEnv, sizeof(int) * (nBlock+1), &rc);
+  }
+  if( rc==LSM_OK ){
+    int i;
+    for(i=0; i<nBlock; i++){
+      if( aUsed[i] ) aBlk[nBlk++] = i+1;
+    }
+  }
+
+  lsmFree(pFS->pEnv, aUsed);
+  *paBlk = aBlk;
+  *pnBlk = nBlk;
+  return rc;
+}
+
+/*
+** Read the contents of block iBlk from the database file into buffer 
+** aBuf[], which must be at least one block in size. Set *piOff to the 
+** file offset the data was read from and *pnData to its size in bytes.
+** The meta pages at the start of block 1 are not included.
+*/
+int lsmFsReadBlock(
+  FileSystem *pFS,                /* File-system object */
+  int iBlk,                       /* Block to read */
+  u8 *aBuf,                       /* Buffer to read data into */
+  i64 *piOff,                     /* OUT: File offset of data */
+  int *pnData                     /* OUT: Size of data in bytes */
+){
+  i64 iOff = (i64)(iBlk-1) * pFS->nBlocksize;
+  int nData = pFS->nBlocksize;
+
+  assert( iBlk>0 );
+  if( iBlk==1 ){
+    iOff = pFS->nMetasize * 2;
+    nData -= (int)iOff;
+  }
+  *piOff = iOff;
+  *pnData = nData;
+  return lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aBuf, nData);
+}
+
 /*
 ** The following macros are used by the integrity-check code. Associated with
 ** each block in the database is an 8-bit bit mask (the entry in the aUsed[]
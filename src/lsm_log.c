@@ -26,6 +26,7 @@
 **
 **   LOG_WRITE:  A key-value pair written to the database.
 **   LOG_DELETE: A delete key issued to the database.
+**   LOG_VPTR:   A key written with a value stored in the value-log file.
 **   LOG_COMMIT: A transaction commit.
 **
 ** And the following types of records for ancillary purposes..
@@ -159,6 +160,10 @@
 **               * If the first byte was 0x09, an 8 byte checksum.
 **               * The key data.
 **
+**   LOG_VPTR:   * A single 0x0A or 0x0B byte, followed by the same fields
+**                 as a LOG_WRITE record. The value data is a 12 byte
+**                 pointer into the value-log file (see LSM_VALUEPTR).
+**
 **   Varints are as described in lsm_varint.c (SQLite 4 format).
 **
 ** CHECKSUMS:
@@ -201,6 +206,8 @@
 #define LSM_LOG_WRITE_CKSUM  0x07
 #define LSM_LOG_DELETE       0x08
 #define LSM_LOG_DELETE_CKSUM 0x09
+#define LSM_LOG_VPTR         0x0A
+#define LSM_LOG_VPTR_CKSUM   0x0B
 
 /* Require a checksum every 32KB. */
 #define LSM_CKSUM_MAXDATA (32*1024)
@@ -638,21 +645,17 @@ static int logFlush(lsm_db *pDb, int eType){
   pLog->buf.z[pLog->buf.n++] = eType;
   memset(&pLog->buf.z[pLog->buf.n], 0, 8);
 
-  rc = logCksumAndFlush(pDb);
-
-  /* If this is a commit and synchronous=full, sync the log to disk. */
-  if( rc==LSM_OK && eType==LSM_LOG_COMMIT && pDb->eSafety==LSM_SAFETY_FULL ){
-    rc = lsmFsSyncLog(pDb->pFS);
-  }
-  return rc;
+  return logCksumAndFlush(pDb);
 }
 
 /*
 ** Append an LSM_LOG_WRITE (if nVal>=0) or LSM_LOG_DELETE (if nVal<0) 
-** record to the database log.
+** record to the database log. Or, if bValuePtr is true, an LSM_LOG_VPTR 
+** record. In this case pVal/nVal is a pointer into the value-log file.
 */
 int lsmLogWrite(
   lsm_db *pDb,                    /* Database handle */
+  int bValuePtr,                  /* True if pVal is a value-log pointer */
   void *pKey, int nKey,           /* Database key to write to log */
   void *pVal, int nVal            /* Database value (or nVal<0) to write */
 ){
@@ -687,7 +690,13 @@ int lsmLogWrite(
     ** DELETE) or 2 (for WRITE) varints.  */
     assert( LSM_LOG_WRITE_CKSUM == (LSM_LOG_WRITE | 0x0001) );
     assert( LSM_LOG_DELETE_CKSUM == (LSM_LOG_DELETE | 0x0001) );
-    *(a++) = (nVal>=0 ? LSM_LOG_WRITE : LSM_LOG_DELETE) | (u8)bCksum;
+    assert( LSM_LOG_VPTR_CKSUM == (LSM_LOG_VPTR | 0x0001) );
+    assert( bValuePtr==0 || nVal==LSM_VALUEPTR_SIZE );
+    if( bValuePtr ){
+      *(a++) = LSM_LOG_VPTR | (u8)bCksum;
+    }else{
+      *(a++) = (nVal>=0 ? LSM_LOG_WRITE : LSM_LOG_DELETE) | (u8)bCksum;
+    }
     a += lsmVarintPut32(a, nKey);
     if( nVal>=0 ) a += lsmVarintPut32(a, nVal);
 
@@ -711,11 +720,86 @@ int lsmLogWrite(
 }
 
 /*
-** Append an LSM_LOG_COMMIT record to the database log.
+** Append an LSM_LOG_COMMIT record to the database log. The log file is not
+** synced by this function. If the transaction is to be made durable, the
+** caller should pass the value written to *piCommit to lsmLogSync() after
+** the WRITER lock has been released. The caller must be holding the 
+** WRITER lock when this function is called.
+**
+** If the safety level is FULL, the commit is also recorded in shared 
+** variable ShmHeader.iLogDurable. Read transactions opened after this 
+** point do not proceed until the log has been synced (see 
+** lsmLogSyncDurable()).
 */
-int lsmLogCommit(lsm_db *pDb){
+int lsmLogCommit(lsm_db *pDb, u32 *piCommit){
+  int rc;
+  *piCommit = 0;
   if( pDb->bUseLog==0 ) return LSM_OK;
-  return logFlush(pDb, LSM_LOG_COMMIT);
+  rc = logFlush(pDb, LSM_LOG_COMMIT);
+  if( rc==LSM_OK ){
+    ShmHeader *pShm = pDb->pShmhdr;
+    u32 iCommit = pShm->iLogCommit + 1;
+    lsmShmBarrier(pDb);
+    pShm->iLogCommit = iCommit;
+    if( pDb->eSafety==LSM_SAFETY_FULL ) pShm->iLogDurable = iCommit;
+    lsmShmBarrier(pDb);
+    *piCommit = iCommit;
+  }
+  return rc;
+}
+
+/*
+** Make sure that the COMMIT record identified by iCommit (a value returned
+** by an earlier call to lsmLogCommit()) has been synced to disk.
+**
+** This implements group commit. The WRITER lock is not held when this
+** function is called, so other connections may write and commit their own
+** transactions to the log while this connection is waiting on the sync.
+** Since a sync covers all log records written before it began, a single 
+** sync may make the transactions of several connections durable.
+**
+** Within a process, syncs are serialized by a mutex. A connection that 
+** finds a sync in progress blocks on the mutex until it is finished, then
+** checks whether or not that sync covered its own COMMIT record (using 
+** shared-memory variables ShmHeader.iLogCommit and iLogSynced). It only
+** syncs the log itself if it did not. Connections in different processes
+** may sync the log concurrently. This is harmless, as iLogSynced is only 
+** ever set to a value that has actually been synced.
+*/
+int lsmLogSync(lsm_db *pDb, u32 iCommit){
+  ShmHeader *pShm = pDb->pShmhdr;
+  int rc = LSM_OK;
+
+  if( iCommit && !shm_sequence_ge(pShm->iLogSynced, iCommit) ){
+    lsmDbSyncMutexEnter(pDb);
+    if( !shm_sequence_ge(pShm->iLogSynced, iCommit) ){
+      int bOpen = 0;
+      u32 iSync;
+      rc = lsmFsOpenLog(pDb, &bOpen);
+      lsmShmBarrier(pDb);
+      iSync = pShm->iLogCommit;
+      if( rc==LSM_OK && bOpen ){
+        rc = lsmFsSyncLog(pDb->pFS);
+      }
+      if( rc==LSM_OK && shm_sequence_ge(iSync, pShm->iLogSynced) ){
+        pShm->iLogSynced = iSync;
+      }
+    }
+    lsmDbSyncMutexLeave(pDb);
+  }
+  return rc;
+}
+
+/*
+** This is called when a read transaction is opened. If a transaction 
+** committed with safety=FULL is visible but may not yet have been synced
+** to disk, sync the log (or wait for the connection already doing so) 
+** before returning.
+*/
+int lsmLogSyncDurable(lsm_db *pDb){
+  u32 iDurable = pDb->pShmhdr->iLogDurable;
+  lsmShmBarrier(pDb);
+  return lsmLogSync(pDb, iDurable);
 }
 
 /*
@@ -970,6 +1054,7 @@ int lsmLogRecover(lsm_db *pDb){
   if( rc!=LSM_OK ) return rc;
 
   rc = lsmTreeInit(pDb);
+  if( rc==LSM_OK ) rc = lsmFsRecoverVlog(pDb->pFS, 0);
   if( rc!=LSM_OK ) return rc;
 
   pLog = &pDb->treehdr.log;
@@ -1002,6 +1087,8 @@ int lsmLogRecover(lsm_db *pDb){
             break;
           }
 
+          case LSM_LOG_VPTR:
+          case LSM_LOG_VPTR_CKSUM:
           case LSM_LOG_WRITE:
           case LSM_LOG_WRITE_CKSUM: {
             int nKey;
@@ -1010,7 +1097,7 @@ int lsmLogRecover(lsm_db *pDb){
             logReaderVarint(&reader, &buf1, &nKey, &rc);
             logReaderVarint(&reader, &buf2, &nVal, &rc);
 
-            if( eType==LSM_LOG_WRITE_CKSUM ){
+            if( eType & 0x0001 ){
               logReaderCksum(&reader, &buf1, &bEof, &rc);
             }else{
               bEof = logRequireCksum(&reader, nKey+nVal);
@@ -1020,7 +1107,18 @@ int lsmLogRecover(lsm_db *pDb){
             logReaderBlob(&reader, &buf1, nKey, 0, &rc);
             logReaderBlob(&reader, &buf2, nVal, &aVal, &rc);
             if( iPass==1 && rc==LSM_OK ){ 
-              rc = lsmTreeInsert(pDb, (u8 *)buf1.z, nKey, aVal, nVal);
+              if( (eType & ~0x0001)==LSM_LOG_VPTR ){
+                if( nVal!=LSM_VALUEPTR_SIZE ){
+                  rc = LSM_CORRUPT_BKPT;
+                }else{
+                  rc = lsmFsRecoverVlog(pDb->pFS, aVal);
+                }
+                if( rc==LSM_OK ){
+                  rc = lsmTreeInsertValuePtr(pDb, (u8 *)buf1.z, nKey, aVal);
+                }
+              }else{
+                rc = lsmTreeInsert(pDb, (u8 *)buf1.z, nKey, aVal, nVal);
+              }
             }
             break;
           }
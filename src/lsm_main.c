@@ -53,7 +53,7 @@ static void assert_db_state(lsm_db *pDb){
 /*
 ** The default key-compare function.
 */
-static int xCmp(void *p1, int n1, void *p2, int n2){
+int lsmDefaultCompare(void *p1, int n1, void *p2, int n2){
   int res;
   res = memcmp(p1, p2, LSM_MIN(n1, n2));
   if( res==0 ) res = (n1-n2);
@@ -87,10 +87,14 @@ int lsm_new(lsm_env *pEnv, lsm_db **ppDb){
   pDb->nAutockpt = LSM_DFLT_AUTOCHECKPOINT;
   pDb->bAutowork = LSM_DFLT_AUTOWORK;
   pDb->eSafety = LSM_DFLT_SAFETY;
-  pDb->xCmp = xCmp;
+  pDb->xCmp = lsmDefaultCompare;
   pDb->nDfltPgsz = LSM_DFLT_PAGE_SIZE;
   pDb->nDfltBlksz = LSM_DFLT_BLOCK_SIZE;
   pDb->nMerge = LSM_DFLT_AUTOMERGE;
+  pDb->eMergePolicy = LSM_DFLT_MERGE_POLICY;
+  pDb->nSizeRatio = LSM_DFLT_SIZE_RATIO;
+  pDb->nWindowAge = LSM_DFLT_WINDOW_AGE;
+  pDb->nVlogSize = LSM_DFLT_VALUE_LOG_SIZE;
   pDb->nMaxFreelist = LSM_MAX_FREELIST_ENTRIES;
   pDb->bUseLog = LSM_DFLT_USE_LOG;
   pDb->iReader = -1;
@@ -144,21 +148,21 @@ static int getFullpathname(
 }
 
 /*
-** Check that the bits in the db->mLock mask are consistent with the
-** value stored in db->iRwclient. An assert shall fail otherwise.
+** Check that the bits in the db->mExcl and db->mShared masks are consistent
+** with the value stored in db->iRwclient. An assert shall fail otherwise.
 */
 static void assertRwclientLockValue(lsm_db *db){
 #ifndef NDEBUG
-  u64 msk;                        /* Mask of mLock bits for RWCLIENT locks */
+  u64 msk;                        /* Mask of mExcl bits for RWCLIENT locks */
   u64 rwclient = 0;               /* Bit corresponding to db->iRwclient */
 
   if( db->iRwclient>=0 ){
     rwclient = ((u64)1 << (LSM_LOCK_RWCLIENT(db->iRwclient)-1));
   }
-  msk  = ((u64)1 << (LSM_LOCK_RWCLIENT(LSM_LOCK_NRWCLIENT)-1)) - 1;
-  msk -= (((u64)1 << (LSM_LOCK_RWCLIENT(0)-1)) - 1);
+  msk  = (((u64)1 << LSM_LOCK_NRWCLIENT) - 1) << (LSM_LOCK_RWCLIENT(0)-1);
 
-  assert( (db->mLock & msk)==rwclient );
+  assert( (db->mExcl & msk)==rwclient );
+  assert( (db->mShared & msk)==rwclient );
 #endif
 }
 
@@ -214,10 +218,11 @@ int lsm_close(lsm_db *pDb){
   int rc = LSM_OK;
   if( pDb ){
     assert_db_state(pDb);
-    if( pDb->pCsr || pDb->nTransOpen ){
+    if( pDb->pCsr || pDb->nTransOpen || pDb->nBackup ){
       rc = LSM_MISUSE_BKPT;
     }else{
       lsmMCursorFreeCache(pDb);
+      lsmReleaseAllSnapshots(pDb);
       lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
       pDb->pClient = 0;
 
@@ -226,7 +231,7 @@ int lsm_close(lsm_db *pDb){
       lsmDbDatabaseRelease(pDb);
       lsmLogClose(pDb);
       lsmFsClose(pDb->pFS);
-      assert( pDb->mLock==0 );
+      assert( pDb->mExcl==0 && pDb->mShared==0 );
       
       /* Invoke any destructors registered for the compression or 
       ** compression factory callbacks.  */
@@ -353,6 +358,32 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_CONFIG_MERGE_POLICY: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal==LSM_MERGE_TIERED 
+       || *piVal==LSM_MERGE_LEVELED 
+       || *piVal==LSM_MERGE_TIMEWINDOW 
+      ){
+        pDb->eMergePolicy = *piVal;
+      }
+      *piVal = pDb->eMergePolicy;
+      break;
+    }
+
+    case LSM_CONFIG_SIZE_RATIO: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=2 ) pDb->nSizeRatio = *piVal;
+      *piVal = pDb->nSizeRatio;
+      break;
+    }
+
+    case LSM_CONFIG_WINDOW_AGE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=1 ) pDb->nWindowAge = *piVal;
+      *piVal = pDb->nWindowAge;
+      break;
+    }
+
     case LSM_CONFIG_MAX_FREELIST: {
       int *piVal = va_arg(ap, int *);
       if( *piVal>=2 && *piVal<=LSM_MAX_FREELIST_ENTRIES ){
@@ -385,6 +416,27 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_CONFIG_VALUE_LOG: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ){
+        pDb->nValueLog = *piVal;
+        if( pDb->nValueLog>0 && pDb->nValueLog<LSM_VALUEPTR_SIZE ){
+          pDb->nValueLog = LSM_VALUEPTR_SIZE;
+        }
+      }
+      *piVal = pDb->nValueLog;
+      break;
+    }
+
+    case LSM_CONFIG_VALUE_LOG_SIZE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>0 ){
+        pDb->nVlogSize = LSM_MIN(*piVal, LSM_MAX_VALUE_LOG_SIZE);
+      }
+      *piVal = pDb->nVlogSize;
+      break;
+    }
+
     case LSM_CONFIG_SET_COMPRESSION: {
       lsm_compress *p = va_arg(ap, lsm_compress *);
       if( pDb->iReader>=0 && pDb->bInFactory==0 ){
@@ -558,6 +610,54 @@ static int infoTreeSize(lsm_db *db, int *pnOldKB, int *pnNewKB){
   return LSM_OK;
 }
 
+/*
+** Implementation of lsm_info(LSM_INFO_AMPLIFICATION). See the description
+** of LSM_INFO_AMPLIFICATION in lsm.h for details.
+*/
+static int infoAmplification(
+  lsm_db *pDb,                    /* Database handle */
+  int *pnWrite,                   /* OUT: Write amplification * 100 */
+  int *pnRead,                    /* OUT: Read amplification * 100 */
+  int *pnSpace                    /* OUT: Space amplification * 100 */
+){
+  ShmHeader *pShm = pDb->pShmhdr;
+  Snapshot *pWorker;              /* Worker snapshot */
+  int bUnlock = 0;
+  int rc;
+
+  rc = infoGetWorker(pDb, &pWorker, &bUnlock);
+  if( rc==LSM_OK ){
+    Level *p;
+    i64 nTotal = 0;               /* Total pages in all segments */
+    i64 nLast = 0;                /* Pages in the oldest level */
+    i64 nFlush = pShm->nFlushWrite;
+    int nRun = 1;                 /* Number of sorted runs to search */
+
+    if( pShm->hdr1.iOldShmid
+     && pShm->hdr1.iOldLog!=lsmCheckpointLogOffset(pShm->aSnap1)
+    ){
+      nRun++;
+    }
+    for(p=lsmDbSnapshotLevel(pWorker); p; p=p->pNext){
+      int i;
+      nLast = p->lhs.nSize;
+      for(i=0; i<p->nRight; i++) nLast += p->aRhs[i].nSize;
+      nTotal += nLast;
+      nRun += 1 + p->nRight;
+    }
+
+    *pnWrite = 100;
+    if( nFlush>0 ){
+      *pnWrite = (int)(((nFlush + pShm->nMergeWrite) * 100) / nFlush);
+    }
+    *pnRead = nRun * 100;
+    *pnSpace = (int)(nLast>0 ? (nTotal * 100) / nLast : 100);
+  }
+
+  infoFreeWorker(pDb, bUnlock);
+  return rc;
+}
+
 int lsm_info(lsm_db *pDb, int eParam, ...){
   int rc = LSM_OK;
   va_list ap;
@@ -645,6 +745,22 @@ int lsm_info(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_INFO_AMPLIFICATION: {
+      int *pnWrite = va_arg(ap, int *);
+      int *pnRead = va_arg(ap, int *);
+      int *pnSpace = va_arg(ap, int *);
+      rc = infoAmplification(pDb, pnWrite, pnRead, pnSpace);
+      break;
+    }
+
+    case LSM_INFO_WRITE_STALLS: {
+      int *pnStall = va_arg(ap, int *);
+      int *pnStallWrite = va_arg(ap, int *);
+      *pnStall = (int)pDb->pShmhdr->nStall;
+      *pnStallWrite = (int)pDb->pShmhdr->nStallWrite;
+      break;
+    }
+
     default:
       rc = LSM_MISUSE;
       break;
@@ -662,15 +778,31 @@ static int doWriteOp(
 ){
   int rc = LSM_OK;                /* Return code */
   int bCommit = 0;                /* True to commit before returning */
+  int bValuePtr = 0;              /* True if pVal points into value-log */
+  u8 aPtr[LSM_VALUEPTR_SIZE];     /* Value-log pointer (if bValuePtr) */
 
   if( pDb->nTransOpen==0 ){
     bCommit = 1;
     rc = lsm_begin(pDb, 1);
   }
 
+  /* If the value-log is enabled and this is a large value, append the 
+  ** value to the value-log file. The log and in-memory tree then store a
+  ** pointer to the value instead of the value itself.  */
+  if( rc==LSM_OK && bDeleteRange==0 
+   && pDb->nValueLog>0 && nVal>pDb->nValueLog 
+  ){
+    rc = lsmFsAppendVlog(pDb->pFS, 1, (void *)pVal, nVal, aPtr);
+    if( rc==LSM_OK ){
+      bValuePtr = 1;
+      pVal = (const void *)aPtr;
+      nVal = LSM_VALUEPTR_SIZE;
+    }
+  }
+
   if( rc==LSM_OK ){
     if( bDeleteRange==0 ){
-      rc = lsmLogWrite(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
+      rc = lsmLogWrite(pDb, bValuePtr, (void *)pKey, nKey, (void *)pVal, nVal);
     }else{
       /* TODO */
     }
@@ -692,6 +824,8 @@ static int doWriteOp(
     nBefore = lsmTreeSize(pDb);
     if( bDeleteRange ){
       rc = lsmTreeDelete(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
+    }else if( bValuePtr ){
+      rc = lsmTreeInsertValuePtr(pDb, (void *)pKey, nKey, (void *)pVal);
     }else{
       rc = lsmTreeInsert(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
     }
@@ -801,6 +935,176 @@ int lsm_csr_close(lsm_cursor *p){
   return LSM_OK;
 }
 
+/*
+** Retain the current database snapshot. See lsm.h for details.
+*/
+int lsm_snapshot_retain(lsm_db *pDb, lsm_i64 *piId){
+  int rc = LSM_OK;
+
+  assert_db_state(pDb);
+  *piId = 0;
+  if( pDb->bReadonly ) return LSM_READONLY;
+
+  if( pDb->iReader<0 ){
+    rc = lsmBeginReadTrans(pDb);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmRetainSnapshot(pDb, piId);
+  }
+  dbReleaseClientSnapshot(pDb);
+
+  assert_db_state(pDb);
+  return rc;
+}
+
+/*
+** Release a snapshot retained by lsm_snapshot_retain().
+*/
+int lsm_snapshot_release(lsm_db *pDb, lsm_i64 iId){
+  return lsmReleaseSnapshot(pDb, iId);
+}
+
+/*
+** Open a cursor on a snapshot retained by lsm_snapshot_retain(). Like
+** lsm_csr_open(), open a read transaction if one is not already open.
+*/
+int lsm_csr_open_snapshot(lsm_db *pDb, lsm_i64 iId, lsm_cursor **ppCsr){
+  int rc = LSM_OK;                /* Return code */
+  MultiCursor *pCsr = 0;          /* New cursor object */
+  Retained *pRet;                 /* Retained snapshot */
+
+  assert_db_state(pDb);
+  pRet = lsmRetainedSnapshot(pDb, iId);
+  if( pRet==0 ){
+    rc = LSM_MISUSE_BKPT;
+  }else if( pDb->iReader<0 ){
+    rc = lsmBeginReadTrans(pDb);
+  }
+
+  if( rc==LSM_OK ){
+    rc = lsmMCursorNewSnapshot(pDb, pRet->pSnap, &pCsr);
+  }
+  if( rc!=LSM_OK ){
+    lsmMCursorClose(pCsr, 0);
+    dbReleaseClientSnapshot(pDb);
+  }
+
+  assert_db_state(pDb);
+  *ppCsr = (lsm_cursor *)pCsr;
+  return rc;
+}
+
+/*
+** Divide the keys with the specified prefix into nSplit parts. See lsm.h
+** for details.
+*/
+int lsm_split(
+  lsm_db *pDb, 
+  const void *pPrefix, int nPrefix, 
+  int nSplit, 
+  int (*xKey)(void *, const void *, int), 
+  void *pCtx
+){
+  int rc = LSM_OK;
+
+  assert_db_state(pDb);
+  if( pDb->iReader<0 ){
+    rc = lsmBeginReadTrans(pDb);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmSortedSplit(pDb, (void *)pPrefix, nPrefix, nSplit, xKey, pCtx);
+  }
+  dbReleaseClientSnapshot(pDb);
+
+  assert_db_state(pDb);
+  return rc;
+}
+
+/*
+** Estimate the number of keys between pLo/nLo and pHi/nHi. See lsm.h for
+** details.
+*/
+int lsm_estimate(
+  lsm_db *pDb, 
+  const void *pLo, int nLo, 
+  const void *pHi, int nHi, 
+  lsm_i64 *pnRow
+){
+  int rc = LSM_OK;
+
+  assert_db_state(pDb);
+  *pnRow = -1;
+  if( pDb->iReader<0 ){
+    rc = lsmBeginReadTrans(pDb);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmSortedEstimate(pDb, (void *)pLo, nLo, (void *)pHi, nHi, pnRow);
+  }
+  dbReleaseClientSnapshot(pDb);
+
+  assert_db_state(pDb);
+  return rc;
+}
+
+/*
+** Open a second connection to the database pDb is connected to, using the
+** same environment and configuration as pDb, and open a read transaction
+** on it that reads the same snapshot as the read transaction open on pDb.
+*/
+int lsm_clone(lsm_db *pDb, lsm_db **ppNew){
+  lsm_db *pNew = 0;
+  int rc;
+
+  assert_db_state(pDb);
+  *ppNew = 0;
+  if( pDb->pDatabase==0 ) return LSM_MISUSE_BKPT;
+  if( pDb->iReader<0 || pDb->nTransOpen>0 || pDb->bReadonly ){
+    return LSM_BUSY;
+  }
+
+  rc = lsm_new(pDb->pEnv, &pNew);
+  if( rc==LSM_OK ){
+    pNew->xCmp = pDb->xCmp;
+    pNew->eSafety = pDb->eSafety;
+    pNew->bAutowork = pDb->bAutowork;
+    pNew->nTreeLimit = pDb->nTreeLimit;
+    pNew->nMerge = pDb->nMerge;
+    pNew->eMergePolicy = pDb->eMergePolicy;
+    pNew->nSizeRatio = pDb->nSizeRatio;
+    pNew->nWindowAge = pDb->nWindowAge;
+    pNew->bUseLog = pDb->bUseLog;
+    pNew->nDfltPgsz = pDb->nDfltPgsz;
+    pNew->nDfltBlksz = pDb->nDfltBlksz;
+    pNew->nMaxFreelist = pDb->nMaxFreelist;
+    pNew->iMmap = pDb->iMmap;
+    pNew->nAutockpt = pDb->nAutockpt;
+    pNew->bMultiProc = pDb->bMultiProc;
+    pNew->nValueLog = pDb->nValueLog;
+    pNew->nVlogSize = pDb->nVlogSize;
+    pNew->xLog = pDb->xLog;
+    pNew->pLogCtx = pDb->pLogCtx;
+
+    /* The clone shares the compression hooks of pDb. It does not invoke
+    ** their destructors, as pDb remains responsible for that.  */
+    pNew->compress = pDb->compress;
+    pNew->compress.xFree = 0;
+    pNew->factory = pDb->factory;
+    pNew->factory.xFree = 0;
+
+    rc = lsm_open(pNew, lsmDbFilename(pDb));
+  }
+  if( rc==LSM_OK ){
+    rc = lsmBeginReadTransFrom(pNew, pDb);
+  }
+
+  if( rc!=LSM_OK ){
+    lsm_close(pNew);
+    pNew = 0;
+  }
+  *ppNew = pNew;
+  return rc;
+}
+
 /*
 ** Attempt to seek the cursor to the database entry specified by pKey/nKey.
 ** If an error occurs (e.g. an OOM or IO error), return an LSM error code.
@@ -810,6 +1114,14 @@ int lsm_csr_seek(lsm_cursor *pCsr, const void *pKey, int nKey, int eSeek){
   return lsmMCursorSeek((MultiCursor *)pCsr, 0, (void *)pKey, nKey, eSeek);
 }
 
+/*
+** Restrict the cursor to entries with keys that begin with the nPrefix
+** byte prefix pPrefix. Or, if nPrefix is zero, remove any restriction.
+*/
+int lsm_csr_prefix(lsm_cursor *pCsr, const void *pPrefix, int nPrefix){
+  return lsmMCursorPrefix((MultiCursor *)pCsr, (void *)pPrefix, nPrefix);
+}
+
 int lsm_csr_next(lsm_cursor *pCsr){
   return lsmMCursorNext((MultiCursor *)pCsr);
 }
@@ -923,12 +1235,22 @@ int lsm_commit(lsm_db *pDb, int iLevel){
 
   if( iLevel<pDb->nTransOpen ){
     if( iLevel==0 ){
-      /* Commit the transaction to disk. */
-      if( rc==LSM_OK ) rc = lsmLogCommit(pDb);
+      u32 iCommit = 0;
+
+      /* Commit the transaction to disk. If the safety level is FULL, sync 
+      ** the log file only after the WRITER lock has been released. This 
+      ** allows other connections to write to the log while the sync is in
+      ** progress, and the syncs for concurrent commits to be merged.  
+      **
+      ** Any values appended to the value-log by this transaction are synced
+      ** before the commit record is written, so that the log never refers
+      ** to a value that may be lost in a crash.  */
+      rc = lsmFsSyncVlog(pDb->pFS, pDb->eSafety!=LSM_SAFETY_OFF);
+      if( rc==LSM_OK ) rc = lsmLogCommit(pDb, &iCommit);
+      lsmFinishWriteTrans(pDb, (rc==LSM_OK));
       if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_FULL ){
-        rc = lsmFsSyncLog(pDb->pFS);
+        rc = lsmLogSync(pDb, iCommit);
       }
-      lsmFinishWriteTrans(pDb, (rc==LSM_OK));
     }
     pDb->nTransOpen = iLevel;
   }
@@ -54,6 +54,7 @@ struct Database {
   lsm_file *pFile;                /* Used for locks/shm in multi-proc mode */
   LsmFile *pLsmFile;              /* List of deferred closes */
   lsm_mutex *pClientMutex;        /* Protects the apShmChunk[] and pConn */
+  lsm_mutex *pSyncMutex;          /* Serializes log syncs (lsmLogSync) */
   int nShmChunk;                  /* Number of entries in apShmChunk[] array */
   void **apShmChunk;              /* Array of "shared" memory regions */
   lsm_db *pConn;                  /* List of connections to this db. */
@@ -146,6 +147,7 @@ static void freeDatabase(lsm_env *pEnv, Database *p){
   if( p ){
     /* Free the mutexes */
     lsmMutexDel(pEnv, p->pClientMutex);
+    lsmMutexDel(pEnv, p->pSyncMutex);
 
     if( p->pFile ){
       lsmEnvClose(pEnv, p->pFile);
@@ -463,6 +465,7 @@ int lsmDbDatabaseConnect(
         p->nName = nName;
         memcpy((void *)p->zName, zName, nName+1);
         rc = lsmMutexNew(pEnv, &p->pClientMutex);
+        if( rc==LSM_OK ) rc = lsmMutexNew(pEnv, &p->pSyncMutex);
       }
 
       /* If nothing has gone wrong so far, open the shared fd. And if that
@@ -761,12 +764,48 @@ static int findFreeblock(lsm_db *pDb, i64 iInUse, int bNotOne, int *piRet){
 ** If successful, *piBlk is set to the block number allocated and LSM_OK is
 ** returned. Otherwise, *piBlk is zeroed and an lsm error code returned.
 */
+/*
+** Set *piInUse to the smallest snapshot id that is either:
+**
+**   * Currently in use by a database client,
+**   * May be used by a database client in the future, or
+**   * Is the most recently checkpointed snapshot (i.e. the one that will
+**     be used following recovery if a failure occurs at this point).
+**
+** If there is no checkpointed snapshot, iDflt is used in its place.
+*/
+static int dbSnapshotInUse(lsm_db *pDb, i64 iDflt, i64 *piInUse){
+  i64 iInUse = 0;                 /* Snapshot id still in use */
+  i64 iSynced = 0;                /* Snapshot id synced to disk */
+  int rc;
+
+  rc = lsmCheckpointSynced(pDb, &iSynced, 0, 0);
+  if( rc==LSM_OK && iSynced==0 ) iSynced = iDflt;
+  iInUse = iSynced;
+  if( rc==LSM_OK && pDb->iReader>=0 ){
+    assert( pDb->pClient );
+    iInUse = LSM_MIN(iInUse, pDb->pClient->iId);
+  }
+  if( rc==LSM_OK && iInUse>0 ) rc = firstSnapshotInUse(pDb, &iInUse);
+
+#ifdef LSM_LOG_FREELIST
+  {
+    lsmLogMessage(pDb, 0, "dbSnapshotInUse(): "
+        "snapshot-in-use: %lld (iSynced=%lld) (client-id=%lld)", 
+        iInUse, iSynced, (pDb->iReader>=0 ? pDb->pClient->iId : 0)
+    );
+  }
+#endif
+
+  *piInUse = iInUse;
+  return rc;
+}
+
 int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
   Snapshot *p = pDb->pWorker;
   int iRet = 0;                   /* Block number of allocated block */
   int rc = LSM_OK;
   i64 iInUse = 0;                 /* Snapshot id still in use */
-  i64 iSynced = 0;                /* Snapshot id synced to disk */
 
   assert( p );
 
@@ -782,31 +821,8 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
   }
 #endif
 
-  /* Set iInUse to the smallest snapshot id that is either:
-  **
-  **   * Currently in use by a database client,
-  **   * May be used by a database client in the future, or
-  **   * Is the most recently checkpointed snapshot (i.e. the one that will
-  **     be used following recovery if a failure occurs at this point).
-  */
-  rc = lsmCheckpointSynced(pDb, &iSynced, 0, 0);
-  if( rc==LSM_OK && iSynced==0 ) iSynced = p->iId;
-  iInUse = iSynced;
-  if( rc==LSM_OK && pDb->iReader>=0 ){
-    assert( pDb->pClient );
-    iInUse = LSM_MIN(iInUse, pDb->pClient->iId);
-  }
-  if( rc==LSM_OK ) rc = firstSnapshotInUse(pDb, &iInUse);
-
-#ifdef LSM_LOG_FREELIST
-  {
-    lsmLogMessage(pDb, 0, "lsmBlockAllocate(): "
-        "snapshot-in-use: %lld (iSynced=%lld) (client-id=%lld)", 
-        iInUse, iSynced, (pDb->iReader>=0 ? pDb->pClient->iId : 0)
-    );
-  }
-#endif
-
+  /* Set iInUse to the smallest snapshot id that is still in use. */
+  if( rc==LSM_OK ) rc = dbSnapshotInUse(pDb, p->iId, &iInUse);
 
   /* Unless there exists a read-only transaction (which prevents us from
   ** recycling any blocks regardless, query the free block list for a 
@@ -893,6 +909,39 @@ int lsmBlockRefree(lsm_db *pDb, int iBlk){
   return rc;
 }
 
+/*
+** This function is called by a connection holding the CHECKPOINTER lock
+** after a checkpoint has been written to the database file. If a worker
+** has determined that no snapshot newer than ShmHeader.iVlogFreeId refers
+** to the previous value-log generation (see sortedVlogCheck()) and no 
+** older snapshot may be used by a client or by recovery, delete the file
+** used to store the previous generation. This allows the next value-log
+** generation to be started.
+*/
+static int dbDeleteVlog(lsm_db *pDb){
+  ShmHeader *pShm = pDb->pShmhdr;
+  u32 iOld = pShm->iVlogOld;
+  int rc = LSM_OK;
+
+  if( iOld && pShm->iVlogFree==iOld ){
+    i64 iInUse = 0;
+    int bRotrans = 0;
+    lsmShmBarrier(pDb);
+    rc = dbSnapshotInUse(pDb, 0, &iInUse);
+    if( rc==LSM_OK && iInUse>pShm->iVlogFreeId ){
+      rc = lsmDetectRoTrans(pDb, &bRotrans);
+      if( rc==LSM_OK && bRotrans==0 ){
+        rc = lsmFsDeleteVlog(pDb->pFS, iOld);
+        if( rc==LSM_OK ){
+          lsmShmBarrier(pDb);
+          pShm->iVlogOld = 0;
+        }
+      }
+    }
+  }
+  return rc;
+}
+
 /*
 ** If required, copy a database checkpoint from shared memory into the
 ** database itself.
@@ -963,6 +1012,8 @@ int lsmCheckpointWrite(lsm_db *pDb, int bTruncate, u32 *pnWrite){
     }
   }
 
+  if( rc==LSM_OK ) rc = dbDeleteVlog(pDb);
+
   lsmShmLock(pDb, LSM_LOCK_CHECKPOINTER, LSM_LOCK_UNLOCK, 0);
   if( pnWrite && rc==LSM_OK ) *pnWrite = nWrite;
   return rc;
@@ -1128,8 +1179,14 @@ int lsmCheckCompressionId(lsm_db *pDb, u32 iReq){
 /*
 ** Begin a read transaction. This function is a no-op if the connection
 ** passed as the only argument already has an open read transaction.
+**
+** This is used both by lsmBeginReadTrans() and by lsmBeginWriteTrans().
+** Only the former waits for transactions committed with safety=FULL to
+** be synced to disk. A write transaction may read data that is not yet
+** durable, but since the log is written sequentially, its own COMMIT 
+** record can only become durable along with that data.
 */
-int lsmBeginReadTrans(lsm_db *pDb){
+static int dbBeginReadTrans(lsm_db *pDb){
   const int MAX_READLOCK_ATTEMPTS = 10;
   const int nMaxAttempt = (pDb->bRoTrans ? 1 : MAX_READLOCK_ATTEMPTS);
 
@@ -1220,6 +1277,75 @@ if( rc==LSM_OK && pDb->pClient ){
   return rc;
 }
 
+/*
+** Begin a read transaction. This function is a no-op if the connection
+** passed as the only argument already has an open read transaction.
+**
+** The new read transaction does not see any transaction committed with
+** safety=FULL until it has been synced to disk. If such a sync is still
+** outstanding, this function waits for it, or performs it itself.
+*/
+int lsmBeginReadTrans(lsm_db *pDb){
+  int rc = LSM_OK;
+  if( pDb->iReader<0 ){
+    rc = dbBeginReadTrans(pDb);
+    if( rc==LSM_OK && pDb->bRoTrans==0 ){
+      rc = lsmLogSyncDurable(pDb);
+      if( rc!=LSM_OK ) dbReleaseReadlock(pDb);
+    }
+  }
+  return rc;
+}
+
+/*
+** Open a read transaction on connection pDb that reads the same database
+** snapshot and in-memory tree as the read transaction open on connection
+** pOther. Both connections must be connected to the same database. As 
+** pOther holds a SHARED lock on its READER slot, the values stored in the
+** slot cannot change while it is open. So pDb may take a SHARED lock on
+** the same slot without checking them again.
+**
+** LSM_BUSY is returned if pOther does not have a read transaction open, 
+** has a write transaction open, or is a read-only connection.
+*/
+int lsmBeginReadTransFrom(lsm_db *pDb, lsm_db *pOther){
+  int rc;
+
+  assert( pDb->iReader<0 && pDb->pWorker==0 && pDb->pCsr==0 );
+  if( pOther->iReader<0 || pOther->nTransOpen>0 || pOther->bReadonly
+   || pOther->pDatabase!=pDb->pDatabase
+  ){
+    return LSM_BUSY;
+  }
+
+  rc = lsmShmLock(pDb, LSM_LOCK_READER(pOther->iReader), LSM_LOCK_SHARED, 0);
+  if( rc==LSM_OK ){
+    pDb->iReader = pOther->iReader;
+    memcpy(&pDb->treehdr, &pOther->treehdr, sizeof(TreeHeader));
+    lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
+    pDb->pClient = 0;
+    lsmMCursorFreeCache(pDb);
+    lsmFsPurgeCache(pDb->pFS);
+    memcpy(pDb->aSnapshot, pOther->aSnapshot, sizeof(pDb->aSnapshot));
+    rc = lsmCheckpointDeserialize(pDb, 0, pDb->aSnapshot, &pDb->pClient);
+    if( rc==LSM_OK ){
+      rc = lsmCheckCompressionId(pDb, pDb->pClient->iCmpId);
+    }
+    if( rc==LSM_OK ){
+      rc = lsmShmCacheChunks(pDb, pDb->treehdr.nChunk);
+    }
+    if( rc!=LSM_OK ) dbReleaseReadlock(pDb);
+  }
+  return rc;
+}
+
+/*
+** Return the full path to the database file that pDb is connected to.
+*/
+const char *lsmDbFilename(lsm_db *pDb){
+  return pDb->pDatabase->zName;
+}
+
 /*
 ** This function is used by a read-write connection to determine if there
 ** are currently one or more read-only transactions open on the database
@@ -1348,7 +1474,7 @@ int lsmBeginWriteTrans(lsm_db *pDb){
 
   /* If there is no read-transaction open, open one now. */
   if( pDb->iReader<0 ){
-    rc = lsmBeginReadTrans(pDb);
+    rc = dbBeginReadTrans(pDb);
   }
 
   /* Attempt to take the WRITER lock */
@@ -1431,6 +1557,17 @@ int lsmFinishWriteTrans(lsm_db *pDb, int bCommit){
 }
 
 
+/*
+** Enter and leave the mutex used to serialize log syncs by connections
+** within this process. See lsmLogSync().
+*/
+void lsmDbSyncMutexEnter(lsm_db *pDb){
+  lsmMutexEnter(pDb->pEnv, pDb->pDatabase->pSyncMutex);
+}
+void lsmDbSyncMutexLeave(lsm_db *pDb){
+  lsmMutexLeave(pDb->pEnv, pDb->pDatabase->pSyncMutex);
+}
+
 /*
 ** Return non-zero if the caller is holding the client mutex.
 */
@@ -1515,6 +1652,339 @@ int lsmReadlock(lsm_db *db, i64 iLsm, u32 iShmMin, u32 iShmMax){
   return rc;
 }
 
+/*
+** Return true if connection db holds a lock on RETAIN slot iSlot.
+*/
+static int retainSlotHeld(lsm_db *db, int iSlot){
+  Retained *p;
+  for(p=db->pRetained; p; p=p->pNext){
+    if( p->iSlot==iSlot ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Obtain a SHARED lock on a RETAIN slot containing snapshot id iId. If no
+** slot already contains iId, claim a free slot for it. Set *piSlot to the 
+** index of the locked slot and return LSM_OK if successful. Return LSM_BUSY 
+** if all slots are in use, or some other LSM error code if an error occurs.
+*/
+static int retainLock(lsm_db *db, i64 iId, int *piSlot){
+  ShmHeader *pShm = db->pShmhdr;
+  int iSlot = -1;
+  int rc = LSM_OK;
+  int i;
+
+  /* Search for an exact match. */
+  for(i=0; iSlot<0 && rc==LSM_OK && i<LSM_LOCK_NRETAIN; i++){
+    if( pShm->aRetain[i]==iId ){
+      rc = lsmShmLock(db, LSM_LOCK_RETAIN(i), LSM_LOCK_SHARED, 0);
+      if( rc==LSM_OK ){
+        if( pShm->aRetain[i]==iId ){
+          iSlot = i;
+        }else{
+          lsmShmLock(db, LSM_LOCK_RETAIN(i), LSM_LOCK_UNLOCK, 0);
+        }
+      }else if( rc==LSM_BUSY ){
+        rc = LSM_OK;
+      }
+    }
+  }
+
+  /* Try to obtain a write-lock on each slot not already used by this 
+  ** connection, in order. If successful, set the slot value to iId.  */
+  for(i=0; iSlot<0 && rc==LSM_OK && i<LSM_LOCK_NRETAIN; i++){
+    if( retainSlotHeld(db, i) ) continue;
+    rc = lsmShmLock(db, LSM_LOCK_RETAIN(i), LSM_LOCK_EXCL, 0);
+    if( rc==LSM_BUSY ){
+      rc = LSM_OK;
+    }else if( rc==LSM_OK ){
+      pShm->aRetain[i] = iId;
+      rc = lsmShmLock(db, LSM_LOCK_RETAIN(i), LSM_LOCK_SHARED, 0);
+      assert( rc!=LSM_BUSY );
+      if( rc==LSM_OK ) iSlot = i;
+    }
+  }
+
+  if( rc==LSM_OK && iSlot<0 ){
+    rc = LSM_BUSY;
+  }
+  *piSlot = iSlot;
+  return rc;
+}
+
+/*
+** Free a Retained object and release the RETAIN slot lock it holds.
+*/
+static void retainFree(lsm_db *db, Retained *p){
+  lsmShmLock(db, LSM_LOCK_RETAIN(p->iSlot), LSM_LOCK_UNLOCK, 0);
+  lsmFreeSnapshot(db->pEnv, p->pSnap);
+  lsmFree(db->pEnv, p->aCkpt);
+  lsmFree(db->pEnv, p);
+}
+
+/*
+** Retain the database snapshot used by the current read transaction.
+** Until it is released, the blocks used by the snapshot are not reused
+** by any connection. If successful, set *piId to the snapshot id and 
+** return LSM_OK. Return LSM_BUSY if all RETAIN slots are in use by other 
+** snapshots, or some other LSM error code if an error occurs.
+**
+** Only the contents of the database file are retained. Data that has not
+** yet been flushed from the in-memory tree is not part of the snapshot.
+*/
+int lsmRetainSnapshot(lsm_db *db, i64 *piId){
+  Retained *p;
+  int rc = LSM_OK;
+  i64 iId;
+  int iSlot;
+
+  assert( db->iReader>=0 && db->pClient && db->bRoTrans==0 );
+  iId = db->pClient->iId;
+
+  for(p=db->pRetained; p; p=p->pNext){
+    if( p->iId==iId ){
+      p->nRef++;
+      *piId = iId;
+      return LSM_OK;
+    }
+  }
+
+  rc = retainLock(db, iId, &iSlot);
+  if( rc==LSM_OK ){
+    p = (Retained *)lsmMallocZeroRc(db->pEnv, sizeof(Retained), &rc);
+    if( p ){
+      p->iId = iId;
+      p->iSlot = iSlot;
+      p->nRef = 1;
+      rc = lsmCheckpointDeserialize(db, 0, db->aSnapshot, &p->pSnap);
+    }
+    if( rc==LSM_OK ){
+      int nCkpt = lsmCheckpointNInt(db->aSnapshot);
+      p->aCkpt = (u32 *)lsmMallocRc(db->pEnv, nCkpt*sizeof(u32), &rc);
+      if( p->aCkpt ) memcpy(p->aCkpt, db->aSnapshot, nCkpt*sizeof(u32));
+    }
+    if( rc==LSM_OK ){
+      rc = lsmFsVlogState(db->pFS, p->aVlogGen, p->aVlogEnd);
+    }
+    if( rc==LSM_OK ){
+      assert( p->pSnap->iId==iId );
+      p->pNext = db->pRetained;
+      db->pRetained = p;
+      *piId = iId;
+    }else if( p ){
+      retainFree(db, p);
+    }else{
+      lsmShmLock(db, LSM_LOCK_RETAIN(iSlot), LSM_LOCK_UNLOCK, 0);
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Release a reference to the snapshot with id iId obtained by an earlier 
+** call to lsmRetainSnapshot(). It is an error to release the last 
+** reference to a snapshot while there are open cursors using it.
+*/
+int lsmReleaseSnapshot(lsm_db *db, i64 iId){
+  Retained **pp;
+  Retained *p;
+
+  for(pp=&db->pRetained; *pp && (*pp)->iId!=iId; pp=&(*pp)->pNext);
+  p = *pp;
+  if( p==0 ) return LSM_MISUSE_BKPT;
+
+  if( p->nRef>1 ){
+    p->nRef--;
+  }else{
+    if( lsmMCursorUsesSnapshot(db, p->pSnap) ) return LSM_MISUSE_BKPT;
+    *pp = p->pNext;
+    retainFree(db, p);
+  }
+  return LSM_OK;
+}
+
+/*
+** Release all snapshots retained by connection db. This is called when
+** the connection is closed.
+*/
+void lsmReleaseAllSnapshots(lsm_db *db){
+  Retained *p;
+  Retained *pNext;
+  for(p=db->pRetained; p; p=pNext){
+    pNext = p->pNext;
+    retainFree(db, p);
+  }
+  db->pRetained = 0;
+}
+
+/*
+** Return the object for the snapshot with id iId retained by connection 
+** db, or NULL if there is no such snapshot.
+*/
+Retained *lsmRetainedSnapshot(lsm_db *db, i64 iId){
+  Retained *p;
+  for(p=db->pRetained; p; p=p->pNext){
+    if( p->iId==iId ) break;
+  }
+  return p;
+}
+
+/*
+** An lsm_backup handle. See lsm_backup_open().
+*/
+struct lsm_backup {
+  lsm_db *pDb;                    /* Connection that owns this backup */
+  Retained *pRet;                 /* Snapshot being copied */
+  int *aBlk;                      /* Blocks to copy, in ascending order */
+  int nBlk;                       /* Size of aBlk[] */
+  int iNext;                      /* Index of next entry in aBlk[] to copy */
+  u8 *aBuf;                       /* Buffer for data returned by _step() */
+  int nBuf;                       /* Size of aBuf[] in bytes */
+  int iVlog;                      /* Index in Retained.aVlogGen[] to copy */
+  u32 aVlogOff[2];                /* Next offset of each vlog gen. to copy */
+};
+
+/*
+** Open a backup of retained snapshot iId. See lsm.h for details.
+*/
+int lsm_backup_open(
+  lsm_db *pDb, 
+  lsm_i64 iId, 
+  lsm_i64 iBase, 
+  lsm_backup **ppBackup
+){
+  int rc = LSM_OK;
+  Retained *pRet;
+  Retained *pBase = 0;
+  lsm_backup *p;
+
+  *ppBackup = 0;
+  pRet = lsmRetainedSnapshot(pDb, iId);
+  if( iBase ) pBase = lsmRetainedSnapshot(pDb, iBase);
+  if( pRet==0 || (iBase && (pBase==0 || iBase>iId)) ){
+    return LSM_MISUSE_BKPT;
+  }
+
+  p = (lsm_backup *)lsmMallocZeroRc(pDb->pEnv, sizeof(lsm_backup), &rc);
+  if( p ){
+    int i;
+    p->nBuf = LSM_MAX(lsmFsBlockSize(pDb->pFS), 2*LSM_META_PAGE_SIZE);
+    p->pDb = pDb;
+    p->pRet = pRet;
+    p->aBuf = (u8 *)lsmMallocRc(pDb->pEnv, p->nBuf, &rc);
+
+    /* Only value-log data appended since snapshot iBase is copied */
+    for(i=0; i<2; i++){
+      p->aVlogOff[i] = LSM_VLOG_HDRSIZE;
+      if( pBase && pRet->aVlogGen[i] ){
+        int j;
+        for(j=0; j<2; j++){
+          if( pBase->aVlogGen[j]==pRet->aVlogGen[i] ){
+            p->aVlogOff[i] = pBase->aVlogEnd[j];
+          }
+        }
+      }
+    }
+  }
+  if( rc==LSM_OK ){
+    rc = lsmFsSnapshotBlocks(pDb->pFS, 
+        pRet->pSnap, (pBase ? pBase->pSnap : 0), &p->aBlk, &p->nBlk
+    );
+  }
+
+  if( rc==LSM_OK ){
+    pRet->nRef++;
+    pDb->nBackup++;
+    *ppBackup = p;
+  }else if( p ){
+    lsmFree(pDb->pEnv, p->aBlk);
+    lsmFree(pDb->pEnv, p->aBuf);
+    lsmFree(pDb->pEnv, p);
+  }
+  return rc;
+}
+
+/*
+** Return the next buffer of backup data. The database blocks are returned
+** first, followed by the value-log data, the value-log file headers and
+** finally the two meta pages.
+*/
+int lsm_backup_step(
+  lsm_backup *p, 
+  const char **pzSuffix,
+  lsm_i64 *piOff, 
+  const void **ppData, 
+  int *pnData
+){
+  Retained *pRet = p->pRet;
+  int rc = LSM_OK;
+
+  *pzSuffix = "";
+  *ppData = 0;
+  *piOff = 0;
+  *pnData = 0;
+  while( rc==LSM_OK && *pnData==0 && p->iNext<=p->nBlk+3 ){
+    int iPhase = p->iNext - p->nBlk;
+    if( iPhase<0 ){
+      int iBlk = p->aBlk[p->iNext++];
+      rc = lsmFsReadBlock(p->pDb->pFS, iBlk, p->aBuf, piOff, pnData);
+    }else if( iPhase==0 ){
+      /* Copy the next chunk of value-log data, if any */
+      int i = p->iVlog;
+      if( i>=2 ){
+        p->iNext++;
+      }else if( pRet->aVlogGen[i]==0 || p->aVlogOff[i]>=pRet->aVlogEnd[i] ){
+        p->iVlog++;
+      }else{
+        u32 iGen = pRet->aVlogGen[i];
+        u32 iOff = p->aVlogOff[i];
+        int nRead = (int)LSM_MIN((u32)p->nBuf, pRet->aVlogEnd[i] - iOff);
+        rc = lsmFsReadVlogFile(p->pDb->pFS, iGen, iOff, p->aBuf, nRead);
+        *pzSuffix = lsmFsVlogSuffix(iGen);
+        *piOff = iOff;
+        *pnData = nRead;
+        p->aVlogOff[i] += nRead;
+      }
+    }else if( iPhase<=2 ){
+      /* The header of value-log generation aVlogGen[iPhase-1], if any */
+      u32 iGen = pRet->aVlogGen[iPhase-1];
+      if( iGen ){
+        *pzSuffix = lsmFsVlogSuffix(iGen);
+        *pnData = lsmFsVlogHeader(iGen, pRet->aVlogEnd[iPhase-1], p->aBuf);
+      }
+      p->iNext++;
+    }else{
+      lsmCheckpointBackupMeta(pRet->aCkpt, p->aBuf);
+      memcpy(&p->aBuf[LSM_META_PAGE_SIZE], p->aBuf, LSM_META_PAGE_SIZE);
+      *pnData = 2*LSM_META_PAGE_SIZE;
+      p->iNext++;
+    }
+  }
+
+  if( rc==LSM_OK && *pnData>0 ){
+    *ppData = (const void *)p->aBuf;
+  }
+  return rc;
+}
+
+/*
+** Close a backup handle opened by lsm_backup_open().
+*/
+int lsm_backup_close(lsm_backup *p){
+  int rc = LSM_OK;
+  if( p ){
+    lsm_db *pDb = p->pDb;
+    rc = lsmReleaseSnapshot(pDb, p->pRet->iId);
+    pDb->nBackup--;
+    lsmFree(pDb->pEnv, p->aBlk);
+    lsmFree(pDb->pEnv, p->aBuf);
+    lsmFree(pDb->pEnv, p);
+  }
+  return rc;
+}
+
 /*
 ** This is used to check if there exists a read-lock locking a particular
 ** version of either the in-memory tree or database file. 
@@ -1566,6 +2036,7 @@ static int firstSnapshotInUse(
 ){
   ShmHeader *pShm = db->pShmhdr;
   i64 iInUse = *piInUse;
+  Retained *pRet;
   int i;
 
   assert( iInUse>0 );
@@ -1589,6 +2060,27 @@ static int firstSnapshotInUse(
     }
   }
 
+  /* Snapshots retained by this connection are in use. Those retained by
+  ** other connections are in use if the corresponding RETAIN slot is 
+  ** locked. As for the READER slots above, stale slots are cleared.  */
+  for(pRet=db->pRetained; pRet; pRet=pRet->pNext){
+    iInUse = LSM_MIN(iInUse, pRet->iId);
+  }
+  for(i=0; i<LSM_LOCK_NRETAIN; i++){
+    i64 iThis = pShm->aRetain[i];
+    if( iThis!=0 && iInUse>iThis && retainSlotHeld(db, i)==0 ){
+      int rc = lsmShmLock(db, LSM_LOCK_RETAIN(i), LSM_LOCK_EXCL, 0);
+      if( rc==LSM_OK ){
+        pShm->aRetain[i] = 0;
+        lsmShmLock(db, LSM_LOCK_RETAIN(i), LSM_LOCK_UNLOCK, 0);
+      }else if( rc==LSM_BUSY ){
+        iInUse = iThis;
+      }else{
+        return rc;
+      }
+    }
+  }
+
   *piInUse = iInUse;
   return LSM_OK;
 }
@@ -1618,6 +2110,13 @@ int lsmDbMultiProc(lsm_db *pDb){
   return pDb->pDatabase && pDb->pDatabase->bMultiProc;
 }
 
+/*
+** Return true if connection pDb is currently holding the WRITER lock.
+*/
+int lsmDbHoldsWriter(lsm_db *pDb){
+  return (pDb->mExcl & ((u64)1 << (LSM_LOCK_WRITER-1)))!=0;
+}
+
 
 /*************************************************************************
 **************************************************************************
@@ -1738,13 +2237,15 @@ int lsmShmTestLock(
   u64 mask = 0;
 
   for(i=iLock; i<(iLock+nLock); i++){
-    mask |= ((u64)1 << (iLock-1));
-    if( eOp==LSM_LOCK_EXCL ) mask |= ((u64)1 << (iLock+32-1));
+    mask |= ((u64)1 << (i-1));
   }
 
   lsmMutexEnter(db->pEnv, p->pClientMutex);
   for(pIter=p->pConn; pIter; pIter=pIter->pNext){
-    if( pIter!=db && (pIter->mLock & mask) ) break;
+    if( pIter!=db ){
+      if( pIter->mExcl & mask ) break;
+      if( eOp==LSM_LOCK_EXCL && (pIter->mShared & mask) ) break;
+    }
   }
 
   if( pIter ){
@@ -1773,20 +2274,19 @@ int lsmShmLock(
   int bBlock                      /* True for a blocking lock */
 ){
   lsm_db *pIter;
-  const u64 me = ((u64)1 << (iLock-1));
-  const u64 ms = ((u64)1 << (iLock+32-1));
+  const u64 m = ((u64)1 << (iLock-1));
   int rc = LSM_OK;
   Database *p = db->pDatabase;
 
   assert( eOp!=LSM_LOCK_EXCL || p->bReadonly==0 );
-  assert( iLock>=1 && iLock<=LSM_LOCK_RWCLIENT(LSM_LOCK_NRWCLIENT-1) );
-  assert( LSM_LOCK_RWCLIENT(LSM_LOCK_NRWCLIENT-1)<=32 );
+  assert( iLock>=1 && iLock<=LSM_LOCK_LAST );
+  assert( LSM_LOCK_LAST<=64 );
   assert( eOp==LSM_LOCK_UNLOCK || eOp==LSM_LOCK_SHARED || eOp==LSM_LOCK_EXCL );
 
   /* Check for a no-op. Proceed only if this is not one of those. */
-  if( (eOp==LSM_LOCK_UNLOCK && (db->mLock & (me|ms))!=0)
-   || (eOp==LSM_LOCK_SHARED && (db->mLock & (me|ms))!=ms)
-   || (eOp==LSM_LOCK_EXCL   && (db->mLock & me)==0)
+  if( (eOp==LSM_LOCK_UNLOCK && (db->mShared & m)!=0)
+   || (eOp==LSM_LOCK_SHARED && ((db->mShared & m)==0 || (db->mExcl & m)))
+   || (eOp==LSM_LOCK_EXCL   && (db->mExcl & m)==0)
   ){
     int nExcl = 0;                /* Number of connections holding EXCLUSIVE */
     int nShared = 0;              /* Number of connections holding SHARED */
@@ -1795,25 +2295,26 @@ int lsmShmLock(
     /* Figure out the locks currently held by this process on iLock, not
     ** including any held by connection db.  */
     for(pIter=p->pConn; pIter; pIter=pIter->pNext){
-      assert( (pIter->mLock & me)==0 || (pIter->mLock & ms)!=0 );
+      assert( (pIter->mExcl & m)==0 || (pIter->mShared & m)!=0 );
       if( pIter!=db ){
-        if( pIter->mLock & me ){
+        if( pIter->mExcl & m ){
           nExcl++;
-        }else if( pIter->mLock & ms ){
+        }else if( pIter->mShared & m ){
           nShared++;
         }
       }
     }
     assert( nExcl==0 || nExcl==1 );
     assert( nExcl==0 || nShared==0 );
-    assert( nExcl==0 || (db->mLock & (me|ms))==0 );
+    assert( nExcl==0 || (db->mShared & m)==0 );
 
     switch( eOp ){
       case LSM_LOCK_UNLOCK:
         if( nShared==0 ){
           lockSharedFile(db->pEnv, p, iLock, LSM_LOCK_UNLOCK);
         }
-        db->mLock &= ~(me|ms);
+        db->mExcl &= ~m;
+        db->mShared &= ~m;
         break;
 
       case LSM_LOCK_SHARED:
@@ -1824,8 +2325,8 @@ int lsmShmLock(
             rc = lockSharedFile(db->pEnv, p, iLock, LSM_LOCK_SHARED);
           }
           if( rc==LSM_OK ){
-            db->mLock |= ms;
-            db->mLock &= ~me;
+            db->mShared |= m;
+            db->mExcl &= ~m;
           }
         }
         break;
@@ -1837,7 +2338,8 @@ int lsmShmLock(
         }else{
           rc = lockSharedFile(db->pEnv, p, iLock, LSM_LOCK_EXCL);
           if( rc==LSM_OK ){
-            db->mLock |= (me|ms);
+            db->mExcl |= m;
+            db->mShared |= m;
           }
         }
         break;
@@ -1852,11 +2354,10 @@ int lsmShmLock(
 #ifdef LSM_DEBUG
 
 int shmLockType(lsm_db *db, int iLock){
-  const u64 me = ((u64)1 << (iLock-1));
-  const u64 ms = ((u64)1 << (iLock+32-1));
+  const u64 m = ((u64)1 << (iLock-1));
 
-  if( db->mLock & me ) return LSM_LOCK_EXCL;
-  if( db->mLock & ms ) return LSM_LOCK_SHARED;
+  if( db->mExcl & m ) return LSM_LOCK_EXCL;
+  if( db->mShared & m ) return LSM_LOCK_SHARED;
   return LSM_LOCK_UNLOCK;
 }
 
@@ -1876,7 +2377,6 @@ int lsmShmAssertLock(lsm_db *db, int iLock, int eOp){
   int eHave;
 
   assert( iLock>=1 && iLock<=LSM_LOCK_READER(LSM_LOCK_NREADER-1) );
-  assert( iLock<=16 );
   assert( eOp==LSM_LOCK_UNLOCK || eOp==LSM_LOCK_SHARED || eOp==LSM_LOCK_EXCL );
 
   eHave = shmLockType(db, iLock);
@@ -101,6 +101,7 @@
 
 typedef struct SegmentPtr SegmentPtr;
 typedef struct Blob Blob;
+typedef struct KeyPrefix KeyPrefix;
 
 struct Blob {
   lsm_env *pEnv;
@@ -109,6 +110,37 @@ struct Blob {
   int nAlloc;
 };
 
+/*
+** The smallest and largest keys stored in the left-hand segment of a level
+** that is not undergoing a merge. Computed by sortedLevelRange() the first
+** time the level is searched and cached in Level.pRange. The key buffers
+** are stored in the same allocation as the structure itself.
+*/
+struct KeyRange {
+  int iMinTopic;                /* Topic of smallest key */
+  void *pMin;                   /* Smallest key */
+  int nMin;                     /* Size of pMin in bytes */
+  int iMaxTopic;                /* Topic of largest key */
+  void *pMax;                   /* Largest key */
+  int nMax;                     /* Size of pMax in bytes */
+};
+
+/*
+** The first 8 bytes of the current key of a component cursor of a
+** multi-cursor, interpreted as a big-endian integer (keys shorter than 8
+** bytes are padded with 0x00 bytes). Since keys are compared using 
+** memcmp(), if the prefixes of two keys are not equal, comparing the 
+** prefixes gives the same result as comparing the keys themselves.
+**
+** MultiCursor.aPrefix[] contains one of these for each component cursor.
+** The value is computed the first time the component's key is compared 
+** and reused until the component is moved.
+*/
+struct KeyPrefix {
+  u64 iPrefix;                  /* First 8 bytes of key */
+  int bValid;                   /* True if iPrefix is valid */
+};
+
 /*
 ** A SegmentPtr object may be used for one of two purposes:
 **
@@ -201,6 +233,7 @@ struct MultiCursor {
   int eType;                      /* Cache of current key type */
   Blob key;                       /* Cache of current key (or NULL) */
   Blob val;                       /* Cache of current value */
+  Blob prefix;                    /* Prefix set by lsm_csr_prefix() */
 
   /* All the component cursors: */
   TreeCursor *apTreeCsr[2];       /* Up to two tree cursors */
@@ -212,12 +245,16 @@ struct MultiCursor {
   /* Comparison results */
   int nTree;                      /* Size of aTree[] array */
   int *aTree;                     /* Array of comparison results */
+  KeyPrefix *aPrefix;             /* Cached key prefix for each component */
 
   /* Used by cursors flushing the in-memory tree only */
   void *pSystemVal;               /* Pointer to buffer to free */
 
   /* Used by worker cursors only */
   Pgno *pPrevMergePtr;
+
+  /* Used by cursors opened on a retained snapshot only */
+  Snapshot *pSnap;                /* Retained snapshot read by this cursor */
 };
 
 /*
@@ -298,6 +335,10 @@ struct MergeWorker {
     Pgno iPgno;
     int bStore;
   } aSave[2];
+
+  u32 iVlogOld;                   /* Relocate values from this vlog gen. */
+  Blob vlog;                      /* Buffer for relocated value */
+  u8 aVlogPtr[LSM_VALUEPTR_SIZE]; /* Pointer to relocated value */
 };
 
 #ifdef LSM_DEBUG_EXPENSIVE
@@ -397,6 +438,29 @@ static void sortedBlobFree(Blob *pBlob){
   memset(pBlob, 0, sizeof(Blob));
 }
 
+/*
+** Buffer pPtr/nPtr contains a pointer into the value-log file (the value
+** of an entry with the LSM_VALUEPTR flag set). Read the value it points
+** to into blob pBlob. pPtr may point into pBlob's existing buffer.
+*/
+static int sortedReadValuePtr(lsm_db *pDb, Blob *pBlob, void *pPtr, int nPtr){
+  u8 aPtr[LSM_VALUEPTR_SIZE];
+  int nVal;
+  int rc;
+
+  if( nPtr!=LSM_VALUEPTR_SIZE ) return LSM_CORRUPT_BKPT;
+  memcpy(aPtr, pPtr, LSM_VALUEPTR_SIZE);
+  nVal = (int)lsmGetU32(&aPtr[8]);
+  if( nVal<0 ) return LSM_CORRUPT_BKPT;
+
+  rc = sortedBlobGrow(pDb->pEnv, pBlob, nVal);
+  if( rc==LSM_OK ){
+    rc = lsmFsReadVlog(pDb->pFS, aPtr, pBlob->pData);
+    pBlob->nData = (rc==LSM_OK ? nVal : 0);
+  }
+  return rc;
+}
+
 static int sortedReadData(
   Segment *pSeg,
   Page *pPg,
@@ -485,6 +549,14 @@ static int pageGetFlags(u8 *aData, int nData){
   return (int)lsmGetU16(&aData[SEGMENT_FLAGS_OFFSET(nData)]);
 }
 
+/*
+** Decode a varint from buffer a[] into variable i. Return the number of
+** bytes consumed. Single byte varints, which make up the bulk of those
+** found in cell headers, are decoded inline.
+*/
+#define GETVARINT64(a, i) (((i)=((u8*)(a))[0])<=240?1:lsmVarintGet64((a), &(i)))
+#define GETVARINT32(a, i) (((i)=((u8*)(a))[0])<=240?1:lsmVarintGet32((a), &(i)))
+
 static u8 *pageGetCell(u8 *aData, int nData, int iCell){
   return &aData[lsmGetU16(&aData[SEGMENT_CELLPTR_OFFSET(nData, iCell)])];
 }
@@ -533,10 +605,10 @@ static u8 *pageGetKey(
 
   pKey = pageGetCell(aData, nData, iCell);
   eType = *pKey++;
-  pKey += lsmVarintGet32(pKey, &nDummy);
-  pKey += lsmVarintGet32(pKey, pnKey);
+  pKey += GETVARINT32(pKey, nDummy);
+  pKey += GETVARINT32(pKey, *pnKey);
   if( rtIsWrite(eType) ){
-    pKey += lsmVarintGet32(pKey, &nDummy);
+    pKey += GETVARINT32(pKey, nDummy);
   }
   *piTopic = rtTopic(eType);
 
@@ -581,9 +653,6 @@ static Pgno pageGetBtreeRef(Page *pPg, int iKey){
   return iRef;
 }
 
-#define GETVARINT64(a, i) (((i)=((u8*)(a))[0])<=240?1:lsmVarintGet64((a), &(i)))
-#define GETVARINT32(a, i) (((i)=((u8*)(a))[0])<=240?1:lsmVarintGet32((a), &(i)))
-
 static int pageGetBtreeKey(
   Segment *pSeg,                  /* Segment page pPg belongs to */
   Page *pPg,
@@ -823,7 +892,13 @@ static int sortedKeyCompare(
 ){
   int res = iLhsTopic - iRhsTopic;
   if( res==0 ){
-    res = xCmp(pLhsKey, nLhsKey, pRhsKey, nRhsKey);
+    if( xCmp==lsmDefaultCompare ){
+      /* Avoid the indirect call for the default memcmp() comparator. */
+      res = memcmp(pLhsKey, pRhsKey, LSM_MIN(nLhsKey, nRhsKey));
+      if( res==0 ) res = nLhsKey - nRhsKey;
+    }else{
+      res = xCmp(pLhsKey, nLhsKey, pRhsKey, nRhsKey);
+    }
   }
   return res;
 }
@@ -1870,6 +1945,115 @@ static int seekInSegment(
   return rc;
 }
 
+/*
+** Set *ppRange to point to a KeyRange object describing the smallest and 
+** largest keys in the left-hand segment of level pLvl. If the segment is 
+** empty, or if the level is currently being written to or merged (so that
+** its contents may change), set *ppRange to NULL.
+**
+** The KeyRange is cached in Level.pRange, so the first and last pages of 
+** the segment are only read the first time this is called for a level 
+** object. Separator keys are included in the range.
+*/
+static int sortedLevelRange(MultiCursor *pCsr, Level *pLvl, KeyRange **ppRange){
+  int rc = LSM_OK;
+
+  if( pLvl->pRange==0 && pLvl->nRight==0 && pLvl->pMerge==0 
+   && (pLvl->flags & LEVEL_INCOMPLETE)==0 && pLvl->lhs.iFirst!=0
+  ){
+    lsm_env *pEnv = pCsr->pDb->pEnv;
+    SegmentPtr aPtr[2];
+    int i;
+
+    memset(aPtr, 0, sizeof(aPtr));
+    for(i=0; i<2; i++){
+      SegmentPtr *pPtr = &aPtr[i];
+      pPtr->pLevel = pLvl;
+      pPtr->pSeg = &pLvl->lhs;
+      segmentPtrEndPage(pCsr->pDb->pFS, pPtr, i, &rc);
+      while( rc==LSM_OK && pPtr->pPg 
+          && (pPtr->nCell==0 || (pPtr->flags & SEGMENT_BTREE_FLAG))
+      ){
+        rc = segmentPtrNextPage(pPtr, (i ? -1 : 1));
+      }
+      if( rc==LSM_OK && pPtr->pPg ){
+        rc = segmentPtrLoadCell(pPtr, i ? (pPtr->nCell-1) : 0);
+      }
+    }
+
+    if( rc==LSM_OK && aPtr[0].pPg && aPtr[1].pPg ){
+      int nByte = sizeof(KeyRange) + aPtr[0].nKey + aPtr[1].nKey;
+      KeyRange *p = (KeyRange *)lsmMallocRc(pEnv, nByte, &rc);
+      if( p ){
+        p->iMinTopic = rtTopic(aPtr[0].eType);
+        p->pMin = (void *)&p[1];
+        p->nMin = aPtr[0].nKey;
+        memcpy(p->pMin, aPtr[0].pKey, aPtr[0].nKey);
+        p->iMaxTopic = rtTopic(aPtr[1].eType);
+        p->pMax = &((u8 *)p->pMin)[p->nMin];
+        p->nMax = aPtr[1].nKey;
+        memcpy(p->pMax, aPtr[1].pKey, aPtr[1].nKey);
+        pLvl->pRange = p;
+      }
+    }
+
+    segmentPtrReset(&aPtr[0]);
+    segmentPtrReset(&aPtr[1]);
+  }
+
+  *ppRange = pLvl->pRange;
+  return rc;
+}
+
+/*
+** Return true if it can be determined, using the cached key range of the
+** level, that the left-hand segment of level pLvl contains no entry that
+** would be visited by a seek of type eSeek for key (iTopic/pKey/nKey). 
+** That is, if the key is larger than all keys in the segment and eSeek is 
+** LSM_SEEK_GE or LSM_SEEK_EQ, or smaller than all keys in the segment and 
+** eSeek is LSM_SEEK_LE or LSM_SEEK_EQ.
+**
+** A segment is never excluded if any segment of the next level down has no
+** b-tree, as seeking within such a segment relies on the fraction cascade 
+** pointer read from this one.
+*/
+static int sortedLevelExcludes(
+  MultiCursor *pCsr,              /* Cursor being seeked */
+  Level *pLvl,                    /* Level to test */
+  int eSeek,                      /* Search bias */
+  int iTopic,                     /* Key topic to search for */
+  void *pKey, int nKey,           /* Key to search for */
+  int *pRc                        /* IN/OUT: Error code */
+){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  Level *pNext = pLvl->pNext;
+  KeyRange *p = 0;
+  int bRet = 0;
+
+  if( pNext ){
+    int i;
+    if( pNext->lhs.iRoot==0 ) return 0;
+    for(i=0; i<pNext->nRight; i++){
+      if( pNext->aRhs[i].iRoot==0 ) return 0;
+    }
+  }
+
+  if( *pRc==LSM_OK ) *pRc = sortedLevelRange(pCsr, pLvl, &p);
+  if( p ){
+    if( eSeek!=LSM_SEEK_LE && 0<sortedKeyCompare(xCmp, 
+          iTopic, pKey, nKey, p->iMaxTopic, p->pMax, p->nMax
+    )){
+      bRet = 1;
+    }
+    if( eSeek!=LSM_SEEK_GE && 0>sortedKeyCompare(xCmp, 
+          iTopic, pKey, nKey, p->iMinTopic, p->pMin, p->nMin
+    )){
+      bRet = 1;
+    }
+  }
+  return bRet;
+}
+
 /*
 ** Seek each segment pointer in the array of (pLvl->nRight+1) at aPtr[].
 **
@@ -1916,9 +2100,17 @@ static int seekInLevel(
     int iPtr = 0;
     if( nRhs==0 ) iPtr = *piPgno;
 
-    rc = seekInSegment(
-        pCsr, &aPtr[0], iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
-    );
+    /* If the key is outside the range of keys stored in the segment, there
+    ** is no need to search it. Leave the segment-pointer at EOF.  */
+    if( nRhs==0 
+     && sortedLevelExcludes(pCsr, pLvl, eSeek, iTopic, pKey, nKey, &rc) 
+    ){
+      segmentPtrReset(&aPtr[0]);
+    }else if( rc==LSM_OK ){
+      rc = seekInSegment(
+          pCsr, &aPtr[0], iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
+      );
+    }
     if( rc==LSM_OK && nRhs>0 && eSeek==LSM_SEEK_GE && aPtr[0].pPg==0 ){
       res = 0;
     }
@@ -2084,6 +2276,39 @@ static int sortedDbKeyCompare(
   return res;
 }
 
+/*
+** Return the 8 byte prefix of key pKey/nKey, the current key of component
+** cursor iKey of multi-cursor pCsr. See the comments above struct KeyPrefix
+** for details.
+**
+** The in-memory tree cursors may be moved when they are restored after the
+** tree is modified, so the prefixes of their keys are not cached.
+*/
+static u64 multiCursorKeyPrefix(
+  MultiCursor *pCsr, 
+  int iKey, 
+  void *pKey, int nKey
+){
+  KeyPrefix *p = &pCsr->aPrefix[iKey];
+  if( iKey<=CURSOR_DATA_TREE1 || p->bValid==0 ){
+    u8 *aKey = (u8 *)pKey;
+    u64 iPrefix;
+    if( nKey>=8 ){
+      iPrefix = lsmGetU64(aKey);
+    }else{
+      int i;
+      iPrefix = 0;
+      for(i=0; i<8; i++){
+        iPrefix = (iPrefix << 8) + (i<nKey ? aKey[i] : 0);
+      }
+    }
+    if( iKey<=CURSOR_DATA_TREE1 ) return iPrefix;
+    p->iPrefix = iPrefix;
+    p->bValid = 1;
+  }
+  return p->iPrefix;
+}
+
 static void multiCursorDoCompare(MultiCursor *pCsr, int iOut, int bReverse){
   int i1;
   int i2;
@@ -2111,10 +2336,21 @@ static void multiCursorDoCompare(MultiCursor *pCsr, int iOut, int bReverse){
   }else{
     int res;
 
-    /* Compare the keys */
-    res = sortedDbKeyCompare(pCsr,
-        eType1, pKey1, nKey1, eType2, pKey2, nKey2
-    );
+    /* Compare the keys. If both keys have the same topic, try comparing
+    ** the cached 8 byte key prefixes first. Only if they are equal is it
+    ** necessary to compare the full keys.  */
+    res = rtTopic(eType1) - rtTopic(eType2);
+    if( res==0 ){
+      u64 iPrefix1 = multiCursorKeyPrefix(pCsr, i1, pKey1, nKey1);
+      u64 iPrefix2 = multiCursorKeyPrefix(pCsr, i2, pKey2, nKey2);
+      if( iPrefix1!=iPrefix2 ){
+        res = (iPrefix1<iPrefix2) ? -1 : +1;
+      }else{
+        res = sortedDbKeyCompare(pCsr,
+            eType1, pKey1, nKey1, eType2, pKey2, nKey2
+        );
+      }
+    }
 
     res = res * mul;
     if( res==0 ){
@@ -2135,6 +2371,19 @@ static void multiCursorDoCompare(MultiCursor *pCsr, int iOut, int bReverse){
   pCsr->aTree[iOut] = iRes;
 }
 
+/*
+** Recompute all entries in the aTree[] array of multi-cursor pCsr. This is
+** called after all component cursors may have been moved, so any cached
+** key prefixes are discarded first.
+*/
+static void multiCursorCompareAll(MultiCursor *pCsr, int bReverse){
+  int i;
+  memset(pCsr->aPrefix, 0, sizeof(KeyPrefix) * pCsr->nTree);
+  for(i=pCsr->nTree-1; i>0; i--){
+    multiCursorDoCompare(pCsr, i, bReverse);
+  }
+}
+
 /*
 ** This function advances segment pointer iPtr belonging to multi-cursor
 ** pCsr forward (bReverse==0) or backward (bReverse!=0).
@@ -2184,10 +2433,7 @@ static int segmentCursorAdvance(
     }
 
     if( bFix ){
-      int i;
-      for(i=pCsr->nTree-1; i>0; i--){
-        multiCursorDoCompare(pCsr, i, bReverse);
-      }
+      multiCursorCompareAll(pCsr, bReverse);
     }
   }
 
@@ -2235,6 +2481,7 @@ static void mcursorFreeComponents(MultiCursor *pCsr){
   pCsr->aPtr = 0;
   pCsr->nTree = 0;
   pCsr->aTree = 0;
+  pCsr->aPrefix = 0;
   pCsr->pSystemVal = 0;
   pCsr->apTreeCsr[0] = 0;
   pCsr->apTreeCsr[1] = 0;
@@ -2271,7 +2518,9 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       }
     }
 
-    if( bCache ){
+    /* Cursors opened on retained snapshots are never cached, as they are
+    ** not usable as cursors on the current database snapshot.  */
+    if( bCache && pCsr->pSnap==0 ){
       int i;                      /* Used to iterate through segment-pointers */
 
       /* Release any page references held by this cursor. */
@@ -2286,6 +2535,9 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       lsmTreeCursorReset(pCsr->apTreeCsr[0]);
       lsmTreeCursorReset(pCsr->apTreeCsr[1]);
 
+      /* Clear any prefix set on the cursor before it is reused. */
+      pCsr->prefix.nData = 0;
+
       /* Add the cursor to the pCsrCache list */
       pCsr->pNext = pDb->pCsrCache;
       pDb->pCsrCache = pCsr;
@@ -2293,6 +2545,7 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       /* Free the allocation used to cache the current key, if any. */
       sortedBlobFree(&pCsr->key);
       sortedBlobFree(&pCsr->val);
+      sortedBlobFree(&pCsr->prefix);
 
       /* Free the component cursors */
       mcursorFreeComponents(pCsr);
@@ -2504,6 +2757,45 @@ int lsmMCursorNew(
   return rc;
 }
 
+/*
+** Allocate and return a new cursor that reads the database snapshot pSnap,
+** which must have been retained by an earlier call to lsmRetainSnapshot().
+** The cursor does not read the in-memory tree.
+*/
+int lsmMCursorNewSnapshot(
+  lsm_db *pDb,                    /* Database handle */
+  Snapshot *pSnap,                /* Retained snapshot to read */
+  MultiCursor **ppCsr             /* OUT: Allocated cursor */
+){
+  MultiCursor *pCsr;
+  int rc = LSM_OK;
+
+  pCsr = multiCursorNew(pDb, &rc);
+  if( rc==LSM_OK ){
+    pCsr->pSnap = pSnap;
+    pCsr->flags = (CURSOR_IGNORE_SYSTEM | CURSOR_IGNORE_DELETE);
+    rc = multiCursorAddAll(pCsr, pSnap);
+  }
+  if( rc!=LSM_OK ){
+    lsmMCursorClose(pCsr, 0);
+    pCsr = 0;
+  }
+  *ppCsr = pCsr;
+  return rc;
+}
+
+/*
+** Return true if any cursor open on connection pDb is reading retained
+** snapshot pSnap.
+*/
+int lsmMCursorUsesSnapshot(lsm_db *pDb, Snapshot *pSnap){
+  MultiCursor *pCsr;
+  for(pCsr=pDb->pCsr; pCsr; pCsr=pCsr->pNext){
+    if( pCsr->pSnap==pSnap ) return 1;
+  }
+  return 0;
+}
+
 static int multiCursorGetVal(
   MultiCursor *pCsr, 
   int iVal, 
@@ -2676,8 +2968,14 @@ static int multiCursorAllocTree(MultiCursor *pCsr){
       pCsr->nTree = pCsr->nTree*2;
     }
 
-    nByte = sizeof(int)*pCsr->nTree*2;
+    /* The aPrefix[] array is stored in the same allocation as aTree[].
+    ** Since nTree is a power of two greater than 1, aPrefix[] is 
+    ** suitably aligned.  */
+    nByte = sizeof(int)*pCsr->nTree*2 + sizeof(KeyPrefix)*pCsr->nTree;
     pCsr->aTree = (int *)lsmMallocZeroRc(pCsr->pDb->pEnv, nByte, &rc);
+    if( pCsr->aTree ){
+      pCsr->aPrefix = (KeyPrefix *)&pCsr->aTree[pCsr->nTree*2];
+    }
   }
   return rc;
 }
@@ -2695,10 +2993,12 @@ static void multiCursorCacheKey(MultiCursor *pCsr, int *pRc){
 static void assertCursorTree(MultiCursor *pCsr){
   int bRev = !!(pCsr->flags & CURSOR_PREV_OK);
   int *aSave = pCsr->aTree;
+  KeyPrefix *aSavePrefix = pCsr->aPrefix;
   int nSave = pCsr->nTree;
   int rc;
 
   pCsr->aTree = 0;
+  pCsr->aPrefix = 0;
   pCsr->nTree = 0;
   rc = multiCursorAllocTree(pCsr);
   if( rc==LSM_OK ){
@@ -2715,6 +3015,7 @@ static void assertCursorTree(MultiCursor *pCsr){
   }
 
   pCsr->aTree = aSave;
+  pCsr->aPrefix = aSavePrefix;
   pCsr->nTree = nSave;
 }
 #else
@@ -2829,10 +3130,7 @@ static int multiCursorSetupTree(MultiCursor *pCsr, int bRev){
 
   rc = multiCursorAllocTree(pCsr);
   if( rc==LSM_OK ){
-    int i;
-    for(i=pCsr->nTree-1; i>0; i--){
-      multiCursorDoCompare(pCsr, i, bRev);
-    }
+    multiCursorCompareAll(pCsr, bRev);
   }
 
   assertCursorTree(pCsr);
@@ -2937,7 +3235,7 @@ int lsmSaveCursors(lsm_db *pDb){
   MultiCursor *pCsr;
 
   for(pCsr=pDb->pCsr; rc==LSM_OK && pCsr; pCsr=pCsr->pNext){
-    rc = mcursorSave(pCsr);
+    if( pCsr->pSnap==0 ) rc = mcursorSave(pCsr);
   }
   return rc;
 }
@@ -2947,7 +3245,7 @@ int lsmRestoreCursors(lsm_db *pDb){
   MultiCursor *pCsr;
 
   for(pCsr=pDb->pCsr; rc==LSM_OK && pCsr; pCsr=pCsr->pNext){
-    rc = mcursorRestore(pDb, pCsr);
+    if( pCsr->pSnap==0 ) rc = mcursorRestore(pDb, pCsr);
   }
   return rc;
 }
@@ -3061,15 +3359,22 @@ int lsmMCursorSeek(
     iPtr += pPtr->pLevel->nRight;
   }
 
+  /* If an exact match was found and its value is stored in the value-log,
+  ** replace the cached pointer with the value itself.  */
+  if( rc==LSM_OK 
+   && (pCsr->flags & CURSOR_SEEK_EQ) && (pCsr->eType & LSM_VALUEPTR)
+  ){
+    rc = sortedReadValuePtr(
+        pCsr->pDb, &pCsr->val, pCsr->val.pData, pCsr->val.nData
+    );
+  }
+
   if( eSeek!=LSM_SEEK_EQ ){
     if( rc==LSM_OK ){
       rc = multiCursorAllocTree(pCsr);
     }
     if( rc==LSM_OK ){
-      int i;
-      for(i=pCsr->nTree-1; i>0; i--){
-        multiCursorDoCompare(pCsr, i, eESeek==LSM_SEEK_LE);
-      }
+      multiCursorCompareAll(pCsr, eESeek==LSM_SEEK_LE);
       if( eSeek==LSM_SEEK_GE ) pCsr->flags |= CURSOR_NEXT_OK;
       if( eSeek==LSM_SEEK_LE ) pCsr->flags |= CURSOR_PREV_OK;
     }
@@ -3093,19 +3398,53 @@ int lsmMCursorSeek(
   return rc;
 }
 
+/*
+** Set the prefix that cursor pCsr is restricted to. If nPrefix is zero,
+** any existing restriction is removed.
+*/
+int lsmMCursorPrefix(MultiCursor *pCsr, void *pPrefix, int nPrefix){
+  int rc = LSM_OK;
+  if( nPrefix>0 ){
+    rc = sortedBlobSet(pCsr->pDb->pEnv, &pCsr->prefix, pPrefix, nPrefix);
+  }else{
+    pCsr->prefix.nData = 0;
+  }
+  return rc;
+}
+
+/*
+** Return true if the key of type eType stored in buffer pKey/nKey may be
+** visited by cursor pCsr. It may not be if a prefix has been configured
+** using lsm_csr_prefix() and the key is either a system key or does not
+** begin with that prefix.
+*/
+static int mcursorPrefixOk(MultiCursor *pCsr, int eType, void *pKey, int nKey){
+  int nPrefix = pCsr->prefix.nData;
+  return (nPrefix==0 || (
+      (eType & LSM_SYSTEMKEY)==0 && nKey>=nPrefix
+   && memcmp(pKey, pCsr->prefix.pData, nPrefix)==0
+  ));
+}
+
 int lsmMCursorValid(MultiCursor *pCsr){
   int res = 0;
   if( pCsr->flags & CURSOR_SEEK_EQ ){
-    res = 1;
+    res = mcursorPrefixOk(pCsr, pCsr->eType, pCsr->key.pData, pCsr->key.nData);
   }else if( pCsr->aTree ){
     int iKey = pCsr->aTree[1];
+    int eType = 0;
+    void *pKey = 0;
+    int nKey = 0;
     if( iKey==CURSOR_DATA_TREE0 || iKey==CURSOR_DATA_TREE1 ){
       res = lsmTreeCursorValid(pCsr->apTreeCsr[iKey-CURSOR_DATA_TREE0]);
+      if( res && pCsr->prefix.nData ){
+        multiCursorGetKey(pCsr, iKey, &eType, &pKey, &nKey);
+      }
     }else{
-      void *pKey; 
-      multiCursorGetKey(pCsr, iKey, 0, &pKey, 0);
+      multiCursorGetKey(pCsr, iKey, &eType, &pKey, &nKey);
       res = pKey!=0;
     }
+    if( res ) res = mcursorPrefixOk(pCsr, eType, pKey, nKey);
   }
   return res;
 }
@@ -3140,6 +3479,11 @@ static int mcursorAdvanceOk(
     multiCursorCacheKey(pCsr, pRc);
     assert( pCsr->eType==eNewType );
 
+    /* If the cursor has moved past the end of the configured prefix, stop
+    ** here. lsmMCursorValid() reports EOF for this position, so there is
+    ** no need to search past it for a visible entry.  */
+    if( 0==mcursorPrefixOk(pCsr, eNewType, pNew, nNew) ) return 1;
+
     /* If this cursor is configured to skip deleted keys, and the current
     ** cursor points to a SORTED_DELETE entry, then the cursor has not been 
     ** successfully advanced.  
@@ -3179,11 +3523,80 @@ static void flCsrAdvance(MultiCursor *pCsr){
   }
 }
 
+/*
+** The number of consecutive entries a multi-cursor must step past without
+** finding a visible key before multiCursorSkipDeleted() is used to try to
+** jump over the rest of a range-delete.
+*/
+#define CURSOR_SKIP_THRESHOLD 8
+
+/*
+** The multi-cursor currently points to an entry in a segment that has been
+** deleted by a range-delete in a newer component (the in-memory tree or a
+** newer level). Instead of stepping through the deleted entries one at a
+** time, this function attempts to seek the segment pointer directly to the
+** far boundary of the range-delete using the segment b-tree. If successful,
+** *pbDone is set to true before returning. Otherwise, if the skip cannot
+** be performed (because the cursor is a merge or flush cursor, the segment
+** is part of a level undergoing an incremental merge, or the segment has
+** no b-tree), *pbDone is left unmodified.
+**
+** The aTree[] array is not updated. The caller must do that.
+*/
+static int multiCursorSkipDeleted(
+  MultiCursor *pCsr,              /* Multi-cursor to advance */
+  int bReverse,                   /* True if iterating in reverse */
+  int *pbDone                     /* OUT: Set to true if skip performed */
+){
+  const int rdmask = (bReverse ? LSM_START_DELETE : LSM_END_DELETE);
+  int iKey = pCsr->aTree[1];
+  int rc = LSM_OK;
+  SegmentPtr *pPtr;
+  int i;
+
+  if( (pCsr->flags & CURSOR_IGNORE_DELETE)==0
+   || (pCsr->flags & CURSOR_FLUSH_FREELIST)
+   || pCsr->pBtCsr || pCsr->pPrevMergePtr
+   || iKey<CURSOR_DATA_SEGMENT || iKey>=(CURSOR_DATA_SEGMENT+pCsr->nPtr)
+  ){
+    return LSM_OK;
+  }
+  pPtr = &pCsr->aPtr[iKey-CURSOR_DATA_SEGMENT];
+  if( pPtr->pPg==0 || pPtr->pLevel->nRight || pPtr->pSeg->iRoot==0 ){
+    return LSM_OK;
+  }
+
+  for(i=0; i<iKey; i++){
+    int eType;
+    void *pKey; int nKey;
+    multiCursorGetKey(pCsr, i, &eType, &pKey, &nKey);
+    if( pKey && (eType & rdmask) ){
+      int res = sortedKeyCompare(pCsr->pDb->xCmp,
+          rtTopic(eType), pKey, nKey,
+          rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey
+      );
+      if( (bReverse==0 && res>0) || (bReverse!=0 && res<0) ){
+        int iPtr = 0;
+        int bStop = 0;
+        rc = seekInSegment(pCsr, pPtr, rtTopic(eType), pKey, nKey, 0,
+            (bReverse ? LSM_SEEK_LE : LSM_SEEK_GE), &iPtr, &bStop
+        );
+        *pbDone = 1;
+        break;
+      }
+    }
+  }
+
+  return rc;
+}
+
 static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
   int rc = LSM_OK;                /* Return Code */
   if( lsmMCursorValid(pCsr) ){
+    int nStep = 0;                /* Entries stepped past so far */
     do {
       int iKey = pCsr->aTree[1];
+      int bDone = 0;
 
       assertCursorTree(pCsr);
 
@@ -3202,7 +3615,16 @@ static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
         }
       }
 
-      if( iKey==CURSOR_DATA_TREE0 || iKey==CURSOR_DATA_TREE1 ){
+      /* If the cursor has stepped past a run of invisible entries, try to
+      ** skip the remainder of the range-delete in a single seek.  */
+      if( (nStep++)>=CURSOR_SKIP_THRESHOLD ){
+        rc = multiCursorSkipDeleted(pCsr, bReverse, &bDone);
+      }
+
+      if( rc!=LSM_OK || bDone ){
+        /* Either an error has occurred or the segment pointer has already
+        ** been moved by multiCursorSkipDeleted(). */
+      }else if( iKey==CURSOR_DATA_TREE0 || iKey==CURSOR_DATA_TREE1 ){
         TreeCursor *pTreeCsr = pCsr->apTreeCsr[iKey-CURSOR_DATA_TREE0];
         if( bReverse ){
           rc = lsmTreeCursorPrev(pTreeCsr);
@@ -3221,6 +3643,7 @@ static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
       }
       if( rc==LSM_OK ){
         int i;
+        pCsr->aPrefix[iKey].bValid = 0;
         for(i=(iKey+pCsr->nTree)/2; i>0; i=i/2){
           multiCursorDoCompare(pCsr, i, bReverse);
         }
@@ -3300,14 +3723,21 @@ int lsmMCursorValue(MultiCursor *pCsr, void **ppVal, int *pnVal){
     nVal = pCsr->val.nData;
     pVal = pCsr->val.pData;
   }else{
+    int eType = 0;
 
     assert( pCsr->aTree );
     assert( mcursorLocationOk(pCsr, (pCsr->flags & CURSOR_IGNORE_DELETE)) );
 
+    multiCursorGetKey(pCsr, pCsr->aTree[1], &eType, 0, 0);
     rc = multiCursorGetVal(pCsr, pCsr->aTree[1], &pVal, &nVal);
     if( pVal && rc==LSM_OK ){
-      rc = sortedBlobSet(pCsr->pDb->pEnv, &pCsr->val, pVal, nVal);
+      if( eType & LSM_VALUEPTR ){
+        rc = sortedReadValuePtr(pCsr->pDb, &pCsr->val, pVal, nVal);
+      }else{
+        rc = sortedBlobSet(pCsr->pDb->pEnv, &pCsr->val, pVal, nVal);
+      }
       pVal = pCsr->val.pData;
+      nVal = pCsr->val.nData;
     }
 
     if( rc!=LSM_OK ){
@@ -3327,67 +3757,404 @@ int lsmMCursorType(MultiCursor *pCsr, int *peType){
 }
 
 /*
-** Buffer aData[], size nData, is assumed to contain a valid b-tree 
-** hierarchy page image. Return the offset in aData[] of the next free
-** byte in the data area (where a new cell may be written if there is
-** space).
+** Compare the key iTopic/pKey/nKey with the set of user keys that begin
+** with prefix pPrefix/nPrefix. Return -1 if the key is smaller than all
+** keys in the set, +1 if it is larger than all keys in the set, or 0 if
+** the key itself begins with the prefix.
 */
-static int mergeWorkerPageOffset(u8 *aData, int nData){
-  int nRec;
-  int iOff;
-  int nKey;
-  int eType;
-
-  nRec = lsmGetU16(&aData[SEGMENT_NRECORD_OFFSET(nData)]);
-  iOff = lsmGetU16(&aData[SEGMENT_CELLPTR_OFFSET(nData, nRec-1)]);
-  eType = aData[iOff++];
-  assert( eType==0 
-       || eType==(LSM_SYSTEMKEY|LSM_SEPARATOR) 
-       || eType==(LSM_SEPARATOR)
-  );
-
-  iOff += lsmVarintGet32(&aData[iOff], &nKey);
-  iOff += lsmVarintGet32(&aData[iOff], &nKey);
-
-  return iOff + (eType ? nKey : 0);
+static int sortedPrefixCompare(
+  int iTopic, void *pKey, int nKey,
+  void *pPrefix, int nPrefix
+){
+  int res;
+  if( iTopic ) return 1;
+  res = memcmp(pKey, pPrefix, LSM_MIN(nKey, nPrefix));
+  if( res==0 && nKey<nPrefix ) res = -1;
+  return (res<0 ? -1 : (res>0 ? 1 : 0));
 }
 
 /*
-** Following a checkpoint operation, database pages that are part of the
-** checkpointed state of the LSM are deemed read-only. This includes the
-** right-most page of the b-tree hierarchy of any separators array under
-** construction, and all pages between it and the b-tree root, inclusive.
-** This is a problem, as when further pages are appended to the separators
-** array, entries must be added to the indicated b-tree hierarchy pages.
+** Iterate through the cells of the nPg b-tree pages of segment pSeg in
+** array aPg[], in order. Set *pnKey to the number of keys that begin with
+** prefix pPrefix/nPrefix (excluding any key equal to the prefix itself).
 **
-** This function copies all such b-tree pages to new locations, so that
-** they can be modified as required.
+** If aChild is not NULL, also append the page numbers of all child pages
+** that may contain keys that begin with the prefix to aChild[], and set
+** *pnChild to the number of entries added. Space for up to nChildAlloc
+** entries is available. If there are more than that, *pnChild is set to
+** nChildAlloc+1.
 **
-** The complication is that not all database pages are the same size - due
-** to the way the file.c module works some (the first and last in each block)
-** are 4 bytes smaller than the others.
+** Or, if aChild is NULL, then invoke xKey on the keys selected to divide
+** the *pnKey keys found by an earlier call into nSplit roughly equal parts.
 */
-static int mergeWorkerMoveHierarchy(
-  MergeWorker *pMW,               /* Merge worker */
-  int bSep                        /* True for separators run */
+static int sortedSplitLevel(
+  lsm_db *pDb,                    /* Database handle */
+  Segment *pSeg,                  /* Segment to read b-tree pages from */
+  Pgno *aPg, int nPg,             /* B-tree pages to iterate through */
+  void *pPrefix, int nPrefix,     /* Key prefix */
+  int *pnKey,                     /* IN/OUT: Keys with prefix */
+  Pgno *aChild, int nChildAlloc,  /* OUT: Child pages (or NULL) */
+  int *pnChild,                   /* OUT: Number of entries in aChild[] */
+  int nSplit,                     /* Number of parts */
+  int (*xKey)(void *, const void *, int), void *pCtx
 ){
-  lsm_db *pDb = pMW->pDb;         /* Database handle */
-  int rc = LSM_OK;                /* Return code */
-  int i;
-  Page **apHier = pMW->hier.apHier;
-  int nHier = pMW->hier.nHier;
-
-  for(i=0; rc==LSM_OK && i<nHier; i++){
-    Page *pNew = 0;
-    rc = lsmFsSortedAppend(pDb->pFS, pDb->pWorker, pMW->pLevel, 1, &pNew);
-    assert( rc==LSM_OK );
+  int rc = LSM_OK;
+  Blob blob = {0, 0, 0};
+  int nKey = 0;                   /* Keys with prefix visited so far */
+  int nChild = 0;                 /* Entries in aChild[] */
+  int iPg;
 
+  for(iPg=0; rc==LSM_OK && iPg<nPg; iPg++){
+    Page *pPg = 0;
+    rc = lsmFsDbPageGet(pDb->pFS, pSeg, aPg[iPg], &pPg);
     if( rc==LSM_OK ){
-      u8 *a1; int n1;
-      u8 *a2; int n2;
-
-      a1 = fsPageData(pNew, &n1);
-      a2 = fsPageData(apHier[i], &n2);
+      int nData;
+      u8 *aData = fsPageData(pPg, &nData);
+      int nRec = pageGetNRec(aData, nData);
+      int bLower = 1;             /* True if child iCell may be in range */
+      int iCell;
+
+      for(iCell=0; rc==LSM_OK && iCell<=nRec; iCell++){
+        int bUpper = 1;           /* True if child iCell may be in range */
+        int res = 0;              /* Comparison of key iCell and prefix */
+        Pgno iPtr;                /* Child page iCell */
+        void *pK = 0;             /* Key iCell (if any) */
+        int nK = 0;               /* Size of pK in bytes */
+
+        if( iCell<nRec ){
+          int iTopic;
+          rc = pageGetBtreeKey(
+              pSeg, pPg, iCell, &iPtr, &iTopic, &pK, &nK, &blob
+          );
+          if( rc!=LSM_OK ) break;
+          res = sortedPrefixCompare(iTopic, pK, nK, pPrefix, nPrefix);
+          bUpper = (res>0 || (res==0 && nK>nPrefix));
+        }else{
+          iPtr = pageGetPtr(aData, nData);
+        }
+        if( aChild && bLower && bUpper ){
+          if( nChild<nChildAlloc ) aChild[nChild] = iPtr;
+          nChild++;
+        }
+        if( res==0 && nK>nPrefix ){
+          if( aChild==0 ){
+            int iPart = (int)(((i64)(nKey+1) * nSplit) / (*pnKey+1));
+            int iPrev = (int)(((i64)nKey * nSplit) / (*pnKey+1));
+            if( iPart!=iPrev ) rc = xKey(pCtx, pK, nK);
+          }
+          nKey++;
+        }
+        bLower = (res<=0);
+      }
+      lsmFsPageRelease(pPg);
+    }
+  }
+
+  sortedBlobFree(&blob);
+  if( aChild ){
+    *pnKey = nKey;
+    *pnChild = LSM_MIN(nChild, nChildAlloc+1);
+  }
+  return rc;
+}
+
+/*
+** Find up to (nSplit-1) keys that divide the set of user keys that begin
+** with prefix pPrefix/nPrefix into nSplit roughly equal parts, and invoke
+** xKey on each of them in ascending order. Each key passed to xKey begins
+** with the prefix and is larger than the prefix itself.
+**
+** The keys are read from the separators b-tree of the largest segment
+** that has one in the snapshot read by the current read transaction.
+** Starting at the root, each level of the b-tree is examined in turn until
+** one is found that contains at least (nSplit-1) keys that begin with the
+** prefix, or until the lowest level is reached. Fewer than (nSplit-1) keys
+** are returned if the prefix matches keys on too few pages of the segment.
+** Entries in the in-memory tree and in other segments are not considered,
+** so the parts are only balanced if most of the data is in that segment.
+*/
+int lsmSortedSplit(
+  lsm_db *pDb,                    /* Database handle */
+  void *pPrefix, int nPrefix,     /* Key prefix */
+  int nSplit,                     /* Desired number of parts */
+  int (*xKey)(void *, const void *, int),
+  void *pCtx                      /* First argument passed to xKey */
+){
+  int rc = LSM_OK;
+  Segment *pSeg = 0;              /* Segment to read separators from */
+  Level *pLvl;
+  int nAlloc = nSplit+2;          /* Allocated size of each array */
+  Pgno *aPg;                      /* B-tree pages on current level */
+  Pgno *aChild;                   /* B-tree pages on next level */
+  int nPg = 1;
+  int nKey = 0;
+
+  assert( pDb->pClient );
+  if( nSplit<2 ) return LSM_OK;
+
+  for(pLvl=lsmDbSnapshotLevel(pDb->pClient); pLvl; pLvl=pLvl->pNext){
+    int i;
+    if( pLvl->flags & LEVEL_FREELIST_ONLY ) continue;
+    if( pLvl->nRight==0 && pLvl->pMerge==0
+     && (pLvl->flags & LEVEL_INCOMPLETE)==0 && pLvl->lhs.iRoot
+     && (pSeg==0 || pLvl->lhs.nSize>pSeg->nSize)
+    ){
+      pSeg = &pLvl->lhs;
+    }
+    for(i=0; i<pLvl->nRight; i++){
+      Segment *pRhs = &pLvl->aRhs[i];
+      if( pRhs->iRoot && (pSeg==0 || pRhs->nSize>pSeg->nSize) ) pSeg = pRhs;
+    }
+  }
+  if( pSeg==0 ) return LSM_OK;
+
+  aPg = (Pgno *)lsmMallocRc(pDb->pEnv, sizeof(Pgno)*nAlloc*2, &rc);
+  if( rc!=LSM_OK ) return rc;
+  aChild = &aPg[nAlloc];
+  aPg[0] = pSeg->iRoot;
+
+  while( rc==LSM_OK ){
+    int nChild = 0;
+    rc = sortedSplitLevel(pDb, pSeg, aPg, nPg, pPrefix, nPrefix,
+        &nKey, aChild, nAlloc, &nChild, 0, 0, 0
+    );
+    if( rc==LSM_OK ){
+      int bLast = (nKey>=nSplit-1 || nChild==0 || nChild>nAlloc);
+      if( bLast==0 ){
+        /* Discard any children that are not b-tree pages. These may be
+        ** mixed with b-tree pages if the b-tree of an older segment was
+        ** linked into this one when it was created. Stop here if there
+        ** are no b-tree pages on the next level.  */
+        int i;
+        int nBtree = 0;
+        for(i=0; rc==LSM_OK && i<nChild; i++){
+          Page *pPg = 0;
+          rc = lsmFsDbPageGet(pDb->pFS, pSeg, aChild[i], &pPg);
+          if( rc==LSM_OK ){
+            int nData;
+            u8 *aData = fsPageData(pPg, &nData);
+            if( pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG ){
+              aChild[nBtree++] = aChild[i];
+            }
+            lsmFsPageRelease(pPg);
+          }
+        }
+        nChild = nBtree;
+        bLast = (nChild==0);
+      }
+      if( rc==LSM_OK && bLast ){
+        if( nKey>0 ){
+          rc = sortedSplitLevel(pDb, pSeg, aPg, nPg, pPrefix, nPrefix,
+              &nKey, 0, 0, 0, nSplit, xKey, pCtx
+          );
+        }
+        break;
+      }
+      memcpy(aPg, aChild, sizeof(Pgno)*nChild);
+      nPg = nChild;
+    }
+  }
+
+  lsmFree(pDb->pEnv, aPg);
+  return rc;
+}
+
+/*
+** Seek the separators b-tree of segment pSeg for user key pKey/nKey. Set
+** *pfPos to the estimated fraction of the pages addressed by the b-tree
+** that contain only keys smaller than pKey/nKey, based on the position of
+** the key within each b-tree page visited. Set *pnRec to the number of 
+** records on the sorted-run page at the bottom of the path.
+*/
+static int sortedEstimatePos(
+  lsm_db *pDb,                    /* Database handle */
+  Segment *pSeg,                  /* Segment to seek */
+  void *pKey, int nKey,           /* Key to estimate the position of */
+  double *pfPos,                  /* OUT: Position of key in segment */
+  int *pnRec                      /* OUT: Records on sorted-run page */
+){
+  int rc = LSM_OK;
+  Blob blob = {0, 0, 0};
+  double fPos = 0.0;              /* Return value for *pfPos */
+  double fWidth = 1.0;            /* Fraction of segment under page iPg */
+  Pgno iPg = pSeg->iRoot;
+
+  *pnRec = 0;
+  while( rc==LSM_OK ){
+    Page *pPg = 0;
+    rc = lsmFsDbPageGet(pDb->pFS, pSeg, iPg, &pPg);
+    if( rc==LSM_OK ){
+      int nData;
+      u8 *aData = fsPageData(pPg, &nData);
+      int nRec = pageGetNRec(aData, nData);
+      int bBtree = (pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG);
+
+      if( bBtree ){
+        int iMin = 0;
+        int iMax = nRec-1;
+        iPg = pageGetPtr(aData, nData);
+        while( iMax>=iMin ){
+          int iTry = (iMin+iMax)/2;
+          void *pKeyT; int nKeyT;   /* Key for cell iTry */
+          int iTopicT;              /* Topic for key pKeyT/nKeyT */
+          Pgno iPtr;                /* Pointer associated with cell iTry */
+
+          rc = pageGetBtreeKey(
+              pSeg, pPg, iTry, &iPtr, &iTopicT, &pKeyT, &nKeyT, &blob
+          );
+          if( rc!=LSM_OK ) break;
+          if( sortedKeyCompare(pDb->xCmp, 0, pKey, nKey, 
+                               iTopicT, pKeyT, nKeyT)<0 
+          ){
+            iPg = iPtr;
+            iMax = iTry-1;
+          }else{
+            iMin = iTry+1;
+          }
+        }
+        fWidth = fWidth / (nRec+1);
+        fPos += fWidth * iMin;
+      }else{
+        *pnRec = nRec;
+      }
+      lsmFsPageRelease(pPg);
+      if( bBtree==0 ) break;
+    }
+  }
+
+  sortedBlobFree(&blob);
+  *pfPos = fPos;
+  return rc;
+}
+
+/*
+** Estimate the number of user keys in the database snapshot read by the
+** current read transaction that are greater than or equal to pLo/nLo and
+** smaller than pHi/nHi. If pHi is NULL, there is no upper bound. Write 
+** the estimate to *pnRow, or set *pnRow to -1 if no estimate is possible.
+**
+** The fraction of each segment that lies between the two keys is found
+** by seeking its separators b-tree for each of them, so this costs no
+** more than a few page reads per segment. Segments that do not have a
+** separators b-tree of their own are assumed to have the same key 
+** distribution as those that do. The number of keys in each segment is 
+** estimated from its size and the number of records on the sorted-run
+** pages visited. Entries in the in-memory tree are not counted. If no 
+** segment has a separators b-tree, no estimate is possible.
+*/
+int lsmSortedEstimate(
+  lsm_db *pDb,                    /* Database handle */
+  void *pLo, int nLo,             /* Lower bound (inclusive) */
+  void *pHi, int nHi,             /* Upper bound (exclusive), or NULL */
+  i64 *pnRow                      /* OUT: Estimated number of keys */
+){
+  int rc = LSM_OK;
+  Level *pLvl;
+  double fRange = 0.0;            /* Sum of (fraction * size) of segments */
+  double nMeasured = 0.0;         /* Pages in segments with a b-tree */
+  double nTotal = 0.0;            /* Pages in all segments */
+  i64 nRec = 0;                   /* Records on sorted-run pages visited */
+  int nLeaf = 0;                  /* Number of sorted-run pages visited */
+
+  assert( pDb->pClient );
+  *pnRow = -1;
+
+  for(pLvl=lsmDbSnapshotLevel(pDb->pClient); pLvl; pLvl=pLvl->pNext){
+    int i;
+    if( pLvl->flags & LEVEL_FREELIST_ONLY ) continue;
+    for(i=-1; rc==LSM_OK && i<pLvl->nRight; i++){
+      Segment *pSeg = (i<0 ? &pLvl->lhs : &pLvl->aRhs[i]);
+      nTotal += pSeg->nSize;
+      if( pSeg->iRoot ){
+        double fLo = 0.0;
+        double fHi = 1.0;
+        int n = 0;
+        rc = sortedEstimatePos(pDb, pSeg, pLo ? pLo : (void *)"", 
+            pLo ? nLo : 0, &fLo, &n
+        );
+        nRec += n;
+        nLeaf++;
+        if( rc==LSM_OK && pHi ){
+          rc = sortedEstimatePos(pDb, pSeg, pHi, nHi, &fHi, &n);
+          nRec += n;
+          nLeaf++;
+        }
+        if( fHi>fLo ) fRange += (fHi - fLo) * pSeg->nSize;
+        nMeasured += pSeg->nSize;
+      }
+    }
+  }
+
+  if( rc==LSM_OK && nMeasured>0.0 ){
+    double nPerPage = (nLeaf>0 ? (double)nRec / nLeaf : 0.0);
+    if( nPerPage<1.0 ) nPerPage = 1.0;
+    *pnRow = (i64)(fRange / nMeasured * nTotal * nPerPage + 0.5);
+  }
+  return rc;
+}
+
+/*
+** Buffer aData[], size nData, is assumed to contain a valid b-tree 
+** hierarchy page image. Return the offset in aData[] of the next free
+** byte in the data area (where a new cell may be written if there is
+** space).
+*/
+static int mergeWorkerPageOffset(u8 *aData, int nData){
+  int nRec;
+  int iOff;
+  int nKey;
+  int eType;
+
+  nRec = lsmGetU16(&aData[SEGMENT_NRECORD_OFFSET(nData)]);
+  iOff = lsmGetU16(&aData[SEGMENT_CELLPTR_OFFSET(nData, nRec-1)]);
+  eType = aData[iOff++];
+  assert( eType==0 
+       || eType==(LSM_SYSTEMKEY|LSM_SEPARATOR) 
+       || eType==(LSM_SEPARATOR)
+  );
+
+  iOff += lsmVarintGet32(&aData[iOff], &nKey);
+  iOff += lsmVarintGet32(&aData[iOff], &nKey);
+
+  return iOff + (eType ? nKey : 0);
+}
+
+/*
+** Following a checkpoint operation, database pages that are part of the
+** checkpointed state of the LSM are deemed read-only. This includes the
+** right-most page of the b-tree hierarchy of any separators array under
+** construction, and all pages between it and the b-tree root, inclusive.
+** This is a problem, as when further pages are appended to the separators
+** array, entries must be added to the indicated b-tree hierarchy pages.
+**
+** This function copies all such b-tree pages to new locations, so that
+** they can be modified as required.
+**
+** The complication is that not all database pages are the same size - due
+** to the way the file.c module works some (the first and last in each block)
+** are 4 bytes smaller than the others.
+*/
+static int mergeWorkerMoveHierarchy(
+  MergeWorker *pMW,               /* Merge worker */
+  int bSep                        /* True for separators run */
+){
+  lsm_db *pDb = pMW->pDb;         /* Database handle */
+  int rc = LSM_OK;                /* Return code */
+  int i;
+  Page **apHier = pMW->hier.apHier;
+  int nHier = pMW->hier.nHier;
+
+  for(i=0; rc==LSM_OK && i<nHier; i++){
+    Page *pNew = 0;
+    rc = lsmFsSortedAppend(pDb->pFS, pDb->pWorker, pMW->pLevel, 1, &pNew);
+    assert( rc==LSM_OK );
+
+    if( rc==LSM_OK ){
+      u8 *a1; int n1;
+      u8 *a2; int n2;
+
+      a1 = fsPageData(pNew, &n1);
+      a2 = fsPageData(apHier[i], &n2);
 
       assert( n1==n2 || n1+4==n2 );
 
@@ -4098,10 +4865,61 @@ static void mergeWorkerShutdown(MergeWorker *pMW, int *pRc){
   lsmFree(pMW->pDb->pEnv, pMW->aGobble);
   pMW->aGobble = 0;
   pMW->pCsr = 0;
+  sortedBlobFree(&pMW->vlog);
 
   *pRc = rc;
 }
 
+/*
+** Return the smaller of the two value-log generation numbers passed as
+** arguments, where zero (no generation) is considered larger than any
+** other value.
+*/
+static u32 sortedVlogMin(u32 iGen1, u32 iGen2){
+  if( iGen1==0 || (iGen2!=0 && iGen2<iGen1) ) return iGen2;
+  return iGen1;
+}
+
+/*
+** Return the generation number of the previous value-log generation if
+** there is one and the live values it contains should be relocated to
+** the current generation by merges. This is only done by connections 
+** that hold the WRITER lock, as the current generation may only be 
+** appended to by such connections.
+*/
+static u32 sortedVlogOld(lsm_db *pDb){
+  return (lsmDbHoldsWriter(pDb) ? lsmFsVlogOld(pDb->pFS) : 0);
+}
+
+/*
+** Buffer *ppVal (size *pnVal bytes) contains a pointer into the value-log
+** that is about to be written to the output of merge-worker pMW. If it
+** points into the previous value-log generation (see sortedVlogOld()),
+** copy the value to the current generation and set *ppVal to point to a
+** pointer to the copy. In all cases, update Merge.iVlogGen to account
+** for the pointer written.
+*/
+static int mergeWorkerVlog(MergeWorker *pMW, void **ppVal, int *pnVal){
+  Merge *pMerge = pMW->pLevel->pMerge;
+  u8 *aPtr = (u8 *)*ppVal;
+  int rc = LSM_OK;
+
+  if( *pnVal!=LSM_VALUEPTR_SIZE ) return LSM_CORRUPT_BKPT;
+  if( lsmGetU32(aPtr)<=pMW->iVlogOld ){
+    lsm_db *pDb = pMW->pDb;
+    rc = sortedReadValuePtr(pDb, &pMW->vlog, aPtr, LSM_VALUEPTR_SIZE);
+    if( rc==LSM_OK ){
+      aPtr = pMW->aVlogPtr;
+      rc = lsmFsAppendVlog(
+          pDb->pFS, 0, pMW->vlog.pData, pMW->vlog.nData, aPtr
+      );
+      *ppVal = (void *)aPtr;
+    }
+  }
+  pMerge->iVlogGen = sortedVlogMin(pMerge->iVlogGen, lsmGetU32(aPtr));
+  return rc;
+}
+
 /*
 ** The cursor passed as the first argument is being used as the input for
 ** a merge operation. When this function is called, *piFlags contains the
@@ -4141,7 +4959,7 @@ static void mergeRangeDeletes(MultiCursor *pCsr, int *piVal, int *piFlags){
           if( res==0 ){
             if( (f & (LSM_INSERT|LSM_POINT_DELETE))==0 ){
               if( eType & LSM_INSERT ){
-                f |= LSM_INSERT;
+                f |= (eType & (LSM_INSERT|LSM_VALUEPTR));
                 *piVal = i;
               }
               else if( eType & LSM_POINT_DELETE ){
@@ -4232,14 +5050,24 @@ static int mergeWorkerStep(MergeWorker *pMW){
     ** changed, there is no point in writing an output record. Otherwise,
     ** proceed. */
     if( rc==LSM_OK && (rtIsSeparator(eType)==0 || iPtr!=0) ){
-      /* Write the record into the main run. */
+      /* Write the record into the main run. Unless the value is read from
+      ** an in-memory tree (the shared-memory chunks of which were all mapped
+      ** by sortedNewToplevel() before the flush began and so do not move),
+      ** take a copy of it first. Writing to the output segment may cause 
+      ** the database file to be remapped, invalidating pointers into input
+      ** pages. Avoiding the copy matters most for large values.  */
       void *pVal; int nVal;
       rc = multiCursorGetVal(pCsr, iVal, &pVal, &nVal);
-      if( pVal && rc==LSM_OK ){
+      if( pVal && rc==LSM_OK
+       && iVal!=CURSOR_DATA_TREE0 && iVal!=CURSOR_DATA_TREE1 
+      ){
         assert( nVal>=0 );
         rc = sortedBlobSet(pDb->pEnv, &pCsr->val, pVal, nVal);
         pVal = pCsr->val.pData;
       }
+      if( pVal && rc==LSM_OK && (eType & LSM_VALUEPTR) ){
+        rc = mergeWorkerVlog(pMW, &pVal, &nVal);
+      }
       if( rc==LSM_OK ){
         rc = mergeWorkerWrite(pMW, eType, pKey, nKey, pVal, nVal, iPtr);
       }
@@ -4259,6 +5087,7 @@ static int mergeWorkerDone(MergeWorker *pMW){
 
 static void sortedFreeLevel(lsm_env *pEnv, Level *p){
   if( p ){
+    lsmFree(pEnv, p->pRange);
     lsmFree(pEnv, p->pSplitKey);
     lsmFree(pEnv, p->pMerge);
     lsmFree(pEnv, p->aRhs);
@@ -4346,6 +5175,7 @@ static int sortedNewToplevel(
     mergeworker.pDb = pDb;
     mergeworker.pLevel = pNew;
     mergeworker.pCsr = pCsr;
+    mergeworker.iVlogOld = sortedVlogOld(pDb);
     pCsr->pPrevMergePtr = &iLeftPtr;
 
     /* Mark the separators array for the new level as a "phantom". */
@@ -4362,6 +5192,7 @@ static int sortedNewToplevel(
       rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
     }
     nWrite = mergeworker.nWork;
+    pNew->iVlogGen = merge.iVlogGen;
     pNew->flags &= ~LEVEL_INCOMPLETE;
     if( eTree==TREE_NONE ){
       pNew->flags |= LEVEL_FREELIST_ONLY;
@@ -4402,12 +5233,142 @@ static int sortedNewToplevel(
 
   if( pnWrite ) *pnWrite = nWrite;
   pDb->pWorker->nWrite += nWrite;
+  if( eTree!=TREE_NONE ){
+    pDb->pShmhdr->nFlushWrite += nWrite;
+  }else{
+    pDb->pShmhdr->nMergeWrite += nWrite;
+  }
   pDb->pFreelist = 0;
   pDb->bUseFreelist = 0;
   lsmFree(pDb->pEnv, freelist.aEntry);
   return rc;
 }
 
+/*
+** Return the age that a level of the same size as pLevel would usually have
+** reached had its contents been written by flushing in-memory trees and 
+** merging the resulting segments together. This is used to assign an age
+** to levels created by lsm_ingest(), so that they are not immediately 
+** selected for merging with the small segments created by later flushes.
+*/
+static u16 sortedIngestAge(lsm_db *pDb, Level *pLevel){
+  i64 nFlush;                     /* Approximate size of a flushed segment */
+  int nMerge;                     /* Segments combined by each merge */
+  u16 iAge = 0;
+
+  nFlush = LSM_MAX(1, pDb->nTreeLimit / lsmFsPageSize(pDb->pFS));
+  nMerge = LSM_MAX(2, pDb->nMerge);
+  while( nFlush<pLevel->lhs.nSize && iAge<0xFFFF ){
+    nFlush = nFlush * nMerge;
+    iAge++;
+  }
+  return iAge;
+}
+
+/*
+** Write the entries returned by successive calls to xNext() into a new
+** segment and add it to the worker snapshot as the new top level of the
+** database. The entries are written directly to the output pages by a
+** MergeWorker with an empty input cursor. They are not written to the
+** log or the in-memory tree.
+**
+** If xNext() returns entries that are not in strictly ascending order,
+** LSM_MISUSE is returned and the worker snapshot is left unmodified.
+*/
+static int sortedIngest(
+  lsm_db *pDb,                    /* Connection handle */
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx,                     /* First argument passed to xNext */
+  int *pnWrite                    /* OUT: Number of database pages written */
+){
+  int rc = LSM_OK;                /* Return Code */
+  MultiCursor *pCsr = 0;          /* Empty input cursor for MergeWorker */
+  Level *pNext = 0;               /* The current top level */
+  Level *pNew;                    /* The new level itself */
+  int nWrite = 0;                 /* Number of database pages written */
+  Blob prev = {0, 0, 0, 0};       /* Copy of previous key written */
+
+  /* Allocate the new level structure to write to. */
+  pNext = lsmDbSnapshotLevel(pDb->pWorker);
+  pNew = (Level *)lsmMallocZeroRc(pDb->pEnv, sizeof(Level), &rc);
+  if( pNew ){
+    pNew->pNext = pNext;
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNew);
+  }
+
+  pCsr = multiCursorNew(pDb, &rc);
+  if( rc!=LSM_OK ){
+    lsmMCursorClose(pCsr, 0);
+  }else{
+    Pgno iLeftPtr = 0;
+    Merge merge;                  /* Merge object used to create new level */
+    MergeWorker mergeworker;      /* MergeWorker object for the same purpose */
+    int bFirst = 1;               /* True until the first key is written */
+
+    memset(&merge, 0, sizeof(Merge));
+    memset(&mergeworker, 0, sizeof(MergeWorker));
+
+    pNew->pMerge = &merge;
+    pNew->flags |= LEVEL_INCOMPLETE;
+    pCsr->pDb = pDb;
+    pCsr->pPrevMergePtr = &iLeftPtr;
+    mergeworker.pDb = pDb;
+    mergeworker.pLevel = pNew;
+    mergeworker.pCsr = pCsr;
+
+    while( rc==LSM_OK ){
+      const void *pKey = 0; int nKey = 0;
+      const void *pVal = 0; int nVal = 0;
+
+      rc = xNext(pCtx, &pKey, &nKey, &pVal, &nVal);
+      if( rc!=LSM_OK || pKey==0 ) break;
+
+      if( bFirst==0 && 0<=sortedKeyCompare(pDb->xCmp, 
+            0, prev.pData, prev.nData, 0, (void *)pKey, nKey
+      )){
+        rc = LSM_MISUSE_BKPT;
+      }else{
+        /* Take a copy of the key. It is required for the ordering check 
+        ** above, and mergeWorkerWrite() may push it into the b-tree 
+        ** hierarchy after the caller has reused the buffer.  */
+        rc = sortedBlobSet(pDb->pEnv, &prev, (void *)pKey, nKey);
+        if( rc==LSM_OK ){
+          rc = mergeWorkerWrite(&mergeworker, 
+              LSM_INSERT, prev.pData, nKey, (void *)pVal, LSM_MAX(nVal, 0), 0
+          );
+        }
+        bFirst = 0;
+      }
+    }
+
+    mergeWorkerShutdown(&mergeworker, &rc);
+    if( rc==LSM_OK && pNew->lhs.iFirst ){
+      rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
+    }
+    nWrite = mergeworker.nWork;
+    pNew->flags &= ~LEVEL_INCOMPLETE;
+    pNew->pMerge = 0;
+  }
+
+  if( rc!=LSM_OK || pNew->lhs.iFirst==0 ){
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNext);
+    sortedFreeLevel(pDb->pEnv, pNew);
+  }else{
+    pNew->iAge = sortedIngestAge(pDb, pNew);
+#if LSM_LOG_STRUCTURE
+    lsmSortedDumpStructure(pDb, pDb->pWorker, LSM_LOG_DATA, 0, "ingest");
+#endif
+    assertBtreeOk(pDb, &pNew->lhs);
+    sortedInvokeWorkHook(pDb);
+  }
+
+  if( pnWrite ) *pnWrite = nWrite;
+  pDb->pWorker->nWrite += nWrite;
+  pDb->pShmhdr->nFlushWrite += nWrite;
+  sortedBlobFree(&prev);
+  return rc;
+}
+
 /*
 ** The nMerge levels in the LSM beginning with pLevel consist of a
 ** left-hand-side segment only. Replace these levels with a single new
@@ -4454,10 +5415,11 @@ static int sortedMergeSetup(
     Level *p = pLevel;
     Level **pp;
     pNew->nRight = nMerge;
-    pNew->iAge = pLevel->iAge+1;
     for(i=0; i<nMerge; i++){
       assert( p->nRight==0 );
       pNext = p->pNext;
+      if( p->iAge>=pNew->iAge ) pNew->iAge = LSM_MIN(p->iAge+1, 0xFFFF);
+      pNew->iVlogGen = sortedVlogMin(pNew->iVlogGen, p->iVlogGen);
       pNew->aRhs[i] = p->lhs;
       if( (p->flags & LEVEL_FREELIST_ONLY)==0 ) bFreeOnly = 0;
       sortedFreeLevel(pDb->pEnv, p);
@@ -4511,6 +5473,7 @@ static int mergeWorkerInit(
   memset(pMW, 0, sizeof(MergeWorker));
   pMW->pDb = pDb;
   pMW->pLevel = pLevel;
+  pMW->iVlogOld = sortedVlogOld(pDb);
   pMW->aGobble = lsmMallocZeroRc(pDb->pEnv, sizeof(Pgno) * pLevel->nRight, &rc);
 
   /* Create a multi-cursor to read the data to write to the new
@@ -4633,10 +5596,33 @@ static int sortedCountLevels(Level *p){
   return nRet;
 }
 
-static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
+/*
+** Return the total number of pages in all segments of level p.
+*/
+static i64 sortedLevelSize(Level *p){
+  i64 nRet = p->lhs.nSize;
+  int i;
+  for(i=0; i<p->nRight; i++) nRet += p->aRhs[i].nSize;
+  return nRet;
+}
+
+/*
+** Select levels to merge according to the LSM_MERGE_TIERED policy. Return
+** a pointer to the first level to merge and set *pnBest to the number of
+** levels to merge, or return NULL if there is no work to do. If pBest is
+** returned with Level.nRight!=0, it is a merge already in progress.
+**
+** If nMaxAge is greater than zero, levels with an age of nMaxAge or 
+** greater, and all levels following them, are ignored.
+*/
+static Level *sortedSelectTiered(
+  lsm_db *pDb,                    /* Database handle */
+  int nMerge,                     /* Minimum number of levels to merge */
+  int nMaxAge,                    /* Ignore levels this old (if >0) */
+  int *pnBest                     /* OUT: Number of levels to merge */
+){
   Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
-  int rc = LSM_OK;
-  Level *pLevel = 0;            /* Output value */
+  Level *pLevel = 0;
   Level *pBest = 0;             /* Best level to work on found so far */
   int nBest;                    /* Number of segments merged at pBest */
   Level *pThis = 0;             /* First in run of levels with age=iAge */
@@ -4649,6 +5635,7 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
   ** merge with the same age in the structure. Or the level being merged
   ** with the largest number of right-hand segments. Work on it. */
   for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
+    if( nMaxAge>0 && pLevel->iAge>=nMaxAge ) break;
     if( pLevel->nRight==0 && pThis && pLevel->iAge==pThis->iAge ){
       nThis++;
     }else{
@@ -4696,6 +5683,125 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
     }
   }
 
+  *pnBest = nBest;
+  return pBest;
+}
+
+/*
+** Select levels to merge according to the LSM_MERGE_LEVELED policy. A 
+** merge already in progress is always continued. Otherwise, the first 
+** level that is not at least LSM_CONFIG_SIZE_RATIO times larger than the
+** level above it is merged with that level.
+*/
+static Level *sortedSelectLeveled(lsm_db *pDb, int *pnBest){
+  Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
+  Level *p;
+
+  for(p=pTopLevel; p; p=p->pNext){
+    if( p->nRight ){
+      *pnBest = p->nRight;
+      return p;
+    }
+  }
+  for(p=pTopLevel; p && p->pNext; p=p->pNext){
+    if( sortedLevelSize(p) * pDb->nSizeRatio > sortedLevelSize(p->pNext) ){
+      *pnBest = 2;
+      return p;
+    }
+  }
+  return 0;
+}
+
+/*
+** This is called when the merge policy does not require any merges. If
+** the previous value-log generation is waiting to be collected (see 
+** sortedVlogOld()), return the youngest level that still refers to it, 
+** so that it is rewritten and the live values it contains relocated to
+** the current generation. Where possible the level is merged with the
+** one below it, so that collecting the value-log does not cause levels
+** to accumulate. Or, if there is no such level, return NULL.
+*/
+static Level *sortedSelectVlog(lsm_db *pDb, int *pnBest){
+  u32 iOld = sortedVlogOld(pDb);
+  Level *p = 0;
+
+  if( iOld ){
+    for(p=lsmDbSnapshotLevel(pDb->pWorker); p; p=p->pNext){
+      u32 iGen = p->iVlogGen;
+      if( p->pMerge ) iGen = sortedVlogMin(iGen, p->pMerge->iVlogGen);
+      if( iGen && iGen<=iOld ){
+        if( p->nRight ){
+          *pnBest = p->nRight;
+        }else if( p->pNext && p->pNext->nRight==0 ){
+          *pnBest = 2;
+        }else{
+          *pnBest = 1;
+        }
+        break;
+      }
+    }
+  }
+  return p;
+}
+
+/*
+** Select levels to merge according to the LSM_MERGE_TIMEWINDOW policy.
+** Levels younger than LSM_CONFIG_WINDOW_AGE are merged as for the tiered
+** policy. Older levels, each of which holds the data written during a
+** single window of time, are only merged if there are more than nMerge
+** of them. In that case the nMerge oldest are merged together, so that
+** the number of levels in the database remains bounded.
+*/
+static Level *sortedSelectWindow(lsm_db *pDb, int nMerge, int *pnBest){
+  Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
+  Level *pBest;
+  Level *p;
+  int nWindow = 0;                /* Number of closed windows */
+
+  pBest = sortedSelectTiered(pDb, nMerge, pDb->nWindowAge, pnBest);
+  if( pBest ) return pBest;
+
+  for(p=pTopLevel; p; p=p->pNext){
+    if( p->iAge<pDb->nWindowAge ) continue;
+    if( p->nRight ){
+      *pnBest = p->nRight;
+      return p;
+    }
+    nWindow++;
+  }
+
+  if( nWindow>nMerge ){
+    int i = 0;
+    for(p=pTopLevel; p; p=p->pNext){
+      if( p->iAge>=pDb->nWindowAge && (i++)==nWindow-nMerge ) break;
+    }
+    assert( p );
+    *pnBest = nMerge;
+    return p;
+  }
+  return 0;
+}
+
+static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
+  int rc = LSM_OK;
+  Level *pBest = 0;             /* Best level to work on found so far */
+  int nBest = 0;                /* Number of segments merged at pBest */
+
+  assert( nMerge>=1 );
+  if( nMerge>1 && pDb->eMergePolicy==LSM_MERGE_TIMEWINDOW ){
+    pBest = sortedSelectWindow(pDb, nMerge, &nBest);
+  }else{
+    if( nMerge>1 && pDb->eMergePolicy==LSM_MERGE_LEVELED ){
+      pBest = sortedSelectLeveled(pDb, &nBest);
+    }
+    if( pBest==0 ){
+      pBest = sortedSelectTiered(pDb, nMerge, 0, &nBest);
+    }
+  }
+  if( pBest==0 ){
+    pBest = sortedSelectVlog(pDb, &nBest);
+  }
+
   if( pBest ){
     if( pBest->nRight==0 ){
       rc = sortedMergeSetup(pDb, pBest, nBest, ppOut);
@@ -4849,6 +5955,7 @@ static int mergeInsertFreelistSegments(
     lsmFree(pDb->pEnv, pCsr->aTree);
     lsmFree(pDb->pEnv, pCsr->aPtr);
     pCsr->aTree = 0;
+    pCsr->aPrefix = 0;
     pCsr->aPtr = aNew1;
 
     aNew2 = (Segment *)lsmMallocZeroRc(
@@ -5043,7 +6150,9 @@ static int sortedWork(
             pLevel->nRight = 0;
             pLevel->aRhs = 0;
 
-            /* Free the Merge object */
+            /* Free the Merge object. The level now refers only to the
+            ** value-log generations written by the merge.  */
+            pLevel->iVlogGen = pLevel->pMerge->iVlogGen;
             lsmFree(pDb->pEnv, pLevel->pMerge);
             pLevel->pMerge = 0;
           }
@@ -5077,6 +6186,7 @@ static int sortedWork(
 
   if( pnWrite ) *pnWrite = (nWork - nRemaining);
   pWorker->nWrite += (nWork - nRemaining);
+  pDb->pShmhdr->nMergeWrite += (nWork - nRemaining);
 
 #ifdef LSM_LOG_WORK
   lsmLogMessage(pDb, rc, "sortedWork(): %d pages", (nWork-nRemaining));
@@ -5120,13 +6230,60 @@ static int sortedNewFreelistOnly(lsm_db *pDb){
   return sortedNewToplevel(pDb, TREE_NONE, 0);
 }
 
+/*
+** This function is called before the worker snapshot is saved by a 
+** connection that holds the WRITER lock. It writes the header of the
+** current value-log generation, which may have been appended to by 
+** merges, to disk. Then, if no level of the worker snapshot and no 
+** in-memory tree refers to the previous value-log generation, it records
+** in shared-memory that the previous generation may be deleted once no
+** client is using a snapshot older than the one about to be saved (see
+** lsmCheckpointWrite()).
+**
+** Only connections that hold the WRITER lock do this, as the WRITER lock
+** guarantees that the in-memory tree header in shared-memory is current
+** and that no new pointers to the previous generation are being written.
+*/
+static int sortedVlogCheck(lsm_db *pDb){
+  ShmHeader *pShm = pDb->pShmhdr;
+  int rc;
+  u32 iOld;
+
+  rc = lsmFsSyncVlog(pDb->pFS, pDb->eSafety!=LSM_SAFETY_OFF);
+  iOld = lsmFsVlogOld(pDb->pFS);
+  if( rc==LSM_OK && iOld && pShm->bWriter==0 ){
+    TreeHeader *pHdr = &pShm->hdr1;
+    Level *p;
+    u32 iMin = pHdr->root.iVlogGen;
+    if( pHdr->iOldShmid ){
+      iMin = sortedVlogMin(iMin, pHdr->oldroot.iVlogGen);
+    }
+    for(p=lsmDbSnapshotLevel(pDb->pWorker); p; p=p->pNext){
+      iMin = sortedVlogMin(iMin, p->iVlogGen);
+      if( p->pMerge ) iMin = sortedVlogMin(iMin, p->pMerge->iVlogGen);
+    }
+    if( iMin==0 || iMin>iOld ){
+      pShm->iVlogFreeId = pDb->pWorker->iId;
+      lsmShmBarrier(pDb);
+      pShm->iVlogFree = iOld;
+    }
+  }
+  return rc;
+}
+
 int lsmSaveWorker(lsm_db *pDb, int bFlush){
   Snapshot *p = pDb->pWorker;
+  int rc = LSM_OK;
   if( p->freelist.nEntry>pDb->nMaxFreelist ){
-    int rc = sortedNewFreelistOnly(pDb);
-    if( rc!=LSM_OK ) return rc;
+    rc = sortedNewFreelistOnly(pDb);
+  }
+  if( rc==LSM_OK && lsmDbHoldsWriter(pDb) ){
+    rc = sortedVlogCheck(pDb);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmCheckpointSaveWorker(pDb, bFlush);
   }
-  return lsmCheckpointSaveWorker(pDb, bFlush);
+  return rc;
 }
 
 static int doLsmSingleWork(
@@ -5188,6 +6345,10 @@ static int doLsmSingleWork(
       nRem -= nPg;
       assert( rc!=LSM_OK || nRem<=0 || !sortedDbIsFull(pDb) );
       bDirty = 1;
+      if( rc==LSM_OK ){
+        pDb->pShmhdr->nStall++;
+        pDb->pShmhdr->nStallWrite += nPg;
+      }
     }
 
     if( rc==LSM_OK && nRem>0 ){
@@ -5289,12 +6450,21 @@ int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite){
   int nPgsz;                      /* Nominal page size in bytes */
   int nPage;                      /* Equivalent of nKB in pages */
   int nWrite = 0;                 /* Number of pages written */
+  int bWriter = 0;                /* True if WRITER lock taken below */
 
   /* This function may not be called if pDb has an open read or write
   ** transaction. Return LSM_MISUSE if an application attempts this.  */
   if( pDb->nTransOpen || pDb->pCsr ) return LSM_MISUSE_BKPT;
   if( nMerge<=0 ) nMerge = pDb->nMerge;
 
+  /* If the previous value-log generation has not yet been collected, try
+  ** to take the WRITER lock for the duration of this call, so that merges
+  ** relocate the live values it contains (see sortedVlogOld()). If the 
+  ** lock is not available, the work is done without relocating values.  */
+  if( pDb->bReadonly==0 && lsmFsVlogOld(pDb->pFS) ){
+    bWriter = (lsmShmLock(pDb, LSM_LOCK_WRITER, LSM_LOCK_EXCL, 0)==LSM_OK);
+  }
+
   lsmFsPurgeCache(pDb->pFS);
 
   /* Convert from KB to pages */
@@ -5306,6 +6476,7 @@ int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite){
   }
 
   rc = doLsmWork(pDb, nMerge, nPage, &nWrite);
+  if( bWriter ) lsmShmLock(pDb, LSM_LOCK_WRITER, LSM_LOCK_UNLOCK, 0);
   
   if( pnWrite ){
     /* Convert back from pages to KB */
@@ -5314,6 +6485,74 @@ int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite){
   return rc;
 }
 
+/*
+** Merge segments in the worker snapshot until sortedDbIsFull() returns
+** false, so that a new top level may be added. If any merging is required,
+** the stall counters in shared-memory are updated.
+*/
+static int sortedWorkUntilNotFull(lsm_db *pDb){
+  int rc = LSM_OK;
+  if( sortedDbIsFull(pDb) ){
+    int nTotal = 0;
+    while( rc==LSM_OK && sortedDbIsFull(pDb) ){
+      int nPg = 0;
+      rc = sortedWork(pDb, 256, pDb->nMerge, 1, &nPg);
+      nTotal += nPg;
+    }
+    if( rc==LSM_OK ){
+      pDb->pShmhdr->nStall++;
+      pDb->pShmhdr->nStallWrite += nTotal;
+    }
+  }
+  return rc;
+}
+
+/*
+** Write the sorted entries returned by xNext directly into a new segment.
+** See the comments above lsm_ingest() in lsm.h for details.
+*/
+int lsm_ingest(
+  lsm_db *db, 
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx
+){
+  int rc;
+
+  if( db->nTransOpen>0 || db->pCsr ){
+    rc = LSM_MISUSE_BKPT;
+  }else{
+    rc = lsmBeginWriteTrans(db);
+    if( rc==LSM_OK ){
+      /* Flush the contents of the in-memory tree to disk first, so that
+      ** the ingested segment is newer than all other data in the db. */
+      rc = lsmBeginWork(db);
+      if( rc==LSM_OK ) rc = sortedWorkUntilNotFull(db);
+      if( rc==LSM_OK ) rc = sortedNewToplevel(db, TREE_BOTH, 0);
+      if( rc==LSM_OK ) rc = sortedIngest(db, xNext, pCtx, 0);
+      lsmFinishWork(db, 1, &rc);
+
+      if( rc==LSM_OK ){
+        lsmTreeDiscardOld(db);
+        lsmTreeMakeOld(db);
+        lsmTreeDiscardOld(db);
+      }
+    }
+
+    if( rc==LSM_OK ){
+      rc = lsmFinishWriteTrans(db, 1);
+    }else{
+      lsmFinishWriteTrans(db, 0);
+    }
+    lsmFinishReadTrans(db);
+
+    /* The ingested data was never written to the log file. Checkpoint the
+    ** database so that it survives a crash.  */
+    if( rc==LSM_OK ) rc = lsm_checkpoint(db, 0);
+  }
+
+  return rc;
+}
+
 int lsm_flush(lsm_db *db){
   int rc;
 
@@ -5339,6 +6578,24 @@ int lsm_flush(lsm_db *db){
   return rc;
 }
 
+/*
+** Return the factor by which the amount of auto-work performed following
+** a write should be multiplied, based on how close the client snapshot is
+** to the "full" condition tested by sortedDbIsFull(). Once the number of
+** un-merged age=0 levels comes within two of the nMerge limit, each 
+** additional such level adds one to the factor. This spreads the merging
+** required to clear the condition over a number of writes, instead of 
+** leaving it all to be done by the writer that next flushes the tree.
+*/
+static int sortedWorkPressure(lsm_db *pDb){
+  Level *pTop = lsmDbSnapshotLevel(pDb->pClient);
+  int nPressure = 1;
+  if( pTop && pTop->iAge==0 && pTop->nRight==0 ){
+    nPressure += LSM_MAX(0, sortedCountLevels(pTop) - (pDb->nMerge-2));
+  }
+  return nPressure;
+}
+
 /*
 ** This function is called in auto-work mode to perform merging work on
 ** the data structure. It performs enough merging work to prevent the
@@ -5374,7 +6631,7 @@ int lsmSortedAutoWork(
   if( nDepth>0 ){
     int nRemaining;               /* Units of work to do before returning */
 
-    nRemaining = nUnit * nDepth;
+    nRemaining = nUnit * nDepth * sortedWorkPressure(pDb);
 #ifdef LSM_LOG_WORK
     lsmLogMessage(pDb, rc, "lsmSortedAutoWork(): %d*%d = %d pages", 
         nUnit, nDepth, nRemaining);
@@ -5408,9 +6665,7 @@ int lsmFlushTreeToDisk(lsm_db *pDb){
   int rc;
 
   rc = lsmBeginWork(pDb);
-  while( rc==LSM_OK && sortedDbIsFull(pDb) ){
-    rc = sortedWork(pDb, 256, pDb->nMerge, 1, 0);
-  }
+  if( rc==LSM_OK ) rc = sortedWorkUntilNotFull(pDb);
 
   if( rc==LSM_OK ){
     rc = sortedNewToplevel(pDb, TREE_BOTH, 0);
@@ -5949,6 +7204,8 @@ static void assertRunInOrder(lsm_db *pDb, Segment *pSeg){
   Page *pPg = 0;
   Blob blob1 = {0, 0, 0, 0};
   Blob blob2 = {0, 0, 0, 0};
+  int iTopic1 = 0;
+  int iTopic2 = 0;
 
   lsmFsDbPageGet(pDb->pFS, pSeg, pSeg->iFirst, &pPg);
   while( pPg ){
@@ -5960,7 +7217,6 @@ static void assertRunInOrder(lsm_db *pDb, Segment *pSeg){
       int i;
       int nRec = pageGetNRec(aData, nData);
       for(i=0; i<nRec; i++){
-        int iTopic1, iTopic2;
         pageGetKeyCopy(pDb->pEnv, pSeg, pPg, i, &iTopic1, &blob1);
 
         if( i==0 && blob2.nData ){
@@ -1091,6 +1091,7 @@ void lsmTreeMakeOld(lsm_db *pDb){
     pDb->treehdr.root.iRoot = 0;
     pDb->treehdr.root.nHeight = 0;
     pDb->treehdr.root.nByte = 0;
+    pDb->treehdr.root.iVlogGen = 0;
   }
 }
 
@@ -1457,6 +1458,7 @@ static int treeInsertEntry(
   assert_tree_looks_ok(LSM_OK, pTree);
   assert( flags==LSM_INSERT       || flags==LSM_POINT_DELETE 
        || flags==LSM_START_DELETE || flags==LSM_END_DELETE 
+       || flags==(LSM_INSERT|LSM_VALUEPTR)
   );
   assert( (flags & LSM_CONTIGUOUS)==0 );
 #if 0
@@ -1587,6 +1589,25 @@ int lsmTreeInsert(
   return treeInsertEntry(pDb, flags, pKey, nKey, pVal, nVal);
 }
 
+/*
+** Insert a new entry into the in-memory tree. The value associated with
+** the new entry is stored in the value-log file. Buffer pPtr contains the
+** LSM_VALUEPTR_SIZE byte pointer to it.
+*/
+int lsmTreeInsertValuePtr(
+  lsm_db *pDb,                    /* Database handle */
+  void *pKey,                     /* Pointer to key data */
+  int nKey,                       /* Size of key data in bytes */
+  void *pPtr                      /* Pointer to value in value-log */
+){
+  TreeRoot *pRoot = &pDb->treehdr.root;
+  u32 iGen = lsmGetU32((u8 *)pPtr);
+  if( pRoot->iVlogGen==0 || iGen<pRoot->iVlogGen ) pRoot->iVlogGen = iGen;
+  return treeInsertEntry(
+      pDb, LSM_INSERT|LSM_VALUEPTR, pKey, nKey, pPtr, LSM_VALUEPTR_SIZE
+  );
+}
+
 static int treeDeleteEntry(lsm_db *db, TreeCursor *pCsr, u32 iNewptr){
   TreeRoot *p = &db->treehdr.root;
   TreeNode *pNode = pCsr->apTreeNode[pCsr->iNode];
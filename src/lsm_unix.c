@@ -19,6 +19,11 @@
 # endif
 #endif
 
+/* Required for MAP_POPULATE and madvise() on Linux. */
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+# define _DEFAULT_SOURCE 1
+#endif
+
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -43,6 +48,32 @@
 # define fdatasync(x) fsync(x)
 #endif
 
+/*
+** The following compile-time options control how the database file is
+** memory mapped when LSM_CONFIG_MMAP is enabled. Each is ignored on 
+** platforms that do not support the corresponding mmap() flag or 
+** madvise() hint.
+**
+** LSM_MMAP_POPULATE:
+**   Pass MAP_POPULATE to mmap(), so that the page tables for the whole 
+**   file are populated when it is mapped instead of by page faults on 
+**   first access.
+**
+** LSM_MMAP_HUGEPAGE:
+**   Advise the system to back the mapping with transparent huge pages
+**   (MADV_HUGEPAGE), reducing TLB misses for large databases.
+**
+** LSM_MMAP_RANDOM:
+**   Advise the system that the mapping is accessed in random order 
+**   (MADV_RANDOM), disabling read-ahead. This suits point-read workloads
+**   on databases larger than memory, at some cost to merges.
+*/
+#if defined(LSM_MMAP_POPULATE) && defined(MAP_POPULATE)
+# define POSIX_MMAP_FLAGS (MAP_SHARED|MAP_POPULATE)
+#else
+# define POSIX_MMAP_FLAGS MAP_SHARED
+#endif
+
 /*
 ** An open file is an instance of the following object
 */
@@ -54,6 +85,7 @@ struct PosixFile {
   int shmfd;                      /* Shared memory file-descriptor */
   void *pMap;                     /* Pointer to mapping of file fd */
   off_t nMap;                     /* Size of mapping at pMap in bytes */
+  off_t nReserve;                 /* Address space reserved at pMap */
   int nShm;                       /* Number of entries in array apShm[] */
   void **apShm;                   /* Array of 32K shared memory segments */
 };
@@ -109,19 +141,25 @@ static int lsmPosixOsWrite(
   void *pData,                    /* Write data from this buffer */
   int nData                       /* Bytes of data to write */
 ){
-  int rc = LSM_OK;
   PosixFile *p = (PosixFile *)pFile;
-  off_t offset;
-
-  offset = lseek(p->fd, (off_t)iOff, SEEK_SET);
-  if( offset!=iOff ){
-    rc = LSM_IOERR_BKPT;
-  }else{
-    ssize_t prc = write(p->fd, pData, (size_t)nData);
-    if( prc<0 ) rc = LSM_IOERR_BKPT;
+  u8 *aData = (u8 *)pData;
+
+  /* Use pwrite() so that each write requires a single system call, rather
+  ** than an lseek() followed by a write(). Retry if the write is 
+  ** interrupted or only partially completed. A pwrite() that writes no
+  ** data at all is an error, as retrying it would loop forever.  */
+  while( nData>0 ){
+    ssize_t prc = pwrite(p->fd, aData, (size_t)nData, (off_t)iOff);
+    if( prc<=0 ){
+      if( prc<0 && errno==EINTR ) continue;
+      return LSM_IOERR_BKPT;
+    }
+    aData += prc;
+    iOff += prc;
+    nData -= (int)prc;
   }
 
-  return rc;
+  return LSM_OK;
 }
 
 static int lsmPosixOsTruncate(
@@ -148,24 +186,30 @@ static int lsmPosixOsRead(
   void *pData,                    /* Read data into this buffer */
   int nData                       /* Bytes of data to read */
 ){
-  int rc = LSM_OK;
   PosixFile *p = (PosixFile *)pFile;
-  off_t offset;
-
-  offset = lseek(p->fd, (off_t)iOff, SEEK_SET);
-  if( offset!=iOff ){
-    rc = LSM_IOERR_BKPT;
-  }else{
-    ssize_t prc = read(p->fd, pData, (size_t)nData);
-    if( prc<0 ){ 
-      rc = LSM_IOERR_BKPT;
-    }else if( prc<nData ){
-      memset(&((u8 *)pData)[prc], 0, nData - prc);
+  u8 *aData = (u8 *)pData;
+
+  /* As in lsmPosixOsWrite(), use pread() to avoid a separate lseek() call.
+  ** If the end of the file is reached before nData bytes have been read,
+  ** zero the remainder of the buffer. This is what the read() based 
+  ** version did, and callers rely on it. For example, the meta pages of
+  ** a new, empty database file are read as zeroes.  */
+  while( nData>0 ){
+    ssize_t prc = pread(p->fd, aData, (size_t)nData, (off_t)iOff);
+    if( prc<0 ){
+      if( errno==EINTR ) continue;
+      return LSM_IOERR_BKPT;
     }
-
+    if( prc==0 ){
+      memset(aData, 0, nData);
+      break;
+    }
+    aData += prc;
+    iOff += prc;
+    nData -= (int)prc;
   }
 
-  return rc;
+  return LSM_OK;
 }
 
 static int lsmPosixOsSync(lsm_file *pFile){
@@ -191,6 +235,21 @@ static int lsmPosixOsSectorSize(lsm_file *pFile){
   return 512;
 }
 
+/*
+** Apply the madvise() hints selected at compile time to the nByte byte 
+** region of the mapping starting at aMap.
+*/
+static void posixMadvise(u8 *aMap, off_t nByte){
+#if defined(LSM_MMAP_HUGEPAGE) && defined(MADV_HUGEPAGE)
+  madvise(aMap, nByte, MADV_HUGEPAGE);
+#endif
+#if defined(LSM_MMAP_RANDOM) && defined(MADV_RANDOM)
+  madvise(aMap, nByte, MADV_RANDOM);
+#endif
+  (void)aMap;
+  (void)nByte;
+}
+
 static int lsmPosixOsRemap(
   lsm_file *pFile, 
   lsm_i64 iMin, 
@@ -207,26 +266,57 @@ static int lsmPosixOsRemap(
   const int aIncrSz[] = {256*1024, 1024*1024};
   int nIncrSz = aIncrSz[iMin>(2*1024*1024)];
 
-  if( p->pMap ){
-    munmap(p->pMap, p->nMap);
+  if( iMin<0 ){
+    if( p->pMap ) munmap(p->pMap, p->nReserve);
     *ppOut = p->pMap = 0;
-    *pnOut = p->nMap = 0;
+    *pnOut = p->nMap = p->nReserve = 0;
+    return LSM_OK;
   }
 
-  if( iMin>=0 ){
-    memset(&buf, 0, sizeof(buf));
-    prc = fstat(p->fd, &buf);
+  memset(&buf, 0, sizeof(buf));
+  prc = fstat(p->fd, &buf);
+  if( prc!=0 ) return LSM_IOERR_BKPT;
+  iSz = buf.st_size;
+  if( iSz<iMin ){
+    iSz = ((iMin + nIncrSz-1) / nIncrSz) * nIncrSz;
+    prc = ftruncate(p->fd, iSz);
     if( prc!=0 ) return LSM_IOERR_BKPT;
-    iSz = buf.st_size;
-    if( iSz<iMin ){
-      iSz = ((iMin + nIncrSz-1) / nIncrSz) * nIncrSz;
-      prc = ftruncate(p->fd, iSz);
-      if( prc!=0 ) return LSM_IOERR_BKPT;
+  }
+
+  /* The file is mapped with a length greater than its current size (on
+  ** 64-bit platforms, twice its size). Pages beyond the end of the file 
+  ** are never accessed. But while the file still fits within the 
+  ** reserved region, growing it does not require a new mapping, so the
+  ** mapping does not move and existing pointers into it remain valid.  */
+  if( p->pMap==0 || iSz>p->nReserve ){
+    int fd = p->fd;
+    off_t nReserve = iSz;
+    void *pMap = MAP_FAILED;
+
+    if( p->pMap ){
+      munmap(p->pMap, p->nReserve);
+      p->pMap = 0;
+      p->nMap = p->nReserve = 0;
+    }
+    if( sizeof(void *)>4 ){
+      nReserve = iSz*2;
+      pMap = mmap(0, nReserve, PROT_READ|PROT_WRITE, POSIX_MMAP_FLAGS, fd, 0);
+    }
+    if( pMap==MAP_FAILED ){
+      nReserve = iSz;
+      pMap = mmap(0, nReserve, PROT_READ|PROT_WRITE, POSIX_MMAP_FLAGS, fd, 0);
+    }
+    if( pMap==MAP_FAILED ){
+      *ppOut = 0;
+      *pnOut = 0;
+      return LSM_IOERR_BKPT;
     }
 
-    p->pMap = mmap(0, iSz, PROT_READ|PROT_WRITE, MAP_SHARED, p->fd, 0);
-    p->nMap = iSz;
+    posixMadvise((u8 *)pMap, nReserve);
+    p->pMap = pMap;
+    p->nReserve = nReserve;
   }
+  p->nMap = iSz;
 
   *ppOut = p->pMap;
   *pnOut = p->nMap;
@@ -316,7 +406,7 @@ int lsmPosixOsLock(lsm_file *pFile, int iLock, int eType){
   assert( aType[LSM_LOCK_SHARED]==F_RDLCK );
   assert( aType[LSM_LOCK_EXCL]==F_WRLCK );
   assert( eType>=0 && eType<array_size(aType) );
-  assert( iLock>0 && iLock<=32 );
+  assert( iLock>0 && iLock<=64 );
 
   memset(&lock, 0, sizeof(lock));
   lock.l_whence = SEEK_SET;
@@ -346,7 +436,7 @@ int lsmPosixOsTestLock(lsm_file *pFile, int iLock, int nLock, int eType){
   assert( aType[LSM_LOCK_SHARED]==F_RDLCK );
   assert( aType[LSM_LOCK_EXCL]==F_WRLCK );
   assert( eType>=0 && eType<array_size(aType) );
-  assert( iLock>0 && iLock<=32 );
+  assert( iLock>0 && iLock<=64 );
 
   memset(&lock, 0, sizeof(lock));
   lock.l_whence = SEEK_SET;
@@ -445,7 +535,7 @@ int lsmPosixOsShmUnmap(lsm_file *pFile, int bDelete){
 static int lsmPosixOsClose(lsm_file *pFile){
    PosixFile *p = (PosixFile *)pFile;
    lsmPosixOsShmUnmap(pFile, 0);
-   if( p->pMap ) munmap(p->pMap, p->nMap);
+   if( p->pMap ) munmap(p->pMap, p->nReserve);
    close(p->fd);
    lsm_free(p->pEnv, p->apShm);
    lsm_free(p->pEnv, p);
@@ -1147,6 +1147,8 @@ static int openDatabase(
   memcpy(db->aLimit, aHardLimit, sizeof(db->aLimit));
   db->nextAutovac = -1;
   db->nextPagesize = 0;
+  db->nEphemeralMaxMem = SQLITE4_EPHEMERAL_MAXMEM;
+  db->nSorterMaxMem = SQLITE4_SORTER_MAXMEM;
   db->flags |=  SQLITE4_AutoIndex
                  | SQLITE4_EnableTrigger
                  | SQLITE4_ForeignKeys
@@ -90,6 +90,29 @@ int sqlite4OsRandomness(sqlite4_env *pEnv, int nByte, unsigned char *zBufOut){
   return SQLITE4_OK;
 }
 
+/*
+** Return the name of a new temporary file in a buffer obtained from
+** sqlite4_malloc(), or NULL if a malloc fails. The caller is responsible
+** for creating, and later deleting, the file itself. The name is made up
+** of the temporary directory, zPrefix and a random suffix. On unix, the
+** temporary directory is the one named by the TMPDIR environment
+** variable, or /tmp. On windows it is the one named by TEMP, or the
+** current directory.
+*/
+char *sqlite4OsTempName(sqlite4_env *pEnv, const char *zPrefix){
+  const char *zDir = 0;
+  sqlite4_uint64 iRandom;
+#if SQLITE4_OS_WIN
+  zDir = getenv("TEMP");
+  if( zDir==0 || zDir[0]=='\0' ) zDir = ".";
+#else
+  zDir = getenv("TMPDIR");
+  if( zDir==0 || zDir[0]=='\0' ) zDir = "/tmp";
+#endif
+  sqlite4_randomness(pEnv, sizeof(iRandom), &iRandom);
+  return sqlite4_mprintf(pEnv, "%s/%s_%llx", zDir, zPrefix, iRandom);
+}
+
 /*
 ** This function is a wrapper around the OS specific implementation of
 ** sqlite4_os_init(). The purpose of the wrapper is to provide the
@@ -78,5 +78,6 @@
 int sqlite4OsInit(sqlite4_env*);
 int sqlite4OsRandomness(sqlite4_env*, int, unsigned char*);
 int sqlite4OsCurrentTime(sqlite4_env*, sqlite4_uint64*);
+char *sqlite4OsTempName(sqlite4_env*, const char*);
 
 #endif /* _SQLITE4_OS_H_ */
@@ -841,6 +841,40 @@ void sqlite4Pragma(
     sqlite4_db_release_memory(db);
   }else
 
+  /*
+  **  PRAGMA ephemeral_maxmem
+  **  PRAGMA ephemeral_maxmem = N
+  **
+  ** Query or set the maximum number of bytes of memory used by each of
+  ** the ephemeral tables opened by this connection before their contents
+  ** are moved to a temporary file. The new limit applies to ephemeral
+  ** tables opened after it is set.
+  */
+  if( sqlite4_stricmp(zPragma, "ephemeral_maxmem")==0 ){
+    if( zRight ){
+      int nMax = sqlite4Atoi(zRight);
+      if( nMax>0 ) db->nEphemeralMaxMem = nMax;
+    }
+    returnSingleInt(pParse, "ephemeral_maxmem", db->nEphemeralMaxMem);
+  }else
+
+  /*
+  **  PRAGMA sorter_maxmem
+  **  PRAGMA sorter_maxmem = N
+  **
+  ** Query or set the maximum number of bytes of record data held in
+  ** memory by each of the sorters opened by this connection before the
+  ** records are written to a temporary file. The new limit applies to
+  ** sorters opened after it is set.
+  */
+  if( sqlite4_stricmp(zPragma, "sorter_maxmem")==0 ){
+    if( zRight ){
+      int nMax = sqlite4Atoi(zRight);
+      if( nMax>0 ) db->nSorterMaxMem = nMax;
+    }
+    returnSingleInt(pParse, "sorter_maxmem", db->nSorterMaxMem);
+  }else
+
   /*
   **  PRAGMA schema_version
   */
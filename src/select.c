@@ -597,9 +597,19 @@ static void selectInnerLoop(
   }else if( eDest!=SRT_Exists ){
     /* If the destination is an EXISTS(...) expression, the actual
     ** values returned by the SELECT are not required.
+    **
+    ** If the values are only used by the OP_ResultRow below, columns
+    ** are pinned in their cursors instead of being copied out of them.
+    ** This is not done for DISTINCT, as rows that are not returned
+    ** would release the pins by copying the values anyway.
     */
+    u8 ecelFlags = 0;
+    if( eDest==SRT_Output ){
+      ecelFlags = SQLITE4_ECEL_DUP;
+      if( pOrderBy==0 && !hasDistinct ) ecelFlags |= SQLITE4_ECEL_PIN;
+    }
     sqlite4ExprCacheClear(pParse);
-    sqlite4ExprCodeExprList(pParse, pEList, regResult, eDest==SRT_Output);
+    sqlite4ExprCodeExprList(pParse, pEList, regResult, ecelFlags);
   }
   nColumn = nResultCol;
 
@@ -854,6 +864,20 @@ static void explainTempTable(Parse *pParse, const char *zUsage){
   }
 }
 
+/*
+** Unless an "EXPLAIN QUERY PLAN" command is being processed, this function
+** is a no-op. Otherwise, it adds a single row of output to the EQP result
+** for a "SELECT count(*) FROM tbl" query optimized using OP_Count. The
+** caption is of the form "SCAN TABLE tbl".
+*/
+static void explainSimpleCount(Parse *pParse, Table *pTab){
+  if( pParse->explain==2 ){
+    Vdbe *v = pParse->pVdbe;
+    char *zMsg = sqlite4MPrintf(pParse->db, "SCAN TABLE %s", pTab->zName);
+    sqlite4VdbeAddOp4(v, OP_Explain, pParse->iSelectId, 0, 0, zMsg, P4_DYNAMIC);
+  }
+}
+
 /*
 ** Assign expression b to lvalue a. A second, no-op, version of this macro
 ** is provided when SQLITE4_OMIT_EXPLAIN is defined. This allows the code
@@ -866,6 +890,7 @@ static void explainTempTable(Parse *pParse, const char *zUsage){
 #else
 /* No-op versions of the explainXXX() functions and macros. */
 # define explainTempTable(y,z)
+# define explainSimpleCount(y,z)
 # define explainSetInteger(y,z)
 #endif
 
@@ -978,9 +1003,14 @@ static void generateSortTail(
       testcase( eDest==SRT_Coroutine );
 
       /* Read the data out of the sorter and into the array of nColumn
-      ** contiguous registers starting at pDest->iMem.  */
+      ** contiguous registers starting at pDest->iMem. If they are only
+      ** used by OP_ResultRow, the values are pinned in the sorter cursor
+      ** instead of being copied out of it.  */
       for(i=0; i<nColumn; i++){
         sqlite4VdbeAddOp3(v, OP_Column, iTab, i, pDest->iMem+i);
+        if( eDest==SRT_Output ){
+          sqlite4VdbeChangeP5(v, OPFLAG_EPHEM|OPFLAG_PIN);
+        }
       }
 
       if( eDest==SRT_Output ){
@@ -3117,6 +3147,41 @@ static u8 minMaxQuery(Select *p){
   return WHERE_ORDERBY_NORMAL;
 }
 
+/*
+** The select statement passed as the first argument is an aggregate query.
+** The second argument is the associated aggregate-info object. This 
+** function tests if the SELECT is of the form:
+**
+**   SELECT count(*) FROM <tbl>
+**
+** where table is a database table, not a sub-select or view. If the query
+** does match this pattern, then a pointer to the Table object representing
+** <tbl> is returned. Otherwise, 0 is returned.
+*/
+static Table *isSimpleCount(Select *p, AggInfo *pAggInfo){
+  Table *pTab;
+  Expr *pExpr;
+
+  assert( !p->pGroupBy );
+
+  if( p->pWhere || p->pEList->nExpr!=1 
+   || p->pSrc->nSrc!=1 || p->pSrc->a[0].pSelect
+  ){
+    return 0;
+  }
+  pTab = p->pSrc->a[0].pTab;
+  pExpr = p->pEList->a[0].pExpr;
+  assert( pTab && !pTab->pSelect && pExpr );
+
+  if( IsVirtual(pTab) ) return 0;
+  if( pExpr->op!=TK_AGG_FUNCTION ) return 0;
+  if( NEVER(pAggInfo->nFunc==0) ) return 0;
+  if( (pAggInfo->aFunc[0].pFunc->flags&SQLITE4_FUNC_COUNT)==0 ) return 0;
+  if( pExpr->flags&EP_Distinct ) return 0;
+
+  return pTab;
+}
+
 /*
 ** If the source-list item passed as an argument was augmented with an
 ** INDEXED BY clause, then try to locate the specified index. If there
@@ -3573,7 +3638,7 @@ static void updateAccumulator(Parse *pParse, AggInfo *pAggInfo){
     if( pList ){
       nArg = pList->nExpr;
       regAgg = sqlite4GetTempRange(pParse, nArg);
-      sqlite4ExprCodeExprList(pParse, pList, regAgg, 1);
+      sqlite4ExprCodeExprList(pParse, pList, regAgg, SQLITE4_ECEL_DUP);
     }else{
       nArg = 0;
       regAgg = 0;
@@ -3983,7 +4048,7 @@ int sqlite4Select(
         pOp->p1 = 1;
         pOp->p2 = iFlag;
 
-        sqlite4ExprCodeExprList(pParse, pEList, iBase, 1);
+        sqlite4ExprCodeExprList(pParse, pEList, iBase, SQLITE4_ECEL_DUP);
         iJump = sqlite4VdbeCurrentAddr(v) + 1 + pEList->nExpr + 1 + 1;
         sqlite4VdbeAddOp2(v, OP_If, iFlag, iJump-1);
         for(iExpr=0; iExpr<pEList->nExpr; iExpr++){
@@ -4179,7 +4244,7 @@ int sqlite4Select(
             AggInfoCol *pCol = &sAggInfo.aCol[i];
             int regDest = i + regBase;
             int regValue = sqlite4ExprCodeGetColumn(
-                pParse, pCol->pTab, pCol->iColumn, pCol->iTable, regDest
+                pParse, pCol->pTab, pCol->iColumn, pCol->iTable, regDest, 0
                 );
             if( regDest!=regValue ){
               sqlite4VdbeAddOp2(v, OP_SCopy, regValue, regDest);
@@ -4284,7 +4349,29 @@ int sqlite4Select(
     } /* endif pGroupBy.  Begin aggregate queries without GROUP BY: */
     else {
       ExprList *pDel = 0;
-      {
+      Table *pTab;
+      if( (pTab = isSimpleCount(p, &sAggInfo))!=0 ){
+        /* If isSimpleCount() returns a pointer to a Table structure, then
+        ** the SQL statement is of the form:
+        **
+        **   SELECT count(*) FROM <tbl>
+        **
+        ** where the Table structure returned represents table <tbl>.
+        **
+        ** This statement is so common that it is optimized specially. The
+        ** OP_Count instruction is executed on the PRIMARY KEY index of 
+        ** <tbl>, which may count the entries using several threads.
+        */
+        const int iDb = sqlite4SchemaToIndex(pParse->db, pTab->pSchema);
+        const int iCsr = pParse->nTab++;
+
+        sqlite4CodeVerifySchema(pParse, iDb);
+        sqlite4OpenPrimaryKey(pParse, iCsr, iDb, pTab, OP_OpenRead);
+        sqlite4VdbeChangeP5(v, OPFLAG_SCAN);
+        sqlite4VdbeAddOp2(v, OP_Count, iCsr, sAggInfo.aFunc[0].iMem);
+        sqlite4VdbeAddOp1(v, OP_Close, iCsr);
+        explainSimpleCount(pParse, pTab);
+      }else{
         /* Check if the query is of one of the following forms:
         **
         **   SELECT min(x) FROM ...
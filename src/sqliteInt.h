@@ -341,6 +341,24 @@
 # define SQLITE4_TEMP_STORE 1
 #endif
 
+/*
+** The default maximum number of bytes of memory used by an ephemeral table
+** before its contents are moved to a temporary file. This may be changed
+** for a single connection using "PRAGMA ephemeral_maxmem".
+*/
+#ifndef SQLITE4_EPHEMERAL_MAXMEM
+# define SQLITE4_EPHEMERAL_MAXMEM (32*1024*1024)
+#endif
+
+/*
+** The default maximum number of bytes of record data held in memory by a
+** sorter before the records are sorted and written to a temporary file.
+** This may be changed for a single connection using "PRAGMA sorter_maxmem".
+*/
+#ifndef SQLITE4_SORTER_MAXMEM
+# define SQLITE4_SORTER_MAXMEM (8*1024*1024)
+#endif
+
 /*
 ** GCC does not define the offsetof() macro so we'll have to do it
 ** ourselves.
@@ -814,6 +832,8 @@ struct sqlite4 {
   u8 suppressErr;               /* Do not issue error messages if true */
   u8 vtabOnConflict;            /* Value to return for s3_vtab_on_conflict() */
   int nextPagesize;             /* Pagesize after VACUUM if >0 */
+  int nEphemeralMaxMem;         /* Memory budget of each ephemeral table */
+  int nSorterMaxMem;            /* Memory budget of each sorter */
   int nTable;                   /* Number of tables in the database */
   CollSeq *pDfltColl;           /* The default collating sequence (BINARY) */
   u32 magic;                    /* Magic number for detect library misuse */
@@ -2255,6 +2275,10 @@ struct AuthContext {
 #define OPFLAG_USEKEY        0x04    /* Optimize OP_EncodeData using key content */
 #define OPFLAG_SEQCOUNT      0x08    /* Append sequence number to key */
 #define OPFLAG_CLEARCACHE    0x10    /* Clear pseudo-table cache in OP_Column */
+#define OPFLAG_EPHEM         0x20    /* OP_Column may return MEM_Ephem values */
+#define OPFLAG_P2ISREG       0x40    /* OP_Open*: P2 is a register number */
+#define OPFLAG_SCAN          0x80    /* OP_OpenRead: cursor scans many rows */
+#define OPFLAG_PIN           0x40    /* OP_Column: pin entry for result row */
 
 /*
  * Each trigger present in the database schema is stored as an instance of
@@ -2593,6 +2617,18 @@ const sqlite4_mem_methods *sqlite4MemGetMemsys5(void);
   int sqlite4MutexEnd(sqlite4_env*);
 #endif
 
+/*
+** Worker threads (threads.c). SQLITE4_THREADS_IMPLEMENTED is defined if
+** sqlite4ThreadCreate() runs tasks concurrently with the caller. Otherwise
+** the task is run before sqlite4ThreadCreate() returns.
+*/
+#ifdef SQLITE4_MUTEX_PTHREADS
+# define SQLITE4_THREADS_IMPLEMENTED 1
+#endif
+typedef struct SQLiteThread SQLiteThread;
+int sqlite4ThreadCreate(sqlite4_env*,SQLiteThread**,void*(*)(void*),void*);
+int sqlite4ThreadJoin(sqlite4_env*, SQLiteThread*, void**);
+
 void sqlite4StatusAdd(sqlite4_env*, int, sqlite4_int64);
 void sqlite4StatusSet(sqlite4_env*, int, sqlite4_uint64);
 
@@ -2747,8 +2783,8 @@ int sqlite4WhereIsOrdered(WhereInfo*);
 int sqlite4WhereContinueLabel(WhereInfo*);
 int sqlite4WhereBreakLabel(WhereInfo*);
 int sqlite4WhereOkOnePass(WhereInfo*);
-int sqlite4ExprCodeGetColumn(Parse*, Table*, int, int, int);
-void sqlite4ExprCodeGetColumnOfTable(Vdbe*, Table*, int, int, int);
+int sqlite4ExprCodeGetColumn(Parse*, Table*, int, int, int, u8);
+void sqlite4ExprCodeGetColumnOfTable(Vdbe*, Table*, int, int, int, u8);
 void sqlite4ExprCodeMove(Parse*, int, int, int);
 void sqlite4ExprCodeCopy(Parse*, int, int, int);
 void sqlite4ExprCacheStore(Parse*, int, int, int);
@@ -2762,7 +2798,9 @@ int sqlite4ExprCodeTemp(Parse*, Expr*, int*);
 int sqlite4ExprCodeTarget(Parse*, Expr*, int);
 int sqlite4ExprCodeAndCache(Parse*, Expr*, int);
 void sqlite4ExprCodeConstants(Parse*, Expr*);
-int sqlite4ExprCodeExprList(Parse*, ExprList*, int, int);
+int sqlite4ExprCodeExprList(Parse*, ExprList*, int, u8);
+#define SQLITE4_ECEL_DUP     0x01  /* Deep, not shallow copies */
+#define SQLITE4_ECEL_PIN     0x02  /* Values are only used by OP_ResultRow */
 void sqlite4ExprIfTrue(Parse*, Expr*, int, int);
 void sqlite4ExprIfFalse(Parse*, Expr*, int, int);
 Table *sqlite4FindTable(sqlite4*,const char*, const char*);
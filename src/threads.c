@@ -0,0 +1,120 @@
+/*
+** 2013 April 2
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** This file contains a simple interface for running a task in a worker
+** thread. It is used to read parts of a database in parallel.
+**
+** If threads are not available on the target platform, or if the
+** library is compiled with SQLITE4_THREADSAFE=0, then sqlite4ThreadCreate()
+** runs the task immediately in the calling thread and
+** sqlite4ThreadJoin() returns its result. Callers that only benefit from
+** running tasks concurrently may check SQLITE4_THREADS_IMPLEMENTED.
+*/
+#include "sqliteInt.h"
+
+#ifdef SQLITE4_MUTEX_PTHREADS
+/********************************* Unix Pthreads ****************************/
+#include <pthread.h>
+
+/* A running thread */
+struct SQLiteThread {
+  pthread_t tid;                  /* Thread id */
+  int done;                       /* True if the task has already run */
+  void *pOut;                     /* Result if the task has already run */
+};
+
+/*
+** Create a new thread that runs xTask(pIn). If a thread cannot be
+** created, run the task in the calling thread instead. Return
+** SQLITE4_NOMEM if the thread object cannot be allocated.
+*/
+int sqlite4ThreadCreate(
+  sqlite4_env *pEnv,              /* Environment for memory allocation */
+  SQLiteThread **ppThread,        /* OUT: Write the thread object here */
+  void *(*xTask)(void*),          /* Routine to run in a separate thread */
+  void *pIn                       /* Argument passed into xTask() */
+){
+  SQLiteThread *p;
+
+  *ppThread = 0;
+  p = sqlite4_malloc(pEnv, sizeof(*p));
+  if( p==0 ) return SQLITE4_NOMEM;
+  memset(p, 0, sizeof(*p));
+  if( pthread_create(&p->tid, 0, xTask, pIn) ){
+    p->done = 1;
+    p->pOut = xTask(pIn);
+  }
+  *ppThread = p;
+  return SQLITE4_OK;
+}
+
+/*
+** Wait for the thread to finish and free the thread object. Set *ppOut
+** to the value returned by the task.
+*/
+int sqlite4ThreadJoin(sqlite4_env *pEnv, SQLiteThread *p, void **ppOut){
+  int rc = SQLITE4_OK;
+
+  assert( ppOut!=0 );
+  if( p==0 ) return SQLITE4_NOMEM;
+  if( p->done ){
+    *ppOut = p->pOut;
+  }else{
+    rc = pthread_join(p->tid, ppOut) ? SQLITE4_ERROR : SQLITE4_OK;
+  }
+  sqlite4_free(pEnv, p);
+  return rc;
+}
+
+#endif /* SQLITE4_MUTEX_PTHREADS */
+/******************************** End Unix Pthreads *************************/
+
+#ifndef SQLITE4_THREADS_IMPLEMENTED
+/****************************** No Threads **********************************/
+
+/* A thread object that has already run its task */
+struct SQLiteThread {
+  void *pOut;                     /* Result returned by the task */
+};
+
+/*
+** Run xTask(pIn) immediately and store the result in the thread object.
+*/
+int sqlite4ThreadCreate(
+  sqlite4_env *pEnv,              /* Environment for memory allocation */
+  SQLiteThread **ppThread,        /* OUT: Write the thread object here */
+  void *(*xTask)(void*),          /* Routine to run */
+  void *pIn                       /* Argument passed into xTask() */
+){
+  SQLiteThread *p;
+
+  *ppThread = 0;
+  p = sqlite4_malloc(pEnv, sizeof(*p));
+  if( p==0 ) return SQLITE4_NOMEM;
+  p->pOut = xTask(pIn);
+  *ppThread = p;
+  return SQLITE4_OK;
+}
+
+/*
+** Free the thread object and return the result of its task via *ppOut.
+*/
+int sqlite4ThreadJoin(sqlite4_env *pEnv, SQLiteThread *p, void **ppOut){
+  assert( ppOut!=0 );
+  if( p==0 ) return SQLITE4_NOMEM;
+  *ppOut = p->pOut;
+  sqlite4_free(pEnv, p);
+  return SQLITE4_OK;
+}
+
+#endif /* !defined(SQLITE4_THREADS_IMPLEMENTED) */
+/****************************** End No Threads ******************************/
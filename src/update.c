@@ -415,7 +415,7 @@ void sqlite4Update(
     }
     for(i=0; i<pTab->nCol; i++){
       if( aXRef[i]<0 || oldmask==0xffffffff || (i<32 && (oldmask & (1<<i))) ){
-        sqlite4ExprCodeGetColumnOfTable(v, pTab, iCur+iPk, i, regOld+i);
+        sqlite4ExprCodeGetColumnOfTable(v, pTab, iCur+iPk, i, regOld+i, 0);
       }else{
         sqlite4VdbeAddOp2(v, OP_Null, 0, regOld+i);
       }
@@ -451,7 +451,7 @@ void sqlite4Update(
       */
       testcase( i==31 );
       testcase( i==32 );
-      sqlite4ExprCodeGetColumnOfTable(v, pTab, iCur+iPk, i, regNew+i);
+      sqlite4ExprCodeGetColumnOfTable(v, pTab, iCur+iPk, i, regNew+i, 0);
     }
   }
   if( bImplicitPk ){
@@ -482,7 +482,7 @@ void sqlite4Update(
     */
     for(i=0; i<pTab->nCol; i++){
       if( aXRef[i]<0 ){
-        sqlite4ExprCodeGetColumnOfTable(v, pTab, iCur+iPk, i, regNew+i);
+        sqlite4ExprCodeGetColumnOfTable(v, pTab, iCur+iPk, i, regNew+i, 0);
       }
     }
   }
@@ -489,6 +489,17 @@ static Mem *sqlite4RegisterInRootFrame(Vdbe *p, int i){
   }
 }
 
+/*
+** xEntry callback used by OP_Count with sqlite4KVStoreParallelScan(). 
+** Each part of the scan is counted separately.
+*/
+static int vdbeCountEntry(void *pCtx, int iPart, KVCursor *pCsr){
+  i64 *aCount = (i64 *)pCtx;
+  UNUSED_PARAMETER(pCsr);
+  aCount[iPart]++;
+  return SQLITE4_OK;
+}
+
 /*
 ** Execute as much of a VDBE program as we can then return.
 **
@@ -557,6 +568,10 @@ int sqlite4VdbeExec(
   p->rc = SQLITE4_OK;
   assert( p->explain==0 );
   p->pResultSet = 0;
+  if( p->bPinned ){
+    /* The previous result row is no longer in use */
+    sqlite4VdbeUnpin(p, 0);
+  }
   CHECK_FOR_INTERRUPT;
   sqlite4VdbeIOTraceSql(p);
 #ifndef SQLITE4_OMIT_PROGRESS_CALLBACK
@@ -1100,15 +1115,20 @@ case OP_ResultRow: {
 
   /* Make sure the results of the current row are \000 terminated
   ** and have an assigned type.  The results are de-ephemeralized as
-  ** a side effect.
+  ** a side effect. Except, values that point into entries pinned by
+  ** OP_Column remain valid until the next step, so they are returned 
+  ** as they are. Such text values are \000 terminated, which requires a
+  ** copy, only if sqlite4_column_text() or similar is used to read them.
   */
   pMem = p->pResultSet = &aMem[pOp->p1];
   for(i=0; i<pOp->p2; i++){
     assert( memIsValid(&pMem[i]) );
-    Deephemeralize(&pMem[i]);
-    assert( (pMem[i].flags & MEM_Ephem)==0
-            || (pMem[i].flags & (MEM_Str|MEM_Blob))==0 );
-    sqlite4VdbeMemNulTerminate(&pMem[i]);
+    if( !sqlite4VdbeMemIsPinned(p, &pMem[i]) ){
+      Deephemeralize(&pMem[i]);
+      assert( (pMem[i].flags & MEM_Ephem)==0
+              || (pMem[i].flags & (MEM_Str|MEM_Blob))==0 );
+      sqlite4VdbeMemNulTerminate(&pMem[i]);
+    }
     sqlite4VdbeMemStoreType(&pMem[i]);
     REGISTER_TRACE(pOp->p1+i, &pMem[i]);
   }
@@ -2099,6 +2119,18 @@ case OP_NotNull: {            /* same as TK_NOTNULL, jump, in1 */
 ** then the cache of the cursor is reset prior to extracting the column.
 ** The first OP_Column against a pseudo-table after the value of the content
 ** register has changed should have this bit set.
+**
+** If the OPFLAG_EPHEM bit is set on P5, then text and blob values may be
+** returned as MEM_Ephem values that point directly into the memory of the
+** KV cursor, instead of being copied. Such values are only valid until 
+** cursor P1 is next moved, so this bit may only be set if register P3 is
+** consumed (for example by OP_MakeKey or OP_MakeRecord) before then.
+**
+** If the OPFLAG_PIN bit is also set, the entry is pinned in the KV cursor
+** until the VM is next stepped or reset, so that register P3 may be 
+** returned by OP_ResultRow without copying it. This bit may only be set
+** if register P3 is used by nothing but expressions of the current row
+** and the OP_ResultRow that returns it.
 */
 case OP_Column: {
   int p1;                   /* Index of VdbeCursor to decode */
@@ -2126,7 +2158,12 @@ case OP_Column: {
   }
   if( rc==SQLITE4_OK ){
     pDefault = (pOp->p4type==P4_MEM) ? pOp->p4.pMem : 0;
-    rc = sqlite4VdbeDecoderGetColumn(pC->pDecoder, pOp->p2, pDefault, pDest);
+    rc = sqlite4VdbeDecoderGetColumn(pC->pDecoder, pOp->p2, 
+        (pOp->p5 & OPFLAG_EPHEM)!=0, pDefault, pDest
+    );
+    if( (pOp->p5 & OPFLAG_PIN) && (pDest->flags & MEM_Ephem) ){
+      sqlite4VdbeCursorPin(p, pC);
+    }
   }else{
     sqlite4VdbeMemSetNull(pDest);
   }
@@ -2275,17 +2312,37 @@ case OP_Affinity: {
 **
 ** Store the number of entries (an integer value) in the table or index 
 ** opened by cursor P1 in register P2
+**
+** If the KV store supports it, the entries are counted by several threads
+** in parallel (see sqlite4KVStoreParallelScan()). Otherwise, cursor P1 is 
+** used to visit each entry in turn.
 */
 case OP_Count: {         /* out2-prerelease */
   i64 nEntry;
   VdbeCursor *pC;
+  int nPart;
+  int i;
+  i64 aCount[KVSCAN_MAXPART];
+  KVByteArray aPrefix[10];
+  KVSize nPrefix;
   
   pC = p->apCsr[pOp->p1];
-  rc = sqlite4VdbeSeekEnd(pC, +1);
   nEntry = 0;
-  while( rc!=SQLITE4_NOTFOUND ){
-    nEntry++;
-    rc = sqlite4VdbeNext(pC);
+  nPart = 0;
+  if( pC->iRoot!=KVSTORE_ROOT ){
+    memset(aCount, 0, sizeof(aCount));
+    nPrefix = sqlite4PutVarint64(aPrefix, pC->iRoot);
+    rc = sqlite4KVStoreParallelScan(pC->pKVCur->pStore, aPrefix, nPrefix,
+        vdbeCountEntry, (void *)aCount, &nPart
+    );
+    for(i=0; i<nPart; i++) nEntry += aCount[i];
+  }
+  if( rc==SQLITE4_OK && nPart==0 ){
+    rc = sqlite4VdbeSeekEnd(pC, +1);
+    while( rc==SQLITE4_OK ){
+      nEntry++;
+      rc = sqlite4VdbeNext(pC);
+    }
   }
   sqlite4VdbeMemSetInt64(pOut, nEntry);
   if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
@@ -2569,8 +2626,13 @@ case OP_VerifyCookie: {
 ** values need not be contiguous but all P1 values should be small integers.
 ** It is an error for P1 to be negative.
 **
-** If P5!=0 then use the content of register P2 as the root page, not
-** the value of P2 itself.
+** If the OPFLAG_P2ISREG bit of P5 is set then use the content of register
+** P2 as the root page, not the value of P2 itself.
+**
+** If the OPFLAG_SCAN bit of P5 is set, the cursor is expected to visit
+** many consecutive rows, so the KV layer may read entries ahead of the
+** current position in batches. Other read-only cursors, for example 
+** those used for primary key lookups, do not read ahead.
 **
 ** There will be a read lock on the database whenever there is an
 ** open cursor.  If the database was unlocked prior to this instruction
@@ -2592,8 +2654,8 @@ case OP_VerifyCookie: {
 /* Opcode: OpenWrite P1 P2 P3 P4 P5
 **
 ** Open a read/write cursor named P1 on the table or index whose root
-** page is P2.  Or if P5!=0 use the content of register P2 to find the
-** root page.
+** page is P2.  Or if the OPFLAG_P2ISREG bit of P5 is set use the content
+** of register P2 to find the root page.
 **
 ** The P4 value may be either an integer (P4_INT32) or a pointer to
 ** a KeyInfo structure (P4_KEYINFO). If it is a pointer to a KeyInfo 
@@ -2631,7 +2693,7 @@ case OP_OpenWrite: {
   pDb = &db->aDb[iDb];
   pX = pDb->pKV;
   assert( pX!=0 );
-  if( pOp->p5 ){
+  if( pOp->p5 & OPFLAG_P2ISREG ){
     assert( p2>0 );
     assert( p2<=p->nMem );
     pIn2 = &aMem[p2];
@@ -2661,6 +2723,21 @@ case OP_OpenWrite: {
   pCur->iRoot = p2;
   rc = sqlite4KVStoreOpenCursor(pX, &pCur->pKVCur);
   pCur->pKeyInfo = pKeyInfo;
+
+  /* Every key that belongs to table or index p2 begins with the varint
+  ** encoding of p2. Tell the KV store so that it may stop cursor scans at
+  ** the end of the table instead of stepping into the next one.  */
+  if( rc==SQLITE4_OK && p2!=KVSTORE_ROOT ){
+    KVByteArray aPrefix[16];
+    KVSize nPrefix = sqlite4PutVarint64(aPrefix, p2);
+    rc = sqlite4KVCursorSetPrefix(pCur->pKVCur, aPrefix, nPrefix);
+  }
+
+  /* A read-only cursor may resolve lookups in batches. It reads ahead of
+  ** its current position only if it is used for a scan.  */
+  if( rc==SQLITE4_OK && pOp->opcode==OP_OpenRead ){
+    sqlite4KVCursorEnableBatch(pCur->pKVCur, (pOp->p5 & OPFLAG_SCAN)!=0);
+  }
   break;
 }
 
@@ -2694,18 +2771,33 @@ case OP_OpenWrite: {
 ** by this opcode will be used for automatically created transient
 ** indices in joins.
 */
+/* Opcode: SorterOpen P1 P2 * P4 *
+**
+** This opcode works like OP_OpenEphemeral except that it opens
+** a transient index that is specifically designed to sort large
+** tables using an external merge-sort algorithm. The only operations
+** supported by the index are inserts followed by a single forward scan.
+*/
+case OP_SorterOpen:
 case OP_OpenAutoindex: 
 case OP_OpenEphemeral: {
   VdbeCursor *pCx;
+  unsigned openFlags;
 
   assert( pOp->p1>=0 );
   pCx = allocateCursor(p, pOp->p1, pOp->p2, -1, 1);
   if( pCx==0 ) goto no_mem;
   pCx->nullRow = 1;
 
-  rc = sqlite4KVStoreOpen(db, "ephm", 0, &pCx->pTmpKV,
-          SQLITE4_KVOPEN_TEMPORARY | SQLITE4_KVOPEN_NO_TRANSACTIONS
-  );
+  openFlags = SQLITE4_KVOPEN_TEMPORARY | SQLITE4_KVOPEN_NO_TRANSACTIONS;
+  if( pOp->opcode==OP_SorterOpen ) openFlags |= SQLITE4_KVOPEN_SORTER;
+  rc = sqlite4KVStoreOpen(db, "ephm", 0, &pCx->pTmpKV, openFlags);
+  if( rc==SQLITE4_OK ){
+    int nMax = db->nEphemeralMaxMem;
+    KVStore *pTmpKV = pCx->pTmpKV;
+    if( pOp->opcode==OP_SorterOpen ) nMax = db->nSorterMaxMem;
+    pTmpKV->pStoreVfunc->xControl(pTmpKV, SQLITE4_KVCTRL_MAXMEM, &nMax);
+  }
   if( rc==SQLITE4_OK ) rc = sqlite4KVStoreOpenCursor(pCx->pTmpKV, &pCx->pKVCur);
   if( rc==SQLITE4_OK ) rc = sqlite4KVStoreBegin(pCx->pTmpKV, 2);
 
@@ -2714,19 +2806,6 @@ case OP_OpenEphemeral: {
   break;
 }
 
-/* Opcode: OpenSorter P1 P2 * P4 *
-**
-** This opcode works like OP_OpenEphemeral except that it opens
-** a transient index that is specifically designed to sort large
-** tables using an external merge-sort algorithm.
-*/
-case OP_SorterOpen: {
-  /* VdbeCursor *pCx; */
-  pOp->opcode = OP_OpenEphemeral;
-  pc--;
-  break;
-}
-
 /* Opcode: Close P1 * * * *
 **
 ** Close a cursor previously opened as P1.  If P1 is not
@@ -2785,6 +2864,7 @@ case OP_SeekPk: {
     putVarint32((u8 *)(pPk->sSeekKey.p), pPk->iRoot);
     memcpy(((u8*)pPk->sSeekKey.p) + nVarint, &aKey[nShort], nKey-nShort);
     assert( pPk->sSeekKey.n>0 );
+    rc = sqlite4VdbeCursorPrefetch(pPk, pIdx);
   }
   pPk->rowChnged = 1;
 
@@ -30,9 +30,6 @@ typedef struct VdbeOp Op;
 */
 typedef unsigned char Bool;
 
-/* Opaque type used by code in vdbesort.c */
-typedef struct VdbeSorter VdbeSorter;
-
 /* Opaque type used by the explainer */
 typedef struct Explain Explain;
 
@@ -60,12 +57,12 @@ struct VdbeCursor {
   Bool nullRow;         /* True if pointing to a row with no data */
   Bool rowChnged;       /* True if row has changed out from under pDecoder */
   i64 seqCount;         /* Sequence counter */
-  VdbeSorter *pSorter;  /* Sorter object for OP_SorterOpen cursors */
   Fts5Cursor *pFts;     /* Fts5 cursor object (or NULL) */
   RowDecoder *pDecoder;              /* Decoder for row content */
   sqlite4_vtab_cursor *pVtabCursor;  /* The cursor for a virtual table */
   const sqlite4_module *pModule;     /* Module for cursor pVtabCursor */
   sqlite4_buffer sSeekKey;           /* Key for deferred seek */
+  KVPin sPin;                        /* Pin on current entry (OPFLAG_PIN) */
 };
 
 /* Methods for the VdbeCursor object */
@@ -74,6 +71,10 @@ int sqlite4VdbeSeekEnd(VdbeCursor*, int);
 int sqlite4VdbeNext(VdbeCursor*);
 int sqlite4VdbePrevious(VdbeCursor*);
 int sqlite4VdbeCursorMoveto(VdbeCursor *);
+int sqlite4VdbeCursorPrefetch(VdbeCursor *, VdbeCursor *);
+void sqlite4VdbeCursorPin(Vdbe*, VdbeCursor*);
+int sqlite4VdbeMemIsPinned(Vdbe*, Mem*);
+void sqlite4VdbeUnpin(Vdbe*, int);
 
 
 /*
@@ -302,6 +303,7 @@ struct Vdbe {
   u8 inVtabMethod;        /* See comments above */
   u8 needSavepoint;       /* True if a change might abort and needs savepoint */
   u8 readOnly;            /* True for read-only statements */
+  u8 bPinned;             /* True if cursors may hold pins (OPFLAG_PIN) */
   int nChange;            /* Number of db changes made since last reset */
   yDbMask stmtTransMask;  /* db->aDb[] entries that have a subtransaction */
   int aCounter[3];        /* Counters used by sqlite4_stmt_status() */
@@ -356,9 +358,11 @@ int sqlite4VdbeDecoderDestroy(RowDecoder *pDecoder);
 int sqlite4VdbeDecoderGetColumn(
   RowDecoder *pDecoder,        /* The decoder for the whole string */
   int iVal,                    /* Index of the value to decode.  First is 0 */
+  int bEphem,                  /* True to allow MEM_Ephem results */
   Mem *pDefault,               /* The default value.  Often NULL */
   Mem *pOut                    /* Write the result here */
 );
+int sqlite4VdbeDecoderContains(RowDecoder *pDecoder, const Mem *pMem);
 int sqlite4VdbeEncodeData(
   sqlite4 *db,                /* The database connection */
   Mem *aIn,                   /* Array of values to encode */
@@ -405,6 +405,45 @@ static int decoderFromKey(
   return rc;
 }
 
+/*
+** Set pOut to the text or blob value a[0..n-1] taken from the data record
+** of the current entry.  If bEphem is true, pOut is set to an MEM_Ephem
+** value that points directly into the record.  The KV cursor guarantees 
+** that the record remains stable until the cursor is moved (see the
+** description of xData in kv.h), or for longer if the VDBE pins the 
+** entry (see sqlite4VdbeCursorPin()).  Otherwise, the value is copied.
+**
+** Enc is SQLITE4_UTF8 for text or 0 for a blob. UTF-16 text is always
+** copied, as sqlite4VdbeMemSetStr() may modify it in place to remove a
+** byte-order mark.
+*/
+static void decoderMemSetStr(
+  Mem *pOut,                      /* Write the value here */
+  const KVByteArray *a, int n,    /* Text or blob content */
+  u8 enc,                         /* SQLITE4_UTF8, or 0 for a blob */
+  int bEphem                      /* True to allow an MEM_Ephem result */
+){
+  if( bEphem ){
+    assert( enc==0 || enc==SQLITE4_UTF8 );
+    sqlite4VdbeMemSetStr(pOut, (char*)a, n, enc, SQLITE4_STATIC, 0);
+    pOut->flags = (pOut->flags & ~MEM_Static) | MEM_Ephem;
+    pOut->xDel = 0;
+  }else{
+    sqlite4VdbeMemSetStr(pOut, (char*)a, n, enc, SQLITE4_TRANSIENT, 0);
+  }
+}
+
+/*
+** Return true if pMem is a text or blob value that points into the data
+** record currently loaded by decoder p, as returned with bEphem set by
+** sqlite4VdbeDecoderGetColumn().
+*/
+int sqlite4VdbeDecoderContains(RowDecoder *p, const Mem *pMem){
+  const KVByteArray *z = (const KVByteArray*)pMem->z;
+  return (pMem->flags & (MEM_Str|MEM_Blob))!=0 
+      && p->a!=0 && z>=p->a && z<&p->a[p->n];
+}
+
 /*
 ** Decode a single column from a key/value pair taken from the storage
 ** engine.  The key/value pair to be decoded is the one that the VdbeCursor
@@ -422,6 +461,7 @@ static int decoderFromKey(
 int sqlite4VdbeDecoderGetColumn(
   RowDecoder *p,             /* The decoder for the whole string */
   int iVal,                    /* Index of the value to decode.  First is 0 */
+  int bEphem,                  /* True to allow MEM_Ephem results */
   Mem *pDefault,               /* The default value.  Often NULL */
   Mem *pOut                    /* Write the result here */
 ){
@@ -503,8 +543,7 @@ int sqlite4VdbeDecoderGetColumn(
       if( size==0 ){
         sqlite4VdbeMemSetStr(pOut, "", 0, SQLITE4_UTF8, SQLITE4_TRANSIENT, 0);
       }else if( p->a[ofst]>0x02 ){
-        sqlite4VdbeMemSetStr(pOut, (char*)(p->a+ofst), size, 
-                             SQLITE4_UTF8, SQLITE4_TRANSIENT, 0);
+        decoderMemSetStr(pOut, p->a+ofst, size, SQLITE4_UTF8, bEphem);
       }else{
         static const u8 enc[] = {SQLITE4_UTF8,SQLITE4_UTF16LE,SQLITE4_UTF16BE };
         sqlite4VdbeMemSetStr(pOut, (char*)(p->a+ofst+1), size-1, 
@@ -514,8 +553,7 @@ int sqlite4VdbeDecoderGetColumn(
       unsigned int k = (type - 24)/4;
       return decoderFromKey(p, (k&1)!=0, k/2, pOut);
     }else{
-      sqlite4VdbeMemSetStr(pOut, (char*)(p->a+ofst), size, 0,
-                           SQLITE4_TRANSIENT, 0);
+      decoderMemSetStr(pOut, p->a+ofst, size, 0, bEphem);
       pOut->enc = ENC(p->db);
     }
   }
@@ -127,6 +127,7 @@ void sqlite4VdbeFreeCursor(VdbeCursor *pCx){
   }
   sqlite4Fts5Close(pCx->pFts);
   if( pCx->pKVCur ){
+    sqlite4KVCursorUnpin(&pCx->sPin);
     sqlite4KVCursorClose(pCx->pKVCur);
   }
   if( pCx->pTmpKV ){
@@ -148,6 +149,195 @@ void sqlite4VdbeFreeCursor(VdbeCursor *pCx){
 #endif
 }
 
+/*
+** This function is invoked by the KV layer before the content of an
+** entry pinned by a cursor of VM pPin->pCtx changes.
+*/
+static void vdbeUnpinCallback(KVPin *pPin){
+  sqlite4VdbeUnpin((Vdbe*)pPin->pCtx, 1);
+}
+
+/*
+** Pin the current entry of cursor pC, which belongs to VM p. This is done
+** by OP_Column when OPFLAG_PIN is set, so that the MEM_Ephem values it
+** decodes from the entry remain valid until the VM is next stepped, even
+** if the database is written in the meantime, for example by another 
+** statement or by a user function.  If the pinned content is about to
+** change before then, all registers that point into it are copied (see
+** sqlite4VdbeUnpin()).
+*/
+void sqlite4VdbeCursorPin(Vdbe *p, VdbeCursor *pC){
+  assert( pC->pKVCur );
+  if( pC->sPin.pCsr==0 ){
+    pC->sPin.xUnpin = vdbeUnpinCallback;
+    pC->sPin.pCtx = (void*)p;
+    sqlite4KVCursorPin(pC->pKVCur, &pC->sPin);
+    p->bPinned = 1;
+  }
+}
+
+/*
+** Return true if register pMem of VM p is an MEM_Ephem value that points
+** into an entry pinned by one of the VM's cursors.
+*/
+int sqlite4VdbeMemIsPinned(Vdbe *p, Mem *pMem){
+  if( p->bPinned && (pMem->flags & MEM_Ephem) ){
+    int i;
+    for(i=0; i<p->nCursor; i++){
+      VdbeCursor *pC = p->apCsr[i];
+      if( pC && pC->sPin.pCsr && pC->pDecoder
+       && sqlite4VdbeDecoderContains(pC->pDecoder, pMem)
+      ){
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+** Release the pins held by the cursors of VM p.
+**
+** If bCopy is true, the registers that point into pinned entries are 
+** first copied, so that they remain valid after the pinned content
+** changes. If a copy cannot be made because a malloc fails, the register
+** is set to NULL. The decoders of the pinned cursors are also told to
+** fetch the entry again, as the record they point to may change.
+**
+** If bCopy is false, the caller guarantees that such registers are no
+** longer in use. This is the case whenever the VM is stepped or reset, as
+** the values pinned by OP_Column are only used by the result row.
+*/
+void sqlite4VdbeUnpin(Vdbe *p, int bCopy){
+  int i;
+  if( bCopy ){
+    for(i=1; i<=p->nMem; i++){
+      Mem *pMem = &p->aMem[i];
+      if( sqlite4VdbeMemIsPinned(p, pMem) 
+       && sqlite4VdbeMemMakeWriteable(pMem)
+      ){
+        sqlite4VdbeMemSetNull(pMem);
+      }
+    }
+  }
+  for(i=0; i<p->nCursor; i++){
+    VdbeCursor *pC = p->apCsr[i];
+    if( pC && pC->sPin.pCsr ){
+      sqlite4KVCursorUnpin(&pC->sPin);
+      if( bCopy ) pC->rowChnged = 1;
+    }
+  }
+  p->bPinned = 0;
+}
+
+
+/*
+** The maximum number of primary keys looked up together by
+** sqlite4VdbeCursorPrefetch().
+*/
+#define VDBE_PREFETCH_NKEY 32
+
+/*
+** Compare two KV keys in the same way as memcmp().
+*/
+static int vdbeKeyCompare(
+  const KVByteArray *aKey1, KVSize nKey1,
+  const KVByteArray *aKey2, KVSize nKey2
+){
+  int c = memcmp(aKey1, aKey2, nKey1<nKey2 ? nKey1 : nKey2);
+  if( c==0 ) c = (int)(nKey1 - nKey2);
+  return c;
+}
+
+/*
+** A deferred seek has just been set up on read-only cursor pPk by 
+** OP_SeekPk, using the primary key of the current entry of index cursor
+** pIdx. If the index cursor is reading entries in batches, look up the 
+** primary keys of the current entry and of the upcoming entries of the 
+** same batch using a single sqlite4KVCursorMultiGet() call. The seeks made
+** by sqlite4VdbeCursorMoveto() for those entries are then served from the 
+** results.
+**
+** This is a no-op if the storage engine does not support multi-get, or if
+** the key for the pending seek is already available.
+*/
+int sqlite4VdbeCursorPrefetch(VdbeCursor *pPk, VdbeCursor *pIdx){
+  KVSlice aKey[VDBE_PREFETCH_NKEY];
+  int aOff[VDBE_PREFETCH_NKEY];   /* Offset of each key within buf */
+  sqlite4_buffer buf;             /* Buffer holding prefetched keys */
+  const KVByteArray *aIdx;        /* Key of current index entry */
+  KVSize nIdx;                    /* Size of aIdx[] in bytes */
+  int nPrefix;                    /* Size of index root varint */
+  int nField;                     /* Number of non-PK fields in index */
+  int nVarint;                    /* Size of varint pPk->iRoot */
+  int nKey = 0;                   /* Number of valid entries in aKey[] */
+  int i, j;
+  int rc;
+  u32 iDummy;
+
+  if( !sqlite4KVCursorWantMultiGet(
+        pPk->pKVCur, pPk->sSeekKey.p, pPk->sSeekKey.n) 
+  ){
+    return SQLITE4_OK;
+  }
+  rc = sqlite4KVCursorKey(pIdx->pKVCur, &aIdx, &nIdx);
+  if( rc!=SQLITE4_OK ) return rc;
+  nPrefix = getVarint32(aIdx, iDummy);
+  nField = pIdx->pKeyInfo->nField - pIdx->pKeyInfo->nPK;
+  nVarint = sqlite4VarintLen(pPk->iRoot);
+
+  /* Build the primary keys in buf. The key for the current entry is 
+  ** already in pPk->sSeekKey.  */
+  sqlite4_buffer_init(&buf, pPk->db->pEnv->pMM);
+  rc = sqlite4_buffer_set(&buf, pPk->sSeekKey.p, pPk->sSeekKey.n);
+  aOff[nKey] = 0;
+  aKey[nKey++].nKey = pPk->sSeekKey.n;
+  for(i=1; rc==SQLITE4_OK && nKey<VDBE_PREFETCH_NKEY; i++){
+    const KVByteArray *a;
+    KVSize n;
+    int nShort;
+    u8 aVarint[10];
+
+    if( sqlite4KVCursorPeek(pIdx->pKVCur, i, &a, &n) ) break;
+    if( n<=nPrefix || memcmp(a, aIdx, nPrefix) ) break;
+    nShort = sqlite4VdbeShortKey(a, n, nField, 0);
+    if( nShort>=n ) break;
+    aOff[nKey] = buf.n;
+    aKey[nKey++].nKey = nVarint + n - nShort;
+    putVarint32(aVarint, pPk->iRoot);
+    rc = sqlite4_buffer_append(&buf, aVarint, nVarint);
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4_buffer_append(&buf, &a[nShort], n - nShort);
+    }
+  }
+
+  if( rc==SQLITE4_OK && nKey>1 ){
+    /* Sort the keys and remove duplicates. */
+    for(i=0; i<nKey; i++){
+      aKey[i].pKey = &((const KVByteArray*)buf.p)[aOff[i]];
+    }
+    for(i=1; i<nKey; i++){
+      KVSlice x = aKey[i];
+      for(j=i; j>0; j--){
+        int c = vdbeKeyCompare(aKey[j-1].pKey, aKey[j-1].nKey, x.pKey, x.nKey);
+        if( c<=0 ) break;
+        aKey[j] = aKey[j-1];
+      }
+      aKey[j] = x;
+    }
+    for(i=j=1; i<nKey; i++){
+      if( vdbeKeyCompare(aKey[j-1].pKey, aKey[j-1].nKey, 
+                         aKey[i].pKey, aKey[i].nKey) ){
+        aKey[j++] = aKey[i];
+      }
+    }
+    rc = sqlite4KVCursorMultiGet(pPk->pKVCur, aKey, j);
+    if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  }
+
+  sqlite4_buffer_clear(&buf);
+  return rc;
+}
 
 /*
 ** Cursor pPk is open on a primary key index. If there is currently a
@@ -2588,7 +2588,6 @@ static int whereKeyStats(
 **
 ** If an error occurs, return an error code. Otherwise, SQLITE4_OK.
 */
-#ifdef SQLITE4_ENABLE_STAT3
 static int valueFromExpr(
   Parse *pParse,                  /* Parse context */
   KeyInfo *pKeyinfo,              /* Collation sequence and sort order */
@@ -2625,7 +2624,6 @@ static int valueFromExpr(
   sqlite4ValueFree(pVal);
   return SQLITE4_OK;
 }
-#endif
 
 /*
 ** TODO: Should this be ENABLE_STAT3 only.
@@ -2644,6 +2642,128 @@ static int whereSampleKeyinfo(Parse *pParse, Index *p, KeyInfo *pKeyInfo){
 }
 
 
+/*
+** Set buffer pBuf to the KV store key that bounds a scan of index p on 
+** one side. If pTerm is NULL, the key is the first key of the index 
+** (bUpper==0) or the first key past its end (bUpper!=0). Otherwise, it is
+** the encoded value of the right-hand side of range constraint pTerm,
+** prefixed with the index number. Whether the constraint is inclusive or
+** exclusive is ignored.
+**
+** If pTerm is not NULL and its value is not a literal, leave the buffer 
+** empty. SQL variables are not used, as doing so would force the statement
+** to be reprepared each time a new value is bound to them.
+*/
+static int whereRangeBound(
+  Parse *pParse,                  /* Parse context */
+  Index *p,                       /* Index being scanned */
+  KeyInfo *pKeyinfo,              /* Key encoding for left-most column */
+  WhereTerm *pTerm,               /* Range constraint, or NULL */
+  int bUpper,                     /* True for an upper bound */
+  sqlite4_buffer *pBuf            /* OUT: Encoded key */
+){
+  u8 aPrefix[10];
+  int nPrefix;
+  int rc = SQLITE4_OK;
+
+  nPrefix = sqlite4PutVarint64(aPrefix, p->tnum + (pTerm==0 && bUpper));
+  if( pTerm ){
+    Expr *pExpr = pTerm->pExpr->pRight;
+    int iCol = p->aiColumn[0];
+    u8 aff = SQLITE4_AFF_INTEGER;
+    sqlite4_buffer val;
+
+    if( pExpr->op==TK_VARIABLE
+     || (pExpr->op==TK_REGISTER && pExpr->op2==TK_VARIABLE)
+    ){
+      return SQLITE4_OK;
+    }
+    if( iCol>=0 ) aff = p->pTable->aCol[iCol].affinity;
+    sqlite4_buffer_init(&val, pParse->db->pEnv->pMM);
+    rc = valueFromExpr(pParse, pKeyinfo, pExpr, aff, &val);
+    if( rc==SQLITE4_OK && val.n>0 ){
+      rc = sqlite4_buffer_set(pBuf, aPrefix, nPrefix);
+      if( rc==SQLITE4_OK ) rc = sqlite4_buffer_append(pBuf, val.p, val.n);
+    }
+    sqlite4_buffer_clear(&val);
+  }else{
+    rc = sqlite4_buffer_set(pBuf, aPrefix, nPrefix);
+  }
+  return rc;
+}
+
+/*
+** Use the xEstimateRange method of the KV store that index p is stored in
+** to estimate the fraction of the index entries that lie between the
+** bounds pLower and pUpper on its left-most column. Set *pRangeDiv to the
+** divisor by which the range constraints reduce the search space and 
+** return SQLITE4_OK if successful. Return SQLITE4_NOTFOUND if the store
+** does not provide estimates, or if a bound is not a literal value.
+**
+** Unlike the samples collected by ANALYZE, these estimates are always 
+** current. Each costs a few page reads in the KV store.
+*/
+static int whereKVRangeEst(
+  Parse *pParse,       /* Parsing & code generating context */
+  Index *p,            /* The index containing the range-compared column */
+  WhereTerm *pLower,   /* Lower bound on the range, or NULL */
+  WhereTerm *pUpper,   /* Upper bound on the range, or NULL */
+  WhereCost *pRangeDiv /* OUT: Reduce search space by this divisor */
+){
+  sqlite4 *db = pParse->db;
+  KVStore *pKV = db->aDb[sqlite4SchemaToIndex(db, p->pSchema)].pKV;
+  KeyInfo keyinfo;
+  sqlite4_buffer aBuf[4];         /* Index bounds, then range bounds */
+  sqlite4_int64 nTotal = 0;       /* Estimated entries in index */
+  sqlite4_int64 nRange = 0;       /* Estimated entries in range */
+  int i;
+  int rc;
+
+  if( pKV==0 ) return SQLITE4_NOTFOUND;
+  if( p->aSortOrder && p->aSortOrder[0]==SQLITE4_SO_DESC ){
+    WhereTerm *pTmp = pLower;
+    pLower = pUpper;
+    pUpper = pTmp;
+  }
+  for(i=0; i<ArraySize(aBuf); i++){
+    sqlite4_buffer_init(&aBuf[i], db->pEnv->pMM);
+  }
+
+  /* Estimate the size of the entire index first. This fails quickly if
+  ** the KV store does not support estimates.  */
+  rc = whereSampleKeyinfo(pParse, p, &keyinfo);
+  for(i=0; rc==SQLITE4_OK && i<ArraySize(aBuf); i++){
+    WhereTerm *pTerm = (i<2 ? 0 : (i==2 ? pLower : pUpper));
+    rc = whereRangeBound(pParse, p, &keyinfo, pTerm, (i & 0x01), &aBuf[i]);
+    if( rc==SQLITE4_OK && aBuf[i].n==0 ) rc = SQLITE4_NOTFOUND;
+    if( rc==SQLITE4_OK && i==1 ){
+      rc = sqlite4KVStoreEstimateRange(pKV, 
+          aBuf[0].p, aBuf[0].n, aBuf[1].p, aBuf[1].n, &nTotal
+      );
+    }
+  }
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4KVStoreEstimateRange(pKV, 
+        aBuf[2].p, aBuf[2].n, aBuf[3].p, aBuf[3].n, &nRange
+    );
+  }
+  if( rc==SQLITE4_OK ){
+    if( nTotal<=0 ){
+      rc = SQLITE4_NOTFOUND;
+    }else{
+      *pRangeDiv = 0;
+      if( nRange<nTotal ){
+        *pRangeDiv = whereCost(nTotal) - whereCost(nRange);
+      }
+      WHERETRACE(0x100, ("kv range estimate: %lld of %lld  div=%d\n",
+                         nRange, nTotal, *pRangeDiv));
+    }
+  }
+
+  for(i=0; i<ArraySize(aBuf); i++) sqlite4_buffer_clear(&aBuf[i]);
+  return rc;
+}
+
 /*
 ** This function is used to estimate the number of rows that will be visited
 ** by scanning an index for a range of values. The range may have an upper
@@ -2678,8 +2798,10 @@ static int whereSampleKeyinfo(Parse *pParse, Index *p, KeyInfo *pKeyInfo){
 ** no help at all.  A return value of 2 means range constraints are
 ** expected to reduce the search space by half.  And so forth...
 **
-** In the absence of sqlite_stat3 ANALYZE data, each range inequality
-** reduces the search space by a factor of 4.  Hence a single constraint (x>?)
+** In the absence of sqlite_stat3 ANALYZE data, and if nEq is 0, the KV
+** store is asked to estimate the number of entries in the range (see
+** whereKVRangeEst()). If it cannot, each range inequality reduces the 
+** search space by a factor of 4.  Hence a single constraint (x>?)
 ** results in a return of 4 and a range constraint (x>? AND x<?) results
 ** in a return of 16.
 */
@@ -2742,12 +2864,13 @@ static int whereRangeScanEst(
       return SQLITE4_OK;
     }
   }
-#else
-  UNUSED_PARAMETER(pParse);
-  UNUSED_PARAMETER(p);
-  UNUSED_PARAMETER(nEq);
 #endif
   assert( pLower || pUpper );
+  if( nEq==0 
+   && whereKVRangeEst(pParse, p, pLower, pUpper, pRangeDiv)==SQLITE4_OK 
+  ){
+    return SQLITE4_OK;
+  }
   *pRangeDiv = 0;
   /* TUNING:  Each inequality constraint reduces the search space 4-fold.
   ** A BETWEEN operator, therefore, reduces the search space 16-fold */
@@ -3703,7 +3826,7 @@ static Bitmask codeOneLoopStart(
     testcase( pLoop->wsFlags & WHERE_BTM_LIMIT );
     testcase( pLoop->wsFlags & WHERE_TOP_LIMIT );
     if( (pLoop->wsFlags & (WHERE_BTM_LIMIT|WHERE_TOP_LIMIT))!=0 ){
-      sqlite4ExprCodeGetColumnOfTable(v, pIdx->pTable, iCur, iIneq, r1);
+      sqlite4ExprCodeGetColumnOfTable(v, pIdx->pTable, iCur, iIneq, r1, 0);
       sqlite4VdbeAddOp2(v, OP_IsNull, r1, addrCont);
     }
     sqlite4ReleaseTempReg(pParse, r1);
@@ -6046,6 +6169,16 @@ WhereInfo *sqlite4WhereBegin(
          && (wctrlFlags & WHERE_OMIT_OPEN_CLOSE)==0 ){
       int op = pWInfo->okOnePass ? OP_OpenWrite : OP_OpenRead;
       sqlite4OpenPrimaryKey(pParse, pTabItem->iCursor, iDb, pTab, op);
+      /* The PK cursor is used for a scan unless it is only used to look
+      ** up rows found using a secondary index, or the loop visits at most
+      ** one row. Only cursors used for scans read ahead.  */
+      if( op==OP_OpenRead && (pLoop->wsFlags & WHERE_ONEROW)==0
+       && ((pLoop->wsFlags & WHERE_INDEXED)==0 
+        || (pLoop->wsFlags & WHERE_PRIMARY_KEY)!=0)
+       && (pLoop->wsFlags & (WHERE_MULTI_OR|WHERE_AUTO_INDEX))==0
+      ){
+        sqlite4VdbeChangeP5(v, OPFLAG_SCAN);
+      }
       testcase( !pWInfo->okOnePass && pTab->nCol==BMS-1 );
       testcase( !pWInfo->okOnePass && pTab->nCol==BMS );
     }
@@ -6067,6 +6200,9 @@ WhereInfo *sqlite4WhereBegin(
           assert( pLevel->iIdxCur>=0 );
           sqlite4VdbeAddOp4(v, OP_OpenRead, pLevel->iIdxCur, pIx->tnum, iDb,
               (char*)pKey, P4_KEYINFO_HANDOFF);
+          if( (pLoop->wsFlags & WHERE_ONEROW)==0 ){
+            sqlite4VdbeChangeP5(v, OPFLAG_SCAN);
+          }
           VdbeComment((v, "%s", pIx->zName));
         }
       }
@@ -425,6 +425,96 @@ static int test_storage_key(
   return TCL_OK;
 }
 
+/*
+** xSplit callback used by storage_split. Append the key, encoded as hex,
+** to the list in the interpreter result.
+*/
+static int storageSplitKey(void *pCtx, const KVByteArray *aKey, KVSize nKey){
+  Tcl_Interp *interp = (Tcl_Interp *)pCtx;
+  unsigned char zBuf[500];
+  if( nKey>=sizeof(zBuf)/2 ) nKey = sizeof(zBuf)/2 - 1;
+  memcpy(zBuf, aKey, nKey);
+  sqlite4TestBinToHex(zBuf, nKey);
+  Tcl_AppendElement(interp, (char*)zBuf);
+  return SQLITE4_OK;
+}
+
+/*
+** TCLCMD:    storage_split STORAGE PREFIX NPART
+**
+** Return the list of keys that the xSplit method of the storage object
+** uses to divide the keys that begin with PREFIX into NPART parts. An 
+** empty list is returned if the storage object has no xSplit method.
+*/
+static int test_storage_split(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  KVStore *p = 0;
+  int rc = SQLITE4_OK;
+  int nPrefix, nPart;
+  unsigned char aPrefix[100];
+  if( objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "STORAGE PREFIX NPART");
+    return TCL_ERROR;
+  }
+  p = sqlite4TestTextToPtr(Tcl_GetString(objv[1]));
+  sqlite4DecodeHex(objv[2], aPrefix, &nPrefix);
+  if( Tcl_GetIntFromObj(interp, objv[3], &nPart) ) return TCL_ERROR;
+  Tcl_ResetResult(interp);
+  if( p->pStoreVfunc->iVersion>=4 && p->pStoreVfunc->xSplit ){
+    rc = p->pStoreVfunc->xSplit(p, aPrefix, nPrefix, nPart, 
+        storageSplitKey, (void *)interp
+    );
+  }
+  if( rc ){
+    storageSetTclErrorName(interp, rc);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+/*
+** TCLCMD:    storage_estimate STORAGE LO ?HI?
+**
+** Return the number of entries between keys LO and HI (or after LO if HI
+** is omitted) as estimated by the xEstimateRange method of the store. If 
+** the store cannot provide an estimate, return an empty string.
+*/
+static int test_storage_estimate(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  KVStore *p = 0;
+  int rc;
+  int nLo, nHi = 0;
+  unsigned char aLo[100], aHi[100];
+  sqlite4_int64 nRow = 0;
+  if( objc!=3 && objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "STORAGE LO ?HI?");
+    return TCL_ERROR;
+  }
+  p = sqlite4TestTextToPtr(Tcl_GetString(objv[1]));
+  sqlite4DecodeHex(objv[2], aLo, &nLo);
+  if( objc==4 ) sqlite4DecodeHex(objv[3], aHi, &nHi);
+  rc = sqlite4KVStoreEstimateRange(p, aLo, nLo, (objc==4 ? aHi : 0), nHi, 
+      &nRow
+  );
+  if( rc==SQLITE4_NOTFOUND ){
+    Tcl_ResetResult(interp);
+  }else if( rc ){
+    storageSetTclErrorName(interp, rc);
+    return TCL_ERROR;
+  }else{
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(nRow));
+  }
+  return TCL_OK;
+}
+
 /*
 ** TCLCMD:    storage_data CURSOR
 **
@@ -485,6 +575,8 @@ int Sqliteteststorage_Init(Tcl_Interp *interp){
     { "storage_reset",        test_storage_reset           },
     { "storage_key",          test_storage_key             },
     { "storage_data",         test_storage_data            },
+    { "storage_split",        test_storage_split           },
+    { "storage_estimate",     test_storage_estimate        },
   };
   int i;
 
@@ -15,6 +15,7 @@
 #include "lsm.h"
 #include "sqlite4.h"
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 
 extern int getDbPointer(Tcl_Interp *interp, const char *zA, sqlite4 **ppDb);
@@ -261,6 +262,11 @@ static int testConfigureLsm(
     { "set_compression",         LSM_CONFIG_SET_COMPRESSION,         0 },
     { "set_compression_factory", LSM_CONFIG_SET_COMPRESSION_FACTORY, 0 },
     { "readonly",                LSM_CONFIG_READONLY,                1 },
+    { "merge_policy",            LSM_CONFIG_MERGE_POLICY,            1 },
+    { "size_ratio",              LSM_CONFIG_SIZE_RATIO,              1 },
+    { "window_age",              LSM_CONFIG_WINDOW_AGE,              1 },
+    { "value_log",               LSM_CONFIG_VALUE_LOG,               1 },
+    { "value_log_size",          LSM_CONFIG_VALUE_LOG_SIZE,          1 },
     { 0, 0, 0 }
   };
   int i;
@@ -546,6 +552,8 @@ static int testInfoLsm(Tcl_Interp *interp, lsm_db *db, Tcl_Obj *pObj){
     int eOpt;
   } aInfo[] = {
     { "compression_id",          LSM_INFO_COMPRESSION_ID },
+    { "amplification",           LSM_INFO_AMPLIFICATION },
+    { "write_stalls",            LSM_INFO_WRITE_STALLS },
     { 0, 0 }
   };
   int rc;
@@ -566,6 +574,34 @@ static int testInfoLsm(Tcl_Interp *interp, lsm_db *db, Tcl_Obj *pObj){
         }
         break;
       }
+      case LSM_INFO_AMPLIFICATION: {
+        int aVal[3] = {0, 0, 0};
+        rc = lsm_info(db, LSM_INFO_AMPLIFICATION, &aVal[0], &aVal[1], &aVal[2]);
+        if( rc==LSM_OK ){
+          Tcl_Obj *pRes = Tcl_NewObj();
+          int i;
+          for(i=0; i<3; i++){
+            Tcl_ListObjAppendElement(interp, pRes, Tcl_NewIntObj(aVal[i]));
+          }
+          Tcl_SetObjResult(interp, pRes);
+        }else{
+          test_lsm_error(interp, "lsm_info", rc);
+        }
+        break;
+      }
+      case LSM_INFO_WRITE_STALLS: {
+        int aVal[2] = {0, 0};
+        rc = lsm_info(db, LSM_INFO_WRITE_STALLS, &aVal[0], &aVal[1]);
+        if( rc==LSM_OK ){
+          Tcl_Obj *pRes = Tcl_NewObj();
+          Tcl_ListObjAppendElement(interp, pRes, Tcl_NewIntObj(aVal[0]));
+          Tcl_ListObjAppendElement(interp, pRes, Tcl_NewIntObj(aVal[1]));
+          Tcl_SetObjResult(interp, pRes);
+        }else{
+          test_lsm_error(interp, "lsm_info", rc);
+        }
+        break;
+      }
     }
   }
 
@@ -595,6 +631,7 @@ static int test_lsm_cursor_cmd(
     /* 6 */ {"key",        0, ""},
     /* 7 */ {"value",      0, ""},
     /* 8 */ {"valid",      0, ""},
+    /* 9 */ {"prefix",     1, "PREFIX"},
     {0, 0, 0}
   };
   int iCmd;
@@ -685,12 +722,46 @@ static int test_lsm_cursor_cmd(
       Tcl_SetObjResult(interp, Tcl_NewBooleanObj(bValid));
       return TCL_OK;
     }
+
+    case 9: assert( 0==strcmp(aCmd[9].zCmd, "prefix") ); {
+      const char *zPrefix; int nPrefix;
+      zPrefix = Tcl_GetStringFromObj(objv[2], &nPrefix);
+      rc = lsm_csr_prefix(pCsr->csr, zPrefix, nPrefix);
+      return test_lsm_error(interp, "lsm_csr_prefix", rc);
+    }
   }
 
   Tcl_AppendResult(interp, "internal error", 0);
   return TCL_ERROR;
 }
 
+/*
+** Context object and xNext callback used by the [DB ingest] command to
+** feed the key/value pairs of a Tcl list to lsm_ingest().
+*/
+typedef struct TestIngest TestIngest;
+struct TestIngest {
+  Tcl_Obj **apObj;                /* Array of keys and values */
+  int nObj;                       /* Size of apObj[] */
+  int iObj;                       /* Index of next key in apObj[] */
+};
+
+static int testIngestNext(
+  void *pCtx, 
+  const void **ppKey, int *pnKey,
+  const void **ppVal, int *pnVal
+){
+  TestIngest *p = (TestIngest *)pCtx;
+  if( p->iObj<p->nObj ){
+    *ppKey = (const void *)Tcl_GetStringFromObj(p->apObj[p->iObj], pnKey);
+    *ppVal = (const void *)Tcl_GetStringFromObj(p->apObj[p->iObj+1], pnVal);
+    p->iObj += 2;
+  }else{
+    *ppKey = 0;
+  }
+  return LSM_OK;
+}
+
 /*
 ** Usage: DB sub-command ...
 */
@@ -718,6 +789,11 @@ static int test_lsm_cmd(
     /* 10 */ {"config",       1, "LIST"},
     /* 11 */ {"checkpoint",   0, ""},
     /* 12 */ {"info",         1, "OPTION"},
+    /* 13 */ {"ingest",       1, "LIST"},
+    /* 14 */ {"snapshot_retain",   0, ""},
+    /* 15 */ {"snapshot_release",  1, "ID"},
+    /* 16 */ {"csr_open_snapshot", 2, "CSR ID"},
+    /* 17 */ {"backup",            3, "ID BASE FILENAME"},
     {0, 0, 0}
   };
   int iCmd;
@@ -862,6 +938,122 @@ static int test_lsm_cmd(
       return testInfoLsm(interp, p->db, objv[2]);
     }
 
+    case 13: assert( 0==strcmp(aCmd[13].zCmd, "ingest") ); {
+      TestIngest ctx;
+      rc = Tcl_ListObjGetElements(interp, objv[2], &ctx.nObj, &ctx.apObj);
+      if( rc!=TCL_OK ) return rc;
+      if( ctx.nObj%2 ){
+        Tcl_AppendResult(interp, "odd number of list elements", 0);
+        return TCL_ERROR;
+      }
+      ctx.iObj = 0;
+      rc = lsm_ingest(p->db, testIngestNext, (void *)&ctx);
+      return test_lsm_error(interp, "lsm_ingest", rc);
+    }
+
+    case 14: assert( 0==strcmp(aCmd[14].zCmd, "snapshot_retain") ); {
+      lsm_i64 iId = 0;
+      rc = lsm_snapshot_retain(p->db, &iId);
+      if( rc!=LSM_OK ) return test_lsm_error(interp, "lsm_snapshot_retain", rc);
+      Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)iId));
+      return TCL_OK;
+    }
+
+    case 15: assert( 0==strcmp(aCmd[15].zCmd, "snapshot_release") ); {
+      Tcl_WideInt iId;
+      rc = Tcl_GetWideIntFromObj(interp, objv[2], &iId);
+      if( rc!=TCL_OK ) return rc;
+      rc = lsm_snapshot_release(p->db, (lsm_i64)iId);
+      return test_lsm_error(interp, "lsm_snapshot_release", rc);
+    }
+
+    case 16: assert( 0==strcmp(aCmd[16].zCmd, "csr_open_snapshot") ); {
+      const char *zCsr = Tcl_GetString(objv[2]);
+      TclLsmCursor *pCsr;
+      Tcl_WideInt iId;
+
+      rc = Tcl_GetWideIntFromObj(interp, objv[3], &iId);
+      if( rc!=TCL_OK ) return rc;
+
+      pCsr = (TclLsmCursor *)ckalloc(sizeof(TclLsmCursor));
+      rc = lsm_csr_open_snapshot(p->db, (lsm_i64)iId, &pCsr->csr);
+      if( rc!=LSM_OK ){
+        test_lsm_cursor_del(pCsr);
+        return test_lsm_error(interp, "lsm_csr_open_snapshot", rc);
+      }
+
+      Tcl_CreateObjCommand(
+          interp, zCsr, test_lsm_cursor_cmd, 
+          (ClientData)pCsr, test_lsm_cursor_del
+      );
+      Tcl_SetObjResult(interp, objv[2]);
+      return TCL_OK;
+    }
+
+    case 17: assert( 0==strcmp(aCmd[17].zCmd, "backup") ); {
+      Tcl_WideInt iId;
+      Tcl_WideInt iBase;
+      const char *zFile;
+      lsm_backup *pBackup = 0;
+      struct BackupFile {
+        const char *zSuffix;
+        FILE *pFile;
+      } aFile[3];                 /* Database and value-log files */
+      int nFile = 0;
+      int nBuf = 0;
+      int i;
+
+      if( Tcl_GetWideIntFromObj(interp, objv[2], &iId)
+       || Tcl_GetWideIntFromObj(interp, objv[3], &iBase)
+      ){
+        return TCL_ERROR;
+      }
+      zFile = Tcl_GetString(objv[4]);
+
+      rc = lsm_backup_open(p->db, (lsm_i64)iId, (lsm_i64)iBase, &pBackup);
+      while( rc==LSM_OK ){
+        const char *zSuffix;
+        lsm_i64 iOff;
+        const void *pData;
+        int nData;
+        FILE *pFile = 0;
+        rc = lsm_backup_step(pBackup, &zSuffix, &iOff, &pData, &nData);
+        if( rc!=LSM_OK || pData==0 ) break;
+
+        for(i=0; i<nFile; i++){
+          if( strcmp(aFile[i].zSuffix, zSuffix)==0 ) pFile = aFile[i].pFile;
+        }
+        if( pFile==0 && nFile<(int)(sizeof(aFile)/sizeof(aFile[0])) ){
+          Tcl_Obj *pName = Tcl_ObjPrintf("%s%s", zFile, zSuffix);
+          Tcl_IncrRefCount(pName);
+          pFile = fopen(Tcl_GetString(pName), "r+b");
+          if( pFile==0 ) pFile = fopen(Tcl_GetString(pName), "w+b");
+          Tcl_DecrRefCount(pName);
+          if( pFile ){
+            aFile[nFile].zSuffix = zSuffix;
+            aFile[nFile].pFile = pFile;
+            nFile++;
+          }
+        }
+        if( pFile==0 
+         || fseek(pFile, (long)iOff, SEEK_SET) 
+         || fwrite(pData, 1, nData, pFile)!=(size_t)nData 
+        ){
+          rc = LSM_IOERR;
+        }
+        nBuf++;
+      }
+      if( pBackup ){
+        int rc2 = lsm_backup_close(pBackup);
+        if( rc==LSM_OK ) rc = rc2;
+      }
+      for(i=0; i<nFile; i++) fclose(aFile[i].pFile);
+
+      if( rc!=LSM_OK ) return test_lsm_error(interp, "lsm_backup", rc);
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(nBuf));
+      return TCL_OK;
+    }
+
     default:
       assert( 0 );
   }
@@ -934,6 +1126,154 @@ static int test_lsm_open(
   return TCL_OK;
 }
 
+#ifdef LSM_MUTEX_PTHREADS
+/*************************************************************************
+** Implementation of the [lsm_group_commit] command. This is used to test
+** that concurrent committers using safety=FULL share log syncs.
+*/
+#include <pthread.h>
+
+typedef struct GroupCommit GroupCommit;
+struct GroupCommit {
+  const char *zFile;              /* Database file to write */
+  int nCommit;                    /* Transactions to commit per thread */
+  int iThread;                    /* Thread id (used in keys) */
+  int rc;                         /* Error code (if any) */
+};
+
+static lsm_env gcEnv;             /* Copy of default env with xSync hooked */
+static int (*gcRealSync)(lsm_file *);
+static pthread_mutex_t gcMutex = PTHREAD_MUTEX_INITIALIZER;
+static int gcSync = 0;            /* Number of xSync() calls */
+
+/*
+** xSync() method used by gcEnv. Count the calls, and sleep for a while
+** to widen the window in which other threads may commit.
+*/
+static int gcSyncMethod(lsm_file *pFile){
+  pthread_mutex_lock(&gcMutex);
+  gcSync++;
+  pthread_mutex_unlock(&gcMutex);
+  gcEnv.xSleep(&gcEnv, 2000);
+  return gcRealSync(pFile);
+}
+
+static int gcOpen(const char *zFile, lsm_db **pDb){
+  int rc;
+  int eSafety = LSM_SAFETY_FULL;
+  int iZero = 0;
+  rc = lsm_new(&gcEnv, pDb);
+  if( rc==LSM_OK ){
+    lsm_config(*pDb, LSM_CONFIG_SAFETY, &eSafety);
+    lsm_config(*pDb, LSM_CONFIG_AUTOWORK, &iZero);
+    lsm_config(*pDb, LSM_CONFIG_AUTOCHECKPOINT, &iZero);
+    rc = lsm_open(*pDb, zFile);
+  }
+  return rc;
+}
+
+static void *gcThread(void *pArg){
+  GroupCommit *p = (GroupCommit *)pArg;
+  lsm_db *db = 0;
+  int i;
+
+  p->rc = gcOpen(p->zFile, &db);
+  for(i=0; p->rc==LSM_OK && i<p->nCommit; i++){
+    char zKey[32];
+    sprintf(zKey, "t%d.%.4d", p->iThread, i);
+    p->rc = lsm_begin(db, 1);
+    if( p->rc==LSM_OK ){
+      p->rc = lsm_insert(db, zKey, strlen(zKey), zKey, strlen(zKey));
+    }
+    if( p->rc==LSM_OK ){
+      p->rc = lsm_commit(db, 0);
+    }else{
+      lsm_rollback(db, 0);
+    }
+  }
+  lsm_close(db);
+  return 0;
+}
+
+/*
+** Usage: lsm_group_commit FILENAME NTHREAD NCOMMIT
+**
+** Start NTHREAD threads, each of which opens a connection to database
+** FILENAME and commits NCOMMIT single-row transactions with safety=FULL.
+** Key "tI.NNNN" is written by the Ith thread in its NNNNth transaction. 
+** Return a list of two integers - the total number of transactions 
+** committed and the number of times xSync() was called.
+*/
+static int test_lsm_group_commit(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  GroupCommit aThread[16];
+  pthread_t aId[16];
+  const char *zFile;
+  int nThread;
+  int nCommit;
+  int nSync;
+  int rc = LSM_OK;
+  lsm_db *db = 0;
+  int i;
+
+  if( objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "FILENAME NTHREAD NCOMMIT");
+    return TCL_ERROR;
+  }
+  zFile = Tcl_GetString(objv[1]);
+  if( Tcl_GetIntFromObj(interp, objv[2], &nThread)
+   || Tcl_GetIntFromObj(interp, objv[3], &nCommit)
+  ){
+    return TCL_ERROR;
+  }
+  if( nThread<1 || nThread>(int)(sizeof(aId)/sizeof(aId[0])) ){
+    Tcl_AppendResult(interp, "NTHREAD out of range", (char *)0);
+    return TCL_ERROR;
+  }
+
+  gcEnv = *lsm_default_env();
+  gcRealSync = gcEnv.xSync;
+  gcEnv.xSync = gcSyncMethod;
+
+  /* This connection stays open while the threads run, so that closing 
+  ** a thread connection does not checkpoint (and sync) the database. */
+  rc = gcOpen(zFile, &db);
+  if( rc!=LSM_OK ){
+    lsm_close(db);
+    return test_lsm_error(interp, "lsm_open", rc);
+  }
+
+  gcSync = 0;
+  for(i=0; i<nThread; i++){
+    aThread[i].zFile = zFile;
+    aThread[i].nCommit = nCommit;
+    aThread[i].iThread = i;
+    aThread[i].rc = LSM_OK;
+    pthread_create(&aId[i], 0, gcThread, (void *)&aThread[i]);
+  }
+  for(i=0; i<nThread; i++){
+    pthread_join(aId[i], 0);
+    if( rc==LSM_OK ) rc = aThread[i].rc;
+  }
+  nSync = gcSync;
+  lsm_close(db);
+
+  if( rc!=LSM_OK ) return test_lsm_error(interp, "lsm_commit", rc);
+  Tcl_SetObjResult(interp, Tcl_NewListObj(0, 0));
+  Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), 
+      Tcl_NewIntObj(nThread*nCommit)
+  );
+  Tcl_ListObjAppendElement(interp, Tcl_GetObjResult(interp), 
+      Tcl_NewIntObj(nSync)
+  );
+  return TCL_OK;
+}
+#endif /* LSM_MUTEX_PTHREADS */
+
 int SqlitetestLsm_Init(Tcl_Interp *interp){
   struct SyscallCmd {
     const char *zName;
@@ -944,6 +1284,9 @@ int SqlitetestLsm_Init(Tcl_Interp *interp){
     { "sqlite4_lsm_info",       test_sqlite4_lsm_info                },
     { "sqlite4_lsm_config",     test_sqlite4_lsm_config              },
     { "lsm_open",               test_lsm_open                        },
+#ifdef LSM_MUTEX_PTHREADS
+    { "lsm_group_commit",       test_lsm_group_commit                },
+#endif
   };
   int i;
 
@@ -4162,6 +4162,11 @@ int Sqlitetest1_Init(Tcl_Interp *interp){
   extern int sqlite4_found_count;
   extern int sqlite4_interrupt_count;
   extern int sqlite4_sort_count;
+  extern int sqlite4_kv_multigets;
+  extern int sqlite4_kv_multiget_hits;
+  extern int sqlite4_scan_threads;
+  extern int sqlite4_parallel_scans;
+  extern int sqlite4_scan_minrow;
   extern int sqlite4_current_time;
 #if SQLITE4_OS_UNIX && defined(__APPLE__) && SQLITE4_ENABLE_LOCKING_STYLE
   extern int sqlite4_hostid_num;
@@ -4333,6 +4338,16 @@ int Sqlitetest1_Init(Tcl_Interp *interp){
       (char*)&sqlite4_found_count, TCL_LINK_INT);
   Tcl_LinkVar(interp, "sqlite_sort_count", 
       (char*)&sqlite4_sort_count, TCL_LINK_INT);
+  Tcl_LinkVar(interp, "sqlite_kv_multigets", 
+      (char*)&sqlite4_kv_multigets, TCL_LINK_INT);
+  Tcl_LinkVar(interp, "sqlite_kv_multiget_hits", 
+      (char*)&sqlite4_kv_multiget_hits, TCL_LINK_INT);
+  Tcl_LinkVar(interp, "sqlite_scan_threads", 
+      (char*)&sqlite4_scan_threads, TCL_LINK_INT);
+  Tcl_LinkVar(interp, "sqlite_parallel_scans", 
+      (char*)&sqlite4_parallel_scans, TCL_LINK_INT);
+  Tcl_LinkVar(interp, "sqlite_scan_minrow", 
+      (char*)&sqlite4_scan_minrow, TCL_LINK_INT);
   Tcl_LinkVar(interp, "sqlite4_max_blobsize", 
       (char*)&sqlite4_max_blobsize, TCL_LINK_INT);
   Tcl_LinkVar(interp, "sqlite_like_count", 
@@ -234,6 +234,7 @@ foreach file {
    mutex_noop.c
    mutex_unix.c
    mutex_w32.c
+   threads.c
    malloc.c
    printf.c
    random.c
@@ -258,9 +259,12 @@ foreach file {
 
    kv.c
    kvmem.c
+   kvephm.c
+   kvsort.c
    kvlsm.c
    rowset.c
    kvbt.c
+   kvhybrid.c
    bt_lock.c
    bt_log.c
    bt_main.c